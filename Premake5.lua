@@ -1,3 +1,8 @@
+newoption {
+    trigger = "traversal-stats",
+    description = "Count rays, BVH nodes and triangle tests per pixel of the ray tracer"
+}
+
 workspace "Computer graphics in Game development"
     configurations { "Debug", "Release" }
     language "C++"
@@ -16,6 +21,8 @@ workspace "Computer graphics in Game development"
     filter("configurations:Release")
         defines({ "NDEBUG" })
         symbols("On")
+    filter("options:traversal-stats")
+        defines({ "RAY_TRAVERSAL_STATS" })
 
 project "01. Rasterization"
     kind "ConsoleApp"
@@ -29,7 +36,11 @@ project "01. Rasterization"
     files { "src/renderer/rasterizer/rasterizer_renderer.*"}
     files { "src/world/camera.*"}
     files { "src/world/model.*"}
+    files { "src/world/obj_parser.*"}
+    files { "src/world/mesh_optimizer.*"}
+    files { "src/utils/mapped_file.*"}
     files { "src/utils/resource_utils.*"}
+    files { "src/utils/profiler.*"}
     files { "src/main.cpp" }
 
 group "Tests"
@@ -45,10 +56,24 @@ group "Tests"
         files { "src/renderer/rasterizer/rasterizer.*" }
         files { "src/renderer/rasterizer/rasterizer_renderer.*"}
         files { "src/renderer/raytracer/raytracer.*" }
+        files { "src/renderer/raytracer/acceleration_structure.*" }
+        files { "src/renderer/raytracer/uniform_grid.*" }
+        files { "src/renderer/raytracer/kd_tree.*" }
+        files { "src/renderer/raytracer/triangle_block.*" }
+        files { "src/renderer/raytracer/traversal_stats.*" }
+        files { "src/renderer/raytracer/path_integrator.*" }
+        files { "src/renderer/raytracer/light_sampler.*" }
+        files { "src/renderer/raytracer/denoiser.*" }
+        files { "src/renderer/raytracer/scene_cache.*" }
+        files { "src/renderer/raytracer/checkpoint.*" }
         files { "src/renderer/raytracer/raytracer_renderer.*"}
         files { "src/world/camera.*"}
         files { "src/world/model.*"}
+        files { "src/world/obj_parser.*"}
+        files { "src/world/mesh_optimizer.*"}
         files { "src/utils/resource_utils.*"}
+        files { "src/utils/profiler.*"}
+        files { "src/utils/mapped_file.*"}
 
     project "Test 01. Clearing of resource"
         kind "ConsoleApp"
@@ -95,6 +120,15 @@ group "Tests"
         links { "Static" }
         files { "tests/rasterization/depth_buffer_test.cpp" }
 
+    project "Test 23. Mesh optimizer"
+        kind "ConsoleApp"
+        defines { "RASTERIZATION" }
+        includedirs { "libs/Catch2/single_include/catch2" }
+        includedirs { "libs/stb", "libs/tinyobjloader", "libs/linalg", "libs/cxxopts/include" }
+        includedirs { "src" }
+        links { "Static" }
+        files { "tests/rasterization/mesh_optimizer_test.cpp" }
+
 group ""
 
 project "02. Ray tracing"
@@ -106,10 +140,24 @@ project "02. Ray tracing"
     files { "src/resource.*" }
     files { "src/renderer/renderer.*"}
     files { "src/renderer/raytracer/raytracer.*" }
+    files { "src/renderer/raytracer/acceleration_structure.*" }
+    files { "src/renderer/raytracer/uniform_grid.*" }
+    files { "src/renderer/raytracer/kd_tree.*" }
+    files { "src/renderer/raytracer/triangle_block.*" }
+    files { "src/renderer/raytracer/traversal_stats.*" }
+    files { "src/renderer/raytracer/path_integrator.*" }
+    files { "src/renderer/raytracer/light_sampler.*" }
+    files { "src/renderer/raytracer/denoiser.*" }
+    files { "src/renderer/raytracer/scene_cache.*" }
+    files { "src/renderer/raytracer/checkpoint.*" }
     files { "src/renderer/raytracer/raytracer_renderer.*"}
     files { "src/world/camera.*"}
     files { "src/world/model.*"}
+    files { "src/world/obj_parser.*"}
+    files { "src/world/mesh_optimizer.*"}
     files { "src/utils/resource_utils.*"}
+    files { "src/utils/profiler.*"}
+    files { "src/utils/mapped_file.*"}
     files { "src/main.cpp" }
 
 group "Tests"
@@ -158,6 +206,110 @@ group "Tests"
         links { "Static" }
         files { "tests/ray_tracing/acceleraction_structure_test.cpp" }
 
+    project "Test 12. Light sampling"
+        kind "ConsoleApp"
+        defines { "RAYTRACING" }
+        includedirs { "libs/Catch2/single_include/catch2" }
+        includedirs { "libs/stb", "libs/tinyobjloader", "libs/linalg", "libs/cxxopts/include" }
+        includedirs { "src" }
+        links { "Static" }
+        files { "tests/ray_tracing/light_sampling_test.cpp" }
+
+    project "Test 13. Denoiser"
+        kind "ConsoleApp"
+        defines { "RAYTRACING" }
+        includedirs { "libs/Catch2/single_include/catch2" }
+        includedirs { "libs/stb", "libs/tinyobjloader", "libs/linalg", "libs/cxxopts/include" }
+        includedirs { "src" }
+        links { "Static" }
+        files { "tests/ray_tracing/denoiser_test.cpp" }
+
+    project "Test 14. Scene cache"
+        kind "ConsoleApp"
+        defines { "RAYTRACING" }
+        includedirs { "libs/Catch2/single_include/catch2" }
+        includedirs { "libs/stb", "libs/tinyobjloader", "libs/linalg", "libs/cxxopts/include" }
+        includedirs { "src" }
+        links { "Static" }
+        files { "tests/ray_tracing/scene_cache_test.cpp" }
+
+    project "Test 15. BVH benchmark"
+        kind "ConsoleApp"
+        defines { "RAYTRACING" }
+        includedirs { "libs/Catch2/single_include/catch2" }
+        includedirs { "libs/stb", "libs/tinyobjloader", "libs/linalg", "libs/cxxopts/include" }
+        includedirs { "src" }
+        links { "Static" }
+        files { "tests/ray_tracing/bvh_benchmark_test.cpp" }
+
+    project "Test 16. Acceleration structure backends"
+        kind "ConsoleApp"
+        defines { "RAYTRACING" }
+        includedirs { "libs/Catch2/single_include/catch2" }
+        includedirs { "libs/stb", "libs/tinyobjloader", "libs/linalg", "libs/cxxopts/include" }
+        includedirs { "src" }
+        links { "Static" }
+        files { "tests/ray_tracing/acceleration_structure_backends_test.cpp" }
+
+    project "Test 17. Triangle block kernel"
+        kind "ConsoleApp"
+        defines { "RAYTRACING" }
+        includedirs { "libs/Catch2/single_include/catch2" }
+        includedirs { "libs/stb", "libs/tinyobjloader", "libs/linalg", "libs/cxxopts/include" }
+        includedirs { "src" }
+        links { "Static" }
+        files { "tests/ray_tracing/triangle_block_test.cpp" }
+
+    -- the counters are compiled in here only, so the tested code is built
+    -- with them instead of being linked from Static
+    project "Test 18. Traversal stats"
+        kind "ConsoleApp"
+        defines { "RAYTRACING", "RAY_TRAVERSAL_STATS" }
+        includedirs { "libs/Catch2/single_include/catch2" }
+        includedirs { "libs/stb", "libs/tinyobjloader", "libs/linalg", "libs/cxxopts/include" }
+        includedirs { "src" }
+        files { "src/renderer/raytracer/traversal_stats.*" }
+        files { "src/renderer/raytracer/triangle_block.*" }
+        files { "src/utils/resource_utils.*" }
+        files { "src/utils/profiler.*" }
+        files { "tests/ray_tracing/traversal_stats_test.cpp" }
+
+    project "Test 19. Profiler"
+        kind "ConsoleApp"
+        defines { "RAYTRACING" }
+        includedirs { "libs/Catch2/single_include/catch2" }
+        includedirs { "libs/stb", "libs/tinyobjloader", "libs/linalg", "libs/cxxopts/include" }
+        includedirs { "src" }
+        links { "Static" }
+        files { "tests/ray_tracing/profiler_test.cpp" }
+
+    project "Test 20. Ray sorting"
+        kind "ConsoleApp"
+        defines { "RAYTRACING" }
+        includedirs { "libs/Catch2/single_include/catch2" }
+        includedirs { "libs/stb", "libs/tinyobjloader", "libs/linalg", "libs/cxxopts/include" }
+        includedirs { "src" }
+        links { "Static" }
+        files { "tests/ray_tracing/ray_sorting_test.cpp" }
+
+    project "Test 21. Checkpoint"
+        kind "ConsoleApp"
+        defines { "RAYTRACING" }
+        includedirs { "libs/Catch2/single_include/catch2" }
+        includedirs { "libs/stb", "libs/tinyobjloader", "libs/linalg", "libs/cxxopts/include" }
+        includedirs { "src" }
+        links { "Static" }
+        files { "tests/ray_tracing/checkpoint_test.cpp" }
+
+    project "Test 22. Time budget"
+        kind "ConsoleApp"
+        defines { "RAYTRACING" }
+        includedirs { "libs/Catch2/single_include/catch2" }
+        includedirs { "libs/stb", "libs/tinyobjloader", "libs/linalg", "libs/cxxopts/include" }
+        includedirs { "src" }
+        links { "Static" }
+        files { "tests/ray_tracing/time_budget_test.cpp" }
+
 group ""
 
 project "03. DirectX 12"
@@ -171,9 +323,13 @@ project "03. DirectX 12"
     files { "src/renderer/renderer.*"}
     files { "src/renderer/dx12/dx12_renderer.*"}
     files { "src/utils/resource_utils.*"}
+    files { "src/utils/profiler.*"}
     files { "src/world/camera.*"}
     files { "src/utils/window.*"}
     files { "src/world/model.*"}
+    files { "src/world/obj_parser.*"}
+    files { "src/world/mesh_optimizer.*"}
+    files { "src/utils/mapped_file.*"}
     files {"src/win_main.cpp" }
     postbuildcommands {
        "{COPY} shaders/shaders.hlsl \"%{cfg.buildtarget.directory}\"",
@@ -189,4 +345,16 @@ group "Tests"
         links { "Static" }
         files { "tests/dx12/dx12_camera_test.cpp" }
 
-group ""
\ No newline at end of file
+group ""
+
+project "04. Mesh converter"
+    kind "ConsoleApp"
+    includedirs { "libs/tinyobjloader", "libs/linalg" }
+    includedirs { "src" }
+    files { "src/resource.*" }
+    files { "src/world/model.*"}
+    files { "src/world/obj_parser.*"}
+    files { "src/world/mesh_optimizer.*"}
+    files { "src/utils/mapped_file.*"}
+    files { "src/utils/profiler.*"}
+    files { "src/tools/mesh_converter.cpp" }
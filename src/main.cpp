@@ -1,21 +1,52 @@
 #include "renderer/renderer.h"
 #include "settings.h"
+#include "utils/profiler.h"
 
+#include <csignal>
 #include <iostream>
 
 
+// The first Ctrl+C finishes a progressive render with the passes done so
+// far; the next one, or any during other renders, ends the program
+static void handle_interrupt(int signal)
+{
+  cg::renderer::renderer::interrupted = true;
+  std::signal(signal, SIG_DFL);
+}
+
 int main(int argc, char** argv)
 {
   try
   {
     auto settings = cg::settings::parse_settings(argc, argv);
+    if (settings->profile)
+      cg::utils::enable_profiler();
+
     auto renderer = cg::renderer::make_renderer(settings);
 
-    renderer->init();
+    {
+      PROFILE_ZONE("Init");
+      renderer->init();
+    }
 
-    renderer->render();
+    {
+      PROFILE_ZONE("Render");
+      cg::renderer::renderer::interrupted = false;
+      if (renderer->stops_on_interrupt())
+        std::signal(SIGINT, handle_interrupt);
+      renderer->render();
+      std::signal(SIGINT, SIG_DFL);
+    }
 
     renderer->destroy();
+
+    if (settings->profile)
+    {
+      // result.png gets result_trace.json
+      std::filesystem::path trace_path = settings->result_path;
+      trace_path.replace_filename(settings->result_path.stem().string() + "_trace.json");
+      cg::utils::save_chrome_trace(trace_path);
+    }
   }
   catch (std::exception& e)
   {
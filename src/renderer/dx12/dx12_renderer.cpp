@@ -33,7 +33,7 @@ void cg::renderer::dx12_renderer::init()
 
   // Load model
   model = std::make_shared<cg::world::model>();
-  model->load_obj(settings->model_path);
+  model->load(settings->model_path);
 
   // Prepare camera
   camera = std::make_shared<cg::world::camera>();
@@ -1,11 +1,15 @@
 #pragma once
 
 #include "resource.h"
+#include "utils/profiler.h"
 
+#include <algorithm>
+#include <cstdint>
 #include <functional>
 #include <iostream>
 #include <linalg.h>
 #include <memory>
+#include <vector>
 
 
 using namespace linalg::aliases;
@@ -37,22 +41,41 @@ public:
   void clear_render_target(const RT& in_clear_value, float in_depth = FLT_MAX);
 
   void set_vertex_buffer(std::shared_ptr<resource<VB>> in_vertex_buffer);
+  // Compact vertices are decoded as they are shaded
+  void set_vertex_buffer(
+    std::shared_ptr<resource<compact_vertex>> in_vertex_buffer,
+    std::function<VB(const compact_vertex&)> in_vertex_decoder
+  );
+  void set_index_buffer(std::shared_ptr<resource<uint32_t>> in_index_buffer);
 
   void set_viewport(size_t in_width, size_t in_height);
 
   void draw(size_t num_vertices, size_t vertex_offset);
+  // Triangles of three indices each; a vertex shared by several triangles
+  // is shaded once
+  void draw_indexed(size_t num_indices, size_t index_offset);
 
   std::function<std::pair<float4, VB>(float4 vertex, VB vertex_data)> vertex_shader;
   std::function<color(const VB& vertex_data, const float z)> pixel_shader;
 
 protected:
   std::shared_ptr<resource<VB>> vertex_buffer;
+  std::shared_ptr<resource<compact_vertex>> compact_vertex_buffer;
+  std::function<VB(const compact_vertex&)> vertex_decoder;
+  std::shared_ptr<resource<uint32_t>> index_buffer;
   std::shared_ptr<resource<RT>> render_target;
   std::shared_ptr<resource<float>> depth_buffer;
+  // Slots of the vertices of a sparse draw among its shaded vertices;
+  // unused entries are UINT32_MAX
+  std::vector<uint32_t> vertex_slots;
 
   size_t width = 1920;
   size_t height = 1080;
 
+  VB fetch_vertex(size_t index);
+  VB shade_vertex(VB vertex);
+  void rasterize_triangle(const VB* vertices);
+
   float edge_function(float2 a, float2 b, float2 c);
   bool depth_test(float z, size_t x, size_t y);
 };
@@ -98,6 +121,24 @@ inline void rasterizer<VB, RT>::set_vertex_buffer(
   std::shared_ptr<resource<VB>> in_vertex_buffer)
 {
   vertex_buffer = in_vertex_buffer;
+  compact_vertex_buffer = nullptr;
+}
+
+template<typename VB, typename RT>
+inline void rasterizer<VB, RT>::set_vertex_buffer(
+  std::shared_ptr<resource<compact_vertex>> in_vertex_buffer,
+  std::function<VB(const compact_vertex&)> in_vertex_decoder)
+{
+  compact_vertex_buffer = in_vertex_buffer;
+  vertex_decoder = in_vertex_decoder;
+  vertex_buffer = nullptr;
+}
+
+template<typename VB, typename RT>
+inline void rasterizer<VB, RT>::set_index_buffer(
+  std::shared_ptr<resource<uint32_t>> in_index_buffer)
+{
+  index_buffer = in_index_buffer;
 }
 
 template<typename VB, typename RT>
@@ -110,101 +151,181 @@ inline void rasterizer<VB, RT>::set_viewport(size_t in_width, size_t in_height)
 template<typename VB, typename RT>
 inline void rasterizer<VB, RT>::draw(size_t num_vertices, size_t vertex_offset)
 {
-  size_t vertex_index = vertex_offset;
-  while (vertex_index < vertex_offset + num_vertices)
+  PROFILE_ZONE("Draw");
+
+  // All vertices are shaded before rasterization, so vertex and pixel work
+  // show up as separate profiler zones
+  std::vector<VB> processed_vertices(num_vertices);
   {
-    // Read a triangle
-    std::vector<VB> vertices(3);
-    vertices[0] = vertex_buffer->item(vertex_index++);
-    vertices[1] = vertex_buffer->item(vertex_index++);
-    vertices[2] = vertex_buffer->item(vertex_index++);
+    PROFILE_ZONE("Vertex shading");
+    for (size_t i = 0; i < num_vertices; i++)
+      processed_vertices[i] = shade_vertex(fetch_vertex(vertex_offset + i));
+  }
 
-    for (auto& vertex : vertices)
-    {
-      float4 coords{ vertex.x, vertex.y, vertex.z, 1.f };
+  PROFILE_ZONE("Rasterization");
+  for (size_t triangle = 0; triangle + 2 < num_vertices; triangle += 3)
+    rasterize_triangle(&processed_vertices[triangle]);
+}
 
-      // Call vertex shader
-      auto processed_vertex = vertex_shader(coords, vertex);
-      
-      vertex.x = processed_vertex.first.x / processed_vertex.first.w;
-      vertex.y = processed_vertex.first.y / processed_vertex.first.w;
-      vertex.z = processed_vertex.first.z / processed_vertex.first.w;
+template<typename VB, typename RT>
+inline void rasterizer<VB, RT>::draw_indexed(size_t num_indices, size_t index_offset)
+{
+  PROFILE_ZONE("Draw");
+  if (num_indices == 0)
+    return;
+
+  // Only the vertices between the smallest and the largest index of the
+  // draw are shaded
+  uint32_t min_index = UINT32_MAX;
+  uint32_t max_index = 0;
+  for (size_t i = 0; i < num_indices; i++)
+  {
+    min_index = std::min(min_index, index_buffer->item(index_offset + i));
+    max_index = std::max(max_index, index_buffer->item(index_offset + i));
+  }
 
-      vertex.x = (vertex.x + 1.f) * width / 2.f;
-      vertex.y = (-vertex.y + 1.f) * height / 2.f;
+  // A draw with fewer indices than its range, like a meshlet, shades just
+  // the vertices it uses; its indices are renumbered to those vertices
+  std::vector<uint32_t> used_vertices;
+  std::vector<uint32_t> local_indices(num_indices);
+  bool sparse = max_index - min_index + 1 > num_indices;
+  if (sparse && vertex_slots.size() <= max_index)
+    vertex_slots.resize(static_cast<size_t>(max_index) + 1, UINT32_MAX);
+  for (size_t i = 0; i < num_indices; i++)
+  {
+    uint32_t index = index_buffer->item(index_offset + i);
+    if (!sparse)
+    {
+      local_indices[i] = index - min_index;
+      continue;
     }
+    if (vertex_slots[index] == UINT32_MAX)
+    {
+      vertex_slots[index] = static_cast<uint32_t>(used_vertices.size());
+      used_vertices.push_back(index);
+    }
+    local_indices[i] = vertex_slots[index];
+  }
+  for (uint32_t index : used_vertices)
+    vertex_slots[index] = UINT32_MAX;
 
-    float2 bounding_box_begin{
-      std::clamp(
-        std::min(std::min(vertices[0].x, vertices[1].x), vertices[2].x),
-        0.f,
-        static_cast<float>(width) - 1.f
-      ),
-      std::clamp(
-        std::min(std::min(vertices[0].y, vertices[1].y), vertices[2].y),
-        0.f,
-        static_cast<float>(height) - 1.f
-      ),
-    };
-    float2 bounding_box_end{
-      std::clamp(
-        std::max(std::max(vertices[0].x, vertices[1].x), vertices[2].x), 0.f,
-        static_cast<float>(width) - 1.f),
-      std::clamp(
-        std::max(std::max(vertices[0].y, vertices[1].y), vertices[2].y), 0.f,
-        static_cast<float>(height) - 1.f),
+  std::vector<VB> processed_vertices(sparse ? used_vertices.size() : max_index - min_index + 1);
+  {
+    PROFILE_ZONE("Vertex shading");
+    for (size_t i = 0; i < processed_vertices.size(); i++)
+      processed_vertices[i] = shade_vertex(fetch_vertex(sparse ? used_vertices[i] : min_index + i));
+  }
+
+  PROFILE_ZONE("Rasterization");
+  for (size_t triangle = 0; triangle + 2 < num_indices; triangle += 3)
+  {
+    const VB vertices[3] = {
+      processed_vertices[local_indices[triangle + 0]],
+      processed_vertices[local_indices[triangle + 1]],
+      processed_vertices[local_indices[triangle + 2]],
     };
+    rasterize_triangle(vertices);
+  }
+}
+
+template<typename VB, typename RT>
+inline VB rasterizer<VB, RT>::fetch_vertex(size_t index)
+{
+  if (compact_vertex_buffer)
+    return vertex_decoder(compact_vertex_buffer->item(index));
+  return vertex_buffer->item(index);
+}
+
+template<typename VB, typename RT>
+inline VB rasterizer<VB, RT>::shade_vertex(VB vertex)
+{
+  float4 coords{ vertex.x, vertex.y, vertex.z, 1.f };
+
+  // Call vertex shader
+  auto processed_vertex = vertex_shader(coords, vertex);
+
+  vertex.x = processed_vertex.first.x / processed_vertex.first.w;
+  vertex.y = processed_vertex.first.y / processed_vertex.first.w;
+  vertex.z = processed_vertex.first.z / processed_vertex.first.w;
 
-    float edge = edge_function(
-      float2{ vertices[0].x, vertices[0].y },
-      float2{ vertices[1].x, vertices[1].y },
-      float2{ vertices[2].x, vertices[2].y }
-    );
+  vertex.x = (vertex.x + 1.f) * width / 2.f;
+  vertex.y = (-vertex.y + 1.f) * height / 2.f;
+  return vertex;
+}
 
-    // For each pixel in the bounding box
-    for (int x = static_cast<int>(bounding_box_begin.x); x <= static_cast<int>(bounding_box_end.x); x++)
-      for (int y = static_cast<int>(bounding_box_begin.y); y <= static_cast<int>(bounding_box_end.y); y++)
+template<typename VB, typename RT>
+inline void rasterizer<VB, RT>::rasterize_triangle(const VB* vertices)
+{
+  float2 bounding_box_begin{
+    std::clamp(
+      std::min(std::min(vertices[0].x, vertices[1].x), vertices[2].x),
+      0.f,
+      static_cast<float>(width) - 1.f
+    ),
+    std::clamp(
+      std::min(std::min(vertices[0].y, vertices[1].y), vertices[2].y),
+      0.f,
+      static_cast<float>(height) - 1.f
+    ),
+  };
+  float2 bounding_box_end{
+    std::clamp(
+      std::max(std::max(vertices[0].x, vertices[1].x), vertices[2].x), 0.f,
+      static_cast<float>(width) - 1.f),
+    std::clamp(
+      std::max(std::max(vertices[0].y, vertices[1].y), vertices[2].y), 0.f,
+      static_cast<float>(height) - 1.f),
+  };
+
+  float edge = edge_function(
+    float2{ vertices[0].x, vertices[0].y },
+    float2{ vertices[1].x, vertices[1].y },
+    float2{ vertices[2].x, vertices[2].y }
+  );
+
+  // For each pixel in the bounding box
+  for (int x = static_cast<int>(bounding_box_begin.x); x <= static_cast<int>(bounding_box_end.x); x++)
+    for (int y = static_cast<int>(bounding_box_begin.y); y <= static_cast<int>(bounding_box_end.y); y++)
+    {
+      // Barycentric coordinate for vertices[2]
+      float edge0 = edge_function(
+        float2{ vertices[0].x, vertices[0].y },
+        float2{ vertices[1].x, vertices[1].y },
+        float2{ static_cast<float>(x), static_cast<float>(y) }
+      );
+      // Barycentric coordinate for vertices[0]
+      float edge1 = edge_function(
+        float2{ vertices[1].x, vertices[1].y },
+        float2{ vertices[2].x, vertices[2].y },
+        float2{ static_cast<float>(x), static_cast<float>(y) }
+      );
+      // Barycentric coordinate for vertices[1]
+      float edge2 = edge_function(
+        float2{ vertices[2].x, vertices[2].y },
+        float2{ vertices[0].x, vertices[0].y },
+        float2{ static_cast<float>(x), static_cast<float>(y) }
+      );
+
+      // If the pixel belongs to the triangle
+      if (edge0 >= 0.f && edge1 >= 0.f && edge2 >= 0.f)
       {
-        // Barycentric coordinate for vertices[2]
-        float edge0 = edge_function(
-          float2{ vertices[0].x, vertices[0].y },
-          float2{ vertices[1].x, vertices[1].y },
-          float2{ static_cast<float>(x), static_cast<float>(y) }
-        );
-        // Barycentric coordinate for vertices[0]
-        float edge1 = edge_function(
-          float2{ vertices[1].x, vertices[1].y },
-          float2{ vertices[2].x, vertices[2].y },
-          float2{ static_cast<float>(x), static_cast<float>(y) }
-        );
-        // Barycentric coordinate for vertices[1]
-        float edge2 = edge_function(
-          float2{ vertices[2].x, vertices[2].y },
-          float2{ vertices[0].x, vertices[0].y },
-          float2{ static_cast<float>(x), static_cast<float>(y) }
-        );
-
-        // If the pixel belongs to the triangle
-        if (edge0 >= 0.f && edge1 >= 0.f && edge2 >= 0.f)
-        {
-          float u = edge1 / edge;
-          float v = edge2 / edge;
-          float w = edge0 / edge;
-
-          float z = u * vertices[0].z + v * vertices[1].z + w * vertices[2].z;
-
-          if (!depth_test(z, x, y))
-            continue;
-
-          auto pixel_shader_result = pixel_shader(vertices[0], 0);
-
-          render_target->item(x, y) = RT::from_color(pixel_shader_result);
-
-          if (depth_buffer)
-            depth_buffer->item(x, y) = z;
-        }
+        float u = edge1 / edge;
+        float v = edge2 / edge;
+        float w = edge0 / edge;
+
+        float z = u * vertices[0].z + v * vertices[1].z + w * vertices[2].z;
+
+        if (!depth_test(z, x, y))
+          continue;
+
+        auto pixel_shader_result = pixel_shader(vertices[0], 0);
+
+        render_target->item(x, y) = RT::from_color(pixel_shader_result);
+
+        if (depth_buffer)
+          depth_buffer->item(x, y) = z;
       }
-  }
+    }
 }
 
 template<typename VB, typename RT>
@@ -1,13 +1,18 @@
 #include "rasterizer_renderer.h"
 
 #include "utils/resource_utils.h"
+#include "world/mesh_optimizer.h"
+
+#include <chrono>
+#include <iostream>
 
 
 void cg::renderer::rasterization_renderer::init()
 {
-  // Load model
+  // Load model while the camera and the targets are set up
   model = std::make_shared<world::model>();
-  model->load_obj(settings->model_path);
+  model->set_memory_budget(size_t{ settings->memory_budget } << 20);
+  auto model_loading = model->load_async(settings->model_path, false);
 
   // Setup camera
   camera = std::make_shared<cg::world::camera>();
@@ -32,7 +37,36 @@ void cg::renderer::rasterization_renderer::init()
   rasterizer =
     std::make_shared<cg::renderer::rasterizer<cg::vertex, cg::unsigned_color>>();
   rasterizer->set_render_target(render_target);
-  rasterizer->set_vertex_buffer(model->get_vertex_buffer());
+  model_loading.get();
+  if (settings->optimize_mesh)
+  {
+    auto analyze = [&]() {
+      auto indices = model->get_index_buffer();
+      return world::analyze_mesh(
+        indices->begin(), indices->get_number_of_elements(),
+        model->get_indexed_vertex_buffer()->begin());
+    };
+    auto before = analyze();
+    model->optimize_mesh();
+    auto after = analyze();
+    std::cout << "Mesh optimization: ACMR " << before.acmr << " -> " << after.acmr
+              << ", overdraw " << before.overdraw << " -> " << after.overdraw << "\n";
+  }
+  if (settings->meshlets)
+    model->build_meshlets();
+  if (settings->lods)
+    model->build_lods();
+  if (settings->compact_vertices)
+  {
+    rasterizer->set_vertex_buffer(
+      model->get_compact_vertex_buffer(),
+      [model = model](const compact_vertex& vertex) { return model->decode_vertex(vertex); });
+  }
+  else
+  {
+    rasterizer->set_vertex_buffer(model->get_indexed_vertex_buffer());
+  }
+  rasterizer->set_index_buffer(model->get_index_buffer());
   rasterizer->set_viewport(settings->width, settings->height);
 }
 
@@ -65,6 +99,136 @@ void cg::renderer::rasterization_renderer::render()
     };
   };
 
-  rasterizer->draw(model->get_vertex_buffer()->get_number_of_elements(), 0);
+  auto start = std::chrono::high_resolution_clock::now();
+  auto levels = select_lods();
+  if (settings->meshlets)
+  {
+    draw_meshlets(matrix, levels);
+  }
+  else
+  {
+    // A streamed model is drawn chunk by chunk, and every chunk leaves
+    // memory once it is drawn
+    auto shapes = model->get_per_shape_index_buffer();
+    for (size_t s = 0; s < shapes.size(); s++)
+    {
+      if (levels[s] > 0)
+        draw_lod(s, levels[s]);
+      else
+        rasterizer->draw_indexed(shapes[s].get_number_of_elements(), shapes[s].get_offset());
+      if (settings->memory_budget > 0)
+        model->release_shape(s);
+    }
+  }
+  auto stop = std::chrono::high_resolution_clock::now();
+  std::cout << "Drawing: " << std::chrono::duration<float, std::milli>(stop - start).count()
+            << " ms\n";
+
   utils::save_resource(*render_target, settings->result_path);
 }
+
+std::vector<size_t> cg::renderer::rasterization_renderer::select_lods() const
+{
+  auto shapes = model->get_per_shape_index_buffer();
+  std::vector<size_t> levels(shapes.size(), 0);
+  const auto& lods = model->get_lods();
+  if (!settings->lods || lods.empty())
+    return levels;
+
+  // Pixels a unit across at a unit from the camera covers on screen
+  float pixels_per_unit = camera->get_projection_matrix()[1][1] * settings->height / 2.f;
+  float4x4 model_view = mul(camera->get_view_matrix(), model->get_world_matrix());
+  size_t coarse_shapes = 0;
+  size_t shape_triangles = 0;
+  size_t drawn_triangles = 0;
+  for (size_t s = 0; s < lods.size(); s++)
+  {
+    // The nearest point of the sphere, as any part of the shape may be there
+    const auto& chain = lods[s];
+    float distance = length(mul(model_view, float4{ chain.center, 1.f }).xyz()) - chain.radius;
+    if (distance <= 0.f)
+      continue;
+    for (size_t l = 0; l < chain.levels.size(); l++)
+    {
+      if (chain.levels[l].error * pixels_per_unit / distance <= settings->lod_threshold)
+        levels[s] = l + 1;
+    }
+    if (levels[s] > 0)
+    {
+      coarse_shapes++;
+      shape_triangles += shapes[s].get_number_of_elements() / 3;
+      drawn_triangles += chain.levels[levels[s] - 1].index_count / 3;
+    }
+  }
+
+  std::cout << "Levels of detail: " << coarse_shapes << " of " << shapes.size()
+            << " shapes coarser, with " << drawn_triangles << " of their " << shape_triangles
+            << " triangles\n";
+  return levels;
+}
+
+void cg::renderer::rasterization_renderer::draw_lod(size_t shape, size_t level)
+{
+  const auto& lod = model->get_lods()[shape].levels[level - 1];
+  rasterizer->set_index_buffer(model->get_lod_index_buffer());
+  rasterizer->draw_indexed(lod.index_count, lod.index_offset);
+  rasterizer->set_index_buffer(model->get_index_buffer());
+}
+
+void cg::renderer::rasterization_renderer::draw_meshlets(
+  const float4x4& matrix, const std::vector<size_t>& levels)
+{
+  // Planes of the clip space, with z from 0 to 1, in model space; a point
+  // is inside when its dot product with every plane is positive
+  auto row = [&](int i) { return float4{ matrix[0][i], matrix[1][i], matrix[2][i], matrix[3][i] }; };
+  const float4 planes[6] = {
+    row(3) + row(0), row(3) - row(0), row(3) + row(1), row(3) - row(1), row(2), row(3) - row(2),
+  };
+  // The cone test runs in view space, where the camera is at the origin
+  float4x4 model_view = mul(camera->get_view_matrix(), model->get_world_matrix());
+
+  size_t frustum_culled = 0;
+  size_t cone_culled = 0;
+  size_t culled_triangles = 0;
+  const auto& meshlets = model->get_meshlets();
+  for (const auto& meshlet : meshlets)
+  {
+    if (levels[meshlet.shape] > 0)
+      continue;
+    float4 center{ meshlet.center, 1.f };
+    bool outside = std::any_of(std::begin(planes), std::end(planes), [&](const float4& plane) {
+      return dot(plane, center) < -meshlet.radius * length(plane.xyz());
+    });
+    if (outside)
+    {
+      frustum_culled++;
+      culled_triangles += meshlet.index_count / 3;
+      continue;
+    }
+
+    // Every triangle faces away when the directions to the sphere stay
+    // within the complement of the cone around the normals
+    float3 view_center = mul(model_view, center).xyz();
+    float distance = length(view_center);
+    float3 axis = normalize(mul(model_view, float4{ meshlet.cone_axis, 0.f }).xyz());
+    if (distance > meshlet.radius &&
+        dot(view_center / distance, axis) >= meshlet.cone_cutoff + meshlet.radius / distance)
+    {
+      cone_culled++;
+      culled_triangles += meshlet.index_count / 3;
+      continue;
+    }
+
+    rasterizer->draw_indexed(meshlet.index_count, meshlet.index_offset);
+  }
+  for (size_t s = 0; s < levels.size(); s++)
+  {
+    if (levels[s] > 0)
+      draw_lod(s, levels[s]);
+  }
+
+  std::cout << "Meshlet culling: " << frustum_culled + cone_culled << " of " << meshlets.size()
+            << " meshlets (" << frustum_culled << " out of view, " << cone_culled
+            << " facing away), " << culled_triangles << " of "
+            << model->get_index_buffer()->get_number_of_elements() / 3 << " triangles\n";
+}
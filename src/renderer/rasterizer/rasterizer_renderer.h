@@ -15,6 +15,14 @@ public:
   virtual void render();
 
 protected:
+  // Level of detail of every shape, the coarsest whose error covers at most
+  // lod_threshold pixels on screen; 0 is the shape itself
+  std::vector<size_t> select_lods() const;
+  void draw_lod(size_t shape, size_t level);
+  // Draws the meshlets of the model that are in view and face the camera;
+  // shapes with a coarser level are drawn from that instead
+  void draw_meshlets(const float4x4& matrix, const std::vector<size_t>& levels);
+
   std::shared_ptr<resource<unsigned_color>> render_target;
   std::shared_ptr<resource<float>> depth_buffer;
 
@@ -0,0 +1,167 @@
+#pragma once
+
+#include "renderer/raytracer/traversal_stats.h"
+#include "resource.h"
+
+#include <cfloat>
+#include <cmath>
+#include <linalg.h>
+#include <vector>
+
+using namespace linalg::aliases;
+
+namespace cg::renderer
+{
+struct ray
+{
+  ray(float3 position, float3 direction) :
+    position(position), direction(direction)
+  {
+  }
+
+  float3 position;
+  float3 direction;
+};
+
+struct payload
+{
+  float t;
+  float3 bary;
+  color color;
+  size_t depth;
+};
+
+template<typename VB>
+struct triangle
+{
+  triangle() = default;
+  triangle(const VB& vertex_a, const VB& vertex_b, const VB& vertex_c);
+
+  float3 a;
+  float3 b;
+  float3 c;
+
+  float3 ba;
+  float3 ca;
+
+  float3 na;
+  float3 nb;
+  float3 nc;
+
+  float3 ambient;
+  float3 diffuse;
+  float3 emissive;
+};
+
+template<typename VB>
+triangle<VB>::triangle(const VB& vertex_a, const VB& vertex_b, const VB& vertex_c)
+{
+  a = float3{ vertex_a.x, vertex_a.y, vertex_a.z };
+  b = float3{ vertex_b.x, vertex_b.y, vertex_b.z };
+  c = float3{ vertex_c.x, vertex_c.y, vertex_c.z };
+
+  ba = b - a;
+  ca = c - a;
+
+  na = float3{ vertex_a.nx, vertex_a.ny, vertex_a.nz };
+  nb = float3{ vertex_b.nx, vertex_b.ny, vertex_b.nz };
+  nc = float3{ vertex_c.nx, vertex_c.ny, vertex_c.nz };
+
+  ambient = {
+    vertex_a.ambient_r,
+    vertex_a.ambient_g,
+    vertex_a.ambient_b,
+  };
+  diffuse = {
+    vertex_a.diffuse_r,
+    vertex_a.diffuse_g,
+    vertex_a.diffuse_b,
+  };
+  emissive = {
+    vertex_a.emissive_r,
+    vertex_a.emissive_g,
+    vertex_a.emissive_b,
+  };
+}
+
+// Moller-Trumbore test; a negative t means no intersection
+template<typename VB>
+inline payload intersect_triangle(const triangle<VB>& triangle, const ray& ray)
+{
+  payload payload{};
+  payload.t = -1.f;
+
+  float3 pvec = cross(ray.direction, triangle.ca);
+  float det = dot(triangle.ba, pvec);
+
+  // No intersection; return empty payload
+  if (det >= -1e-8f && det <= 1e-8f)
+    return payload;
+
+  float inv_det = 1.f / det;
+
+  float3 tvec = ray.position - triangle.a;
+  float u = dot(tvec, pvec) * inv_det;
+  if (u < 0.f || u > 1.f)
+    return payload;
+
+  float3 qvec = cross(tvec, triangle.ba);
+  float v = dot(ray.direction, qvec) * inv_det;
+  if (v < 0.f || (u + v) > 1.f)
+    return payload;
+
+  payload.t = dot(triangle.ca, qvec) * inv_det;
+  payload.bary = float3{ 1.f - u - v, u, v };
+
+  return payload;
+}
+
+// Reciprocal of the direction with zero components nudged away from zero,
+// so slab distances never turn into NaNs
+inline float3 safe_inverse(const float3& direction)
+{
+  float3 inverse;
+  for (int axis = 0; axis < 3; axis++)
+  {
+    float component = direction[axis];
+    if (std::abs(component) < 1e-20f)
+      component = std::copysign(1e-20f, component);
+    inverse[axis] = 1.f / component;
+  }
+  return inverse;
+}
+
+// Spatial index over the triangles of a shape
+template<typename VB>
+class acceleration_structure
+{
+public:
+  virtual ~acceleration_structure() = default;
+
+  virtual void build(std::vector<triangle<VB>> in_triangles) = 0;
+  // Looks for a hit closer than closest_hit_payload.t and updates the
+  // payload with it. Returns the hit triangle or nullptr; with any_hit it
+  // returns at the first such hit instead of the closest one
+  virtual const triangle<VB>* intersect(
+    const ray& ray,
+    payload& closest_hit_payload,
+    float min_t,
+    bool any_hit
+  ) const = 0;
+  virtual bool occluded(const ray& ray, float max_t, float min_t) const;
+
+  virtual const std::vector<triangle<VB>>& get_triangles() const = 0;
+};
+
+template<typename VB>
+inline bool acceleration_structure<VB>::occluded(
+  const ray& ray,
+  float max_t,
+  float min_t
+) const
+{
+  payload payload = {};
+  payload.t = max_t;
+  return intersect(ray, payload, min_t, true) != nullptr;
+}
+} // namespace cg::renderer
@@ -0,0 +1,91 @@
+#include "checkpoint.h"
+
+#include "renderer/raytracer/scene_cache.h"
+#include "utils/profiler.h"
+
+#include <cstring>
+#include <fstream>
+
+
+uint64_t cg::renderer::checkpoint_key(
+  uint64_t scene_key,
+  const std::vector<float>& render_settings
+)
+{
+  uint64_t hash = fnv1a(checkpoint_version, scene_key);
+  return fnv1a(
+    reinterpret_cast<const uint8_t*>(render_settings.data()),
+    render_settings.size() * sizeof(float),
+    hash);
+}
+
+bool cg::renderer::load_checkpoint(
+  const std::filesystem::path& path,
+  uint64_t key,
+  resource<float3>& accumulation,
+  uint32_t& passes
+)
+{
+  PROFILE_ZONE("Load checkpoint");
+
+  std::ifstream stream(path, std::ios::binary);
+  if (!stream)
+    return false;
+
+  checkpoint_header header = {};
+  stream.read(reinterpret_cast<char*>(&header), sizeof(header));
+  if (!stream || std::memcmp(header.magic, "CGCHKPT", 8) != 0 ||
+      header.version != checkpoint_version || header.key != key ||
+      header.width != accumulation.get_stride() ||
+      header.width * header.height != accumulation.get_number_of_elements())
+    return false;
+
+  stream.read(
+    reinterpret_cast<char*>(&accumulation.item(0)),
+    accumulation.get_number_of_elements() * sizeof(float3));
+  if (!stream)
+    return false;
+
+  passes = header.passes;
+  return true;
+}
+
+bool cg::renderer::save_checkpoint(
+  const std::filesystem::path& path,
+  uint64_t key,
+  resource<float3>& accumulation,
+  uint32_t passes
+)
+{
+  PROFILE_ZONE("Save checkpoint");
+
+  // Replaces the previous checkpoint only once the new one is complete, so
+  // a run killed while saving still resumes from the last one
+  std::filesystem::path temporary_path = path;
+  temporary_path += ".tmp";
+
+  {
+    std::ofstream stream(temporary_path, std::ios::binary | std::ios::trunc);
+    if (!stream)
+      return false;
+
+    checkpoint_header header = {};
+    std::memcpy(header.magic, "CGCHKPT", 8);
+    header.version = checkpoint_version;
+    header.passes = passes;
+    header.key = key;
+    header.width = accumulation.get_stride();
+    header.height = accumulation.get_number_of_elements() / accumulation.get_stride();
+    stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    stream.write(
+      reinterpret_cast<const char*>(accumulation.get_data()),
+      accumulation.get_number_of_elements() * sizeof(float3));
+
+    if (!stream)
+      return false;
+  }
+
+  std::error_code error;
+  std::filesystem::rename(temporary_path, path, error);
+  return !error;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "resource.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+
+
+namespace cg::renderer
+{
+// Progress of a progressive render: the float sums of the first passes of
+// every pixel. Samplers are seeded from the pixel and the sample index, so
+// the number of passes is all the sampler state a resumed render needs
+constexpr uint32_t checkpoint_version = 1;
+
+struct checkpoint_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t passes;
+  uint64_t key;
+  uint64_t width;
+  uint64_t height;
+};
+
+// Hash of the scene key and every setting that changes the image; a
+// checkpoint of other settings is not resumed
+uint64_t checkpoint_key(uint64_t scene_key, const std::vector<float>& render_settings);
+
+// False when there is no checkpoint of this key and size
+bool load_checkpoint(
+  const std::filesystem::path& path,
+  uint64_t key,
+  resource<float3>& accumulation,
+  uint32_t& passes
+);
+
+bool save_checkpoint(
+  const std::filesystem::path& path,
+  uint64_t key,
+  resource<float3>& accumulation,
+  uint32_t passes
+);
+} // namespace cg::renderer
@@ -0,0 +1,180 @@
+#include "denoiser.h"
+
+#include "utils/error_handler.h"
+#include "utils/profiler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <omp.h>
+
+
+using namespace cg::renderer;
+
+void denoiser::set_buffers(
+  std::shared_ptr<resource<float3>> in_color,
+  std::shared_ptr<resource<float3>> in_albedo,
+  std::shared_ptr<resource<float3>> in_normal,
+  std::shared_ptr<resource<float>> in_depth
+)
+{
+  color = in_color;
+  albedo = in_albedo;
+  normal = in_normal;
+  depth = in_depth;
+}
+
+void denoiser::denoise()
+{
+  PROFILE_ZONE("Denoise");
+  if (!color || !albedo || !normal || !depth)
+    THROW_ERROR("Denoiser requires color, albedo, normal and depth buffers");
+
+  width = static_cast<int>(color->get_stride());
+  height = static_cast<int>(color->get_number_of_elements()) / width;
+  size_t pixel_count = static_cast<size_t>(width) * height;
+
+  for (int c = 0; c < 3; c++)
+  {
+    illumination[c].resize(pixel_count);
+    filtered[c].resize(pixel_count);
+    normals[c].resize(pixel_count);
+  }
+  luminance.resize(pixel_count);
+  depths.resize(pixel_count);
+
+  // Demodulate the albedo, so textures and material edges stay sharp
+  #pragma omp parallel for
+  for (int i = 0; i < static_cast<int>(pixel_count); i++)
+  {
+    float3 in_color = color->item(i);
+    float3 in_albedo = max(albedo->item(i), float3(1e-3f));
+    float3 in_normal = normal->item(i);
+
+    for (int c = 0; c < 3; c++)
+    {
+      illumination[c][i] = in_color[c] / in_albedo[c];
+      normals[c][i] = in_normal[c];
+    }
+    depths[i] = depth->item(i);
+  }
+
+  for (size_t iteration = 0; iteration < iterations; iteration++)
+  {
+    // Later passes see smoother input, so the luminance test is tightened
+    filter_pass(1 << iteration, 1.f / static_cast<float>(1 << iteration));
+
+    for (int c = 0; c < 3; c++)
+      std::swap(illumination[c], filtered[c]);
+  }
+
+  #pragma omp parallel for
+  for (int i = 0; i < static_cast<int>(pixel_count); i++)
+  {
+    float3 in_albedo = max(albedo->item(i), float3(1e-3f));
+    color->item(i) = float3{
+      illumination[0][i] * in_albedo.x,
+      illumination[1][i] * in_albedo.y,
+      illumination[2][i] * in_albedo.z,
+    };
+  }
+}
+
+void denoiser::filter_pass(int step, float luminance_scale)
+{
+  static const float kernel[5] = { 1.f / 16.f, 1.f / 4.f, 3.f / 8.f, 1.f / 4.f, 1.f / 16.f };
+
+  size_t pixel_count = static_cast<size_t>(width) * height;
+
+  // Luminance is compared in log space, so bright emitters and dim
+  // indirect light get the same relative tolerance
+  #pragma omp parallel for
+  for (int i = 0; i < static_cast<int>(pixel_count); i++)
+  {
+    luminance[i] = std::log1p(std::max(0.f,
+      0.2126f * illumination[0][i] +
+      0.7152f * illumination[1][i] +
+      0.0722f * illumination[2][i]));
+  }
+
+  // Clamped tap columns, so the inner loops have no border branches
+  std::vector<int> columns[5];
+  for (int tap = 0; tap < 5; tap++)
+  {
+    columns[tap].resize(width);
+    for (int x = 0; x < width; x++)
+      columns[tap][x] = std::clamp(x + (tap - 2) * step, 0, width - 1);
+  }
+
+  float inv_sigma_luminance = 1.f / (sigma_luminance * luminance_scale);
+  float inv_sigma_depth = 1.f / (sigma_depth * static_cast<float>(step));
+
+  #pragma omp parallel
+  {
+    std::vector<float> sum[3];
+    for (int c = 0; c < 3; c++)
+      sum[c].resize(width);
+    std::vector<float> weight_sum(width);
+
+    #pragma omp for
+    for (int y = 0; y < height; y++)
+    {
+      const size_t row = static_cast<size_t>(y) * width;
+
+      std::fill(weight_sum.begin(), weight_sum.end(), 0.f);
+      for (int c = 0; c < 3; c++)
+        std::fill(sum[c].begin(), sum[c].end(), 0.f);
+
+      for (int tap_y = 0; tap_y < 5; tap_y++)
+      {
+        const size_t tap_row =
+          static_cast<size_t>(std::clamp(y + (tap_y - 2) * step, 0, height - 1)) * width;
+
+        for (int tap_x = 0; tap_x < 5; tap_x++)
+        {
+          const float tap_kernel = kernel[tap_x] * kernel[tap_y];
+          const int* column = columns[tap_x].data();
+
+          for (int x = 0; x < width; x++)
+          {
+            const size_t p = row + x;
+            const size_t q = tap_row + column[x];
+
+            float normal_weight = std::max(0.f,
+              normals[0][p] * normals[0][q] +
+              normals[1][p] * normals[1][q] +
+              normals[2][p] * normals[2][q]);
+            // pow(normal_weight, 128) by squaring
+            for (int k = 0; k < 7; k++)
+              normal_weight *= normal_weight;
+
+            float depth_distance =
+              std::abs(depths[p] - depths[q]) /
+              std::max(depths[p], 1e-3f);
+            float luminance_distance = std::abs(luminance[p] - luminance[q]);
+
+            float weight = tap_kernel * normal_weight * std::exp(
+              -depth_distance * inv_sigma_depth -
+              luminance_distance * inv_sigma_luminance
+            );
+
+            weight_sum[x] += weight;
+            sum[0][x] += weight * illumination[0][q];
+            sum[1][x] += weight * illumination[1][q];
+            sum[2][x] += weight * illumination[2][q];
+          }
+        }
+      }
+
+      for (int x = 0; x < width; x++)
+      {
+        // The center tap always has full weight unless the normal is zero
+        float inv_weight = weight_sum[x] > 0.f ? 1.f / weight_sum[x] : 0.f;
+        for (int c = 0; c < 3; c++)
+        {
+          filtered[c][row + x] = weight_sum[x] > 0.f ?
+            sum[c][x] * inv_weight : illumination[c][row + x];
+        }
+      }
+    }
+  }
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "resource.h"
+
+#include <linalg.h>
+#include <memory>
+#include <vector>
+
+
+using namespace linalg::aliases;
+
+namespace cg::renderer
+{
+// Edge-aware a-trous wavelet filter for low sample count renders. The
+// illumination (color divided by albedo) is filtered with a 5x5 B3-spline
+// kernel whose taps are spread 1, 2, 4, ... pixels apart; normal (cosine
+// to the 128th power), depth and luminance differences stop the kernel at
+// edges
+class denoiser
+{
+public:
+  void set_buffers(
+    std::shared_ptr<resource<float3>> in_color,
+    std::shared_ptr<resource<float3>> in_albedo,
+    std::shared_ptr<resource<float3>> in_normal,
+    std::shared_ptr<resource<float>> in_depth
+  );
+
+  // Filters the color buffer in place
+  void denoise();
+
+  size_t iterations = 4;
+  // Tolerated difference of log luminance
+  float sigma_luminance = 0.25f;
+  // Tolerated relative depth difference at the first pass
+  float sigma_depth = 0.1f;
+
+protected:
+  void filter_pass(int step, float luminance_scale);
+
+  std::shared_ptr<resource<float3>> color;
+  std::shared_ptr<resource<float3>> albedo;
+  std::shared_ptr<resource<float3>> normal;
+  std::shared_ptr<resource<float>> depth;
+
+  int width = 0;
+  int height = 0;
+
+  // Planar copies, so the per-row loops run over contiguous floats
+  std::vector<float> illumination[3];
+  std::vector<float> filtered[3];
+  std::vector<float> luminance;
+  std::vector<float> normals[3];
+  std::vector<float> depths;
+};
+} // namespace cg::renderer
@@ -0,0 +1,317 @@
+#pragma once
+
+#include "renderer/raytracer/acceleration_structure.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+
+namespace cg::renderer
+{
+// Interior nodes keep the split plane and the index of their far child, the
+// near child directly follows its parent. Leaves keep a range of
+// leaf_triangles
+struct kd_tree_node
+{
+  float split;
+  uint32_t axis_or_leaf; // 0-2 for interior nodes, 3 for leaves
+  uint32_t first;        // far child or first leaf triangle
+  uint32_t count;
+
+  bool is_leaf() const { return axis_or_leaf == 3; }
+};
+
+// SAH kd-tree. Split candidates are the bounds of the node's triangles, the
+// primitive counts on both sides come from binary searches over sorted
+// bounds, so every node costs O(N log N)
+template<typename VB>
+class kd_tree : public acceleration_structure<VB>
+{
+public:
+  void build(std::vector<triangle<VB>> in_triangles) override;
+  const triangle<VB>* intersect(
+    const ray& ray,
+    payload& closest_hit_payload,
+    float min_t,
+    bool any_hit
+  ) const override;
+
+  const std::vector<triangle<VB>>& get_triangles() const override;
+  const std::vector<kd_tree_node>& get_nodes() const;
+
+  float traversal_cost = 1.f;
+  float intersection_cost = 1.5f;
+  float empty_bonus = 0.8f;
+  uint32_t max_leaf_size = 2;
+
+protected:
+  void build_node(
+    const std::vector<uint32_t>& indices,
+    const float3& node_min,
+    const float3& node_max,
+    unsigned depth
+  );
+
+  std::vector<triangle<VB>> triangles;
+  std::vector<kd_tree_node> nodes;
+  std::vector<uint32_t> leaf_triangles;
+
+  std::vector<float3> triangle_min;
+  std::vector<float3> triangle_max;
+
+  float3 tree_min;
+  float3 tree_max;
+  unsigned max_depth = 0;
+};
+
+template<typename VB>
+void kd_tree<VB>::build(std::vector<triangle<VB>> in_triangles)
+{
+  triangles = std::move(in_triangles);
+  nodes.clear();
+  leaf_triangles.clear();
+  if (triangles.empty())
+    return;
+
+  triangle_min.resize(triangles.size());
+  triangle_max.resize(triangles.size());
+  tree_min = float3(FLT_MAX);
+  tree_max = float3(-FLT_MAX);
+  std::vector<uint32_t> indices(triangles.size());
+  for (uint32_t i = 0; i < triangles.size(); i++)
+  {
+    const auto& triangle = triangles[i];
+    triangle_min[i] = min(triangle.a, min(triangle.b, triangle.c));
+    triangle_max[i] = max(triangle.a, max(triangle.b, triangle.c));
+    tree_min = min(tree_min, triangle_min[i]);
+    tree_max = max(tree_max, triangle_max[i]);
+    indices[i] = i;
+  }
+
+  max_depth = static_cast<unsigned>(8.f + 1.3f * std::log2(static_cast<float>(triangles.size())));
+  build_node(indices, tree_min, tree_max, 0);
+
+  triangle_min.clear();
+  triangle_min.shrink_to_fit();
+  triangle_max.clear();
+  triangle_max.shrink_to_fit();
+}
+
+template<typename VB>
+void kd_tree<VB>::build_node(
+  const std::vector<uint32_t>& indices,
+  const float3& node_min,
+  const float3& node_max,
+  unsigned depth
+)
+{
+  uint32_t node_index = static_cast<uint32_t>(nodes.size());
+  nodes.push_back({});
+
+  auto make_leaf = [&]() {
+    nodes[node_index] = { 0.f, 3,
+                          static_cast<uint32_t>(leaf_triangles.size()),
+                          static_cast<uint32_t>(indices.size()) };
+    leaf_triangles.insert(leaf_triangles.end(), indices.begin(), indices.end());
+  };
+
+  uint32_t count = static_cast<uint32_t>(indices.size());
+  if (count <= max_leaf_size || depth >= max_depth)
+  {
+    make_leaf();
+    return;
+  }
+
+  float3 extent = node_max - node_min;
+  float node_area = extent.x * extent.y + extent.y * extent.z + extent.z * extent.x;
+  float best_cost = intersection_cost * count;
+  int best_axis = -1;
+  float best_split = 0.f;
+
+  std::vector<float> starts(count);
+  std::vector<float> ends(count);
+  for (int axis = 0; axis < 3; axis++)
+  {
+    if (extent[axis] <= 0.f)
+      continue;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+      starts[i] = triangle_min[indices[i]][axis];
+      ends[i] = triangle_max[indices[i]][axis];
+    }
+    std::sort(starts.begin(), starts.end());
+    std::sort(ends.begin(), ends.end());
+
+    int u = (axis + 1) % 3;
+    int v = (axis + 2) % 3;
+    float cap_area = extent[u] * extent[v];
+    float perimeter = extent[u] + extent[v];
+
+    auto evaluate = [&](float split) {
+      if (split <= node_min[axis] || split >= node_max[axis])
+        return;
+
+      // Triangles that start left of the plane go left, those that end
+      // right of it go right, planar triangles on the plane go left
+      uint32_t left = static_cast<uint32_t>(
+        std::upper_bound(starts.begin(), starts.end(), split) - starts.begin());
+      uint32_t right = static_cast<uint32_t>(
+        ends.end() - std::upper_bound(ends.begin(), ends.end(), split));
+
+      float left_area = cap_area + (split - node_min[axis]) * perimeter;
+      float right_area = cap_area + (node_max[axis] - split) * perimeter;
+      float cost = traversal_cost +
+                   intersection_cost * (left_area * left + right_area * right) / node_area;
+      if (left == 0 || right == 0)
+        cost *= empty_bonus;
+
+      if (cost < best_cost)
+      {
+        best_cost = cost;
+        best_axis = axis;
+        best_split = split;
+      }
+    };
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+      evaluate(starts[i]);
+      evaluate(ends[i]);
+    }
+  }
+
+  if (best_axis < 0)
+  {
+    make_leaf();
+    return;
+  }
+
+  std::vector<uint32_t> left_indices;
+  std::vector<uint32_t> right_indices;
+  for (uint32_t index : indices)
+  {
+    if (triangle_min[index][best_axis] <= best_split)
+      left_indices.push_back(index);
+    if (triangle_max[index][best_axis] > best_split)
+      right_indices.push_back(index);
+  }
+
+  float3 left_max = node_max;
+  left_max[best_axis] = best_split;
+  float3 right_min = node_min;
+  right_min[best_axis] = best_split;
+
+  build_node(left_indices, node_min, left_max, depth + 1);
+  uint32_t far_child = static_cast<uint32_t>(nodes.size());
+  build_node(right_indices, right_min, node_max, depth + 1);
+
+  nodes[node_index] = { best_split, static_cast<uint32_t>(best_axis), far_child, 0 };
+}
+
+template<typename VB>
+const triangle<VB>* kd_tree<VB>::intersect(
+  const ray& ray,
+  payload& closest_hit_payload,
+  float min_t,
+  bool any_hit
+) const
+{
+  if (nodes.empty())
+    return nullptr;
+
+  float3 inv_ray_direction = safe_inverse(ray.direction);
+  float3 t0 = (tree_min - ray.position) * inv_ray_direction;
+  float3 t1 = (tree_max - ray.position) * inv_ray_direction;
+  float t_min = std::max(maxelem(min(t0, t1)), 0.f);
+  float t_max = std::min(minelem(max(t0, t1)), closest_hit_payload.t);
+  if (t_min > t_max)
+    return nullptr;
+
+  struct stack_entry
+  {
+    uint32_t node;
+    float t_min;
+    float t_max;
+  };
+  stack_entry stack[64];
+  int stack_size = 0;
+
+  const triangle<VB>* closest_triangle = nullptr;
+  uint32_t node_index = 0;
+  while (true)
+  {
+    const kd_tree_node& node = nodes[node_index];
+    count_node();
+    if (!node.is_leaf())
+    {
+      int axis = node.axis_or_leaf;
+      float t_split = (node.split - ray.position[axis]) * inv_ray_direction[axis];
+
+      uint32_t near_child = node_index + 1;
+      uint32_t far_child = node.first;
+      bool left_first = ray.position[axis] < node.split ||
+                        (ray.position[axis] == node.split && ray.direction[axis] <= 0.f);
+      if (!left_first)
+        std::swap(near_child, far_child);
+
+      if (t_split > t_max || t_split <= 0.f)
+      {
+        node_index = near_child;
+      }
+      else if (t_split < t_min)
+      {
+        node_index = far_child;
+      }
+      else
+      {
+        if (stack_size < 64)
+          stack[stack_size++] = { far_child, t_split, t_max };
+        node_index = near_child;
+        t_max = t_split;
+      }
+      continue;
+    }
+
+    for (uint32_t i = node.first; i < node.first + node.count; i++)
+    {
+      const triangle<VB>& triangle = triangles[leaf_triangles[i]];
+      count_triangles(1);
+      payload payload = intersect_triangle(triangle, ray);
+
+      if (payload.t > min_t && payload.t < closest_hit_payload.t)
+      {
+        closest_hit_payload = payload;
+        closest_triangle = &triangle;
+        if (any_hit)
+          return closest_triangle;
+      }
+    }
+
+    // Nodes are visited front to back, a hit inside this leaf is final
+    if (closest_hit_payload.t <= t_max || stack_size == 0)
+      break;
+
+    stack_entry entry = stack[--stack_size];
+    node_index = entry.node;
+    t_min = entry.t_min;
+    t_max = std::min(entry.t_max, closest_hit_payload.t);
+  }
+
+  return closest_triangle;
+}
+
+template<typename VB>
+const std::vector<triangle<VB>>& kd_tree<VB>::get_triangles() const
+{
+  return triangles;
+}
+
+template<typename VB>
+const std::vector<kd_tree_node>& kd_tree<VB>::get_nodes() const
+{
+  return nodes;
+}
+} // namespace cg::renderer
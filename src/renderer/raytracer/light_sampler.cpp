@@ -0,0 +1,111 @@
+#include "light_sampler.h"
+
+#include <algorithm>
+#include <numeric>
+
+
+using namespace cg::renderer;
+
+void alias_table::build(const std::vector<float>& weights)
+{
+  size_t count = weights.size();
+
+  probability.assign(count, 1.f);
+  alias.resize(count);
+  pmf.assign(count, 0.f);
+
+  if (count == 0)
+    return;
+
+  double total = std::accumulate(weights.begin(), weights.end(), 0.0);
+
+  // Degenerate weights fall back to the uniform distribution
+  for (size_t i = 0; i < count; i++)
+  {
+    pmf[i] = total > 0.0 ?
+      static_cast<float>(std::max(weights[i], 0.f) / total) :
+      1.f / static_cast<float>(count);
+  }
+
+  std::vector<float> scaled(count);
+  std::vector<uint32_t> small;
+  std::vector<uint32_t> large;
+
+  for (size_t i = 0; i < count; i++)
+  {
+    alias[i] = static_cast<uint32_t>(i);
+    scaled[i] = pmf[i] * static_cast<float>(count);
+
+    if (scaled[i] < 1.f)
+      small.push_back(static_cast<uint32_t>(i));
+    else
+      large.push_back(static_cast<uint32_t>(i));
+  }
+
+  while (!small.empty() && !large.empty())
+  {
+    uint32_t less = small.back();
+    small.pop_back();
+    uint32_t more = large.back();
+    large.pop_back();
+
+    probability[less] = scaled[less];
+    alias[less] = more;
+
+    scaled[more] = (scaled[more] + scaled[less]) - 1.f;
+    if (scaled[more] < 1.f)
+      small.push_back(more);
+    else
+      large.push_back(more);
+  }
+
+  // Whatever remains is equal to 1 up to rounding, except for entries
+  // without weight: they must never be picked, so they always take the
+  // alias of the heaviest entry
+  uint32_t heaviest = static_cast<uint32_t>(std::max_element(pmf.begin(), pmf.end()) - pmf.begin());
+  for (uint32_t index : large)
+    probability[index] = 1.f;
+  for (uint32_t index : small)
+  {
+    if (pmf[index] > 0.f)
+    {
+      probability[index] = 1.f;
+    }
+    else
+    {
+      probability[index] = 0.f;
+      alias[index] = heaviest;
+    }
+  }
+}
+
+size_t alias_table::sample(float u, float& out_pmf) const
+{
+  float scaled = u * static_cast<float>(probability.size());
+  size_t index = std::min(
+    static_cast<size_t>(scaled),
+    probability.size() - 1
+  );
+  float remainder = scaled - static_cast<float>(index);
+
+  if (remainder >= probability[index])
+    index = alias[index];
+
+  out_pmf = pmf[index];
+  return index;
+}
+
+float alias_table::get_pmf(size_t index) const
+{
+  return pmf[index];
+}
+
+size_t alias_table::size() const
+{
+  return pmf.size();
+}
+
+bool alias_table::empty() const
+{
+  return pmf.empty();
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+
+namespace cg::renderer
+{
+// Walker's alias table: picks an index with probability proportional to its
+// weight in constant time, whatever the number of entries is
+class alias_table
+{
+public:
+  void build(const std::vector<float>& weights);
+
+  size_t sample(float u, float& out_pmf) const;
+  float get_pmf(size_t index) const;
+
+  size_t size() const;
+  bool empty() const;
+
+protected:
+  std::vector<float> probability;
+  std::vector<uint32_t> alias;
+  std::vector<float> pmf;
+};
+} // namespace cg::renderer
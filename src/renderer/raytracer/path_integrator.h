@@ -0,0 +1,380 @@
+#pragma once
+
+#include "renderer/raytracer/light_sampler.h"
+#include "renderer/raytracer/raytracer.h"
+
+#include <algorithm>
+#include <array>
+#include <linalg.h>
+#include <memory>
+#include <set>
+#include <vector>
+
+
+using namespace linalg::aliases;
+
+namespace cg::renderer
+{
+// Loop-carried state of a single path; replaces the recursion through
+// closest_hit_shader -> trace_ray
+struct path_state
+{
+  float3 position;
+  float3 direction;
+  float3 throughput;
+  float3 radiance;
+  size_t bounce;
+};
+
+template<typename VB, typename RT, typename SP = function_shaders<VB>>
+class path_integrator
+{
+public:
+  path_integrator(std::shared_ptr<raytracer<VB, RT, SP>> in_raytracer);
+
+  void set_lights(const std::vector<light>& in_lights);
+  // Turns every emissive triangle of the raytracer's acceleration
+  // structures into an area light
+  void collect_area_lights();
+  size_t get_number_of_area_lights() const;
+
+  // Continues the path from the primary hit found by trace_ray
+  float3 shade(const ray& ray, const payload& hit, const triangle<VB>& closest_triangle) const;
+  // Wavefront variant of shade for the camera samples of a batch: all paths
+  // advance one bounce at a time and the rays of a bounce are traced
+  // together through raytracer->closest_hits. The result matches shade
+  void shade_batch(sample_batch& batch) const;
+
+  // Bounces that are always traced before Russian roulette kicks in
+  size_t min_bounces = 3;
+  // Safety cap only; paths are normally terminated by Russian roulette
+  size_t max_bounces = 64;
+  // Shadow rays per shading point, independent of the number of lights
+  size_t light_samples = 1;
+  // Upper bound of the radiance a bounce past the primary hit may add;
+  // trades a little energy for no fireflies in low sample renders
+  float max_indirect_radiance = FLT_MAX;
+
+protected:
+  // Adds the direct light at the hit and picks the next bounce direction;
+  // false when the path ends there
+  bool continue_path(path_state& state, const payload& hit, const triangle<VB>& hit_triangle) const;
+  float3 direct_lighting(const float3& position, const float3& normal, const triangle<VB>& surface) const;
+  float3 sample_cosine_hemisphere(const float3& normal, float u1, float u2) const;
+  float3 miss_color(const ray& ray) const;
+  void build_light_table();
+
+  std::shared_ptr<raytracer<VB, RT, SP>> raytracer;
+  std::vector<light> lights;
+  std::vector<area_light> area_lights;
+  // Point and area lights are picked proportionally to their power; indices
+  // past the point lights refer to the area lights
+  alias_table light_table;
+};
+
+template<typename VB, typename RT, typename SP>
+path_integrator<VB, RT, SP>::path_integrator(
+  std::shared_ptr<cg::renderer::raytracer<VB, RT, SP>> in_raytracer
+) :
+  raytracer(in_raytracer)
+{
+}
+
+template<typename VB, typename RT, typename SP>
+void path_integrator<VB, RT, SP>::set_lights(const std::vector<light>& in_lights)
+{
+  lights = in_lights;
+  build_light_table();
+}
+
+template<typename VB, typename RT, typename SP>
+void path_integrator<VB, RT, SP>::collect_area_lights()
+{
+  area_lights.clear();
+
+  for (auto& shape : raytracer->acceleration_structures)
+  {
+    // Spatial splits store a triangle once per leaf that references it
+    std::set<std::array<float, 9>> collected;
+
+    for (auto& triangle : shape->get_triangles())
+    {
+      if (maxelem(triangle.emissive) <= 0.f)
+        continue;
+
+      std::array<float, 9> vertices = {
+        triangle.a.x, triangle.a.y, triangle.a.z,
+        triangle.b.x, triangle.b.y, triangle.b.z,
+        triangle.c.x, triangle.c.y, triangle.c.z
+      };
+      if (!collected.insert(vertices).second)
+        continue;
+
+      float3 face_normal = cross(triangle.ba, triangle.ca);
+      float double_area = length(face_normal);
+      if (double_area <= 0.f)
+        continue;
+
+      area_lights.push_back({
+        triangle.a,
+        triangle.ba,
+        triangle.ca,
+        face_normal / double_area,
+        triangle.emissive,
+        0.5f * double_area
+      });
+    }
+  }
+
+  build_light_table();
+}
+
+template<typename VB, typename RT, typename SP>
+size_t path_integrator<VB, RT, SP>::get_number_of_area_lights() const
+{
+  return area_lights.size();
+}
+
+template<typename VB, typename RT, typename SP>
+void path_integrator<VB, RT, SP>::build_light_table()
+{
+  const float3 luminance{ 0.2126f, 0.7152f, 0.0722f };
+
+  std::vector<float> power;
+  power.reserve(lights.size() + area_lights.size());
+
+  for (auto& light : lights)
+    power.push_back(dot(light.color, luminance));
+  for (auto& light : area_lights)
+    power.push_back(dot(light.emissive, luminance) * light.area);
+
+  light_table.build(power);
+}
+
+template<typename VB, typename RT, typename SP>
+float3 path_integrator<VB, RT, SP>::shade(
+  const ray& ray,
+  const payload& hit,
+  const triangle<VB>& closest_triangle
+) const
+{
+  path_state state{ ray.position, ray.direction, float3(1.f), closest_triangle.emissive, 0 };
+  payload path_hit = hit;
+  const triangle<VB>* hit_triangle = &closest_triangle;
+
+  while (continue_path(state, path_hit, *hit_triangle))
+  {
+    cg::renderer::ray bounce_ray(state.position, state.direction);
+    path_hit = {};
+    hit_triangle = raytracer->closest_hit(bounce_ray, path_hit);
+
+    if (!hit_triangle)
+    {
+      state.radiance += state.throughput * miss_color(bounce_ray);
+      break;
+    }
+  }
+
+  return state.radiance;
+}
+
+template<typename VB, typename RT, typename SP>
+void path_integrator<VB, RT, SP>::shade_batch(sample_batch& batch) const
+{
+  std::vector<path_state> states;
+  states.reserve(batch.rays.size());
+  for (auto& ray : batch.rays)
+    states.push_back({ ray.position, ray.direction, float3(1.f), float3(0.f), 0 });
+
+  // Paths that wait for the hit of rays[i]
+  std::vector<uint32_t> paths(batch.rays.size());
+  for (size_t i = 0; i < paths.size(); i++)
+    paths[i] = static_cast<uint32_t>(i);
+  std::vector<cg::renderer::ray> rays = batch.rays;
+
+  std::vector<batch_hit<VB>> hits;
+  std::vector<uint32_t> next_paths;
+  std::vector<cg::renderer::ray> next_rays;
+  bool primary = true;
+  while (!paths.empty())
+  {
+    raytracer->closest_hits(rays, hits);
+
+    next_paths.clear();
+    next_rays.clear();
+    for (size_t i = 0; i < paths.size(); i++)
+    {
+      path_state& state = states[paths[i]];
+      const triangle<VB>* hit_triangle = hits[i].hit_triangle;
+      if (!hit_triangle)
+      {
+        state.radiance += state.throughput * miss_color(rays[i]);
+        continue;
+      }
+
+      if (primary)
+        state.radiance = hit_triangle->emissive;
+
+      // Every path continues its own random sequence, as in shade
+      thread_sampler() = batch.samplers[paths[i]];
+      bool alive = continue_path(state, hits[i].hit, *hit_triangle);
+      batch.samplers[paths[i]] = thread_sampler();
+
+      if (alive)
+      {
+        next_paths.push_back(paths[i]);
+        next_rays.emplace_back(state.position, state.direction);
+      }
+    }
+
+    std::swap(paths, next_paths);
+    std::swap(rays, next_rays);
+    primary = false;
+  }
+
+  batch.colors.resize(states.size());
+  for (size_t i = 0; i < states.size(); i++)
+    batch.colors[i] = states[i].radiance;
+}
+
+template<typename VB, typename RT, typename SP>
+bool path_integrator<VB, RT, SP>::continue_path(
+  path_state& state,
+  const payload& hit,
+  const triangle<VB>& hit_triangle
+) const
+{
+  sampler& sampler = thread_sampler();
+
+  float3 position = state.position + state.direction * hit.t;
+
+  float3 normal = normalize(
+    hit.bary.x * hit_triangle.na +
+    hit.bary.y * hit_triangle.nb +
+    hit.bary.z * hit_triangle.nc
+  );
+  if (dot(normal, state.direction) > 0.f)
+    normal = -normal;
+
+  // Next-event estimation; emission of surfaces hit by bounce rays is not
+  // accumulated, the lights are accounted for here only
+  float3 radiance = state.throughput * direct_lighting(position, normal, hit_triangle);
+  if (state.bounce > 0 && maxelem(radiance) > max_indirect_radiance)
+    radiance *= max_indirect_radiance / maxelem(radiance);
+  state.radiance += radiance;
+
+  if (++state.bounce >= max_bounces)
+    return false;
+
+  state.throughput *= hit_triangle.diffuse;
+
+  if (state.bounce > min_bounces)
+  {
+    float survival = std::min(maxelem(state.throughput), 0.95f);
+    if (sampler.next() >= survival)
+      return false;
+    state.throughput /= survival;
+  }
+
+  float u1 = sampler.next();
+  float u2 = sampler.next();
+  state.position = position;
+  state.direction = sample_cosine_hemisphere(normal, u1, u2);
+  return true;
+}
+
+template<typename VB, typename RT, typename SP>
+float3 path_integrator<VB, RT, SP>::direct_lighting(
+  const float3& position,
+  const float3& normal,
+  const triangle<VB>& surface
+) const
+{
+  float3 result(0.f);
+
+  if (light_table.empty())
+    return result;
+
+  sampler& sampler = thread_sampler();
+
+  for (size_t i = 0; i < light_samples; i++)
+  {
+    float pmf;
+    size_t index = light_table.sample(sampler.next(), pmf);
+    float2 u = sampler.next_stratified();
+
+    if (index < lights.size())
+    {
+      const light& light = lights[index];
+
+      float3 to_light = light.position - position;
+      float distance = length(to_light);
+      float3 light_direction = to_light / distance;
+
+      float cosine = dot(normal, light_direction);
+      if (cosine <= 0.f)
+        continue;
+
+      if (raytracer->occluded(ray(position, light_direction), distance))
+        continue;
+
+      result += surface.diffuse * light.color * cosine / pmf;
+      continue;
+    }
+
+    const area_light& light = area_lights[index - lights.size()];
+
+    // Uniform point on the triangle, so the area PDF is 1 / area
+    float su = std::sqrt(u.x);
+    float3 light_position =
+      light.a + light.ba * (su * (1.f - u.y)) + light.ca * (su * u.y);
+
+    float3 to_light = light_position - position;
+    float distance = length(to_light);
+    float3 light_direction = to_light / distance;
+
+    float cosine = dot(normal, light_direction);
+    float light_cosine = std::abs(dot(light.normal, light_direction));
+    if (cosine <= 0.f || light_cosine <= 0.f)
+      continue;
+
+    if (raytracer->occluded(ray(position, light_direction), distance * 0.999f))
+      continue;
+
+    result +=
+      surface.diffuse * 0.318309886f * light.emissive *
+      (cosine * light_cosine * light.area / (distance * distance * pmf));
+  }
+
+  return result / static_cast<float>(light_samples);
+}
+
+template<typename VB, typename RT, typename SP>
+float3 path_integrator<VB, RT, SP>::sample_cosine_hemisphere(
+  const float3& normal,
+  float u1,
+  float u2
+) const
+{
+  float radius = std::sqrt(u1);
+  float phi = 6.28318530718f * u2;
+
+  float3 tangent = std::abs(normal.x) > 0.9f ?
+    float3{ 0.f, 1.f, 0.f } : float3{ 1.f, 0.f, 0.f };
+  tangent = normalize(cross(tangent, normal));
+  float3 bitangent = cross(normal, tangent);
+
+  return normalize(
+    tangent * (radius * std::cos(phi)) +
+    bitangent * (radius * std::sin(phi)) +
+    normal * std::sqrt(std::max(0.f, 1.f - u1))
+  );
+}
+
+template<typename VB, typename RT, typename SP>
+float3 path_integrator<VB, RT, SP>::miss_color(const ray& ray) const
+{
+  color color = raytracer->shade_miss(ray).color;
+  return float3{ color.r, color.g, color.b };
+}
+} // namespace cg::renderer
@@ -1,100 +1,249 @@
 #pragma once
 
+#include "renderer/raytracer/acceleration_structure.h"
+#include "renderer/raytracer/kd_tree.h"
+#include "renderer/raytracer/triangle_block.h"
+#include "renderer/raytracer/uniform_grid.h"
 #include "resource.h"
+#include "utils/profiler.h"
 
 #include <iostream>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
 #include <linalg.h>
 #include <memory>
 #include <omp.h>
+#include <optional>
 #include <random>
 #include <time.h>
+#include <utility>
+#include <vector>
 
 using namespace linalg::aliases;
 
 namespace cg::renderer
 {
-struct ray
+// Node of a flattened BVH. Children of an interior node are stored next to
+// each other starting at left_first; a leaf covers count triangles starting
+// at left_first
+struct bvh_node
 {
-  ray(float3 position, float3 direction) :
-    position(position), direction(direction)
-  {
-  }
+  float3 aabb_min;
+  uint32_t left_first;
+  float3 aabb_max;
+  uint32_t count;
 
-  float3 position;
-  float3 direction;
+  bool is_leaf() const;
 };
 
-struct payload
+inline bool bvh_node::is_leaf() const
 {
-  float t;
-  float3 bary;
-  color color;
-  size_t depth;
-};
+  return count != 0;
+}
 
-template<typename VB>
-struct triangle
+// Entry distance of the ray into the box or FLT_MAX on a miss
+inline float aabb_distance(
+  const float3& aabb_min,
+  const float3& aabb_max,
+  const ray& ray,
+  const float3& inv_ray_direction,
+  float max_t
+)
 {
-  triangle(const VB& vertex_a, const VB& vertex_b, const VB& vertex_c);
+  float3 t0 = (aabb_min - ray.position) * inv_ray_direction;
+  float3 t1 = (aabb_max - ray.position) * inv_ray_direction;
+  float t_near = maxelem(min(t0, t1));
+  float t_far = minelem(max(t0, t1));
 
-  float3 a;
-  float3 b;
-  float3 c;
+  if (t_near > t_far || t_far < 0.f || t_near > max_t)
+    return FLT_MAX;
 
-  float3 ba;
-  float3 ca;
+  return t_near;
+}
 
-  float3 na;
-  float3 nb;
-  float3 nc;
+// Four-wide BVH node that fits a cache line. Child bounds are quantized to
+// 8 bits on a per-axis power-of-two grid anchored at the parent minimum and
+// rounded outwards, so decoded boxes always contain the exact ones. A child
+// with a non-zero triangle count is a leaf that starts at the triangle
+// referenced by children
+struct alignas(64) compressed_bvh_node
+{
+  float3 origin;
+  int8_t exponent[3];
+  uint8_t padding_0;
+  uint8_t child_min[3][4];
+  uint8_t child_max[3][4];
+  uint32_t children[4];
+  uint8_t triangle_count[4];
+  uint32_t padding_1;
+
+  static constexpr uint32_t empty_child = UINT32_MAX;
+
+  float3 get_scale() const;
+  float3 get_child_min(size_t child, const float3& scale) const;
+  float3 get_child_max(size_t child, const float3& scale) const;
+  // Quantized lower or upper planes of the four children along the axis
+  const uint8_t* get_planes(int axis, bool upper) const;
+
+  void encode_bounds(const float3& aabb_min, const float3& aabb_max);
+  void encode_child(size_t child, const float3& aabb_min, const float3& aabb_max);
 
-  float3 ambient;
-  float3 diffuse;
-  float3 emissive;
+protected:
+  // 2^exponent built directly from the float bits
+  static float exp2(int8_t exponent);
 };
 
-template<typename VB>
-triangle<VB>::triangle(const VB& vertex_a, const VB& vertex_b, const VB& vertex_c)
+static_assert(sizeof(compressed_bvh_node) == 64);
+
+inline float compressed_bvh_node::exp2(int8_t exponent)
 {
-  a = float3{ vertex_a.x, vertex_a.y, vertex_a.z };
-  b = float3{ vertex_b.x, vertex_b.y, vertex_b.z };
-  c = float3{ vertex_c.x, vertex_c.y, vertex_c.z };
+  uint32_t bits = static_cast<uint32_t>(exponent + 127) << 23;
+  float result;
+  std::memcpy(&result, &bits, sizeof(result));
+  return result;
+}
 
-  ba = b - a;
-  ca = c - a;
+inline float3 compressed_bvh_node::get_scale() const
+{
+  return float3{ exp2(exponent[0]), exp2(exponent[1]), exp2(exponent[2]) };
+}
 
-  na = float3{ vertex_a.nx, vertex_a.ny, vertex_a.nz };
-  nb = float3{ vertex_b.nx, vertex_b.ny, vertex_b.nz };
-  nc = float3{ vertex_c.nx, vertex_c.ny, vertex_c.nz };
+inline float3 compressed_bvh_node::get_child_min(size_t child, const float3& scale) const
+{
+  return origin + float3{
+    static_cast<float>(child_min[0][child]),
+    static_cast<float>(child_min[1][child]),
+    static_cast<float>(child_min[2][child])
+  } * scale;
+}
 
-  ambient = {
-    vertex_a.ambient_r,
-    vertex_a.ambient_g,
-    vertex_a.ambient_b,
-  };
-  diffuse = {
-    vertex_a.diffuse_r,
-    vertex_a.diffuse_g,
-    vertex_a.diffuse_b,
-  };
-  emissive = {
-    vertex_a.emissive_r,
-    vertex_a.emissive_g,
-    vertex_a.emissive_b,
-  };
+inline float3 compressed_bvh_node::get_child_max(size_t child, const float3& scale) const
+{
+  return origin + float3{
+    static_cast<float>(child_max[0][child]),
+    static_cast<float>(child_max[1][child]),
+    static_cast<float>(child_max[2][child])
+  } * scale;
+}
+
+inline const uint8_t* compressed_bvh_node::get_planes(int axis, bool upper) const
+{
+  return upper ? child_max[axis] : child_min[axis];
+}
+
+inline void compressed_bvh_node::encode_bounds(const float3& aabb_min, const float3& aabb_max)
+{
+  origin = aabb_min;
+
+  for (int axis = 0; axis < 3; axis++)
+  {
+    // Smallest power of two that spans the node in 255 steps
+    int power;
+    std::frexp((aabb_max[axis] - aabb_min[axis]) / 255.f, &power);
+    power = std::clamp(power, -126, 127);
+    if (power < 127 && origin[axis] + 255.f * exp2(static_cast<int8_t>(power)) < aabb_max[axis])
+      power++;
+
+    exponent[axis] = static_cast<int8_t>(power);
+  }
+}
+
+inline void compressed_bvh_node::encode_child(
+  size_t child,
+  const float3& aabb_min,
+  const float3& aabb_max
+)
+{
+  float3 scale = get_scale();
+
+  for (int axis = 0; axis < 3; axis++)
+  {
+    float lower = std::floor((aabb_min[axis] - origin[axis]) / scale[axis]);
+    float upper = std::ceil((aabb_max[axis] - origin[axis]) / scale[axis]);
+    int lower_step = static_cast<int>(std::clamp(lower, 0.f, 255.f));
+    int upper_step = static_cast<int>(std::clamp(upper, 0.f, 255.f));
+
+    // The division may round across a step, so fix up the decoded values
+    while (lower_step > 0 && origin[axis] + lower_step * scale[axis] > aabb_min[axis])
+      lower_step--;
+    while (upper_step < 255 && origin[axis] + upper_step * scale[axis] < aabb_max[axis])
+      upper_step++;
+
+    child_min[axis][child] = static_cast<uint8_t>(lower_step);
+    child_max[axis][child] = static_cast<uint8_t>(upper_step);
+  }
 }
 
+// BVH backend of acceleration_structure
 template<typename VB>
-class aabb
+class aabb : public acceleration_structure<VB>
 {
 public:
+  void build(std::vector<triangle<VB>> in_triangles) override;
+  const triangle<VB>* intersect(
+    const ray& ray,
+    payload& closest_hit_payload,
+    float min_t,
+    bool any_hit
+  ) const override;
+
   void add_triangle(const triangle<VB> triangle);
-  const std::vector<triangle<VB>>& get_triangles() const;
+  // Binned SAH build behind build(), which also compresses the result when
+  // compress is set; reorders the triangles so every leaf covers a
+  // contiguous range of them. A non-zero spatial split budget also lets
+  // the build clip triangles at split planes, duplicating up to that share
+  // of the triangles
+  void build_bvh();
+  // Collapses the built BVH into four-wide compressed nodes and releases
+  // the binary ones; keeps the binary nodes when a leaf is larger than
+  // max_bvh_leaf_size
+  void compress_bvh();
+  // Copies the triangles of every leaf into SoA blocks, so the leaves are
+  // tested with the SIMD kernel instead of one triangle at a time
+  void build_triangle_blocks();
+  // Takes prebuilt triangles and nodes, e.g. from a scene cache
+  void assign(
+    std::vector<triangle<VB>> in_triangles,
+    std::vector<bvh_node> in_nodes,
+    std::vector<compressed_bvh_node> in_compressed_nodes = {}
+  );
+  // Whether the nodes form a tree no deeper than max_bvh_depth whose child
+  // and triangle references stay inside the arrays. Traversal indexes them
+  // unchecked, so assigned nodes are checked once
+  bool is_valid() const;
+
+  const std::vector<triangle<VB>>& get_triangles() const override;
+  const std::vector<bvh_node>& get_nodes() const;
+  const std::vector<compressed_bvh_node>& get_compressed_nodes() const;
   bool aabb_test(const ray& ray) const;
 
+  size_t max_leaf_size = 4;
+  float spatial_split_budget = 0.f;
+  // Collapse into compressed nodes after the build
+  bool compress = false;
+  // Watertight test in the triangle blocks
+  bool watertight = false;
+
+  static constexpr size_t max_bvh_depth = 64;
+  // Leaves of compressed nodes store their size in 8 bits. The build halves
+  // larger leaves only above max_bvh_depth
+  static constexpr size_t max_bvh_leaf_size = 255;
+
 protected:
   std::vector<triangle<VB>> triangles;
+  std::vector<bvh_node> nodes;
+  std::vector<compressed_bvh_node> compressed_nodes;
+  std::vector<triangle_block> blocks;
+  // First block of the leaf that starts at a triangle
+  std::vector<uint32_t> leaf_blocks;
 
   float3 aabb_min;
   float3 aabb_max;
@@ -106,8 +255,195 @@ struct light
   float3 color;
 };
 
-template<typename VB, typename RT>
-class raytracer
+// Area light built from an emissive triangle
+struct area_light
+{
+  float3 a;
+  float3 ba;
+  float3 ca;
+  float3 normal;
+  float3 emissive;
+  float area;
+};
+
+// Per-thread PCG generator; seeded from the pixel and sample index, so a
+// sample is reproducible regardless of which thread renders it
+struct sampler
+{
+  void seed(uint32_t in_pixel, uint32_t in_sample);
+  float next();
+  // Low-discrepancy point: R2 sequence over the samples of a pixel,
+  // rotated by a per-pixel, per-dimension random offset
+  float2 next_stratified();
+
+  uint32_t state = 0;
+  uint32_t pixel = 0;
+  uint32_t sample = 0;
+  uint32_t dimension = 0;
+
+protected:
+  static uint32_t hash(uint32_t value);
+};
+
+inline void sampler::seed(uint32_t in_pixel, uint32_t in_sample)
+{
+  pixel = in_pixel;
+  sample = in_sample;
+  dimension = 0;
+  state = hash(pixel * 9781u + hash(sample));
+}
+
+inline float sampler::next()
+{
+  state = hash(state);
+  return static_cast<float>(state >> 8) / 16777216.f;
+}
+
+inline float2 sampler::next_stratified()
+{
+  uint32_t rotation = hash(pixel * 6271u + hash(dimension++));
+
+  // R2 generators in 0.32 fixed point; the overflow wraps into [0, 1)
+  uint32_t x = rotation + sample * 3242174889u;
+  uint32_t y = hash(rotation) + sample * 2447445413u;
+
+  return float2{
+    static_cast<float>(x >> 8) / 16777216.f,
+    static_cast<float>(y >> 8) / 16777216.f
+  };
+}
+
+inline uint32_t sampler::hash(uint32_t value)
+{
+  uint32_t state = value * 747796405u + 2891336453u;
+  uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+  return (word >> 22u) ^ word;
+}
+
+inline sampler& thread_sampler()
+{
+  thread_local sampler instance;
+  return instance;
+}
+
+// Camera samples of a pixel tile, shaded at once by a batch shader. Every
+// sampler is seeded like the thread sampler of ray_generation for the same
+// sample
+struct sample_batch
+{
+  std::vector<ray> rays;
+  std::vector<sampler> samplers;
+  std::vector<float3> colors;
+};
+
+template<typename VB>
+struct batch_hit
+{
+  payload hit;
+  const triangle<VB>* hit_triangle = nullptr;
+};
+
+// Spreads the low 10 bits of value to every third bit
+inline uint32_t expand_morton_bits(uint32_t value)
+{
+  value &= 0x3ff;
+  value = (value | value << 16) & 0x030000ff;
+  value = (value | value << 8) & 0x0300f00f;
+  value = (value | value << 4) & 0x030c30c3;
+  value = (value | value << 2) & 0x09249249;
+  return value;
+}
+
+// Direction octant above the Morton code of the origin, which is quantized
+// to 10 bits per axis; scale maps the origin bounds to [0, 1023]
+inline uint64_t ray_sort_key(const ray& ray, const float3& bounds_min, const float3& scale)
+{
+  uint32_t octant = (ray.direction.x < 0.f ? 1u : 0u) |
+                    (ray.direction.y < 0.f ? 2u : 0u) |
+                    (ray.direction.z < 0.f ? 4u : 0u);
+
+  float3 cell = clamp((ray.position - bounds_min) * scale, float3(0.f), float3(1023.f));
+  uint32_t morton = expand_morton_bits(static_cast<uint32_t>(cell.x)) << 2 |
+                    expand_morton_bits(static_cast<uint32_t>(cell.y)) << 1 |
+                    expand_morton_bits(static_cast<uint32_t>(cell.z));
+
+  return static_cast<uint64_t>(octant) << 30 | morton;
+}
+
+// Shader policy adapter that keeps the shaders assignable at run time
+// through std::function. A custom policy provides shade_miss and
+// shade_closest_hit and sets has_any_hit_shader; when it is true the policy
+// also provides any_hit_enabled and shade_any_hit. All calls are resolved at
+// compile time, so they can be inlined into the traversal
+template<typename VB>
+struct function_shaders
+{
+  static constexpr bool has_any_hit_shader = true;
+
+  payload shade_miss(const ray& ray) const;
+  payload shade_closest_hit(const ray& ray, payload& payload, const triangle<VB>& triangle) const;
+  bool any_hit_enabled() const;
+  payload shade_any_hit(const ray& ray, payload& payload, const triangle<VB>& triangle) const;
+
+  std::function<payload(const ray& ray)> miss_shader = nullptr;
+  std::function<payload(
+    const ray& ray, payload& payload, const triangle<VB>& triangle
+  )> closest_hit_shader = nullptr;
+  std::function<payload(
+    const ray& ray, payload& payload, const triangle<VB>& triangle
+  )> any_hit_shader = nullptr;
+};
+
+template<typename VB>
+inline payload function_shaders<VB>::shade_miss(const ray& ray) const
+{
+  return miss_shader(ray);
+}
+
+template<typename VB>
+inline payload function_shaders<VB>::shade_closest_hit(
+  const ray& ray,
+  payload& payload,
+  const triangle<VB>& triangle
+) const
+{
+  if (closest_hit_shader)
+    return closest_hit_shader(ray, payload, triangle);
+
+  return miss_shader(ray);
+}
+
+template<typename VB>
+inline bool function_shaders<VB>::any_hit_enabled() const
+{
+  return any_hit_shader != nullptr;
+}
+
+template<typename VB>
+inline payload function_shaders<VB>::shade_any_hit(
+  const ray& ray,
+  payload& payload,
+  const triangle<VB>& triangle
+) const
+{
+  return any_hit_shader(ray, payload, triangle);
+}
+
+enum class bvh_split_mode
+{
+  object,
+  spatial
+};
+
+enum class acceleration_structure_type
+{
+  bvh,
+  grid,
+  kd_tree
+};
+
+template<typename VB, typename RT, typename SP = function_shaders<VB>>
+class raytracer : public SP
 {
 public:
   raytracer()
@@ -119,47 +455,159 @@ public:
   };
 
   void set_render_target(std::shared_ptr<resource<RT>> in_render_target);
+  // Optional outputs for denoising: unclamped color and the albedo, normal
+  // and distance of the primary hit through the pixel center
+  void set_aux_buffers(
+    std::shared_ptr<resource<float3>> in_hdr_target,
+    std::shared_ptr<resource<float3>> in_albedo_buffer,
+    std::shared_ptr<resource<float3>> in_normal_buffer,
+    std::shared_ptr<resource<float>> in_depth_buffer
+  );
+  // Float sums of the samples of progressive passes
+  void set_accumulation_buffer(std::shared_ptr<resource<float3>> in_accumulation_buffer);
+  // Traversal counters of every pixel; filled only when they are compiled
+  // in with RAY_TRAVERSAL_STATS
+  void set_stats_buffer(std::shared_ptr<resource<traversal_counters>> in_stats_buffer);
   void clear_render_target(const RT& in_clear_value);
   void set_viewport(size_t in_width, size_t in_height);
 
+  void set_per_shape_vertex_buffer(std::vector<resource_view<VB>> in_per_shape_vertex_buffer);
   void set_per_shape_vertex_buffer(std::vector<std::shared_ptr<resource<VB>>> in_per_shape_vertex_buffer);
-  void build_acceleration_structure();
-  std::vector<aabb<VB>> acceleration_structures;
+  // Compact vertices are decoded as the triangles are built
+  void set_per_shape_vertex_buffer(
+    std::vector<resource_view<compact_vertex>> in_per_shape_vertex_buffer,
+    std::function<VB(const compact_vertex&)> in_vertex_decoder
+  );
+  // Builds one structure per shape with the acceleration_type backend. The
+  // split mode applies to BVHs only: spatial splits clip triangles at split
+  // planes, which pays off for scenes with large or long thin triangles at
+  // some extra build time
+  void build_acceleration_structure(bvh_split_mode split_mode = bvh_split_mode::object);
+  // Builds the structure of one more shape, for shapes that arrive one by
+  // one while the model is still loading
+  void add_shape_acceleration_structure(
+    resource_view<VB> shape_vertex_buffer,
+    bvh_split_mode split_mode = bvh_split_mode::object);
+  // One structure per shape, of the backend chosen by acceleration_type
+  std::vector<std::shared_ptr<acceleration_structure<VB>>> acceleration_structures;
+  acceleration_structure_type acceleration_type = acceleration_structure_type::bvh;
+  size_t bvh_max_leaf_size = 4;
+  bool compress_bvh = false;
+  // Test BVH leaves with the SIMD triangle kernel
+  bool simd_leaves = false;
+  bool watertight = false;
+  // Triangle references spatial splits may add, relative to the triangles
+  float spatial_split_budget = 0.3f;
+  // Leaf blocks for simd_leaves; built along with the BVHs, or on their
+  // own for BVHs that come from a scene cache
+  void build_triangle_blocks();
+  // Everything that changes the built structures, for cache keys
+  uint64_t get_build_settings(bvh_split_mode split_mode = bvh_split_mode::object) const;
 
   void ray_generation(float3 position, float3 direction, float3 right, float3 up);
+  // Variant of ray_generation that hands the samples of batch_tile_size^2
+  // pixels to batch_shader at once, so it can trace them as batches
+  void batch_ray_generation(float3 position, float3 direction, float3 right, float3 up);
+  std::function<void(sample_batch& batch)> batch_shader = nullptr;
+  size_t batch_tile_size = 16;
+  // Progressive rendering: a pass adds sample `sample` of every pixel to the
+  // accumulation buffer. Passes 0 .. SSAA_factor^2 - 1 in order sum exactly
+  // like ray_generation, so the resolved image of all passes is the same.
+  // Returns false when the pass was stopped, which leaves the buffer as is
+  bool accumulation_pass(float3 position, float3 direction, float3 right, float3 up, size_t sample);
+  // Writes the average of the first `passes` samples to the render targets
+  void resolve_accumulation(float3 position, float3 direction, float3 right, float3 up, size_t passes);
+  // Stops accumulation passes between rows or tiles; cancel may be called
+  // from any thread and holds until clear_cancel. The deadline and the stop
+  // flag, e.g. one a signal handler sets, are checked by the rendering threads
+  void cancel();
+  void clear_cancel();
+  void set_deadline(std::optional<std::chrono::steady_clock::time_point> in_deadline);
+  void set_stop_flag(const std::atomic<bool>* in_stop_flag);
+  bool is_stopped() const;
 
   payload trace_ray(const ray& ray, size_t depth, float max_t = 1000.f, float min_t = 0.001f) const;
+  const triangle<VB>* closest_hit(const ray& ray, payload& closest_hit_payload, float max_t = 1000.f, float min_t = 0.001f) const;
+  bool occluded(const ray& ray, float max_t = 1000.f, float min_t = 0.001f) const;
+  // Closest hits of a batch of rays. With sort_rays the rays are traced in
+  // ray_sort_key order, so neighbouring rays share their traversal paths in
+  // the cache; the hits are still written to the slots of their rays
+  void closest_hits(const std::vector<ray>& rays, std::vector<batch_hit<VB>>& hits) const;
+  bool sort_rays = false;
   payload intersection_shader(const triangle<VB>& triangle, const ray& ray) const;
 
-  std::function<payload(const ray& ray)> miss_shader = nullptr;
-  std::function<payload(
-    const ray& ray, payload& payload, const triangle<VB>& triangle
-  )> closest_hit_shader = nullptr;
-  std::function<payload(
-    const ray& ray, payload& payload, const triangle<VB>& triangle
-  )> any_hit_shader = nullptr;
-
   float get_random(int thread_num, float range = 0.1f) const;
 
   int SSAA_factor = 16;
   int max_depth = 5;
 
 protected:
+  ray camera_ray(
+    const float3& position, const float3& direction, const float3& right, const float3& up,
+    int x, int y, int px, int py
+  ) const;
+  void write_aux_buffers(size_t x, size_t y, const ray& primary_ray) const;
+  void add_acceleration_structure(std::vector<triangle<VB>> triangles, bvh_split_mode split_mode);
+
   std::shared_ptr<resource<RT>> render_target;
-  std::vector<std::shared_ptr<resource<VB>>> per_shape_vertex_buffer;
+  std::shared_ptr<resource<float3>> hdr_target;
+  std::shared_ptr<resource<float3>> albedo_buffer;
+  std::shared_ptr<resource<float3>> normal_buffer;
+  std::shared_ptr<resource<float>> depth_buffer;
+  std::shared_ptr<resource<float3>> accumulation_buffer;
+  // Samples of the running pass, added to the accumulation buffer once the
+  // pass is complete
+  std::vector<float3> pass_buffer;
+  std::atomic<bool> cancelled = false;
+  const std::atomic<bool>* stop_flag = nullptr;
+  std::optional<std::chrono::steady_clock::time_point> deadline;
+  std::shared_ptr<resource<traversal_counters>> stats_buffer;
+  std::vector<resource_view<VB>> per_shape_vertex_buffer;
+  std::vector<resource_view<compact_vertex>> per_shape_compact_buffer;
+  std::function<VB(const compact_vertex&)> vertex_decoder;
 
   size_t width = 1920;
   size_t height = 1080;
 };
 
-template<typename VB, typename RT>
-void raytracer<VB, RT>::set_render_target(std::shared_ptr<resource<RT>> in_render_target)
+template<typename VB, typename RT, typename SP>
+void raytracer<VB, RT, SP>::set_render_target(std::shared_ptr<resource<RT>> in_render_target)
 {
   render_target = in_render_target;
 }
 
-template<typename VB, typename RT>
-void raytracer<VB, RT>::clear_render_target(const RT& in_clear_value)
+template<typename VB, typename RT, typename SP>
+void raytracer<VB, RT, SP>::set_aux_buffers(
+  std::shared_ptr<resource<float3>> in_hdr_target,
+  std::shared_ptr<resource<float3>> in_albedo_buffer,
+  std::shared_ptr<resource<float3>> in_normal_buffer,
+  std::shared_ptr<resource<float>> in_depth_buffer
+)
+{
+  hdr_target = in_hdr_target;
+  albedo_buffer = in_albedo_buffer;
+  normal_buffer = in_normal_buffer;
+  depth_buffer = in_depth_buffer;
+}
+
+template<typename VB, typename RT, typename SP>
+void raytracer<VB, RT, SP>::set_accumulation_buffer(
+  std::shared_ptr<resource<float3>> in_accumulation_buffer
+)
+{
+  accumulation_buffer = in_accumulation_buffer;
+}
+
+template<typename VB, typename RT, typename SP>
+void raytracer<VB, RT, SP>::set_stats_buffer(
+  std::shared_ptr<resource<traversal_counters>> in_stats_buffer
+)
+{
+  stats_buffer = in_stats_buffer;
+}
+
+template<typename VB, typename RT, typename SP>
+void raytracer<VB, RT, SP>::clear_render_target(const RT& in_clear_value)
 {
   for (auto& px : *render_target)
   {
@@ -167,185 +615,935 @@ void raytracer<VB, RT>::clear_render_target(const RT& in_clear_value)
   }
 }
 
-template<typename VB, typename RT>
-void raytracer<VB, RT>::set_per_shape_vertex_buffer(std::vector<std::shared_ptr<resource<VB>>> in_per_shape_vertex_buffer)
+template<typename VB, typename RT, typename SP>
+void raytracer<VB, RT, SP>::set_per_shape_vertex_buffer(std::vector<resource_view<VB>> in_per_shape_vertex_buffer)
 {
   per_shape_vertex_buffer = in_per_shape_vertex_buffer;
+  per_shape_compact_buffer.clear();
+}
+
+template<typename VB, typename RT, typename SP>
+void raytracer<VB, RT, SP>::set_per_shape_vertex_buffer(std::vector<std::shared_ptr<resource<VB>>> in_per_shape_vertex_buffer)
+{
+  per_shape_vertex_buffer.clear();
+  for (auto& shape_vertex_buffer : in_per_shape_vertex_buffer)
+    per_shape_vertex_buffer.emplace_back(shape_vertex_buffer);
+  per_shape_compact_buffer.clear();
+}
+
+template<typename VB, typename RT, typename SP>
+void raytracer<VB, RT, SP>::set_per_shape_vertex_buffer(
+  std::vector<resource_view<compact_vertex>> in_per_shape_vertex_buffer,
+  std::function<VB(const compact_vertex&)> in_vertex_decoder
+)
+{
+  per_shape_vertex_buffer.clear();
+  per_shape_compact_buffer = in_per_shape_vertex_buffer;
+  vertex_decoder = in_vertex_decoder;
 }
 
-template<typename VB, typename RT>
-void raytracer<VB, RT>::build_acceleration_structure()
+template<typename VB, typename RT, typename SP>
+void raytracer<VB, RT, SP>::build_acceleration_structure(bvh_split_mode split_mode)
 {
-  for (auto& shape_vertex_buffer : per_shape_vertex_buffer)
+  PROFILE_ZONE("Build acceleration structure");
+
+  size_t number_of_shapes = per_shape_compact_buffer.empty() ?
+    per_shape_vertex_buffer.size() : per_shape_compact_buffer.size();
+  for (size_t shape_idx = 0; shape_idx < number_of_shapes; shape_idx++)
   {
+    if (per_shape_compact_buffer.empty())
+    {
+      add_shape_acceleration_structure(per_shape_vertex_buffer[shape_idx], split_mode);
+      continue;
+    }
+
     size_t vertex_idx = 0;
-    aabb<VB> aabb;
+    std::vector<triangle<VB>> triangles;
+    auto& shape_vertex_buffer = per_shape_compact_buffer[shape_idx];
+    triangles.reserve(shape_vertex_buffer.get_number_of_elements() / 3);
 
-    while (vertex_idx < shape_vertex_buffer->get_number_of_elements())
+    while (vertex_idx < shape_vertex_buffer.get_number_of_elements())
     {
-      triangle<VB> triangle(
-        shape_vertex_buffer->item(vertex_idx++),
-        shape_vertex_buffer->item(vertex_idx++),
-        shape_vertex_buffer->item(vertex_idx++)
+      triangles.emplace_back(
+        vertex_decoder(shape_vertex_buffer.item(vertex_idx++)),
+        vertex_decoder(shape_vertex_buffer.item(vertex_idx++)),
+        vertex_decoder(shape_vertex_buffer.item(vertex_idx++))
       );
+    }
+    add_acceleration_structure(std::move(triangles), split_mode);
+  }
+}
+
+template<typename VB, typename RT, typename SP>
+void raytracer<VB, RT, SP>::add_shape_acceleration_structure(
+  resource_view<VB> shape_vertex_buffer,
+  bvh_split_mode split_mode
+)
+{
+  size_t vertex_idx = 0;
+  std::vector<triangle<VB>> triangles;
+  triangles.reserve(shape_vertex_buffer.get_number_of_elements() / 3);
+
+  while (vertex_idx < shape_vertex_buffer.get_number_of_elements())
+  {
+    triangles.emplace_back(
+      shape_vertex_buffer.item(vertex_idx++),
+      shape_vertex_buffer.item(vertex_idx++),
+      shape_vertex_buffer.item(vertex_idx++)
+    );
+  }
+  add_acceleration_structure(std::move(triangles), split_mode);
+}
+
+template<typename VB, typename RT, typename SP>
+void raytracer<VB, RT, SP>::add_acceleration_structure(
+  std::vector<triangle<VB>> triangles,
+  bvh_split_mode split_mode
+)
+{
+  std::shared_ptr<acceleration_structure<VB>> shape;
+  switch (acceleration_type)
+  {
+    case acceleration_structure_type::grid:
+      shape = std::make_shared<uniform_grid<VB>>();
+      break;
+    case acceleration_structure_type::kd_tree:
+      shape = std::make_shared<kd_tree<VB>>();
+      break;
+    default:
+    {
+      auto bvh = std::make_shared<aabb<VB>>();
+      bvh->max_leaf_size = bvh_max_leaf_size;
+      bvh->spatial_split_budget =
+        split_mode == bvh_split_mode::spatial ? spatial_split_budget : 0.f;
+      bvh->compress = compress_bvh;
+      shape = bvh;
+      break;
+    }
+  }
 
-      aabb.add_triangle(triangle);
+  shape->build(std::move(triangles));
+  if (auto bvh = std::dynamic_pointer_cast<aabb<VB>>(shape); bvh && simd_leaves)
+  {
+    bvh->watertight = watertight;
+    bvh->build_triangle_blocks();
+  }
+  acceleration_structures.push_back(shape);
+}
+
+template<typename VB, typename RT, typename SP>
+void raytracer<VB, RT, SP>::build_triangle_blocks()
+{
+  for (auto& shape : acceleration_structures)
+  {
+    if (auto bvh = std::dynamic_pointer_cast<aabb<VB>>(shape))
+    {
+      bvh->watertight = watertight;
+      bvh->build_triangle_blocks();
     }
+  }
+}
+
+template<typename VB, typename RT, typename SP>
+uint64_t raytracer<VB, RT, SP>::get_build_settings(bvh_split_mode split_mode) const
+{
+  uint64_t settings = static_cast<uint64_t>(bvh_max_leaf_size) |
+                      static_cast<uint64_t>(compress_bvh) << 16 |
+                      static_cast<uint64_t>(acceleration_type) << 20;
 
-    acceleration_structures.push_back(aabb);
+  if (split_mode == bvh_split_mode::spatial)
+  {
+    uint32_t budget_bits;
+    std::memcpy(&budget_bits, &spatial_split_budget, sizeof(budget_bits));
+    settings |= static_cast<uint64_t>(1) << 17 | static_cast<uint64_t>(budget_bits) << 32;
   }
+
+  return settings;
 }
 
-template<typename VB, typename RT>
-void raytracer<VB, RT>::set_viewport(size_t in_width, size_t in_height)
+template<typename VB, typename RT, typename SP>
+void raytracer<VB, RT, SP>::set_viewport(size_t in_width, size_t in_height)
 {
   width = in_width;
   height = in_height;
 }
 
-template<typename VB, typename RT>
-void raytracer<VB, RT>::ray_generation(
+template<typename VB, typename RT, typename SP>
+void raytracer<VB, RT, SP>::ray_generation(
   float3 position,
   float3 direction,
   float3 right,
   float3 up
 )
 {
+  PROFILE_ZONE("Ray generation");
+
   for (int x = 0; x < width; x++)
   {
-    #pragma omp parallel for
-    for (int y = 0; y < height; y++)
+    #pragma omp parallel
     {
-      float3 res_color(0.f);
+      // One zone per thread and column, the gaps between them are the threads
+      // waiting for the slowest one
+      PROFILE_ZONE("Ray generation column");
 
-      for (int px = 0; px < SSAA_factor; px++)
-        for (int py = 0; py < SSAA_factor; py++)
-        {
-          float u =
-            2.f *
-            (x + px / static_cast<float>(SSAA_factor)) /
-            static_cast<float>(width - 1) - 1.f;
-          float v =
-            2.f *
-            (y + py / static_cast<float>(SSAA_factor)) /
-            static_cast<float>(height - 1) - 1.f;
-
-          float3 ray_direction = direction + u * right - v * up;
-          ray ray(position, ray_direction);
-
-          payload payload = trace_ray(ray, max_depth);
-
-          res_color += float3(
-            payload.color.r,
-            payload.color.g,
-            payload.color.b
+      #pragma omp for nowait
+      for (int y = 0; y < height; y++)
+      {
+        float3 res_color(0.f);
+        traversal_counters pixel_start;
+        if constexpr (traversal_stats_enabled)
+          pixel_start = thread_counters();
+
+        for (int px = 0; px < SSAA_factor; px++)
+          for (int py = 0; py < SSAA_factor; py++)
+          {
+            ray ray = camera_ray(position, direction, right, up, x, y, px, py);
+
+            thread_sampler().seed(
+              static_cast<uint32_t>(y * width + x),
+              static_cast<uint32_t>(px * SSAA_factor + py)
+            );
+
+            payload payload = trace_ray(ray, max_depth);
+
+            res_color += float3(
+              payload.color.r,
+              payload.color.g,
+              payload.color.b
+            );
+          }
+
+        render_target->item(x, y) =
+          RT::from_color(
+            color::from_float3(res_color / (SSAA_factor * SSAA_factor))
           );
+
+        if (hdr_target)
+          hdr_target->item(x, y) = res_color / (SSAA_factor * SSAA_factor);
+
+        if constexpr (traversal_stats_enabled)
+        {
+          if (stats_buffer)
+          {
+            const traversal_counters& counters = thread_counters();
+            stats_buffer->item(x, y) = {
+              counters.rays - pixel_start.rays,
+              counters.nodes - pixel_start.nodes,
+              counters.triangles - pixel_start.triangles
+            };
+          }
         }
 
-      render_target->item(x, y) =
-        RT::from_color(
-          color::from_float3(res_color / (SSAA_factor * SSAA_factor))
-        );
+        if (albedo_buffer || normal_buffer || depth_buffer)
+        {
+          float u = 2.f * (x + 0.5f) / static_cast<float>(width - 1) - 1.f;
+          float v = 2.f * (y + 0.5f) / static_cast<float>(height - 1) - 1.f;
+          write_aux_buffers(x, y, ray(position, direction + u * right - v * up));
+        }
+      }
     }
 
     std::cout << "Progress: " << 100.f * x / width << "%\n";
   }
 }
 
-template<typename VB, typename RT>
-payload
-  raytracer<VB, RT>::trace_ray(
-    const ray& ray,
-    size_t depth,
-    float max_t,
-    float min_t
-  ) const
+template<typename VB, typename RT, typename SP>
+void raytracer<VB, RT, SP>::batch_ray_generation(
+  float3 position,
+  float3 direction,
+  float3 right,
+  float3 up
+)
 {
-  if (depth == 0)
-    return miss_shader(ray);
-
-  depth--;
+  PROFILE_ZONE("Batch ray generation");
 
-  payload closest_hit_payload = {};
-  closest_hit_payload.t = max_t;
-  const triangle<VB>* closest_triangle = nullptr;
+  int tile_size = static_cast<int>(std::max<size_t>(batch_tile_size, 1));
+  int tiles_x = (static_cast<int>(width) + tile_size - 1) / tile_size;
+  int tiles_y = (static_cast<int>(height) + tile_size - 1) / tile_size;
+  int samples = SSAA_factor * SSAA_factor;
 
-  for (auto& aabb : acceleration_structures)
+  for (int tile_y = 0; tile_y < tiles_y; tile_y++)
   {
-    if (!aabb.aabb_test(ray))
-      continue;
-
-    for (auto& triangle : aabb.get_triangles())
+    #pragma omp parallel for schedule(dynamic)
+    for (int tile_x = 0; tile_x < tiles_x; tile_x++)
     {
-      payload payload = intersection_shader(triangle, ray);
-
-      if (payload.t > min_t && payload.t < closest_hit_payload.t)
+      PROFILE_ZONE("Ray batch tile");
+
+      int x_begin = tile_x * tile_size;
+      int x_end = std::min(x_begin + tile_size, static_cast<int>(width));
+      int y_begin = tile_y * tile_size;
+      int y_end = std::min(y_begin + tile_size, static_cast<int>(height));
+
+      sample_batch batch;
+      for (int x = x_begin; x < x_end; x++)
+        for (int y = y_begin; y < y_end; y++)
+          for (int px = 0; px < SSAA_factor; px++)
+            for (int py = 0; py < SSAA_factor; py++)
+            {
+              batch.rays.push_back(camera_ray(position, direction, right, up, x, y, px, py));
+              batch.samplers.emplace_back().seed(
+                static_cast<uint32_t>(y * width + x),
+                static_cast<uint32_t>(px * SSAA_factor + py)
+              );
+            }
+
+      traversal_counters tile_start;
+      if constexpr (traversal_stats_enabled)
+        tile_start = thread_counters();
+
+      batch_shader(batch);
+
+      // Rays of a batch are not attributed to single pixels, the tile's
+      // counts are spread evenly over its pixels
+      traversal_counters pixel_counts;
+      if constexpr (traversal_stats_enabled)
       {
-        closest_hit_payload = payload;
-        closest_triangle = &triangle;
+        const traversal_counters& counters = thread_counters();
+        uint64_t pixels = static_cast<uint64_t>(x_end - x_begin) * (y_end - y_begin);
+        pixel_counts = {
+          (counters.rays - tile_start.rays) / pixels,
+          (counters.nodes - tile_start.nodes) / pixels,
+          (counters.triangles - tile_start.triangles) / pixels
+        };
+      }
 
-        if (any_hit_shader)
+      size_t sample = 0;
+      for (int x = x_begin; x < x_end; x++)
+        for (int y = y_begin; y < y_end; y++)
         {
-          return any_hit_shader(ray, payload, triangle);
+          float3 res_color(0.f);
+          for (int i = 0; i < samples; i++)
+            res_color += batch.colors[sample++];
+
+          render_target->item(x, y) =
+            RT::from_color(color::from_float3(res_color / samples));
+
+          if (hdr_target)
+            hdr_target->item(x, y) = res_color / samples;
+
+          if constexpr (traversal_stats_enabled)
+          {
+            if (stats_buffer)
+              stats_buffer->item(x, y) = pixel_counts;
+          }
+
+          if (albedo_buffer || normal_buffer || depth_buffer)
+          {
+            float u = 2.f * (x + 0.5f) / static_cast<float>(width - 1) - 1.f;
+            float v = 2.f * (y + 0.5f) / static_cast<float>(height - 1) - 1.f;
+            write_aux_buffers(x, y, ray(position, direction + u * right - v * up));
+          }
         }
-      }
     }
-  }
 
-  if (closest_hit_payload.t < max_t)
-  {
-    if (closest_hit_shader)
-    {
-      closest_hit_payload.depth = depth;
-      return closest_hit_shader(ray, closest_hit_payload, *closest_triangle);
-    }
+    std::cout << "Progress: " << 100.f * tile_y / tiles_y << "%\n";
   }
-
-  return miss_shader(ray);
 }
 
-template<typename VB, typename RT>
-payload raytracer<VB, RT>::intersection_shader(
-    const triangle<VB>& triangle,
-    const ray& ray
-) const
+template<typename VB, typename RT, typename SP>
+bool raytracer<VB, RT, SP>::accumulation_pass(
+  float3 position,
+  float3 direction,
+  float3 right,
+  float3 up,
+  size_t sample
+)
 {
-  payload payload{};
-  payload.t = -1.f;
+  PROFILE_ZONE("Accumulation pass");
 
-  float3 pvec = cross(ray.direction, triangle.ca);
-  float det = dot(triangle.ba, pvec);
+  int px = static_cast<int>(sample) / SSAA_factor;
+  int py = static_cast<int>(sample) % SSAA_factor;
 
-  // No intersection; return empty payload
-  if (det > -1e-8 && det < 1e-8)
-    return payload;
+  pass_buffer.resize(width * height);
+  std::atomic<bool> stopped = false;
 
-  float inv_det = 1.f / det;
+  auto add_counts = [&](int x, int y, const traversal_counters& start, uint64_t pixels) {
+    if constexpr (traversal_stats_enabled)
+    {
+      if (stats_buffer)
+      {
+        const traversal_counters& counters = thread_counters();
+        traversal_counters& pixel = stats_buffer->item(x, y);
+        pixel.rays += (counters.rays - start.rays) / pixels;
+        pixel.nodes += (counters.nodes - start.nodes) / pixels;
+        pixel.triangles += (counters.triangles - start.triangles) / pixels;
+      }
+    }
+  };
 
-  float3 tvec = ray.position - triangle.a;
-  float u = dot(tvec, pvec) * inv_det;
-  if (u < 0.f || u > 1.f)
-    return payload;
+  if (batch_shader)
+  {
+    int tile_size = static_cast<int>(std::max<size_t>(batch_tile_size, 1));
+    int tiles_x = (static_cast<int>(width) + tile_size - 1) / tile_size;
+    int tiles_y = (static_cast<int>(height) + tile_size - 1) / tile_size;
 
-  float3 qvec = cross(tvec, triangle.ba);
-  float v = dot(ray.direction, qvec) * inv_det;
-  if (v < 0.f || (u + v) > 1.f)
-    return payload;
+    #pragma omp parallel for schedule(dynamic)
+    for (int tile = 0; tile < tiles_x * tiles_y; tile++)
+    {
+      if (stopped || is_stopped())
+      {
+        stopped = true;
+        continue;
+      }
 
-  payload.t = dot(triangle.ca, qvec) * inv_det;
-  payload.bary = float3{ 1.f - u - v, u, v };
+      int x_begin = tile % tiles_x * tile_size;
+      int x_end = std::min(x_begin + tile_size, static_cast<int>(width));
+      int y_begin = tile / tiles_x * tile_size;
+      int y_end = std::min(y_begin + tile_size, static_cast<int>(height));
 
-  return payload;
-}
+      sample_batch batch;
+      for (int x = x_begin; x < x_end; x++)
+        for (int y = y_begin; y < y_end; y++)
+        {
+          batch.rays.push_back(camera_ray(position, direction, right, up, x, y, px, py));
+          batch.samplers.emplace_back().seed(
+            static_cast<uint32_t>(y * width + x), static_cast<uint32_t>(sample));
+        }
 
-template<typename VB, typename RT>
-float raytracer<VB, RT>::get_random(const int thread_num, const float range) const
-{
-  static std::default_random_engine generator(thread_num);
+      traversal_counters tile_start;
+      if constexpr (traversal_stats_enabled)
+        tile_start = thread_counters();
+
+      batch_shader(batch);
+
+      size_t index = 0;
+      uint64_t pixels = static_cast<uint64_t>(x_end - x_begin) * (y_end - y_begin);
+      for (int x = x_begin; x < x_end; x++)
+        for (int y = y_begin; y < y_end; y++)
+        {
+          pass_buffer[y * width + x] = batch.colors[index++];
+          add_counts(x, y, tile_start, pixels);
+        }
+    }
+  }
+  else
+  {
+    #pragma omp parallel for schedule(dynamic)
+    for (int y = 0; y < static_cast<int>(height); y++)
+    {
+      if (stopped || is_stopped())
+      {
+        stopped = true;
+        continue;
+      }
+
+      for (int x = 0; x < static_cast<int>(width); x++)
+      {
+        traversal_counters pixel_start;
+        if constexpr (traversal_stats_enabled)
+          pixel_start = thread_counters();
+
+        thread_sampler().seed(
+          static_cast<uint32_t>(y * width + x), static_cast<uint32_t>(sample));
+        payload payload =
+          trace_ray(camera_ray(position, direction, right, up, x, y, px, py), max_depth);
+
+        pass_buffer[y * width + x] = float3(payload.color.r, payload.color.g, payload.color.b);
+        add_counts(x, y, pixel_start, 1);
+      }
+    }
+  }
+
+  if (stopped)
+    return false;
+
+  for (size_t i = 0; i < pass_buffer.size(); i++)
+    accumulation_buffer->item(i) += pass_buffer[i];
+  return true;
+}
+
+template<typename VB, typename RT, typename SP>
+void raytracer<VB, RT, SP>::cancel()
+{
+  cancelled = true;
+}
+
+template<typename VB, typename RT, typename SP>
+void raytracer<VB, RT, SP>::clear_cancel()
+{
+  cancelled = false;
+}
+
+template<typename VB, typename RT, typename SP>
+void raytracer<VB, RT, SP>::set_deadline(
+  std::optional<std::chrono::steady_clock::time_point> in_deadline
+)
+{
+  deadline = in_deadline;
+}
+
+template<typename VB, typename RT, typename SP>
+void raytracer<VB, RT, SP>::set_stop_flag(const std::atomic<bool>* in_stop_flag)
+{
+  stop_flag = in_stop_flag;
+}
+
+template<typename VB, typename RT, typename SP>
+bool raytracer<VB, RT, SP>::is_stopped() const
+{
+  return cancelled.load(std::memory_order_relaxed) ||
+         (stop_flag && stop_flag->load(std::memory_order_relaxed)) ||
+         (deadline && std::chrono::steady_clock::now() >= *deadline);
+}
+
+template<typename VB, typename RT, typename SP>
+void raytracer<VB, RT, SP>::resolve_accumulation(
+  float3 position,
+  float3 direction,
+  float3 right,
+  float3 up,
+  size_t passes
+)
+{
+  PROFILE_ZONE("Resolve accumulation");
+
+  float samples = static_cast<float>(std::max<size_t>(passes, 1));
+
+  #pragma omp parallel for
+  for (int y = 0; y < static_cast<int>(height); y++)
+  {
+    for (int x = 0; x < static_cast<int>(width); x++)
+    {
+      float3 res_color = accumulation_buffer->item(x, y) / samples;
+      render_target->item(x, y) = RT::from_color(color::from_float3(res_color));
+
+      if (hdr_target)
+        hdr_target->item(x, y) = res_color;
+
+      if (albedo_buffer || normal_buffer || depth_buffer)
+      {
+        float u = 2.f * (x + 0.5f) / static_cast<float>(width - 1) - 1.f;
+        float v = 2.f * (y + 0.5f) / static_cast<float>(height - 1) - 1.f;
+        write_aux_buffers(x, y, ray(position, direction + u * right - v * up));
+      }
+    }
+  }
+}
+
+template<typename VB, typename RT, typename SP>
+ray raytracer<VB, RT, SP>::camera_ray(
+  const float3& position,
+  const float3& direction,
+  const float3& right,
+  const float3& up,
+  int x,
+  int y,
+  int px,
+  int py
+) const
+{
+  float u =
+    2.f *
+    (x + px / static_cast<float>(SSAA_factor)) /
+    static_cast<float>(width - 1) - 1.f;
+  float v =
+    2.f *
+    (y + py / static_cast<float>(SSAA_factor)) /
+    static_cast<float>(height - 1) - 1.f;
+
+  return ray(position, direction + u * right - v * up);
+}
+
+template<typename VB, typename RT, typename SP>
+void raytracer<VB, RT, SP>::write_aux_buffers(
+  size_t x,
+  size_t y,
+  const ray& primary_ray
+) const
+{
+  // Misses get a unit albedo, so demodulation leaves the sky as is
+  float3 albedo(1.f);
+  float3 normal(0.f);
+  float depth = FLT_MAX;
+
+  payload hit = {};
+  const triangle<VB>* hit_triangle = closest_hit(primary_ray, hit);
+  if (hit_triangle)
+  {
+    albedo = hit_triangle->diffuse;
+    normal = normalize(
+      hit.bary.x * hit_triangle->na +
+      hit.bary.y * hit_triangle->nb +
+      hit.bary.z * hit_triangle->nc
+    );
+    depth = hit.t * length(primary_ray.direction);
+  }
+
+  if (albedo_buffer)
+    albedo_buffer->item(x, y) = albedo;
+  if (normal_buffer)
+    normal_buffer->item(x, y) = normal;
+  if (depth_buffer)
+    depth_buffer->item(x, y) = depth;
+}
+
+template<typename VB, typename RT, typename SP>
+payload
+  raytracer<VB, RT, SP>::trace_ray(
+    const ray& ray,
+    size_t depth,
+    float max_t,
+    float min_t
+  ) const
+{
+  if (depth == 0)
+    return this->shade_miss(ray);
+
+  depth--;
+  count_ray();
+
+  payload closest_hit_payload = {};
+  closest_hit_payload.t = max_t;
+  const triangle<VB>* closest_triangle = nullptr;
+
+  bool any_hit = false;
+  if constexpr (SP::has_any_hit_shader)
+    any_hit = this->any_hit_enabled();
+
+  for (auto& shape : acceleration_structures)
+  {
+    const triangle<VB>* hit_triangle =
+      shape->intersect(ray, closest_hit_payload, min_t, any_hit);
+    if (hit_triangle)
+      closest_triangle = hit_triangle;
+
+    if constexpr (SP::has_any_hit_shader)
+    {
+      if (hit_triangle && any_hit)
+        return this->shade_any_hit(ray, closest_hit_payload, *closest_triangle);
+    }
+  }
+
+  if (closest_hit_payload.t < max_t)
+  {
+    closest_hit_payload.depth = depth;
+    return this->shade_closest_hit(ray, closest_hit_payload, *closest_triangle);
+  }
+
+  return this->shade_miss(ray);
+}
+
+template<typename VB, typename RT, typename SP>
+const triangle<VB>* raytracer<VB, RT, SP>::closest_hit(
+  const ray& ray,
+  payload& closest_hit_payload,
+  float max_t,
+  float min_t
+) const
+{
+  count_ray();
+  closest_hit_payload.t = max_t;
+  const triangle<VB>* closest_triangle = nullptr;
+
+  for (auto& shape : acceleration_structures)
+  {
+    const triangle<VB>* hit_triangle =
+      shape->intersect(ray, closest_hit_payload, min_t, false);
+    if (hit_triangle)
+      closest_triangle = hit_triangle;
+  }
+
+  return closest_triangle;
+}
+
+template<typename VB, typename RT, typename SP>
+void raytracer<VB, RT, SP>::closest_hits(
+  const std::vector<ray>& rays,
+  std::vector<batch_hit<VB>>& hits
+) const
+{
+  hits.assign(rays.size(), {});
+
+  if (!sort_rays)
+  {
+    for (size_t i = 0; i < rays.size(); i++)
+      hits[i].hit_triangle = closest_hit(rays[i], hits[i].hit);
+    return;
+  }
+
+  float3 bounds_min(FLT_MAX);
+  float3 bounds_max(-FLT_MAX);
+  for (auto& ray : rays)
+  {
+    bounds_min = min(bounds_min, ray.position);
+    bounds_max = max(bounds_max, ray.position);
+  }
+  float3 extent = bounds_max - bounds_min;
+  float3 scale{
+    extent.x > 0.f ? 1023.f / extent.x : 0.f,
+    extent.y > 0.f ? 1023.f / extent.y : 0.f,
+    extent.z > 0.f ? 1023.f / extent.z : 0.f
+  };
+
+  std::vector<std::pair<uint64_t, uint32_t>> order(rays.size());
+  for (size_t i = 0; i < rays.size(); i++)
+    order[i] = { ray_sort_key(rays[i], bounds_min, scale), static_cast<uint32_t>(i) };
+  std::sort(order.begin(), order.end());
+
+  for (auto& [key, index] : order)
+    hits[index].hit_triangle = closest_hit(rays[index], hits[index].hit);
+}
+
+template<typename VB, typename RT, typename SP>
+bool raytracer<VB, RT, SP>::occluded(
+  const ray& ray,
+  float max_t,
+  float min_t
+) const
+{
+  count_ray();
+  for (auto& shape : acceleration_structures)
+  {
+    if (shape->occluded(ray, max_t, min_t))
+      return true;
+  }
+
+  return false;
+}
+
+
+template<typename VB, typename RT, typename SP>
+payload raytracer<VB, RT, SP>::intersection_shader(
+    const triangle<VB>& triangle,
+    const ray& ray
+) const
+{
+  return intersect_triangle(triangle, ray);
+}
+
+template<typename VB, typename RT, typename SP>
+float raytracer<VB, RT, SP>::get_random(const int thread_num, const float range) const
+{
+  static std::default_random_engine generator(thread_num);
   static std::normal_distribution<float> distribution(0.f, range);
   return distribution(generator);
 }
 
+template<typename VB>
+void aabb<VB>::build(std::vector<triangle<VB>> in_triangles)
+{
+  blocks.clear();
+  leaf_blocks.clear();
+  triangles.clear();
+  for (auto& triangle : in_triangles)
+    add_triangle(triangle);
+
+  build_bvh();
+  if (compress)
+    compress_bvh();
+}
+
+template<typename VB>
+const triangle<VB>* aabb<VB>::intersect(
+  const ray& ray,
+  payload& closest_hit_payload,
+  float min_t,
+  bool any_hit
+) const
+{
+  if (!aabb_test(ray))
+    return nullptr;
+
+  const triangle<VB>* closest_triangle = nullptr;
+  auto test_triangle = [&](const triangle<VB>& triangle) {
+    count_triangles(1);
+    payload payload = intersect_triangle(triangle, ray);
+
+    if (payload.t > min_t && payload.t < closest_hit_payload.t)
+    {
+      closest_hit_payload = payload;
+      closest_triangle = &triangle;
+    }
+  };
+
+  std::optional<block_ray> leaf_ray;
+  if (!blocks.empty())
+    leaf_ray.emplace(ray);
+
+  auto test_leaf = [&](uint32_t first, uint32_t count) {
+    if (!leaf_ray)
+    {
+      for (uint32_t i = first; i < first + count; i++)
+      {
+        test_triangle(triangles[i]);
+        if (closest_triangle && any_hit)
+          return;
+      }
+      return;
+    }
+
+    const triangle_block* block = &blocks[leaf_blocks[first]];
+    for (uint32_t i = first; i < first + count; i += triangle_block::width, block++)
+    {
+      count_triangles(std::min(triangle_block::width, first + count - i));
+      block_hit hit;
+      if (intersect_block(*block, *leaf_ray, min_t, closest_hit_payload.t, watertight, hit))
+      {
+        closest_hit_payload = {};
+        closest_hit_payload.t = hit.t;
+        closest_hit_payload.bary = float3{ 1.f - hit.u - hit.v, hit.u, hit.v };
+        closest_triangle = &triangles[i + hit.lane];
+        if (any_hit)
+          return;
+      }
+    }
+  };
+
+  // Shapes without a hierarchy are tested triangle by triangle
+  if (nodes.empty() && compressed_nodes.empty())
+  {
+    for (auto& triangle : triangles)
+    {
+      test_triangle(triangle);
+      if (closest_triangle && any_hit)
+        return closest_triangle;
+    }
+    return closest_triangle;
+  }
+
+  float3 inv_ray_direction = float3(1.f) / ray.direction;
+
+  if (!compressed_nodes.empty())
+  {
+    // Entries are nodes or, with a non-zero count, leaf triangle ranges;
+    // every pop pushes at most four of them
+    struct entry
+    {
+      uint32_t index;
+      uint32_t count;
+      float distance;
+    };
+    entry compressed_stack[3 * max_bvh_depth + 4];
+
+    float3 safe_inv_ray_direction = safe_inverse(ray.direction);
+
+    bool negative[3] = {
+      safe_inv_ray_direction.x < 0.f,
+      safe_inv_ray_direction.y < 0.f,
+      safe_inv_ray_direction.z < 0.f
+    };
+    size_t compressed_stack_size = 0;
+    compressed_stack[compressed_stack_size++] = { 0, 0, 0.f };
+
+    while (compressed_stack_size > 0)
+    {
+      entry current = compressed_stack[--compressed_stack_size];
+      if (current.distance >= closest_hit_payload.t)
+        continue;
+
+      if (current.count != 0)
+      {
+        test_leaf(current.index, current.count);
+        if (closest_triangle && any_hit)
+          return closest_triangle;
+        continue;
+      }
+
+      const compressed_bvh_node& node = compressed_nodes[current.index];
+      count_node();
+
+      // Child slabs in ray distances are the node origin plus steps of the
+      // node scale; the sign of the direction picks the entry planes
+      float3 origin_t = (node.origin - ray.position) * safe_inv_ray_direction;
+      float3 scale_t = node.get_scale() * safe_inv_ray_direction;
+      const uint8_t* near_x = node.get_planes(0, negative[0]);
+      const uint8_t* far_x = node.get_planes(0, !negative[0]);
+      const uint8_t* near_y = node.get_planes(1, negative[1]);
+      const uint8_t* far_y = node.get_planes(1, !negative[1]);
+      const uint8_t* near_z = node.get_planes(2, negative[2]);
+      const uint8_t* far_z = node.get_planes(2, !negative[2]);
+
+      entry children[4];
+      size_t number_of_children = 0;
+      for (size_t i = 0; i < 4; i++)
+      {
+        if (node.children[i] == compressed_bvh_node::empty_child)
+          continue;
+
+        float t_near = std::max(
+          std::max(origin_t.x + near_x[i] * scale_t.x, origin_t.y + near_y[i] * scale_t.y),
+          std::max(origin_t.z + near_z[i] * scale_t.z, 0.f));
+        float t_far = std::min(
+          std::min(origin_t.x + far_x[i] * scale_t.x, origin_t.y + far_y[i] * scale_t.y),
+          std::min(origin_t.z + far_z[i] * scale_t.z, closest_hit_payload.t));
+        if (t_near > t_far)
+          continue;
+        float distance = t_near;
+
+        // Insertion sort, farthest first
+        size_t position = number_of_children++;
+        while (position > 0 && children[position - 1].distance < distance)
+        {
+          children[position] = children[position - 1];
+          position--;
+        }
+        children[position] = { node.children[i], node.triangle_count[i], distance };
+      }
+
+      for (size_t i = 0; i < number_of_children; i++)
+        compressed_stack[compressed_stack_size++] = children[i];
+    }
+
+    return closest_triangle;
+  }
+
+  uint32_t stack[max_bvh_depth + 1];
+  float stack_distance[max_bvh_depth + 1];
+  size_t stack_size = 0;
+
+  stack[stack_size] = 0;
+  stack_distance[stack_size++] = aabb_distance(
+    nodes[0].aabb_min, nodes[0].aabb_max, ray, inv_ray_direction,
+    closest_hit_payload.t);
+
+  while (stack_size > 0)
+  {
+    stack_size--;
+    if (stack_distance[stack_size] >= closest_hit_payload.t)
+      continue;
+
+    const bvh_node& node = nodes[stack[stack_size]];
+    count_node();
+
+    if (node.is_leaf())
+    {
+      test_leaf(node.left_first, node.count);
+      if (closest_triangle && any_hit)
+        return closest_triangle;
+      continue;
+    }
+
+    uint32_t near_child = node.left_first;
+    uint32_t far_child = node.left_first + 1;
+    float near_distance = aabb_distance(
+      nodes[near_child].aabb_min, nodes[near_child].aabb_max, ray,
+      inv_ray_direction, closest_hit_payload.t);
+    float far_distance = aabb_distance(
+      nodes[far_child].aabb_min, nodes[far_child].aabb_max, ray,
+      inv_ray_direction, closest_hit_payload.t);
+
+    if (far_distance < near_distance)
+    {
+      std::swap(near_child, far_child);
+      std::swap(near_distance, far_distance);
+    }
+
+    // The nearer child goes on top, so it is visited first
+    if (far_distance != FLT_MAX)
+    {
+      stack[stack_size] = far_child;
+      stack_distance[stack_size++] = far_distance;
+    }
+    if (near_distance != FLT_MAX)
+    {
+      stack[stack_size] = near_child;
+      stack_distance[stack_size++] = near_distance;
+    }
+  }
+
+  return closest_triangle;
+}
+
 template<typename VB>
 void aabb<VB>::add_triangle(const triangle<VB> triangle)
 {
@@ -363,12 +1561,664 @@ void aabb<VB>::add_triangle(const triangle<VB> triangle)
   aabb_min = min(triangle.c, aabb_min);
 }
 
+template<typename VB>
+void aabb<VB>::build_bvh()
+{
+  nodes.clear();
+  compressed_nodes.clear();
+  if (triangles.empty())
+    return;
+
+  constexpr size_t number_of_bins = 12;
+
+  // Part of a triangle inside a box; spatial splits clip the box, so
+  // a triangle may be referenced from several leaves
+  struct triangle_reference
+  {
+    uint32_t index;
+    float3 aabb_min;
+    float3 aabb_max;
+  };
+
+  struct bin
+  {
+    float3 aabb_min = float3(FLT_MAX);
+    float3 aabb_max = float3(-FLT_MAX);
+    uint32_t count = 0;
+    uint32_t exits = 0;
+
+    void grow(const float3& in_min, const float3& in_max)
+    {
+      aabb_min = min(aabb_min, in_min);
+      aabb_max = max(aabb_max, in_max);
+    }
+  };
+
+  auto half_area = [](const float3& aabb_min, const float3& aabb_max) {
+    float3 extent = aabb_max - aabb_min;
+    return extent.x * extent.y + extent.y * extent.z + extent.z * extent.x;
+  };
+
+  // Bounds of the parts of the reference on both sides of the plane
+  auto split_reference = [&](
+    const triangle_reference& source, int axis, float position,
+    triangle_reference& left, triangle_reference& right)
+  {
+    left = { source.index, float3(FLT_MAX), float3(-FLT_MAX) };
+    right = left;
+
+    const auto& triangle = triangles[source.index];
+    const float3 vertices[3] = { triangle.a, triangle.b, triangle.c };
+    for (int i = 0; i < 3; i++)
+    {
+      const float3& v0 = vertices[i];
+      const float3& v1 = vertices[(i + 1) % 3];
+
+      if (v0[axis] <= position)
+      {
+        left.aabb_min = min(left.aabb_min, v0);
+        left.aabb_max = max(left.aabb_max, v0);
+      }
+      if (v0[axis] >= position)
+      {
+        right.aabb_min = min(right.aabb_min, v0);
+        right.aabb_max = max(right.aabb_max, v0);
+      }
+
+      if ((v0[axis] < position && v1[axis] > position) ||
+          (v0[axis] > position && v1[axis] < position))
+      {
+        float3 crossing =
+          v0 + (v1 - v0) * ((position - v0[axis]) / (v1[axis] - v0[axis]));
+        crossing[axis] = position;
+        left.aabb_min = min(left.aabb_min, crossing);
+        left.aabb_max = max(left.aabb_max, crossing);
+        right.aabb_min = min(right.aabb_min, crossing);
+        right.aabb_max = max(right.aabb_max, crossing);
+      }
+    }
+
+    left.aabb_min = max(left.aabb_min, source.aabb_min);
+    left.aabb_max = min(left.aabb_max, source.aabb_max);
+    left.aabb_max[axis] = std::min(left.aabb_max[axis], position);
+    right.aabb_min = max(right.aabb_min, source.aabb_min);
+    right.aabb_max = min(right.aabb_max, source.aabb_max);
+    right.aabb_min[axis] = std::max(right.aabb_min[axis], position);
+  };
+
+  std::vector<triangle_reference> references(triangles.size());
+  for (size_t i = 0; i < triangles.size(); i++)
+  {
+    const auto& triangle = triangles[i];
+    references[i] = {
+      static_cast<uint32_t>(i),
+      min(triangle.a, min(triangle.b, triangle.c)),
+      max(triangle.a, max(triangle.b, triangle.c))
+    };
+  }
+
+  size_t remaining_duplicates =
+    static_cast<size_t>(spatial_split_budget * triangles.size());
+  // Spatial splits are only tried where the children of the best object
+  // split overlap by a noticeable part of the whole shape
+  float min_overlap = 1e-5f * half_area(aabb_min, aabb_max);
+
+  struct build_task
+  {
+    uint32_t node_index;
+    size_t depth;
+    std::vector<triangle_reference> references;
+  };
+
+  std::vector<uint32_t> order;
+  order.reserve(triangles.size());
+  nodes.reserve(2 * triangles.size());
+  nodes.push_back({ aabb_min, 0, aabb_max, 0 });
+
+  std::vector<build_task> build_stack;
+  build_stack.push_back({ 0, 0, std::move(references) });
+  while (!build_stack.empty())
+  {
+    build_task task = std::move(build_stack.back());
+    build_stack.pop_back();
+
+    auto& node_references = task.references;
+    uint32_t count = static_cast<uint32_t>(node_references.size());
+
+    float3 bounds_min(FLT_MAX), bounds_max(-FLT_MAX);
+    float3 centroid_min(FLT_MAX), centroid_max(-FLT_MAX);
+    for (auto& reference : node_references)
+    {
+      float3 centroid = (reference.aabb_min + reference.aabb_max) * 0.5f;
+      bounds_min = min(bounds_min, reference.aabb_min);
+      bounds_max = max(bounds_max, reference.aabb_max);
+      centroid_min = min(centroid_min, centroid);
+      centroid_max = max(centroid_max, centroid);
+    }
+    nodes[task.node_index].aabb_min = bounds_min;
+    nodes[task.node_index].aabb_max = bounds_max;
+
+    auto make_leaf = [&]() {
+      nodes[task.node_index].left_first = static_cast<uint32_t>(order.size());
+      nodes[task.node_index].count = count;
+      for (auto& reference : node_references)
+        order.push_back(reference.index);
+    };
+
+    if (count <= max_leaf_size || task.depth >= max_bvh_depth)
+    {
+      make_leaf();
+      continue;
+    }
+
+    float best_cost = count * half_area(bounds_min, bounds_max);
+    int best_axis = -1;
+    size_t best_split = 0;
+    bool spatial_split = false;
+    // Without a useful object split the children would overlap entirely
+    float object_overlap = half_area(bounds_min, bounds_max);
+
+    // Object splits: binned SAH over the reference centroids
+    for (int axis = 0; axis < 3; axis++)
+    {
+      float extent = centroid_max[axis] - centroid_min[axis];
+      if (extent <= 0.f)
+        continue;
+
+      float scale = number_of_bins / extent;
+      bin bins[number_of_bins];
+      for (auto& reference : node_references)
+      {
+        float centroid = (reference.aabb_min[axis] + reference.aabb_max[axis]) * 0.5f;
+        size_t bin_index = std::min(
+          number_of_bins - 1,
+          static_cast<size_t>((centroid - centroid_min[axis]) * scale));
+
+        bins[bin_index].count++;
+        bins[bin_index].grow(reference.aabb_min, reference.aabb_max);
+      }
+
+      // Sweep from the right to get every right side, then from the left
+      // to evaluate the splits between the bins
+      bin right_sides[number_of_bins];
+      bin right;
+      for (size_t i = number_of_bins - 1; i > 0; i--)
+      {
+        right.count += bins[i].count;
+        right.grow(bins[i].aabb_min, bins[i].aabb_max);
+        right_sides[i] = right;
+      }
+
+      bin left;
+      for (size_t i = 0; i < number_of_bins - 1; i++)
+      {
+        left.count += bins[i].count;
+        left.grow(bins[i].aabb_min, bins[i].aabb_max);
+
+        if (left.count == 0 || left.count == count)
+          continue;
+
+        const bin& right_side = right_sides[i + 1];
+        float cost =
+          left.count * half_area(left.aabb_min, left.aabb_max) +
+          right_side.count * half_area(right_side.aabb_min, right_side.aabb_max);
+        if (cost < best_cost)
+        {
+          best_cost = cost;
+          best_axis = axis;
+          best_split = i + 1;
+
+          float3 overlap_min = max(left.aabb_min, right_side.aabb_min);
+          float3 overlap_max = min(left.aabb_max, right_side.aabb_max);
+          object_overlap = minelem(overlap_max - overlap_min) > 0.f ?
+            half_area(overlap_min, overlap_max) : 0.f;
+        }
+      }
+    }
+
+    // Spatial splits: references are clipped into every bin they cross and
+    // counted where they enter and exit
+    if (remaining_duplicates > 0 && object_overlap > min_overlap)
+    {
+      for (int axis = 0; axis < 3; axis++)
+      {
+        float extent = bounds_max[axis] - bounds_min[axis];
+        if (extent <= 0.f)
+          continue;
+
+        float bin_size = extent / number_of_bins;
+        auto bin_of = [&](float position) {
+          return std::min(
+            number_of_bins - 1,
+            static_cast<size_t>(std::max(0.f, (position - bounds_min[axis]) / bin_size)));
+        };
+
+        bin bins[number_of_bins];
+        for (auto& source : node_references)
+        {
+          size_t first_bin = bin_of(source.aabb_min[axis]);
+          size_t last_bin = bin_of(source.aabb_max[axis]);
+
+          triangle_reference remaining = source;
+          for (size_t i = first_bin; i < last_bin; i++)
+          {
+            triangle_reference left_part, right_part;
+            split_reference(
+              remaining, axis, bounds_min[axis] + (i + 1) * bin_size,
+              left_part, right_part);
+            bins[i].grow(left_part.aabb_min, left_part.aabb_max);
+            remaining = right_part;
+          }
+          bins[last_bin].grow(remaining.aabb_min, remaining.aabb_max);
+
+          bins[first_bin].count++;
+          bins[last_bin].exits++;
+        }
+
+        bin right_sides[number_of_bins];
+        bin right;
+        for (size_t i = number_of_bins - 1; i > 0; i--)
+        {
+          right.exits += bins[i].exits;
+          right.grow(bins[i].aabb_min, bins[i].aabb_max);
+          right_sides[i] = right;
+        }
+
+        bin left;
+        for (size_t i = 0; i < number_of_bins - 1; i++)
+        {
+          left.count += bins[i].count;
+          left.grow(bins[i].aabb_min, bins[i].aabb_max);
+
+          const bin& right_side = right_sides[i + 1];
+          if (left.count == 0 || right_side.exits == 0)
+            continue;
+
+          float cost =
+            left.count * half_area(left.aabb_min, left.aabb_max) +
+            right_side.exits * half_area(right_side.aabb_min, right_side.aabb_max);
+          if (cost < best_cost)
+          {
+            best_cost = cost;
+            best_axis = axis;
+            best_split = i + 1;
+            spatial_split = true;
+          }
+        }
+      }
+    }
+
+    std::vector<triangle_reference> left_references, right_references;
+    if (spatial_split)
+    {
+      float position = bounds_min[best_axis] +
+        best_split * (bounds_max[best_axis] - bounds_min[best_axis]) / number_of_bins;
+
+      for (auto& reference : node_references)
+      {
+        if (reference.aabb_max[best_axis] <= position)
+        {
+          left_references.push_back(reference);
+        }
+        else if (reference.aabb_min[best_axis] >= position)
+        {
+          right_references.push_back(reference);
+        }
+        else if (remaining_duplicates > 0)
+        {
+          triangle_reference left_part, right_part;
+          split_reference(reference, best_axis, position, left_part, right_part);
+          left_references.push_back(left_part);
+          right_references.push_back(right_part);
+          remaining_duplicates--;
+        }
+        else
+        {
+          float centroid =
+            (reference.aabb_min[best_axis] + reference.aabb_max[best_axis]) * 0.5f;
+          (centroid < position ? left_references : right_references).push_back(reference);
+        }
+      }
+    }
+    else if (best_axis >= 0)
+    {
+      float scale = number_of_bins / (centroid_max[best_axis] - centroid_min[best_axis]);
+      for (auto& reference : node_references)
+      {
+        float centroid =
+          (reference.aabb_min[best_axis] + reference.aabb_max[best_axis]) * 0.5f;
+        size_t bin_index = std::min(
+          number_of_bins - 1,
+          static_cast<size_t>((centroid - centroid_min[best_axis]) * scale));
+        (bin_index < best_split ? left_references : right_references).push_back(reference);
+      }
+    }
+    // Leaves that are too large for compressed nodes are halved even when
+    // SAH prefers to keep them
+    else if (count > max_bvh_leaf_size)
+    {
+      left_references.assign(node_references.begin(), node_references.begin() + count / 2);
+      right_references.assign(node_references.begin() + count / 2, node_references.end());
+    }
+
+    if (left_references.empty() || right_references.empty())
+    {
+      make_leaf();
+      continue;
+    }
+
+    uint32_t left_child = static_cast<uint32_t>(nodes.size());
+    nodes.push_back({ float3(0.f), 0, float3(0.f), 0 });
+    nodes.push_back({ float3(0.f), 0, float3(0.f), 0 });
+    nodes[task.node_index].left_first = left_child;
+    nodes[task.node_index].count = 0;
+
+    node_references.clear();
+    node_references.shrink_to_fit();
+    build_stack.push_back({ left_child + 1, task.depth + 1, std::move(right_references) });
+    build_stack.push_back({ left_child, task.depth + 1, std::move(left_references) });
+  }
+
+  // Leaves index the triangles directly, so referenced triangles are
+  // stored once per reference
+  std::vector<triangle<VB>> ordered_triangles;
+  ordered_triangles.reserve(order.size());
+  for (uint32_t index : order)
+    ordered_triangles.push_back(triangles[index]);
+  triangles = std::move(ordered_triangles);
+}
+
+template<typename VB>
+void aabb<VB>::compress_bvh()
+{
+  compressed_nodes.clear();
+  if (nodes.empty())
+    return;
+
+  // Leaves cut at max_bvh_depth may hold more triangles than the 8-bit
+  // count of a compressed child, so such trees stay binary
+  for (const auto& node : nodes)
+    if (node.is_leaf() && node.count > max_bvh_leaf_size)
+      return;
+
+  // Bottom-up count of the compressed nodes needed when a binary subtree is
+  // spread over 1 to 4 child slots of its parent, with the number of slots
+  // given to the left child. A subtree in a single slot opens a new node.
+  // Children are always stored after their parents
+  constexpr uint32_t infinite_cost = UINT32_MAX / 4;
+  std::vector<std::array<uint32_t, 5>> cost(nodes.size());
+  std::vector<std::array<uint8_t, 5>> left_slots(nodes.size());
+  for (size_t n = nodes.size(); n-- > 0;)
+  {
+    cost[n].fill(infinite_cost);
+    if (nodes[n].is_leaf())
+    {
+      cost[n][1] = 0;
+      continue;
+    }
+
+    uint32_t left = nodes[n].left_first;
+    uint32_t right = left + 1;
+    for (uint8_t slots = 2; slots <= 4; slots++)
+      for (uint8_t left_slot = 1; left_slot < slots; left_slot++)
+      {
+        uint32_t split_cost = cost[left][left_slot] + cost[right][slots - left_slot];
+        if (split_cost < cost[n][slots])
+        {
+          cost[n][slots] = split_cost;
+          left_slots[n][slots] = left_slot;
+        }
+      }
+
+    for (uint8_t slots = 2; slots <= 4; slots++)
+    {
+      if (cost[n][slots] + 1 < cost[n][1])
+      {
+        cost[n][1] = cost[n][slots] + 1;
+        left_slots[n][1] = slots;
+      }
+    }
+  }
+
+  // Pairs of binary and compressed node index
+  compressed_nodes.emplace_back();
+  std::vector<std::pair<uint32_t, uint32_t>> stack{ { 0, 0 } };
+  while (!stack.empty())
+  {
+    auto [binary_index, compressed_index] = stack.back();
+    stack.pop_back();
+
+    uint32_t children[4];
+    size_t number_of_children = 0;
+    if (nodes[binary_index].is_leaf())
+    {
+      children[number_of_children++] = binary_index;
+    }
+    else
+    {
+      // Pairs of binary node and the number of slots it spreads over
+      std::pair<uint32_t, uint8_t> expand_stack[4] = {
+        { binary_index, left_slots[binary_index][1] }
+      };
+      size_t expand_size = 1;
+      while (expand_size > 0)
+      {
+        auto [n, slots] = expand_stack[--expand_size];
+        if (slots == 1)
+        {
+          children[number_of_children++] = n;
+          continue;
+        }
+        uint8_t left_slot = left_slots[n][slots];
+        expand_stack[expand_size++] = { nodes[n].left_first + 1, static_cast<uint8_t>(slots - left_slot) };
+        expand_stack[expand_size++] = { nodes[n].left_first, left_slot };
+      }
+    }
+
+    compressed_bvh_node node = {};
+    node.encode_bounds(nodes[binary_index].aabb_min, nodes[binary_index].aabb_max);
+
+    for (size_t i = 0; i < 4; i++)
+    {
+      if (i >= number_of_children)
+      {
+        node.children[i] = compressed_bvh_node::empty_child;
+        continue;
+      }
+
+      const bvh_node& child = nodes[children[i]];
+      node.encode_child(i, child.aabb_min, child.aabb_max);
+
+      if (child.is_leaf())
+      {
+        node.children[i] = child.left_first;
+        node.triangle_count[i] = static_cast<uint8_t>(child.count);
+      }
+      else
+      {
+        node.children[i] = static_cast<uint32_t>(compressed_nodes.size());
+        compressed_nodes.emplace_back();
+        stack.push_back({ children[i], node.children[i] });
+      }
+    }
+
+    compressed_nodes[compressed_index] = node;
+  }
+
+  nodes.clear();
+  nodes.shrink_to_fit();
+}
+
+template<typename VB>
+void aabb<VB>::build_triangle_blocks()
+{
+  blocks.clear();
+  leaf_blocks.assign(triangles.size(), 0);
+
+  auto add_leaf = [&](uint32_t first, uint32_t count) {
+    leaf_blocks[first] = static_cast<uint32_t>(blocks.size());
+    for (uint32_t i = 0; i < count; i++)
+    {
+      if (i % triangle_block::width == 0)
+        blocks.emplace_back();
+
+      const auto& triangle = triangles[first + i];
+      blocks.back().set(i % triangle_block::width, triangle.a, triangle.b, triangle.c);
+    }
+  };
+
+  for (auto& node : nodes)
+  {
+    if (node.is_leaf() && node.count != 0)
+      add_leaf(node.left_first, node.count);
+  }
+
+  for (auto& node : compressed_nodes)
+  {
+    for (size_t i = 0; i < 4; i++)
+    {
+      if (node.children[i] != compressed_bvh_node::empty_child && node.triangle_count[i] != 0)
+        add_leaf(node.children[i], node.triangle_count[i]);
+    }
+  }
+}
+
+template<typename VB>
+void aabb<VB>::assign(
+  std::vector<triangle<VB>> in_triangles,
+  std::vector<bvh_node> in_nodes,
+  std::vector<compressed_bvh_node> in_compressed_nodes
+)
+{
+  nodes = std::move(in_nodes);
+  compressed_nodes = std::move(in_compressed_nodes);
+  blocks.clear();
+  leaf_blocks.clear();
+
+  if (!nodes.empty())
+  {
+    triangles = std::move(in_triangles);
+    aabb_min = nodes[0].aabb_min;
+    aabb_max = nodes[0].aabb_max;
+    return;
+  }
+
+  // The children of the root enclose the whole shape
+  if (!compressed_nodes.empty())
+  {
+    triangles = std::move(in_triangles);
+    float3 scale = compressed_nodes[0].get_scale();
+    aabb_min = float3(FLT_MAX);
+    aabb_max = float3(-FLT_MAX);
+    for (size_t i = 0; i < 4; i++)
+    {
+      if (compressed_nodes[0].children[i] == compressed_bvh_node::empty_child)
+        continue;
+      aabb_min = min(aabb_min, compressed_nodes[0].get_child_min(i, scale));
+      aabb_max = max(aabb_max, compressed_nodes[0].get_child_max(i, scale));
+    }
+    return;
+  }
+
+  triangles.clear();
+  for (auto& triangle : in_triangles)
+    add_triangle(triangle);
+}
+
+template<typename VB>
+bool aabb<VB>::is_valid() const
+{
+  auto valid_leaf = [&](uint64_t first, uint64_t count) {
+    return first + count <= triangles.size();
+  };
+
+  // Children come after their parents and every node is reached once, so
+  // the walk ends and the nodes form a tree
+  struct entry
+  {
+    uint32_t index;
+    size_t depth;
+  };
+  std::vector<entry> stack;
+  if (!nodes.empty())
+  {
+    std::vector<bool> visited(nodes.size());
+    stack.push_back({ 0, 0 });
+    while (!stack.empty())
+    {
+      entry current = stack.back();
+      stack.pop_back();
+      if (current.depth > max_bvh_depth || visited[current.index])
+        return false;
+      visited[current.index] = true;
+
+      const bvh_node& node = nodes[current.index];
+      if (node.is_leaf())
+      {
+        if (!valid_leaf(node.left_first, node.count))
+          return false;
+        continue;
+      }
+      if (node.left_first <= current.index ||
+          static_cast<uint64_t>(node.left_first) + 1 >= nodes.size())
+        return false;
+      stack.push_back({ node.left_first, current.depth + 1 });
+      stack.push_back({ node.left_first + 1, current.depth + 1 });
+    }
+  }
+
+  if (!compressed_nodes.empty())
+  {
+    std::vector<bool> visited(compressed_nodes.size());
+    stack.push_back({ 0, 0 });
+    while (!stack.empty())
+    {
+      entry current = stack.back();
+      stack.pop_back();
+      if (current.depth > max_bvh_depth || visited[current.index])
+        return false;
+      visited[current.index] = true;
+
+      const compressed_bvh_node& node = compressed_nodes[current.index];
+      for (size_t i = 0; i < 4; i++)
+      {
+        uint32_t child = node.children[i];
+        if (child == compressed_bvh_node::empty_child)
+          continue;
+        if (node.triangle_count[i] != 0)
+        {
+          if (!valid_leaf(child, node.triangle_count[i]))
+            return false;
+          continue;
+        }
+        if (child <= current.index || child >= compressed_nodes.size())
+          return false;
+        stack.push_back({ child, current.depth + 1 });
+      }
+    }
+  }
+
+  return true;
+}
+
 template<typename VB>
 const std::vector<triangle<VB>>& aabb<VB>::get_triangles() const
 {
   return triangles;
 }
 
+template<typename VB>
+const std::vector<bvh_node>& aabb<VB>::get_nodes() const
+{
+  return nodes;
+}
+
+template<typename VB>
+const std::vector<compressed_bvh_node>& aabb<VB>::get_compressed_nodes() const
+{
+  return compressed_nodes;
+}
+
 template<typename VB>
 bool aabb<VB>::aabb_test(const ray& ray) const
 {
@@ -1,7 +1,39 @@
 #include "raytracer_renderer.h"
 
+#include "renderer/raytracer/checkpoint.h"
+#include "renderer/raytracer/scene_cache.h"
+#include "utils/error_handler.h"
 #include "utils/resource_utils.h"
 
+#include <chrono>
+#include <iostream>
+
+
+cg::renderer::payload cg::renderer::path_tracing_shaders::shade_miss(
+  const ray& ray
+) const
+{
+  payload payload = {};
+
+  payload.color = {
+    10.f / 255.f * (0.8f - ray.direction.y * 0.8f),
+    12.f / 255.f * (0.8f - ray.direction.y * 0.8f),
+    23.f / 255.f
+  };
+
+  return payload;
+}
+
+cg::renderer::payload cg::renderer::path_tracing_shaders::shade_closest_hit(
+  const ray& ray,
+  payload& payload,
+  const triangle<vertex>& triangle
+) const
+{
+  payload.color =
+    cg::color::from_float3(integrator->shade(ray, payload, triangle));
+  return payload;
+}
 
 void cg::renderer::ray_tracing_renderer::init()
 {
@@ -11,9 +43,6 @@ void cg::renderer::ray_tracing_renderer::init()
       settings->height
     );
 
-  model = std::make_shared<world::model>();
-  model->load_obj(settings->model_path);
-
   camera = std::make_shared<world::camera>();
   camera->set_width(static_cast<float>(settings->width));
   camera->set_height(static_cast<float>(settings->height));
@@ -26,125 +55,357 @@ void cg::renderer::ray_tracing_renderer::init()
   camera->set_z_near(settings->camera_z_near);
   camera->set_z_far(settings->camera_z_far);
 
-  raytracer = std::make_shared<cg::renderer::raytracer<vertex, unsigned_color>>();
+  raytracer = std::make_shared<
+    cg::renderer::raytracer<vertex, unsigned_color, path_tracing_shaders>>();
   raytracer->set_render_target(render_target);
   raytracer->set_viewport(settings->width, settings->height);
-  raytracer->set_per_shape_vertex_buffer(model->get_per_shape_buffer());
+  raytracer->compress_bvh = settings->compress_bvh;
+  raytracer->simd_leaves = settings->simd_leaves || settings->watertight;
+  raytracer->watertight = settings->watertight;
+  if (raytracer->simd_leaves)
+    raytracer->bvh_max_leaf_size = triangle_block::width;
+  split_mode = settings->spatial_splits ?
+    bvh_split_mode::spatial : bvh_split_mode::object;
+
+  if (settings->acceleration_structure == "bvh")
+    raytracer->acceleration_type = acceleration_structure_type::bvh;
+  else if (settings->acceleration_structure == "grid")
+    raytracer->acceleration_type = acceleration_structure_type::grid;
+  else if (settings->acceleration_structure == "kd_tree")
+    raytracer->acceleration_type = acceleration_structure_type::kd_tree;
+  else
+    THROW_ERROR("Unknown acceleration structure: " + settings->acceleration_structure);
+
+  // A valid scene cache replaces both the model loading and the BVH build
+  auto start = std::chrono::high_resolution_clock::now();
+
+  // The key names both the scene cache and the checkpoints, so the model
+  // file is hashed once
+  if (use_scene_cache() || !settings->checkpoint_path.empty())
+    scene_cache_key = cg::renderer::scene_cache_key(settings->model_path, get_build_settings());
+
+  bool scene_cache_hit = false;
+  if (use_scene_cache())
+  {
+    scene_cache_path = settings->model_path;
+    scene_cache_path.replace_extension(".scene_cache");
+    scene_cache_hit = load_scene_cache(
+      scene_cache_path, scene_cache_key, raytracer->acceleration_structures);
+    if (scene_cache_hit && raytracer->simd_leaves)
+      raytracer->build_triangle_blocks();
+  }
+
+  if (scene_cache_hit)
+  {
+    auto stop = std::chrono::high_resolution_clock::now();
+    std::cout << "Scene cache loading: "
+              << std::chrono::duration<float, std::milli>(stop - start).count()
+              << " ms\n";
+  }
+  else
+  {
+    // The model loads while the rest of the renderer is set up, and render
+    // builds the structures of its shapes as they arrive
+    model = std::make_shared<world::model>();
+    model_loading = model->load_async(settings->model_path);
+  }
+  raytracer->SSAA_factor = static_cast<int>(settings->ssaa_factor);
+
+  if (settings->denoise)
+  {
+    hdr_target = std::make_shared<resource<float3>>(
+      settings->width, settings->height);
+    albedo_buffer = std::make_shared<resource<float3>>(
+      settings->width, settings->height);
+    normal_buffer = std::make_shared<resource<float3>>(
+      settings->width, settings->height);
+    depth_buffer = std::make_shared<resource<float>>(
+      settings->width, settings->height);
+    raytracer->set_aux_buffers(
+      hdr_target, albedo_buffer, normal_buffer, depth_buffer);
+  }
+
+  integrator = std::make_shared<
+    path_integrator<vertex, unsigned_color, path_tracing_shaders>>(raytracer);
+  raytracer->integrator = integrator.get();
+
+  raytracer->sort_rays = settings->sort_rays;
+  if (settings->ray_batches || settings->sort_rays)
+  {
+    raytracer->batch_shader = [this](sample_batch& batch) {
+      integrator->shade_batch(batch);
+    };
+  }
+
+  // Single bright outliers would survive the edge-stopping filter
+  if (settings->denoise)
+    integrator->max_indirect_radiance = 1.f;
+}
+
+bool cg::renderer::ray_tracing_renderer::use_scene_cache() const
+{
+  // Grids and kd-trees are rebuilt on every run
+  return settings->scene_cache &&
+         raytracer->acceleration_type == acceleration_structure_type::bvh;
+}
 
-  shadow_raytracer =
-    std::make_shared<cg::renderer::raytracer<vertex, unsigned_color>>();
-  shadow_raytracer->SSAA_factor = 1;
-  shadow_raytracer->max_depth = 1;
+uint64_t cg::renderer::ray_tracing_renderer::get_build_settings() const
+{
+  // Quantized positions give another BVH
+  return raytracer->get_build_settings(split_mode) |
+         static_cast<uint64_t>(settings->compact_vertices) << 18;
+}
 
-  for (int x = -1; x <= 1; x++)
-    for (int y = -1; y <= 1; y++)
+bool cg::renderer::ray_tracing_renderer::is_progressive() const
+{
+  return !settings->checkpoint_path.empty() || settings->time_budget > 0.f;
+}
+
+uint32_t cg::renderer::ray_tracing_renderer::render_progressive()
+{
+  auto start = std::chrono::steady_clock::now();
+
+  auto accumulation = std::make_shared<resource<float3>>(settings->width, settings->height);
+  raytracer->set_accumulation_buffer(accumulation);
+
+  uint64_t key = checkpoint_key(
+    scene_cache_key,
     {
-      lights.push_back({
-        float3{ 0 + x * 0.05f, 1.58f, -0.03f + y * 0.05f },
-        float3{ 121.f, 58.f, 122.f } / 255.f / 9.f
-      });
+      static_cast<float>(settings->width),
+      static_cast<float>(settings->height),
+      static_cast<float>(settings->ssaa_factor),
+      settings->camera_position[0],
+      settings->camera_position[1],
+      settings->camera_position[2],
+      settings->camera_theta,
+      settings->camera_phi,
+      settings->camera_angle_of_view,
+      integrator->max_indirect_radiance,
+      static_cast<float>(raytracer->watertight)
+    });
+
+  uint32_t total_passes = settings->ssaa_factor * settings->ssaa_factor;
+  uint32_t passes = 0;
+  if (!settings->checkpoint_path.empty() &&
+      load_checkpoint(settings->checkpoint_path, key, *accumulation, passes))
+  {
+    std::cout << "Resuming after pass " << passes << " of " << total_passes << "\n";
+  }
+  else
+  {
+    // A rejected checkpoint may have been read partially
+    for (auto& sum : *accumulation)
+      sum = float3(0.f);
+  }
+
+  uint32_t last_pass = total_passes;
+  if (settings->run_passes > 0)
+    last_pass = std::min(total_passes, passes + settings->run_passes);
+
+  std::optional<std::chrono::steady_clock::time_point> deadline;
+  if (settings->time_budget > 0.f)
+  {
+    deadline = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                         std::chrono::duration<float>(settings->time_budget));
+  }
+
+  bool save = !settings->checkpoint_path.empty();
+  auto last_save = std::chrono::steady_clock::now();
+  auto pass_duration = std::chrono::steady_clock::duration::zero();
+  uint32_t first_pass = passes;
+  while (passes < last_pass)
+  {
+    // A pass that can't finish before the deadline is not started, but the
+    // first one always runs, interrupted or not, so that there is an image
+    // to show
+    auto pass_start = std::chrono::steady_clock::now();
+    if (passes > first_pass && deadline && pass_start + pass_duration > *deadline)
+      break;
+    raytracer->set_deadline(passes > first_pass ? deadline : std::nullopt);
+    raytracer->set_stop_flag(passes > first_pass ? &interrupted : nullptr);
+
+    if (!raytracer->accumulation_pass(
+          camera->get_position(),
+          camera->get_direction(),
+          camera->get_right(),
+          camera->get_up(),
+          passes))
+      break;
+    passes++;
+    std::cout << "Pass " << passes << " of " << total_passes << "\n";
+
+    auto now = std::chrono::steady_clock::now();
+    pass_duration = now - pass_start;
+    if (save && passes < last_pass &&
+        std::chrono::duration<float>(now - last_save).count() >= settings->checkpoint_interval)
+    {
+      if (!save_checkpoint(settings->checkpoint_path, key, *accumulation, passes))
+        std::cout << "Can't write the checkpoint " << settings->checkpoint_path << "\n";
+      last_save = now;
     }
+  }
+  raytracer->set_deadline(std::nullopt);
+  raytracer->set_stop_flag(nullptr);
+
+  // Only a cancel stops the first pass; without a finished pass neither the
+  // image nor the checkpoint is overwritten
+  if (passes == 0)
+    return 0;
+
+  if (save && !save_checkpoint(settings->checkpoint_path, key, *accumulation, passes))
+    std::cout << "Can't write the checkpoint " << settings->checkpoint_path << "\n";
+
+  raytracer->resolve_accumulation(
+    camera->get_position(),
+    camera->get_direction(),
+    camera->get_right(),
+    camera->get_up(),
+    passes
+  );
+
+  return passes;
 }
 
 void cg::renderer::ray_tracing_renderer::destroy()
 {
 }
 
+void cg::renderer::ray_tracing_renderer::cancel()
+{
+  // Only progressive passes stop early; the finished passes are resolved
+  raytracer->cancel();
+}
+
+bool cg::renderer::ray_tracing_renderer::stops_on_interrupt() const
+{
+  return is_progressive();
+}
+
 void cg::renderer::ray_tracing_renderer::update()
 {
 }
 
 void cg::renderer::ray_tracing_renderer::render()
 {
+  // A cancel stops the render it came during, not the ones after it
+  raytracer->clear_cancel();
   raytracer->clear_render_target({ 0, 0, 0 });
 
-  raytracer->miss_shader = [](const ray& ray) {
-    payload payload = {};
+  if (raytracer->acceleration_structures.empty())
+  {
+    auto start = std::chrono::high_resolution_clock::now();
+    if (settings->compact_vertices)
+    {
+      // Compact vertices are quantized to the bounds of the whole model
+      model_loading.get();
+      raytracer->set_per_shape_vertex_buffer(
+        model->get_per_shape_compact_buffer(),
+        [model = model](const compact_vertex& vertex) { return model->decode_vertex(vertex); });
+      raytracer->build_acceleration_structure(split_mode);
+    }
+    else
+    {
+      for (size_t shape = 0; auto shape_buffer = model->wait_for_shape(shape); shape++)
+        raytracer->add_shape_acceleration_structure(*shape_buffer, split_mode);
+      model_loading.get();
+    }
+    auto stop = std::chrono::high_resolution_clock::now();
+    std::cout << "Model loading and acceleration structure building: "
+              << std::chrono::duration<float, std::milli>(stop - start).count()
+              << " ms\n";
 
-    payload.color = {
-      10.f / 255.f * (0.8f - ray.direction.y * 0.8f),
-      12.f / 255.f * (0.8f - ray.direction.y * 0.8f),
-      23.f / 255.f
-    };
+    if (use_scene_cache() &&
+        !save_scene_cache(
+          scene_cache_path, scene_cache_key, raytracer->acceleration_structures))
+      std::cout << "Can't write the scene cache " << scene_cache_path << "\n";
+  }
 
-    return payload;
-  };
+  // Emissive triangles of the model are the area lights of the scene; the
+  // point light grid only lights scenes that have no emissive geometry.
+  // Lights are set up again on every render, so the grid starts empty
+  integrator->collect_area_lights();
+  lights.clear();
+  if (integrator->get_number_of_area_lights() == 0)
+  {
+    for (int x = -1; x <= 1; x++)
+      for (int y = -1; y <= 1; y++)
+      {
+        lights.push_back({
+          float3{ 0 + x * 0.05f, 1.58f, -0.03f + y * 0.05f },
+          float3{ 121.f, 58.f, 122.f } / 255.f / 9.f
+        });
+      }
+  }
+  integrator->set_lights(lights);
 
-  raytracer->closest_hit_shader = [&](
-    const ray& ray,
-    payload& payload,
-    const triangle<cg::vertex>& triangle
-  ) {
-    float3 result_color = triangle.emissive;
-    float3 position = ray.position + ray.direction * payload.t;
-    float3 normal = payload.bary.x * triangle.na + payload.bary.y * triangle.nb + payload.bary.z * triangle.nc;
+  std::shared_ptr<resource<traversal_counters>> stats_buffer;
+  if constexpr (traversal_stats_enabled)
+  {
+    stats_buffer = std::make_shared<resource<traversal_counters>>(
+      settings->width, settings->height);
+    raytracer->set_stats_buffer(stats_buffer);
+  }
 
-    for (auto& light : lights)
-    {
-      cg::renderer::ray to_light(position, light.position - position);
-
-      auto shadow_payload = shadow_raytracer->trace_ray(
-        to_light,
-        1,
-        length(light.position - position)
-      );
-
-      float shadow_factor = 0.4f;
-      if (shadow_payload.t == -1.f)
-        shadow_factor = 1.f;
-
-      result_color +=
-        triangle.diffuse * light.color *
-        std::max(0.f, dot(normal, to_light.direction)) *
-        shadow_factor;
-    }
+  auto start = std::chrono::high_resolution_clock::now();
 
-    if (payload.depth > 0)
+  if (is_progressive())
+  {
+    uint32_t passes = render_progressive();
+    if (passes == 0)
     {
-      float3 ref_direction = ray.direction - 2 * dot(ray.direction, normal) * normal;
-      float3 ref_jitter = float3(
-        raytracer->get_random(omp_get_thread_num() + clock()),
-        raytracer->get_random(omp_get_thread_num() + clock()),
-        raytracer->get_random(omp_get_thread_num() + clock())
-      ) / 3.f;
-
-      ref_direction = normalize(ref_direction + ref_jitter);
-
-      cg::renderer::ray ref_ray(position, ref_direction);
-      auto ref_result = raytracer->trace_ray(ref_ray, payload.depth - 1);
-      result_color += 0.3f * float3(
-        ref_result.color.r,
-        ref_result.color.g,
-        ref_result.color.b
-      );
+      std::cout << "Cancelled before the first pass, nothing is saved\n";
+      return;
     }
+    if (passes < settings->ssaa_factor * settings->ssaa_factor &&
+        !settings->checkpoint_path.empty())
+      std::cout << "Run the same command again to render the remaining passes\n";
+  }
+  else if (raytracer->batch_shader)
+  {
+    raytracer->batch_ray_generation(
+      camera->get_position(),
+      camera->get_direction(),
+      camera->get_right(),
+      camera->get_up()
+    );
+  }
+  else
+  {
+    raytracer->ray_generation(
+      camera->get_position(),
+      camera->get_direction(),
+      camera->get_right(),
+      camera->get_up()
+    );
+  }
 
-    payload.color = cg::color::from_float3(result_color);
-    return payload;
-  };
+  auto stop = std::chrono::high_resolution_clock::now();
+  std::cout << "Ray generation: "
+            << std::chrono::duration<float, std::milli>(stop - start).count()
+            << " ms\n";
 
-  raytracer->build_acceleration_structure();
+  if constexpr (traversal_stats_enabled)
+    report_traversal_stats(*stats_buffer, settings->result_path);
 
-  shadow_raytracer->acceleration_structures = raytracer->acceleration_structures;
-  shadow_raytracer->miss_shader = [](const ray& ray) {
-    payload payload = {};
-    payload.t = -1.f;
-    return payload;
-  };
-  shadow_raytracer->closest_hit_shader = [](
-    const ray& ray,
-    payload& payload,
-    const triangle<vertex>& triangle
-  ) {
-      return payload;
-  };
+  if (settings->denoise)
+  {
+    auto start = std::chrono::high_resolution_clock::now();
 
-  raytracer->ray_generation(
-    camera->get_position(),
-    camera->get_direction(),
-    camera->get_right(),
-    camera->get_up()
-  );
+    denoiser denoiser;
+    denoiser.set_buffers(hdr_target, albedo_buffer, normal_buffer, depth_buffer);
+    denoiser.denoise();
+
+    auto stop = std::chrono::high_resolution_clock::now();
+    std::cout << "Denoising: "
+              << std::chrono::duration<float, std::milli>(stop - start).count()
+              << " ms\n";
+
+    for (size_t i = 0; i < hdr_target->get_number_of_elements(); i++)
+    {
+      render_target->item(i) =
+        unsigned_color::from_color(color::from_float3(hdr_target->item(i)));
+    }
+  }
 
   cg::utils::save_resource(*render_target, settings->result_path);
 }
@@ -1,10 +1,24 @@
+#include "renderer/raytracer/denoiser.h"
+#include "renderer/raytracer/path_integrator.h"
 #include "renderer/raytracer/raytracer.h"
 #include "renderer/renderer.h"
 #include "resource.h"
 
+#include <future>
+
 
 namespace cg::renderer
 {
+struct path_tracing_shaders
+{
+  static constexpr bool has_any_hit_shader = false;
+
+  payload shade_miss(const ray& ray) const;
+  payload shade_closest_hit(const ray& ray, payload& payload, const triangle<vertex>& triangle) const;
+
+  const path_integrator<vertex, unsigned_color, path_tracing_shaders>* integrator = nullptr;
+};
+
 class ray_tracing_renderer : public renderer
 {
 public:
@@ -13,13 +27,35 @@ public:
 
   void update() override;
   void render() override;
+  void cancel() override;
+  bool stops_on_interrupt() const override;
 
 protected:
+  bool use_scene_cache() const;
+  // Checkpoints and time budgets render in accumulation passes, which can
+  // stop between rows
+  bool is_progressive() const;
+  // Build settings of the raytracer and the vertex format it is built from
+  uint64_t get_build_settings() const;
+  // Renders the passes of this run on top of the checkpoint and returns
+  // the passes done so far, zero when the first one was cancelled
+  uint32_t render_progressive();
+
   std::shared_ptr<resource<unsigned_color>> render_target;
+  std::shared_ptr<resource<float3>> hdr_target;
+  std::shared_ptr<resource<float3>> albedo_buffer;
+  std::shared_ptr<resource<float3>> normal_buffer;
+  std::shared_ptr<resource<float>> depth_buffer;
 
-  std::shared_ptr<raytracer<vertex, unsigned_color>> raytracer;
-  std::shared_ptr<cg::renderer::raytracer<vertex, unsigned_color>> shadow_raytracer;
+  std::shared_ptr<raytracer<vertex, unsigned_color, path_tracing_shaders>> raytracer;
+  std::shared_ptr<path_integrator<vertex, unsigned_color, path_tracing_shaders>> integrator;
 
   std::vector<light> lights;
+
+  bvh_split_mode split_mode = bvh_split_mode::object;
+  std::filesystem::path scene_cache_path;
+  uint64_t scene_cache_key = 0;
+
+  std::future<void> model_loading;
 };
 } // namespace cg::renderer
@@ -0,0 +1,63 @@
+#include "scene_cache.h"
+
+#include <string_view>
+
+
+uint64_t cg::renderer::fnv1a(const uint8_t* data, size_t size, uint64_t hash)
+{
+  constexpr uint64_t fnv_prime = 1099511628211ull;
+  for (size_t i = 0; i < size; i++)
+  {
+    hash ^= data[i];
+    hash *= fnv_prime;
+  }
+  return hash;
+}
+
+uint64_t cg::renderer::fnv1a(uint64_t value, uint64_t hash)
+{
+  return fnv1a(reinterpret_cast<const uint8_t*>(&value), sizeof(value), hash);
+}
+
+uint64_t cg::renderer::scene_cache_key(
+  const std::filesystem::path& model_path,
+  uint64_t build_settings
+)
+{
+  uint64_t hash = fnv1a(scene_cache_version, fnv_offset_basis);
+  hash = fnv1a(build_settings, hash);
+
+  utils::mapped_file model_file;
+  if (!model_file.open(model_path))
+    return hash;
+
+  hash = fnv1a(model_file.get_data(), model_file.get_size(), hash);
+
+  // Materials live in the libraries named by mtllib statements, which
+  // tinyobjloader resolves relative to the model directory
+  std::string_view text(
+    reinterpret_cast<const char*>(model_file.get_data()), model_file.get_size());
+  size_t line_start = 0;
+  while (line_start < text.size())
+  {
+    size_t line_end = text.find('\n', line_start);
+    if (line_end == std::string_view::npos)
+      line_end = text.size();
+
+    std::string_view line = text.substr(line_start, line_end - line_start);
+    line_start = line_end + 1;
+
+    if (line.substr(0, 7) != "mtllib ")
+      continue;
+
+    std::string_view name = line.substr(7);
+    while (!name.empty() && (name.back() == '\r' || name.back() == ' '))
+      name.remove_suffix(1);
+
+    utils::mapped_file material_file;
+    if (material_file.open(model_path.parent_path() / std::string(name)))
+      hash = fnv1a(material_file.get_data(), material_file.get_size(), hash);
+  }
+
+  return hash;
+}
@@ -0,0 +1,205 @@
+#pragma once
+
+#include "renderer/raytracer/raytracer.h"
+#include "utils/mapped_file.h"
+#include "utils/profiler.h"
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+
+namespace cg::renderer
+{
+// Binary snapshot of a ray tracing scene: per shape, the flattened
+// triangles with their materials followed by the binary and the compressed
+// BVH nodes, whichever were built. Everything is
+// stored as raw arrays, so loading is a bulk copy out of the mapped file
+constexpr uint32_t scene_cache_version = 2;
+
+struct scene_cache_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t triangle_size;
+  uint64_t key;
+  uint64_t number_of_shapes;
+};
+
+struct scene_cache_shape
+{
+  uint64_t number_of_triangles;
+  uint64_t number_of_nodes;
+  uint64_t number_of_compressed_nodes;
+};
+
+// FNV-1a hash of bytes or of a value, continuing from hash
+constexpr uint64_t fnv_offset_basis = 14695981039346656037ull;
+uint64_t fnv1a(const uint8_t* data, size_t size, uint64_t hash = fnv_offset_basis);
+uint64_t fnv1a(uint64_t value, uint64_t hash = fnv_offset_basis);
+
+// FNV-1a hash of the model, the material libraries it references and the
+// build settings; any change of them invalidates the cache
+uint64_t scene_cache_key(const std::filesystem::path& model_path, uint64_t build_settings);
+
+template<typename VB>
+bool load_scene_cache(
+  const std::filesystem::path& cache_path,
+  uint64_t key,
+  std::vector<std::shared_ptr<acceleration_structure<VB>>>& acceleration_structures
+);
+
+template<typename VB>
+bool save_scene_cache(
+  const std::filesystem::path& cache_path,
+  uint64_t key,
+  const std::vector<std::shared_ptr<acceleration_structure<VB>>>& acceleration_structures
+);
+
+template<typename VB>
+inline bool load_scene_cache(
+  const std::filesystem::path& cache_path,
+  uint64_t key,
+  std::vector<std::shared_ptr<acceleration_structure<VB>>>& acceleration_structures
+)
+{
+  static_assert(std::is_trivially_copyable_v<triangle<VB>>);
+  PROFILE_ZONE("Load scene cache");
+
+  utils::mapped_file file;
+  if (!file.open(cache_path) || file.get_size() < sizeof(scene_cache_header))
+    return false;
+
+  const uint8_t* data = file.get_data();
+  const uint8_t* end = data + file.get_size();
+
+  scene_cache_header header;
+  std::memcpy(&header, data, sizeof(header));
+  data += sizeof(header);
+
+  if (std::memcmp(header.magic, "CGSCENE", 8) != 0 ||
+      header.version != scene_cache_version ||
+      header.triangle_size != sizeof(triangle<VB>) ||
+      header.key != key)
+    return false;
+
+  std::vector<std::shared_ptr<acceleration_structure<VB>>> shapes;
+  for (uint64_t i = 0; i < header.number_of_shapes; i++)
+  {
+    scene_cache_shape shape_header;
+    if (static_cast<size_t>(end - data) < sizeof(shape_header))
+      return false;
+    std::memcpy(&shape_header, data, sizeof(shape_header));
+    data += sizeof(shape_header);
+
+    // Counts are checked against the bytes left before they are multiplied,
+    // so a corrupt count can't wrap the section sizes
+    size_t available = static_cast<size_t>(end - data);
+    if (shape_header.number_of_triangles > available / sizeof(triangle<VB>))
+      return false;
+    size_t triangles_size = shape_header.number_of_triangles * sizeof(triangle<VB>);
+    available -= triangles_size;
+    if (shape_header.number_of_nodes > available / sizeof(bvh_node))
+      return false;
+    size_t nodes_size = shape_header.number_of_nodes * sizeof(bvh_node);
+    available -= nodes_size;
+    if (shape_header.number_of_compressed_nodes > available / sizeof(compressed_bvh_node))
+      return false;
+    size_t compressed_nodes_size =
+      shape_header.number_of_compressed_nodes * sizeof(compressed_bvh_node);
+
+    std::vector<triangle<VB>> triangles(shape_header.number_of_triangles);
+    std::memcpy(triangles.data(), data, triangles_size);
+    data += triangles_size;
+
+    std::vector<bvh_node> nodes(shape_header.number_of_nodes);
+    std::memcpy(nodes.data(), data, nodes_size);
+    data += nodes_size;
+
+    std::vector<compressed_bvh_node> compressed_nodes(
+      shape_header.number_of_compressed_nodes);
+    std::memcpy(compressed_nodes.data(), data, compressed_nodes_size);
+    data += compressed_nodes_size;
+
+    auto shape = std::make_shared<aabb<VB>>();
+    shape->assign(
+      std::move(triangles), std::move(nodes), std::move(compressed_nodes));
+    if (!shape->is_valid())
+      return false;
+    shapes.push_back(shape);
+  }
+
+  acceleration_structures = std::move(shapes);
+  return true;
+}
+
+template<typename VB>
+inline bool save_scene_cache(
+  const std::filesystem::path& cache_path,
+  uint64_t key,
+  const std::vector<std::shared_ptr<acceleration_structure<VB>>>& acceleration_structures
+)
+{
+  static_assert(std::is_trivially_copyable_v<triangle<VB>>);
+  PROFILE_ZONE("Save scene cache");
+
+  // Only BVHs are cached, the other backends are cheap to rebuild
+  for (auto& shape : acceleration_structures)
+  {
+    if (!std::dynamic_pointer_cast<aabb<VB>>(shape))
+      return false;
+  }
+
+  // Written under a temporary name first, so an interrupted run never
+  // leaves a truncated cache behind
+  std::filesystem::path temporary_path = cache_path;
+  temporary_path += ".tmp";
+
+  {
+    std::ofstream stream(temporary_path, std::ios::binary | std::ios::trunc);
+    if (!stream)
+      return false;
+
+    scene_cache_header header = {};
+    std::memcpy(header.magic, "CGSCENE", 8);
+    header.version = scene_cache_version;
+    header.triangle_size = sizeof(triangle<VB>);
+    header.key = key;
+    header.number_of_shapes = acceleration_structures.size();
+    stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    for (auto& structure : acceleration_structures)
+    {
+      const auto& shape = static_cast<const aabb<VB>&>(*structure);
+      const auto& triangles = shape.get_triangles();
+      const auto& nodes = shape.get_nodes();
+      const auto& compressed_nodes = shape.get_compressed_nodes();
+
+      scene_cache_shape shape_header = {
+        triangles.size(), nodes.size(), compressed_nodes.size()
+      };
+      stream.write(reinterpret_cast<const char*>(&shape_header), sizeof(shape_header));
+      stream.write(
+        reinterpret_cast<const char*>(triangles.data()),
+        triangles.size() * sizeof(triangle<VB>));
+      stream.write(
+        reinterpret_cast<const char*>(nodes.data()),
+        nodes.size() * sizeof(bvh_node));
+      stream.write(
+        reinterpret_cast<const char*>(compressed_nodes.data()),
+        compressed_nodes.size() * sizeof(compressed_bvh_node));
+    }
+
+    if (!stream)
+      return false;
+  }
+
+  std::error_code error;
+  std::filesystem::rename(temporary_path, cache_path, error);
+  return !error;
+}
+} // namespace cg::renderer
@@ -0,0 +1,95 @@
+#include "traversal_stats.h"
+
+#include "utils/resource_utils.h"
+
+#include <algorithm>
+#include <iostream>
+#include <iterator>
+#include <vector>
+
+
+using namespace cg::renderer;
+
+// Black through red and yellow to white, so the busy pixels stand out
+static cg::unsigned_color heat_color(float value)
+{
+  const float3 stops[] = {
+    { 0.f, 0.f, 0.f },
+    { 0.5f, 0.f, 0.6f },
+    { 0.9f, 0.1f, 0.1f },
+    { 1.f, 0.8f, 0.f },
+    { 1.f, 1.f, 1.f }
+  };
+  const int last = static_cast<int>(std::size(stops)) - 1;
+
+  float position = std::clamp(value, 0.f, 1.f) * last;
+  int index = std::min(static_cast<int>(position), last - 1);
+  float3 color = lerp(stops[index], stops[index + 1], position - index);
+
+  return cg::unsigned_color::from_color(cg::color::from_float3(color));
+}
+
+static void save_heatmap(
+  cg::resource<traversal_counters>& stats,
+  uint64_t traversal_counters::*counter,
+  const std::filesystem::path& path
+)
+{
+  size_t width = stats.get_stride();
+  size_t height = stats.get_number_of_elements() / width;
+
+  // The 99th percentile maps to white, so a few outliers don't darken the
+  // rest of the image
+  std::vector<uint64_t> values;
+  values.reserve(stats.get_number_of_elements());
+  for (auto& pixel : stats)
+    values.push_back(pixel.*counter);
+  auto percentile = values.begin() + values.size() * 99 / 100;
+  std::nth_element(values.begin(), percentile, values.end());
+  float scale = static_cast<float>(std::max<uint64_t>(*percentile, 1));
+
+  cg::resource<cg::unsigned_color> heatmap(width, height);
+  for (size_t i = 0; i < stats.get_number_of_elements(); i++)
+    heatmap.item(i) = heat_color(static_cast<float>(stats.item(i).*counter) / scale);
+
+  cg::utils::save_resource(heatmap, path, false);
+}
+
+void cg::renderer::report_traversal_stats(
+  resource<traversal_counters>& stats,
+  const std::filesystem::path& result_path
+)
+{
+  traversal_counters total;
+  traversal_counters maximum;
+  for (auto& pixel : stats)
+  {
+    total.rays += pixel.rays;
+    total.nodes += pixel.nodes;
+    total.triangles += pixel.triangles;
+    maximum.rays = std::max(maximum.rays, pixel.rays);
+    maximum.nodes = std::max(maximum.nodes, pixel.nodes);
+    maximum.triangles = std::max(maximum.triangles, pixel.triangles);
+  }
+
+  float pixels = static_cast<float>(stats.get_number_of_elements());
+  float rays = static_cast<float>(std::max<uint64_t>(total.rays, 1));
+  std::cout << "Rays: " << total.rays << ", " << total.rays / pixels
+            << " per pixel, at most " << maximum.rays << "\n";
+  std::cout << "Nodes visited: " << total.nodes << ", " << total.nodes / rays
+            << " per ray, at most " << maximum.nodes << " per pixel\n";
+  std::cout << "Triangles tested: " << total.triangles << ", "
+            << total.triangles / rays << " per ray, at most "
+            << maximum.triangles << " per pixel\n";
+
+  auto heatmap_path = [&](const char* suffix) {
+    std::filesystem::path path = result_path;
+    path.replace_filename(
+      result_path.stem().string() + suffix + result_path.extension().string());
+    return path;
+  };
+
+  save_heatmap(stats, &traversal_counters::rays, heatmap_path("_rays"));
+  save_heatmap(stats, &traversal_counters::nodes, heatmap_path("_nodes"));
+  save_heatmap(stats, &traversal_counters::triangles, heatmap_path("_triangles"));
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "resource.h"
+
+#include <cstdint>
+#include <filesystem>
+
+
+namespace cg::renderer
+{
+// Traversal counters are compiled in with RAY_TRAVERSAL_STATS only. Without
+// it the count functions are empty and vanish from the traversal loops
+#ifdef RAY_TRAVERSAL_STATS
+constexpr bool traversal_stats_enabled = true;
+#else
+constexpr bool traversal_stats_enabled = false;
+#endif
+
+struct traversal_counters
+{
+  uint64_t rays = 0;
+  uint64_t nodes = 0;
+  uint64_t triangles = 0;
+};
+
+// Every thread counts into its own counters, so the traversal increments
+// them without atomics
+inline traversal_counters& thread_counters()
+{
+  thread_local traversal_counters counters;
+  return counters;
+}
+
+inline void count_ray()
+{
+  if constexpr (traversal_stats_enabled)
+    thread_counters().rays++;
+}
+
+inline void count_node()
+{
+  if constexpr (traversal_stats_enabled)
+    thread_counters().nodes++;
+}
+
+inline void count_triangles(uint32_t count)
+{
+  if constexpr (traversal_stats_enabled)
+    thread_counters().triangles += count;
+}
+
+// Prints totals and per-ray averages, and writes one heatmap per counter
+// next to result_path, e.g. result_nodes.png
+void report_traversal_stats(
+  resource<traversal_counters>& stats,
+  const std::filesystem::path& result_path
+);
+} // namespace cg::renderer
@@ -0,0 +1,439 @@
+#include "triangle_block.h"
+
+#include <limits>
+#include <utility>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define TRIANGLE_BLOCK_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+// MSVC emits AVX2 intrinsics anywhere, GCC and Clang only in functions
+// built for it. No FMA, so the results match the scalar kernel bit for bit
+#if defined(__GNUC__) || defined(__clang__)
+#define AVX2_FUNCTION __attribute__((target("avx2")))
+#else
+#define AVX2_FUNCTION
+#endif
+
+
+using namespace cg::renderer;
+
+triangle_block::triangle_block()
+{
+  float nan = std::numeric_limits<float>::quiet_NaN();
+  for (int axis = 0; axis < 3; axis++)
+  {
+    for (uint32_t lane = 0; lane < width; lane++)
+    {
+      a[axis][lane] = nan;
+      b[axis][lane] = nan;
+      c[axis][lane] = nan;
+    }
+  }
+}
+
+void triangle_block::set(
+  uint32_t lane,
+  const float3& in_a,
+  const float3& in_b,
+  const float3& in_c
+)
+{
+  for (int axis = 0; axis < 3; axis++)
+  {
+    a[axis][lane] = in_a[axis];
+    b[axis][lane] = in_b[axis];
+    c[axis][lane] = in_c[axis];
+  }
+}
+
+block_ray::block_ray(const ray& ray) :
+  position(ray.position), direction(ray.direction)
+{
+  float3 magnitude = abs(direction);
+  kz = magnitude.x > magnitude.y ?
+    (magnitude.x > magnitude.z ? 0 : 2) :
+    (magnitude.y > magnitude.z ? 1 : 2);
+  kx = (kz + 1) % 3;
+  ky = (kx + 1) % 3;
+
+  // Keeps the winding, so the sign of the edge functions means the same
+  // for both ray orientations
+  if (direction[kz] < 0.f)
+    std::swap(kx, ky);
+
+  shear = float3{
+    direction[kx] / direction[kz],
+    direction[ky] / direction[kz],
+    1.f / direction[kz]
+  };
+}
+
+// Edge functions in double precision for rays that pass exactly through an
+// edge or a vertex in float. They start from the same sheared coordinates,
+// so a shared edge still gets the same value in both triangles
+static void edge_functions_double(
+  float ax, float ay, float bx, float by, float cx, float cy,
+  float& u,
+  float& v,
+  float& w
+)
+{
+  u = static_cast<float>(static_cast<double>(cx) * by - static_cast<double>(cy) * bx);
+  v = static_cast<float>(static_cast<double>(ax) * cy - static_cast<double>(ay) * cx);
+  w = static_cast<float>(static_cast<double>(bx) * ay - static_cast<double>(by) * ax);
+}
+
+bool cg::renderer::intersect_block_scalar(
+  const triangle_block& block,
+  const block_ray& ray,
+  float min_t,
+  float max_t,
+  bool watertight,
+  block_hit& hit
+)
+{
+  bool found = false;
+  hit.t = max_t;
+
+  for (uint32_t lane = 0; lane < triangle_block::width; lane++)
+  {
+    float3 a{ block.a[0][lane], block.a[1][lane], block.a[2][lane] };
+    float3 b{ block.b[0][lane], block.b[1][lane], block.b[2][lane] };
+    float3 c{ block.c[0][lane], block.c[1][lane], block.c[2][lane] };
+
+    float t, u, v;
+    if (watertight)
+    {
+      float3 a_rel = a - ray.position;
+      float3 b_rel = b - ray.position;
+      float3 c_rel = c - ray.position;
+
+      float ax = a_rel[ray.kx] - ray.shear.x * a_rel[ray.kz];
+      float ay = a_rel[ray.ky] - ray.shear.y * a_rel[ray.kz];
+      float bx = b_rel[ray.kx] - ray.shear.x * b_rel[ray.kz];
+      float by = b_rel[ray.ky] - ray.shear.y * b_rel[ray.kz];
+      float cx = c_rel[ray.kx] - ray.shear.x * c_rel[ray.kz];
+      float cy = c_rel[ray.ky] - ray.shear.y * c_rel[ray.kz];
+
+      float edge_u = cx * by - cy * bx;
+      float edge_v = ax * cy - ay * cx;
+      float edge_w = bx * ay - by * ax;
+      if (edge_u == 0.f || edge_v == 0.f || edge_w == 0.f)
+        edge_functions_double(ax, ay, bx, by, cx, cy, edge_u, edge_v, edge_w);
+
+      bool inside = (edge_u >= 0.f && edge_v >= 0.f && edge_w >= 0.f) ||
+                    (edge_u <= 0.f && edge_v <= 0.f && edge_w <= 0.f);
+      float det = edge_u + edge_v + edge_w;
+      if (!inside || det == 0.f)
+        continue;
+
+      float az = ray.shear.z * a_rel[ray.kz];
+      float bz = ray.shear.z * b_rel[ray.kz];
+      float cz = ray.shear.z * c_rel[ray.kz];
+      t = (edge_u * az + edge_v * bz + edge_w * cz) / det;
+      u = edge_v / det;
+      v = edge_w / det;
+    }
+    else
+    {
+      float3 ba = b - a;
+      float3 ca = c - a;
+
+      float3 pvec = cross(ray.direction, ca);
+      float det = dot(ba, pvec);
+      if (det >= -1e-8f && det <= 1e-8f)
+        continue;
+
+      float inv_det = 1.f / det;
+
+      float3 tvec = ray.position - a;
+      u = dot(tvec, pvec) * inv_det;
+      if (u < 0.f || u > 1.f)
+        continue;
+
+      float3 qvec = cross(tvec, ba);
+      v = dot(ray.direction, qvec) * inv_det;
+      if (v < 0.f || (u + v) > 1.f)
+        continue;
+
+      t = dot(ca, qvec) * inv_det;
+    }
+
+    if (t > min_t && t < hit.t)
+    {
+      hit = { lane, t, u, v };
+      found = true;
+    }
+  }
+
+  return found;
+}
+
+#ifdef TRIANGLE_BLOCK_X86
+
+// Vertices of the lanes relative to the ray origin, sheared so that the
+// ray runs along z through (0, 0)
+AVX2_FUNCTION static void shear_vertices(
+  const float (*vertex)[triangle_block::width],
+  const block_ray& ray,
+  const __m256 origin[3],
+  const __m256 shear[3],
+  __m256& x,
+  __m256& y,
+  __m256& z
+)
+{
+  __m256 relative_z = _mm256_sub_ps(_mm256_load_ps(vertex[ray.kz]), origin[2]);
+  x = _mm256_sub_ps(
+    _mm256_sub_ps(_mm256_load_ps(vertex[ray.kx]), origin[0]),
+    _mm256_mul_ps(shear[0], relative_z));
+  y = _mm256_sub_ps(
+    _mm256_sub_ps(_mm256_load_ps(vertex[ray.ky]), origin[1]),
+    _mm256_mul_ps(shear[1], relative_z));
+  z = _mm256_mul_ps(shear[2], relative_z);
+}
+
+AVX2_FUNCTION bool cg::renderer::intersect_block_avx2(
+  const triangle_block& block,
+  const block_ray& ray,
+  float min_t,
+  float max_t,
+  bool watertight,
+  block_hit& hit
+)
+{
+  __m256 t, u, v, valid;
+
+  if (watertight)
+  {
+    __m256 origin[3] = {
+      _mm256_set1_ps(ray.position[ray.kx]),
+      _mm256_set1_ps(ray.position[ray.ky]),
+      _mm256_set1_ps(ray.position[ray.kz])
+    };
+    __m256 shear[3] = {
+      _mm256_set1_ps(ray.shear.x),
+      _mm256_set1_ps(ray.shear.y),
+      _mm256_set1_ps(ray.shear.z)
+    };
+
+    __m256 ax, ay, az, bx, by, bz, cx, cy, cz;
+    shear_vertices(block.a, ray, origin, shear, ax, ay, az);
+    shear_vertices(block.b, ray, origin, shear, bx, by, bz);
+    shear_vertices(block.c, ray, origin, shear, cx, cy, cz);
+
+    __m256 edge_u = _mm256_sub_ps(_mm256_mul_ps(cx, by), _mm256_mul_ps(cy, bx));
+    __m256 edge_v = _mm256_sub_ps(_mm256_mul_ps(ax, cy), _mm256_mul_ps(ay, cx));
+    __m256 edge_w = _mm256_sub_ps(_mm256_mul_ps(bx, ay), _mm256_mul_ps(by, ax));
+
+    __m256 zero = _mm256_setzero_ps();
+    int on_edge = _mm256_movemask_ps(_mm256_or_ps(
+      _mm256_or_ps(_mm256_cmp_ps(edge_u, zero, _CMP_EQ_OQ), _mm256_cmp_ps(edge_v, zero, _CMP_EQ_OQ)),
+      _mm256_cmp_ps(edge_w, zero, _CMP_EQ_OQ)));
+    if (on_edge != 0)
+    {
+      alignas(32) float sheared[6][triangle_block::width];
+      _mm256_store_ps(sheared[0], ax);
+      _mm256_store_ps(sheared[1], ay);
+      _mm256_store_ps(sheared[2], bx);
+      _mm256_store_ps(sheared[3], by);
+      _mm256_store_ps(sheared[4], cx);
+      _mm256_store_ps(sheared[5], cy);
+
+      alignas(32) float edges[3][triangle_block::width];
+      _mm256_store_ps(edges[0], edge_u);
+      _mm256_store_ps(edges[1], edge_v);
+      _mm256_store_ps(edges[2], edge_w);
+      for (uint32_t lane = 0; lane < triangle_block::width; lane++)
+      {
+        if (on_edge & (1 << lane))
+        {
+          edge_functions_double(
+            sheared[0][lane], sheared[1][lane], sheared[2][lane],
+            sheared[3][lane], sheared[4][lane], sheared[5][lane],
+            edges[0][lane], edges[1][lane], edges[2][lane]);
+        }
+      }
+      edge_u = _mm256_load_ps(edges[0]);
+      edge_v = _mm256_load_ps(edges[1]);
+      edge_w = _mm256_load_ps(edges[2]);
+    }
+
+    __m256 all_positive = _mm256_and_ps(
+      _mm256_and_ps(_mm256_cmp_ps(edge_u, zero, _CMP_GE_OQ), _mm256_cmp_ps(edge_v, zero, _CMP_GE_OQ)),
+      _mm256_cmp_ps(edge_w, zero, _CMP_GE_OQ));
+    __m256 all_negative = _mm256_and_ps(
+      _mm256_and_ps(_mm256_cmp_ps(edge_u, zero, _CMP_LE_OQ), _mm256_cmp_ps(edge_v, zero, _CMP_LE_OQ)),
+      _mm256_cmp_ps(edge_w, zero, _CMP_LE_OQ));
+
+    __m256 det = _mm256_add_ps(_mm256_add_ps(edge_u, edge_v), edge_w);
+    valid = _mm256_and_ps(
+      _mm256_or_ps(all_positive, all_negative),
+      _mm256_cmp_ps(det, zero, _CMP_NEQ_UQ));
+
+    __m256 scaled_t = _mm256_add_ps(
+      _mm256_add_ps(_mm256_mul_ps(edge_u, az), _mm256_mul_ps(edge_v, bz)),
+      _mm256_mul_ps(edge_w, cz));
+    t = _mm256_div_ps(scaled_t, det);
+    u = _mm256_div_ps(edge_v, det);
+    v = _mm256_div_ps(edge_w, det);
+  }
+  else
+  {
+    __m256 origin_x = _mm256_set1_ps(ray.position.x);
+    __m256 origin_y = _mm256_set1_ps(ray.position.y);
+    __m256 origin_z = _mm256_set1_ps(ray.position.z);
+    __m256 direction_x = _mm256_set1_ps(ray.direction.x);
+    __m256 direction_y = _mm256_set1_ps(ray.direction.y);
+    __m256 direction_z = _mm256_set1_ps(ray.direction.z);
+
+    __m256 ax = _mm256_load_ps(block.a[0]);
+    __m256 ay = _mm256_load_ps(block.a[1]);
+    __m256 az = _mm256_load_ps(block.a[2]);
+    __m256 bax = _mm256_sub_ps(_mm256_load_ps(block.b[0]), ax);
+    __m256 bay = _mm256_sub_ps(_mm256_load_ps(block.b[1]), ay);
+    __m256 baz = _mm256_sub_ps(_mm256_load_ps(block.b[2]), az);
+    __m256 cax = _mm256_sub_ps(_mm256_load_ps(block.c[0]), ax);
+    __m256 cay = _mm256_sub_ps(_mm256_load_ps(block.c[1]), ay);
+    __m256 caz = _mm256_sub_ps(_mm256_load_ps(block.c[2]), az);
+
+    // Same operations in the same order as intersect_triangle
+    __m256 px = _mm256_sub_ps(_mm256_mul_ps(direction_y, caz), _mm256_mul_ps(direction_z, cay));
+    __m256 py = _mm256_sub_ps(_mm256_mul_ps(direction_z, cax), _mm256_mul_ps(direction_x, caz));
+    __m256 pz = _mm256_sub_ps(_mm256_mul_ps(direction_x, cay), _mm256_mul_ps(direction_y, cax));
+    __m256 det = _mm256_add_ps(
+      _mm256_add_ps(_mm256_mul_ps(bax, px), _mm256_mul_ps(bay, py)),
+      _mm256_mul_ps(baz, pz));
+    __m256 inv_det = _mm256_div_ps(_mm256_set1_ps(1.f), det);
+
+    __m256 tx = _mm256_sub_ps(origin_x, ax);
+    __m256 ty = _mm256_sub_ps(origin_y, ay);
+    __m256 tz = _mm256_sub_ps(origin_z, az);
+    u = _mm256_mul_ps(
+      _mm256_add_ps(
+        _mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)),
+        _mm256_mul_ps(tz, pz)),
+      inv_det);
+
+    __m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, baz), _mm256_mul_ps(tz, bay));
+    __m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, bax), _mm256_mul_ps(tx, baz));
+    __m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, bay), _mm256_mul_ps(ty, bax));
+    v = _mm256_mul_ps(
+      _mm256_add_ps(
+        _mm256_add_ps(_mm256_mul_ps(direction_x, qx), _mm256_mul_ps(direction_y, qy)),
+        _mm256_mul_ps(direction_z, qz)),
+      inv_det);
+    t = _mm256_mul_ps(
+      _mm256_add_ps(
+        _mm256_add_ps(_mm256_mul_ps(cax, qx), _mm256_mul_ps(cay, qy)),
+        _mm256_mul_ps(caz, qz)),
+      inv_det);
+
+    __m256 zero = _mm256_setzero_ps();
+    __m256 one = _mm256_set1_ps(1.f);
+    __m256 parallel = _mm256_and_ps(
+      _mm256_cmp_ps(det, _mm256_set1_ps(-1e-8f), _CMP_GE_OQ),
+      _mm256_cmp_ps(det, _mm256_set1_ps(1e-8f), _CMP_LE_OQ));
+    __m256 outside = _mm256_or_ps(
+      _mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_LT_OQ), _mm256_cmp_ps(u, one, _CMP_GT_OQ)),
+      _mm256_or_ps(
+        _mm256_cmp_ps(v, zero, _CMP_LT_OQ),
+        _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_GT_OQ)));
+    valid = _mm256_andnot_ps(_mm256_or_ps(parallel, outside), _mm256_castsi256_ps(_mm256_set1_epi32(-1)));
+  }
+
+  valid = _mm256_and_ps(valid, _mm256_and_ps(
+    _mm256_cmp_ps(t, _mm256_set1_ps(min_t), _CMP_GT_OQ),
+    _mm256_cmp_ps(t, _mm256_set1_ps(max_t), _CMP_LT_OQ)));
+  if (_mm256_movemask_ps(valid) == 0)
+    return false;
+
+  // Smallest t across the lanes, then the first lane that has it
+  __m256 masked_t = _mm256_blendv_ps(_mm256_set1_ps(max_t), t, valid);
+  __m256 nearest = _mm256_min_ps(masked_t, _mm256_permute2f128_ps(masked_t, masked_t, 1));
+  nearest = _mm256_min_ps(nearest, _mm256_shuffle_ps(nearest, nearest, _MM_SHUFFLE(1, 0, 3, 2)));
+  nearest = _mm256_min_ps(nearest, _mm256_shuffle_ps(nearest, nearest, _MM_SHUFFLE(2, 3, 0, 1)));
+  int nearest_lanes = _mm256_movemask_ps(
+    _mm256_and_ps(_mm256_cmp_ps(masked_t, nearest, _CMP_EQ_OQ), valid));
+
+  uint32_t lane = 0;
+  while (!(nearest_lanes & (1 << lane)))
+    lane++;
+
+  alignas(32) float lanes[3][triangle_block::width];
+  _mm256_store_ps(lanes[0], t);
+  _mm256_store_ps(lanes[1], u);
+  _mm256_store_ps(lanes[2], v);
+  hit = { lane, lanes[0][lane], lanes[1][lane], lanes[2][lane] };
+  return true;
+}
+
+static bool detect_avx2()
+{
+#if defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 0);
+  if (info[0] < 7)
+    return false;
+
+  // The OS has to save the upper halves of the registers as well
+  __cpuid(info, 1);
+  bool avx = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0;
+  if (!avx || (_xgetbv(0) & 6) != 6)
+    return false;
+
+  __cpuidex(info, 7, 0);
+  return (info[1] & (1 << 5)) != 0;
+#else
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#else
+
+bool cg::renderer::intersect_block_avx2(
+  const triangle_block& block,
+  const block_ray& ray,
+  float min_t,
+  float max_t,
+  bool watertight,
+  block_hit& hit
+)
+{
+  return intersect_block_scalar(block, ray, min_t, max_t, watertight, hit);
+}
+
+static bool detect_avx2()
+{
+  return false;
+}
+
+#endif
+
+static const bool avx2_supported = detect_avx2();
+
+bool cg::renderer::has_avx2()
+{
+  return avx2_supported;
+}
+
+bool cg::renderer::intersect_block(
+  const triangle_block& block,
+  const block_ray& ray,
+  float min_t,
+  float max_t,
+  bool watertight,
+  block_hit& hit
+)
+{
+  if (avx2_supported)
+    return intersect_block_avx2(block, ray, min_t, max_t, watertight, hit);
+
+  return intersect_block_scalar(block, ray, min_t, max_t, watertight, hit);
+}
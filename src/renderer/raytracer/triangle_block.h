@@ -0,0 +1,82 @@
+#pragma once
+
+#include "renderer/raytracer/acceleration_structure.h"
+
+#include <cstdint>
+
+
+namespace cg::renderer
+{
+// Up to eight triangles of a BVH leaf in structure-of-arrays layout, so one
+// ray is tested against all of them at once. Unused lanes hold NaN vertices
+// that never report a hit
+struct alignas(32) triangle_block
+{
+  static constexpr uint32_t width = 8;
+
+  triangle_block();
+  void set(uint32_t lane, const float3& in_a, const float3& in_b, const float3& in_c);
+
+  float a[3][width];
+  float b[3][width];
+  float c[3][width];
+};
+
+// Ray with the shear of the watertight test precomputed: kz is the axis
+// the direction is largest along, the shear maps the direction onto it
+struct block_ray
+{
+  block_ray(const ray& ray);
+
+  float3 position;
+  float3 direction;
+
+  int kx;
+  int ky;
+  int kz;
+  float3 shear;
+};
+
+struct block_hit
+{
+  uint32_t lane;
+  float t;
+  // Barycentric weights of b and c
+  float u;
+  float v;
+};
+
+// Nearest hit in (min_t, max_t) among the lanes of the block. Without
+// watertight it is the same Moller-Trumbore test as intersect_triangle;
+// the watertight test never lets a ray slip through a shared edge or
+// vertex. Uses AVX2 when the CPU has it
+bool intersect_block(
+  const triangle_block& block,
+  const block_ray& ray,
+  float min_t,
+  float max_t,
+  bool watertight,
+  block_hit& hit
+);
+
+// Portable implementation, also the reference for the AVX2 one
+bool intersect_block_scalar(
+  const triangle_block& block,
+  const block_ray& ray,
+  float min_t,
+  float max_t,
+  bool watertight,
+  block_hit& hit
+);
+
+bool intersect_block_avx2(
+  const triangle_block& block,
+  const block_ray& ray,
+  float min_t,
+  float max_t,
+  bool watertight,
+  block_hit& hit
+);
+
+bool has_avx2();
+} // namespace cg::renderer
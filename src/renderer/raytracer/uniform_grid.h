@@ -0,0 +1,204 @@
+#pragma once
+
+#include "renderer/raytracer/acceleration_structure.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+
+namespace cg::renderer
+{
+// Uniform grid with about density cells per triangle. Triangles are binned
+// by their bounding boxes in two linear passes, so the build is cheap
+// enough for scenes that change every frame
+template<typename VB>
+class uniform_grid : public acceleration_structure<VB>
+{
+public:
+  void build(std::vector<triangle<VB>> in_triangles) override;
+  const triangle<VB>* intersect(
+    const ray& ray,
+    payload& closest_hit_payload,
+    float min_t,
+    bool any_hit
+  ) const override;
+
+  const std::vector<triangle<VB>>& get_triangles() const override;
+
+  float density = 2.f;
+  int max_resolution = 256;
+
+protected:
+  int cell_coordinate(float position, int axis) const;
+
+  std::vector<triangle<VB>> triangles;
+  // Triangles of cell i are cell_triangles[cell_start[i]..cell_start[i + 1])
+  std::vector<uint32_t> cell_start;
+  std::vector<uint32_t> cell_triangles;
+
+  float3 grid_min;
+  float3 grid_max;
+  float3 cell_size;
+  int resolution[3] = { 0, 0, 0 };
+};
+
+template<typename VB>
+void uniform_grid<VB>::build(std::vector<triangle<VB>> in_triangles)
+{
+  triangles = std::move(in_triangles);
+  cell_start.clear();
+  cell_triangles.clear();
+  if (triangles.empty())
+    return;
+
+  grid_min = float3(FLT_MAX);
+  grid_max = float3(-FLT_MAX);
+  for (auto& triangle : triangles)
+  {
+    grid_min = min(grid_min, min(triangle.a, min(triangle.b, triangle.c)));
+    grid_max = max(grid_max, max(triangle.a, max(triangle.b, triangle.c)));
+  }
+
+  // Flat shapes get a thin slab instead of a zero extent
+  float3 extent = grid_max - grid_min;
+  float min_extent = std::max(maxelem(extent) * 1e-3f, 1e-6f);
+  for (int axis = 0; axis < 3; axis++)
+  {
+    if (extent[axis] < min_extent)
+    {
+      grid_min[axis] -= 0.5f * min_extent;
+      grid_max[axis] += 0.5f * min_extent;
+      extent[axis] = grid_max[axis] - grid_min[axis];
+    }
+  }
+
+  float cells_per_unit =
+    std::cbrt(density * triangles.size() / (extent.x * extent.y * extent.z));
+  for (int axis = 0; axis < 3; axis++)
+  {
+    resolution[axis] = std::clamp(
+      static_cast<int>(extent[axis] * cells_per_unit), 1, max_resolution);
+    cell_size[axis] = extent[axis] / resolution[axis];
+  }
+
+  size_t number_of_cells =
+    static_cast<size_t>(resolution[0]) * resolution[1] * resolution[2];
+
+  // Count the triangles of every cell, turn the counts into offsets, then
+  // fill the cells in a second pass over the same ranges
+  auto for_each_cell = [&](const triangle<VB>& triangle, auto&& function) {
+    float3 triangle_min = min(triangle.a, min(triangle.b, triangle.c));
+    float3 triangle_max = max(triangle.a, max(triangle.b, triangle.c));
+    int first[3], last[3];
+    for (int axis = 0; axis < 3; axis++)
+    {
+      first[axis] = cell_coordinate(triangle_min[axis], axis);
+      last[axis] = cell_coordinate(triangle_max[axis], axis);
+    }
+
+    for (int z = first[2]; z <= last[2]; z++)
+      for (int y = first[1]; y <= last[1]; y++)
+        for (int x = first[0]; x <= last[0]; x++)
+          function((static_cast<size_t>(z) * resolution[1] + y) * resolution[0] + x);
+  };
+
+  cell_start.assign(number_of_cells + 1, 0);
+  for (auto& triangle : triangles)
+    for_each_cell(triangle, [&](size_t cell) { cell_start[cell + 1]++; });
+
+  for (size_t cell = 0; cell < number_of_cells; cell++)
+    cell_start[cell + 1] += cell_start[cell];
+
+  std::vector<uint32_t> fill(cell_start.begin(), cell_start.end() - 1);
+  cell_triangles.resize(cell_start.back());
+  for (uint32_t index = 0; index < triangles.size(); index++)
+    for_each_cell(triangles[index], [&](size_t cell) { cell_triangles[fill[cell]++] = index; });
+}
+
+template<typename VB>
+const triangle<VB>* uniform_grid<VB>::intersect(
+  const ray& ray,
+  payload& closest_hit_payload,
+  float min_t,
+  bool any_hit
+) const
+{
+  if (triangles.empty())
+    return nullptr;
+
+  float3 inv_ray_direction = safe_inverse(ray.direction);
+  float3 t0 = (grid_min - ray.position) * inv_ray_direction;
+  float3 t1 = (grid_max - ray.position) * inv_ray_direction;
+  float t_enter = std::max(maxelem(min(t0, t1)), 0.f);
+  float t_exit = std::min(minelem(max(t0, t1)), closest_hit_payload.t);
+  if (t_enter > t_exit)
+    return nullptr;
+
+  // 3D-DDA from the cell where the ray enters the grid
+  float3 entry = ray.position + ray.direction * t_enter;
+  int cell[3], step[3];
+  float t_next[3], t_delta[3];
+  for (int axis = 0; axis < 3; axis++)
+  {
+    cell[axis] = cell_coordinate(entry[axis], axis);
+    step[axis] = inv_ray_direction[axis] >= 0.f ? 1 : -1;
+
+    float boundary = grid_min[axis] + (cell[axis] + (step[axis] > 0 ? 1 : 0)) * cell_size[axis];
+    t_next[axis] = (boundary - ray.position[axis]) * inv_ray_direction[axis];
+    t_delta[axis] = cell_size[axis] * std::abs(inv_ray_direction[axis]);
+  }
+
+  const triangle<VB>* closest_triangle = nullptr;
+  while (true)
+  {
+    size_t cell_index =
+      (static_cast<size_t>(cell[2]) * resolution[1] + cell[1]) * resolution[0] + cell[0];
+    count_node();
+    for (uint32_t i = cell_start[cell_index]; i < cell_start[cell_index + 1]; i++)
+    {
+      const triangle<VB>& triangle = triangles[cell_triangles[i]];
+      count_triangles(1);
+      payload payload = intersect_triangle(triangle, ray);
+
+      if (payload.t > min_t && payload.t < closest_hit_payload.t)
+      {
+        closest_hit_payload = payload;
+        closest_triangle = &triangle;
+        if (any_hit)
+          return closest_triangle;
+      }
+    }
+
+    int axis = t_next[0] < t_next[1] ?
+      (t_next[0] < t_next[2] ? 0 : 2) :
+      (t_next[1] < t_next[2] ? 1 : 2);
+
+    // A hit inside the current cell can't be beaten by the cells behind it
+    if (closest_hit_payload.t <= t_next[axis] || t_next[axis] > t_exit)
+      break;
+
+    cell[axis] += step[axis];
+    if (cell[axis] < 0 || cell[axis] >= resolution[axis])
+      break;
+    t_next[axis] += t_delta[axis];
+  }
+
+  return closest_triangle;
+}
+
+template<typename VB>
+const std::vector<triangle<VB>>& uniform_grid<VB>::get_triangles() const
+{
+  return triangles;
+}
+
+template<typename VB>
+int uniform_grid<VB>::cell_coordinate(float position, int axis) const
+{
+  return std::clamp(
+    static_cast<int>((position - grid_min[axis]) / cell_size[axis]),
+    0, resolution[axis] - 1);
+}
+} // namespace cg::renderer
@@ -17,6 +17,9 @@
 
 using namespace cg::renderer;
 
+std::atomic<bool> renderer::interrupted = false;
+static_assert(std::atomic<bool>::is_always_lock_free);
+
 void renderer::set_settings(std::shared_ptr<cg::settings> in_settings)
 {
   settings = in_settings;
@@ -4,6 +4,8 @@
 #include "world/camera.h"
 #include "world/model.h"
 
+#include <atomic>
+
 
 namespace cg::renderer
 {
@@ -20,6 +22,14 @@ public:
 
   virtual void update() = 0;
   virtual void render() = 0;
+  // Asks a running render to stop early; may be called from any thread
+  virtual void cancel() {}
+  // Stops a running render early like cancel, but is set from a signal
+  // handler, which may touch nothing but a lock-free atomic
+  static std::atomic<bool> interrupted;
+  // Whether render reads interrupted; other renders keep the default
+  // action of Ctrl+C
+  virtual bool stops_on_interrupt() const { return false; }
 
   void move_forward(float delta = 0.01f);
   void move_backward(float delta = 0.01f);
@@ -3,7 +3,10 @@
 #include "utils/error_handler.h"
 
 #include <algorithm>
+#include <cstdint>
 #include <linalg.h>
+#include <memory>
+#include <utility>
 #include <vector>
 
 
@@ -17,6 +20,14 @@ class resource
 public:
   resource(size_t size);
   resource(size_t x_size, size_t y_size);
+  // Elements that live in memory of the owner, like a mapped file; the
+  // owner is kept alive as long as the resource and nothing is copied.
+  // Copies of the resource own their elements like any other
+  resource(std::shared_ptr<const void> in_owner, T* in_data, size_t size);
+  resource(const resource& other);
+  resource(resource&& other) noexcept;
+  resource& operator=(const resource& other);
+  resource& operator=(resource&& other) noexcept;
   ~resource();
 
   const T* get_data();
@@ -27,14 +38,17 @@ public:
   size_t get_number_of_elements() const;
   size_t get_stride() const;
 
-  typename std::vector<T>::iterator begin() noexcept;
-  typename std::vector<T>::iterator end() noexcept;
+  T* begin() noexcept;
+  T* end() noexcept;
 
-  typename std::vector<T>::const_iterator begin() const noexcept;
-  typename std::vector<T>::const_iterator end() const noexcept;
+  const T* begin() const noexcept;
+  const T* end() const noexcept;
 
 private:
   std::vector<T> data;
+  std::shared_ptr<const void> owner;
+  T* elements = nullptr;
+  size_t number_of_elements = 0;
   size_t item_size = sizeof(T);
   size_t stride = 0;
 };
@@ -43,6 +57,8 @@ template<typename T>
 resource<T>::resource(size_t size)
 {
   data.resize(size);
+  elements = data.data();
+  number_of_elements = size;
   stride = 0;
 }
 
@@ -50,9 +66,68 @@ template<typename T>
 resource<T>::resource(size_t x_size, size_t y_size)
 {
   data.resize(x_size * y_size);
+  elements = data.data();
+  number_of_elements = x_size * y_size;
   stride = x_size;
 }
 
+template<typename T>
+resource<T>::resource(std::shared_ptr<const void> in_owner, T* in_data, size_t size)
+  : owner(in_owner), elements(in_data), number_of_elements(size)
+{
+}
+
+template<typename T>
+resource<T>::resource(const resource& other)
+  : data(other.begin(), other.end()),
+    elements(data.data()),
+    number_of_elements(other.number_of_elements),
+    stride(other.stride)
+{
+}
+
+template<typename T>
+resource<T>::resource(resource&& other) noexcept
+  : data(std::move(other.data)),
+    owner(std::move(other.owner)),
+    elements(other.elements),
+    number_of_elements(other.number_of_elements),
+    stride(other.stride)
+{
+  other.elements = nullptr;
+  other.number_of_elements = 0;
+}
+
+template<typename T>
+resource<T>& resource<T>::operator=(const resource& other)
+{
+  if (this != &other)
+  {
+    data.assign(other.begin(), other.end());
+    owner.reset();
+    elements = data.data();
+    number_of_elements = other.number_of_elements;
+    stride = other.stride;
+  }
+  return *this;
+}
+
+template<typename T>
+resource<T>& resource<T>::operator=(resource&& other) noexcept
+{
+  if (this != &other)
+  {
+    data = std::move(other.data);
+    owner = std::move(other.owner);
+    elements = other.elements;
+    number_of_elements = other.number_of_elements;
+    stride = other.stride;
+    other.elements = nullptr;
+    other.number_of_elements = 0;
+  }
+  return *this;
+}
+
 template<typename T>
 resource<T>::~resource()
 {
@@ -62,31 +137,33 @@ resource<T>::~resource()
 template<typename T>
 const T* resource<T>::get_data()
 {
-  return data.data();
+  return elements;
 }
 
 template<typename T>
 T& resource<T>::item(size_t item)
 {
-  return data.at(item);
+  if (item >= number_of_elements)
+    THROW_ERROR("Resource item is out of range");
+  return elements[item];
 }
 
 template<typename T>
 T& resource<T>::item(size_t x, size_t y)
 {
-  return data.at(y * stride + x);
+  return item(y * stride + x);
 }
 
 template<typename T>
 size_t resource<T>::get_size_in_bytes() const
 {
-  return data.size() * item_size;
+  return number_of_elements * item_size;
 }
 
 template<typename T>
 size_t resource<T>::get_number_of_elements() const
 {
-  return data.size();
+  return number_of_elements;
 }
 
 template<typename T>
@@ -96,27 +173,93 @@ size_t resource<T>::get_stride() const
 }
 
 template<typename T>
-typename std::vector<T>::iterator resource<T>::begin() noexcept
+T* resource<T>::begin() noexcept
 {
-  return data.begin();
+  return elements;
 }
 
 template<typename T>
-typename std::vector<T>::iterator resource<T>::end() noexcept
+T* resource<T>::end() noexcept
 {
-  return data.end();
+  return elements + number_of_elements;
 }
 
 template<typename T>
-typename std::vector<T>::const_iterator resource<T>::begin() const noexcept
+const T* resource<T>::begin() const noexcept
 {
-  return data.begin();
+  return elements;
 }
 
 template<typename T>
-typename std::vector<T>::const_iterator resource<T>::end() const noexcept
+const T* resource<T>::end() const noexcept
 {
-  return data.end();
+  return elements + number_of_elements;
+}
+
+// A range of the elements of a resource; the view shares the ownership of
+// the resource, so a sub-range needs no copy of its own
+template<typename T>
+class resource_view
+{
+public:
+  explicit resource_view(std::shared_ptr<resource<T>> in_resource);
+  resource_view(std::shared_ptr<resource<T>> in_resource, size_t in_offset, size_t in_count);
+
+  T& item(size_t item);
+
+  size_t get_number_of_elements() const;
+  size_t get_offset() const;
+  std::shared_ptr<resource<T>> get_resource() const;
+
+private:
+  std::shared_ptr<resource<T>> view_resource;
+  size_t offset = 0;
+  size_t count = 0;
+};
+
+template<typename T>
+resource_view<T>::resource_view(std::shared_ptr<resource<T>> in_resource)
+  : resource_view(in_resource, 0, in_resource ? in_resource->get_number_of_elements() : 0)
+{
+}
+
+template<typename T>
+resource_view<T>::resource_view(
+  std::shared_ptr<resource<T>> in_resource,
+  size_t in_offset,
+  size_t in_count
+)
+  : view_resource(in_resource), offset(in_offset), count(in_count)
+{
+  size_t size = view_resource ? view_resource->get_number_of_elements() : 0;
+  if (offset > size || count > size - offset)
+    THROW_ERROR("Resource view is out of the resource range");
+}
+
+template<typename T>
+T& resource_view<T>::item(size_t item)
+{
+  if (item >= count)
+    THROW_ERROR("Resource view item is out of range");
+  return view_resource->item(offset + item);
+}
+
+template<typename T>
+size_t resource_view<T>::get_number_of_elements() const
+{
+  return count;
+}
+
+template<typename T>
+size_t resource_view<T>::get_offset() const
+{
+  return offset;
+}
+
+template<typename T>
+std::shared_ptr<resource<T>> resource_view<T>::get_resource() const
+{
+  return view_resource;
 }
 
 struct color
@@ -175,4 +318,25 @@ struct vertex
   float emissive_g;
   float emissive_b;
 };
+
+struct material
+{
+  float3 ambient;
+  float3 diffuse;
+  float3 emissive;
+};
+
+// 12 bytes instead of the 60 of a vertex: the position in 16-bit steps of
+// the mesh bounds, an octahedral normal and an index into the material table
+struct compact_vertex
+{
+  uint16_t x;
+  uint16_t y;
+  uint16_t z;
+
+  int16_t nx;
+  int16_t ny;
+
+  uint16_t material_id;
+};
 } // namespace cg
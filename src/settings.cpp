@@ -21,7 +21,7 @@ std::shared_ptr<settings> settings::parse_settings(int argc, char** argv)
     "width", "Render target width",
     cxxopts::value<unsigned>()->default_value("1920"));
   add_options(
-    "model_path", "Path to OBJ model",
+    "model_path", "Path to OBJ or binary .cgmesh model",
     cxxopts::value<std::filesystem::path>()->default_value(
       "models/z_test.obj"));
   add_options(
@@ -48,6 +48,69 @@ std::shared_ptr<settings> settings::parse_settings(int argc, char** argv)
   add_options(
     "accumulation_num", "Number of accumulated frames",
     cxxopts::value<unsigned>()->default_value("4"));
+  add_options(
+    "ssaa_factor", "Ray tracing samples per pixel side (factor^2 spp)",
+    cxxopts::value<unsigned>()->default_value("4"));
+  add_options(
+    "denoise", "Denoise the ray traced image",
+    cxxopts::value<bool>()->default_value("false"));
+  add_options(
+    "scene_cache", "Cache the ray tracing scene and its BVH next to the model",
+    cxxopts::value<bool>()->default_value("true"));
+  add_options(
+    "compress_bvh", "Use quantized four-wide BVH nodes to save memory",
+    cxxopts::value<bool>()->default_value("false"));
+  add_options(
+    "spatial_splits", "Build the BVH with spatial splits (SBVH)",
+    cxxopts::value<bool>()->default_value("false"));
+  add_options(
+    "acceleration_structure", "Ray tracing acceleration structure: bvh, grid or kd_tree",
+    cxxopts::value<std::string>()->default_value("bvh"));
+  add_options(
+    "simd_leaves", "Test eight-triangle BVH leaves at once with AVX2",
+    cxxopts::value<bool>()->default_value("false"));
+  add_options(
+    "watertight", "Watertight triangle tests in SIMD leaves, implies simd_leaves",
+    cxxopts::value<bool>()->default_value("false"));
+  add_options(
+    "profile", "Save a Chrome trace of the run next to the resulted image",
+    cxxopts::value<bool>()->default_value("false"));
+  add_options(
+    "ray_batches", "Trace the paths of pixel tiles together, one bounce at a time",
+    cxxopts::value<bool>()->default_value("false"));
+  add_options(
+    "sort_rays", "Sort the rays of every batch by direction and origin, implies ray_batches",
+    cxxopts::value<bool>()->default_value("false"));
+  add_options(
+    "checkpoint_path", "Render in progressive passes and resume from this checkpoint file",
+    cxxopts::value<std::filesystem::path>()->default_value(""));
+  add_options(
+    "checkpoint_interval", "Seconds between checkpoint writes",
+    cxxopts::value<float>()->default_value("60.0"));
+  add_options(
+    "run_passes", "Progressive passes to render before the run stops, 0 for all",
+    cxxopts::value<unsigned>()->default_value("0"));
+  add_options(
+    "time_budget", "Seconds to render progressive passes for, 0 for all passes",
+    cxxopts::value<float>()->default_value("0.0"));
+  add_options(
+    "compact_vertices", "Keep vertices as 16-bit positions, octahedral normals and material ids",
+    cxxopts::value<bool>()->default_value("false"));
+  add_options(
+    "memory_budget", "Megabytes of an OBJ model to convert and draw at a time, 0 for no limit",
+    cxxopts::value<unsigned>()->default_value("0"));
+  add_options(
+    "optimize_mesh", "Reorder triangles and vertices for the vertex cache and overdraw",
+    cxxopts::value<bool>()->default_value("false"));
+  add_options(
+    "meshlets", "Draw shapes as meshlets and skip those out of view or facing away",
+    cxxopts::value<bool>()->default_value("false"));
+  add_options(
+    "lods", "Draw distant shapes from simplified levels of detail",
+    cxxopts::value<bool>()->default_value("false"));
+  add_options(
+    "lod_threshold", "Pixels a level of detail may move the surface of a shape on screen",
+    cxxopts::value<float>()->default_value("1.0"));
   add_options("h,help", "Print usage");
 
   auto result = options.parse(argc, argv);
@@ -68,6 +131,27 @@ std::shared_ptr<settings> settings::parse_settings(int argc, char** argv)
   settings->camera_z_far = result["camera_z_far"].as<float>();
   settings->result_path = result["result_path"].as<std::filesystem::path>();
   settings->accumulation_num = result["accumulation_num"].as<unsigned>();
+  settings->ssaa_factor = result["ssaa_factor"].as<unsigned>();
+  settings->denoise = result["denoise"].as<bool>();
+  settings->scene_cache = result["scene_cache"].as<bool>();
+  settings->compress_bvh = result["compress_bvh"].as<bool>();
+  settings->spatial_splits = result["spatial_splits"].as<bool>();
+  settings->acceleration_structure = result["acceleration_structure"].as<std::string>();
+  settings->simd_leaves = result["simd_leaves"].as<bool>();
+  settings->watertight = result["watertight"].as<bool>();
+  settings->profile = result["profile"].as<bool>();
+  settings->ray_batches = result["ray_batches"].as<bool>();
+  settings->sort_rays = result["sort_rays"].as<bool>();
+  settings->checkpoint_path = result["checkpoint_path"].as<std::filesystem::path>();
+  settings->checkpoint_interval = result["checkpoint_interval"].as<float>();
+  settings->run_passes = result["run_passes"].as<unsigned>();
+  settings->time_budget = result["time_budget"].as<float>();
+  settings->compact_vertices = result["compact_vertices"].as<bool>();
+  settings->memory_budget = result["memory_budget"].as<unsigned>();
+  settings->optimize_mesh = result["optimize_mesh"].as<bool>();
+  settings->meshlets = result["meshlets"].as<bool>();
+  settings->lods = result["lods"].as<bool>();
+  settings->lod_threshold = result["lod_threshold"].as<float>();
 
   return settings;
 }
@@ -29,5 +29,27 @@ struct settings
   std::filesystem::path result_path;
 
   unsigned accumulation_num;
+
+  unsigned ssaa_factor;
+  bool denoise;
+  bool scene_cache;
+  bool compress_bvh;
+  bool spatial_splits;
+  std::string acceleration_structure;
+  bool simd_leaves;
+  bool watertight;
+  bool profile;
+  bool ray_batches;
+  bool sort_rays;
+  std::filesystem::path checkpoint_path;
+  float checkpoint_interval;
+  unsigned run_passes;
+  float time_budget;
+  bool compact_vertices;
+  unsigned memory_budget;
+  bool optimize_mesh;
+  bool meshlets;
+  bool lods;
+  float lod_threshold;
 };
 } // namespace cg
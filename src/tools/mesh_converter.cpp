@@ -0,0 +1,40 @@
+#include "world/model.h"
+
+#include <iostream>
+
+
+// Converts an OBJ model with its MTL materials to the binary mesh that
+// model::load_mesh maps without parsing
+int main(int argc, char** argv)
+{
+  if (argc < 2 || argc > 3)
+  {
+    std::cerr << "Usage: " << argv[0] << " <model.obj> [<model.cgmesh>]" << std::endl;
+    return 1;
+  }
+
+  try
+  {
+    std::filesystem::path obj_path(argv[1]);
+    std::filesystem::path mesh_path = argc == 3
+      ? std::filesystem::path(argv[2])
+      : std::filesystem::path(obj_path).replace_extension(cg::world::mesh_extension);
+
+    cg::world::model model;
+    model.load_obj(obj_path);
+    model.save_mesh(mesh_path);
+
+    std::cout << mesh_path.string() << ": "
+              << model.get_indexed_vertex_buffer()->get_number_of_elements() << " vertices, "
+              << model.get_index_buffer()->get_number_of_elements() / 3 << " triangles, "
+              << model.get_per_shape_index_buffer().size() << " shapes, "
+              << model.get_materials().size() << " materials" << std::endl;
+  }
+  catch (std::exception& e)
+  {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,147 @@
+#include "mapped_file.h"
+
+#include <algorithm>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+cg::utils::mapped_file::~mapped_file()
+{
+  close();
+}
+
+bool cg::utils::mapped_file::open(const std::filesystem::path& path, bool copy_on_write)
+{
+  close();
+
+#ifdef _WIN32
+  file = CreateFileW(
+    path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+    FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+  if (file == INVALID_HANDLE_VALUE)
+  {
+    file = nullptr;
+    return false;
+  }
+
+  LARGE_INTEGER file_size;
+  if (!GetFileSizeEx(file, &file_size))
+  {
+    close();
+    return false;
+  }
+  size = static_cast<size_t>(file_size.QuadPart);
+
+  // Empty files can't be mapped, but they are still valid
+  if (size == 0)
+    return true;
+
+  mapping = CreateFileMappingW(
+    file, nullptr, copy_on_write ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, nullptr);
+  if (!mapping)
+  {
+    close();
+    return false;
+  }
+
+  data = static_cast<const uint8_t*>(
+    MapViewOfFile(mapping, copy_on_write ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0));
+#else
+  int descriptor = ::open(path.c_str(), O_RDONLY);
+  if (descriptor < 0)
+    return false;
+
+  struct stat file_stat;
+  if (fstat(descriptor, &file_stat) != 0)
+  {
+    ::close(descriptor);
+    return false;
+  }
+  size = static_cast<size_t>(file_stat.st_size);
+
+  if (size == 0)
+  {
+    ::close(descriptor);
+    return true;
+  }
+
+  int protection = copy_on_write ? PROT_READ | PROT_WRITE : PROT_READ;
+  void* view = mmap(nullptr, size, protection, MAP_PRIVATE, descriptor, 0);
+  // The mapping stays valid after the descriptor is closed
+  ::close(descriptor);
+
+  if (view != MAP_FAILED)
+    data = static_cast<const uint8_t*>(view);
+#endif
+
+  if (!data)
+  {
+    close();
+    return false;
+  }
+
+  writable = copy_on_write;
+  return true;
+}
+
+void cg::utils::mapped_file::close()
+{
+#ifdef _WIN32
+  if (data)
+    UnmapViewOfFile(data);
+  if (mapping)
+    CloseHandle(mapping);
+  if (file)
+    CloseHandle(file);
+  mapping = nullptr;
+  file = nullptr;
+#else
+  if (data)
+    munmap(const_cast<uint8_t*>(data), size);
+#endif
+
+  data = nullptr;
+  size = 0;
+  writable = false;
+}
+
+void cg::utils::mapped_file::release(size_t offset, size_t length) const
+{
+  if (!data || offset >= size)
+    return;
+  length = std::min(length, size - offset);
+
+#ifdef _WIN32
+  // Unlocking pages that aren't locked removes them from the working set
+  VirtualUnlock(const_cast<uint8_t*>(data) + offset, length);
+#else
+  // The pages the range touches, as the mapping starts at a page
+  size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  size_t begin = offset / page_size * page_size;
+  size_t end = std::min((offset + length + page_size - 1) / page_size * page_size, size);
+  madvise(const_cast<uint8_t*>(data) + begin, end - begin, MADV_DONTNEED);
+#endif
+}
+
+const uint8_t* cg::utils::mapped_file::get_data() const
+{
+  return data;
+}
+
+uint8_t* cg::utils::mapped_file::get_writable_data() const
+{
+  return writable ? const_cast<uint8_t*>(data) : nullptr;
+}
+
+size_t cg::utils::mapped_file::get_size() const
+{
+  return size;
+}
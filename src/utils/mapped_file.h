@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+
+
+namespace cg::utils
+{
+// Read-only or copy-on-write memory mapping of a whole file
+class mapped_file
+{
+public:
+  mapped_file() = default;
+  ~mapped_file();
+
+  mapped_file(const mapped_file&) = delete;
+  mapped_file& operator=(const mapped_file&) = delete;
+
+  // A copy-on-write mapping can be written; the writes stay private to the
+  // process and never reach the file
+  bool open(const std::filesystem::path& path, bool copy_on_write = false);
+  void close();
+  // Drops the pages of a byte range from memory; they are read from the
+  // file again on the next access. Written copy-on-write pages may lose
+  // their changes
+  void release(size_t offset, size_t length) const;
+
+  const uint8_t* get_data() const;
+  // Null unless the file was opened copy-on-write
+  uint8_t* get_writable_data() const;
+  size_t get_size() const;
+
+protected:
+  const uint8_t* data = nullptr;
+  size_t size = 0;
+  bool writable = false;
+
+#ifdef _WIN32
+  void* file = nullptr;
+  void* mapping = nullptr;
+#endif
+};
+} // namespace cg::utils
@@ -0,0 +1,145 @@
+#include "profiler.h"
+
+#include "utils/error_handler.h"
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#define PROFILER_TSC
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PROFILER_TSC
+#endif
+
+
+namespace
+{
+struct zone_event
+{
+  const char* name;
+  uint64_t start;
+  uint64_t end;
+};
+
+// Every thread owns a ring of the latest zones, so recording never takes a
+// lock. Rings are kept after their thread exits until the trace is saved
+struct thread_ring
+{
+  static constexpr size_t size = 1 << 16;
+
+  std::vector<zone_event> events = std::vector<zone_event>(size);
+  uint64_t count = 0;
+  size_t index;
+  bool main_thread;
+};
+
+std::atomic<bool> enabled = false;
+std::thread::id enabling_thread;
+uint64_t enable_ticks;
+std::chrono::steady_clock::time_point enable_time;
+
+std::mutex rings_mutex;
+std::vector<std::unique_ptr<thread_ring>> rings;
+
+thread_ring& current_ring()
+{
+  thread_local thread_ring* ring = nullptr;
+  if (!ring)
+  {
+    std::lock_guard lock(rings_mutex);
+    rings.push_back(std::make_unique<thread_ring>());
+    ring = rings.back().get();
+    ring->index = rings.size() - 1;
+    ring->main_thread = std::this_thread::get_id() == enabling_thread;
+  }
+  return *ring;
+}
+} // namespace
+
+void cg::utils::enable_profiler()
+{
+  enabling_thread = std::this_thread::get_id();
+  enable_time = std::chrono::steady_clock::now();
+  enable_ticks = read_profiler_ticks();
+  enabled = true;
+}
+
+bool cg::utils::is_profiler_enabled()
+{
+  return enabled.load(std::memory_order_relaxed);
+}
+
+uint64_t cg::utils::read_profiler_ticks()
+{
+#ifdef PROFILER_TSC
+  return __rdtsc();
+#else
+  return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+void cg::utils::record_profile_zone(const char* name, uint64_t start, uint64_t end)
+{
+  thread_ring& ring = current_ring();
+  ring.events[ring.count++ % thread_ring::size] = { name, start, end };
+}
+
+void cg::utils::save_chrome_trace(const std::filesystem::path& path)
+{
+  if (!is_profiler_enabled())
+    return;
+
+  // The tick rate is measured over the whole run against the steady clock
+  uint64_t ticks = read_profiler_ticks() - enable_ticks;
+  double microseconds = std::chrono::duration<double, std::micro>(
+                          std::chrono::steady_clock::now() - enable_time)
+                          .count();
+  double ticks_per_microsecond = microseconds > 0.0 ? ticks / microseconds : 1.0;
+
+  std::ofstream file(path);
+  if (!file)
+    THROW_ERROR("Can't write the profile " + path.string());
+
+  file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+  file.precision(3);
+  file << std::fixed;
+
+  std::lock_guard lock(rings_mutex);
+  uint64_t dropped = 0;
+  bool first = true;
+  for (auto& ring : rings)
+  {
+    file << (first ? "" : ",\n")
+         << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":" << ring->index
+         << ",\"args\":{\"name\":\""
+         << (ring->main_thread ? "Main thread" : "Worker " + std::to_string(ring->index))
+         << "\"}}";
+    first = false;
+
+    uint64_t begin = ring->count > thread_ring::size ? ring->count - thread_ring::size : 0;
+    dropped += begin;
+    for (uint64_t i = begin; i < ring->count; i++)
+    {
+      const zone_event& event = ring->events[i % thread_ring::size];
+      file << ",\n{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":0,\"tid\":"
+           << ring->index
+           << ",\"ts\":" << (event.start - enable_ticks) / ticks_per_microsecond
+           << ",\"dur\":" << (event.end - event.start) / ticks_per_microsecond << "}";
+    }
+  }
+  file << "\n]}\n";
+
+  std::cout << "Profile: " << path.string();
+  if (dropped > 0)
+    std::cout << ", " << dropped << " oldest zones were overwritten";
+  std::cout << "\n";
+}
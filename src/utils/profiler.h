@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+
+
+namespace cg::utils
+{
+// Zones are recorded only after enable_profiler(), before that they only
+// check the flag
+void enable_profiler();
+bool is_profiler_enabled();
+
+// Time stamp counter, or a steady clock on CPUs without one
+uint64_t read_profiler_ticks();
+
+// Appends a finished zone to the ring buffer of the calling thread. The
+// name must outlive the profiler, zones use string literals
+void record_profile_zone(const char* name, uint64_t start, uint64_t end);
+
+// Writes the recorded zones as Chrome trace_event JSON (chrome://tracing or
+// ui.perfetto.dev), one track per thread
+void save_chrome_trace(const std::filesystem::path& path);
+
+// Measures the enclosing scope
+class profile_zone
+{
+public:
+  explicit profile_zone(const char* in_name)
+  {
+    if (is_profiler_enabled())
+    {
+      name = in_name;
+      start = read_profiler_ticks();
+    }
+  }
+  ~profile_zone()
+  {
+    if (name)
+      record_profile_zone(name, start, read_profiler_ticks());
+  }
+
+  profile_zone(const profile_zone&) = delete;
+  profile_zone& operator=(const profile_zone&) = delete;
+
+protected:
+  const char* name = nullptr;
+  uint64_t start = 0;
+};
+} // namespace cg::utils
+
+#define PROFILE_ZONE_CONCAT_INNER(a, b) a##b
+#define PROFILE_ZONE_CONCAT(a, b) PROFILE_ZONE_CONCAT_INNER(a, b)
+#define PROFILE_ZONE(name) \
+  cg::utils::profile_zone PROFILE_ZONE_CONCAT(profile_zone_, __LINE__)(name)
@@ -4,6 +4,7 @@
 #include "resource_utils.h"
 
 #include "utils/error_handler.h"
+#include "utils/profiler.h"
 
 #include <stb_image_write.h>
 
@@ -11,8 +12,10 @@
 using namespace cg::utils;
 
 void cg::utils::save_resource(
-  resource<unsigned_color>& render_target, std::filesystem::path filepath)
+  resource<unsigned_color>& render_target, std::filesystem::path filepath, bool show)
 {
+  PROFILE_ZONE("Save resource");
+
   int width = static_cast<int>(render_target.get_stride());
   int height = static_cast<int>(render_target.get_number_of_elements()) / width;
 
@@ -23,6 +26,9 @@ void cg::utils::save_resource(
   if (result != 1)
     THROW_ERROR("Can't save the resource");
 
+  if (!show)
+    return;
+
   std::string view_command("start ");
   view_command.append(filepath.string());
 
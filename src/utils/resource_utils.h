@@ -7,5 +7,6 @@
 
 namespace cg::utils
 {
-void save_resource(resource<unsigned_color>& render_target, std::filesystem::path filepath);
+// Writes a PNG and, with show, opens it in the default viewer
+void save_resource(resource<unsigned_color>& render_target, std::filesystem::path filepath, bool show = true);
 }
@@ -0,0 +1,750 @@
+#include "mesh_optimizer.h"
+
+#include "utils/profiler.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <numeric>
+
+
+namespace
+{
+// Views of the overdraw estimate are squares of this many pixels a side
+constexpr size_t overdraw_grid_size = 256;
+
+float3 position(const cg::vertex& vertex)
+{
+  return float3{ vertex.x, vertex.y, vertex.z };
+}
+
+// Triangles around every vertex, packed by vertex: those of vertex v are
+// at offsets[v] up to offsets[v + 1]
+void build_adjacency(
+  const uint32_t* indices,
+  size_t triangle_count,
+  size_t vertex_count,
+  std::vector<size_t>& offsets,
+  std::vector<uint32_t>& adjacency)
+{
+  offsets.assign(vertex_count + 1, 0);
+  for (size_t i = 0; i < triangle_count * 3; i++)
+    offsets[indices[i] + 1]++;
+  for (size_t v = 0; v < vertex_count; v++)
+    offsets[v + 1] += offsets[v];
+
+  adjacency.resize(triangle_count * 3);
+  std::vector<size_t> filled(offsets.begin(), offsets.end() - 1);
+  for (size_t i = 0; i < triangle_count * 3; i++)
+    adjacency[filled[indices[i]]++] = static_cast<uint32_t>(i / 3);
+}
+
+// Bounding sphere of the vertices and the cone around the normals of the
+// triangles of a meshlet
+void compute_meshlet_bounds(
+  cg::world::meshlet& meshlet,
+  const uint32_t* indices,
+  const cg::vertex* vertices)
+{
+  const uint32_t* begin = indices + meshlet.index_offset;
+  const uint32_t* end = begin + meshlet.index_count;
+
+  float3 bounds_min(FLT_MAX);
+  float3 bounds_max(-FLT_MAX);
+  for (const uint32_t* index = begin; index != end; index++)
+  {
+    bounds_min = min(bounds_min, position(vertices[*index]));
+    bounds_max = max(bounds_max, position(vertices[*index]));
+  }
+  meshlet.center = (bounds_min + bounds_max) / 2.f;
+  meshlet.radius = 0.f;
+  for (const uint32_t* index = begin; index != end; index++)
+    meshlet.radius = std::max(meshlet.radius, length(position(vertices[*index]) - meshlet.center));
+
+  std::vector<float3> normals;
+  float3 axis(0.f);
+  for (const uint32_t* index = begin; index + 2 < end; index += 3)
+  {
+    float3 a = position(vertices[index[0]]);
+    float3 normal = cross(position(vertices[index[1]]) - a, position(vertices[index[2]]) - a);
+    float normal_length = length(normal);
+    if (normal_length == 0.f)
+      continue;
+    normals.push_back(normal / normal_length);
+    axis += normals.back();
+  }
+
+  // Normals that spread over a hemisphere or more can't be culled
+  float axis_length = length(axis);
+  meshlet.cone_axis = axis_length > 0.f ? axis / axis_length : float3(0.f);
+  float min_cosine = normals.empty() || axis_length == 0.f ? -1.f : 1.f;
+  for (const auto& normal : normals)
+    min_cosine = std::min(min_cosine, dot(normal, meshlet.cone_axis));
+  meshlet.cone_cutoff = min_cosine > 0.f ? std::sqrt(1.f - min_cosine * min_cosine) : 1.f;
+}
+
+float edge_function(float2 a, float2 b, float2 c)
+{
+  return (c.x - a.x) * (b.y - a.y) - (c.y - a.y) * (b.x - a.x);
+}
+
+// Draws the triangles with a depth test from the side the axis points
+// from and counts the pixels that pass it and the pixels left covered
+void count_overdraw(
+  const uint32_t* indices,
+  size_t index_count,
+  const cg::vertex* vertices,
+  const float3& bounds_min,
+  const float3& bounds_extent,
+  int axis,
+  float direction,
+  size_t& shaded_pixels,
+  size_t& covered_pixels)
+{
+  int u_axis = (axis + 1) % 3;
+  int v_axis = (axis + 2) % 3;
+  auto project = [&](const cg::vertex& vertex) {
+    float3 p = position(vertex);
+    float scale = static_cast<float>(overdraw_grid_size - 1);
+    return float3{
+      bounds_extent[u_axis] > 0.f ? (p[u_axis] - bounds_min[u_axis]) / bounds_extent[u_axis] * scale : 0.f,
+      bounds_extent[v_axis] > 0.f ? (p[v_axis] - bounds_min[v_axis]) / bounds_extent[v_axis] * scale : 0.f,
+      direction * p[axis],
+    };
+  };
+
+  std::vector<float> depth_buffer(overdraw_grid_size * overdraw_grid_size, FLT_MAX);
+  for (size_t i = 0; i + 2 < index_count; i += 3)
+  {
+    float3 a = project(vertices[indices[i + 0]]);
+    float3 b = project(vertices[indices[i + 1]]);
+    float3 c = project(vertices[indices[i + 2]]);
+    float area = edge_function(a.xy(), b.xy(), c.xy());
+    if (area == 0.f)
+      continue;
+
+    int x_begin = static_cast<int>(std::ceil(std::min({ a.x, b.x, c.x })));
+    int x_end = static_cast<int>(std::floor(std::max({ a.x, b.x, c.x })));
+    int y_begin = static_cast<int>(std::ceil(std::min({ a.y, b.y, c.y })));
+    int y_end = static_cast<int>(std::floor(std::max({ a.y, b.y, c.y })));
+    for (int y = y_begin; y <= y_end; y++)
+    {
+      for (int x = x_begin; x <= x_end; x++)
+      {
+        float2 pixel{ static_cast<float>(x), static_cast<float>(y) };
+        // Both windings are drawn, as the views see the back faces too
+        float u = edge_function(b.xy(), c.xy(), pixel) / area;
+        float v = edge_function(c.xy(), a.xy(), pixel) / area;
+        float w = edge_function(a.xy(), b.xy(), pixel) / area;
+        if (u < 0.f || v < 0.f || w < 0.f)
+          continue;
+
+        float z = u * a.z + v * b.z + w * c.z;
+        float& depth = depth_buffer[y * overdraw_grid_size + x];
+        if (z < depth)
+        {
+          depth = z;
+          shaded_pixels++;
+        }
+      }
+    }
+  }
+
+  covered_pixels += std::count_if(
+    depth_buffer.begin(), depth_buffer.end(), [](float depth) { return depth < FLT_MAX; });
+}
+
+// Squared distances to planes summed with the areas of their triangles as
+// weights: the symmetric matrix A, the vector b and c of
+// p^T A p + 2 b^T p + c, kept in doubles as the terms cancel
+struct quadric
+{
+  double a00, a01, a02, a11, a12, a22;
+  double b0, b1, b2;
+  double c;
+  double weight;
+
+  quadric& operator+=(const quadric& other)
+  {
+    a00 += other.a00;
+    a01 += other.a01;
+    a02 += other.a02;
+    a11 += other.a11;
+    a12 += other.a12;
+    a22 += other.a22;
+    b0 += other.b0;
+    b1 += other.b1;
+    b2 += other.b2;
+    c += other.c;
+    weight += other.weight;
+    return *this;
+  }
+
+  // Mean squared distance of the point to the planes
+  double error(const float3& p) const
+  {
+    if (weight <= 0.0)
+      return 0.0;
+    double x = p.x, y = p.y, z = p.z;
+    double squared = a00 * x * x + a11 * y * y + a22 * z * z +
+                     2.0 * (a01 * x * y + a02 * x * z + a12 * y * z) +
+                     2.0 * (b0 * x + b1 * y + b2 * z) + c;
+    return std::max(squared, 0.0) / weight;
+  }
+};
+
+quadric make_plane_quadric(const float3& a, const float3& b, const float3& c)
+{
+  float3 normal = cross(b - a, c - a);
+  double area = length(normal);
+  if (area == 0.0)
+    return {};
+
+  double nx = normal.x / area, ny = normal.y / area, nz = normal.z / area;
+  double d = -(nx * a.x + ny * a.y + nz * a.z);
+  return {
+    area * nx * nx, area * nx * ny, area * nx * nz, area * ny * ny, area * ny * nz,
+    area * nz * nz, area * nx * d, area * ny * d, area * nz * d, area * d * d, area,
+  };
+}
+} // namespace
+
+cg::world::mesh_statistics cg::world::analyze_mesh(
+  const uint32_t* indices,
+  size_t index_count,
+  const vertex* vertices,
+  size_t cache_size
+)
+{
+  PROFILE_ZONE("Analyze mesh");
+
+  mesh_statistics statistics = { 0.f, 0.f };
+  size_t triangle_count = index_count / 3;
+  if (triangle_count == 0)
+    return statistics;
+
+  // A vertex stays in the FIFO cache until cache_size other vertices are
+  // loaded after it
+  uint32_t max_index = *std::max_element(indices, indices + triangle_count * 3);
+  std::vector<size_t> loaded_at(static_cast<size_t>(max_index) + 1, 0);
+  size_t misses = 0;
+  for (size_t i = 0; i < triangle_count * 3; i++)
+  {
+    size_t& loaded = loaded_at[indices[i]];
+    if (loaded == 0 || misses - loaded >= cache_size)
+      loaded = ++misses;
+  }
+  statistics.acmr = static_cast<float>(misses) / static_cast<float>(triangle_count);
+
+  float3 bounds_min(FLT_MAX);
+  float3 bounds_max(-FLT_MAX);
+  for (size_t i = 0; i < triangle_count * 3; i++)
+  {
+    bounds_min = min(bounds_min, position(vertices[indices[i]]));
+    bounds_max = max(bounds_max, position(vertices[indices[i]]));
+  }
+
+  size_t shaded_pixels = 0;
+  size_t covered_pixels = 0;
+  for (int axis = 0; axis < 3; axis++)
+  {
+    for (float direction : { 1.f, -1.f })
+    {
+      count_overdraw(
+        indices, triangle_count * 3, vertices, bounds_min, bounds_max - bounds_min, axis,
+        direction, shaded_pixels, covered_pixels);
+    }
+  }
+  statistics.overdraw = covered_pixels
+    ? static_cast<float>(shaded_pixels) / static_cast<float>(covered_pixels)
+    : 0.f;
+  return statistics;
+}
+
+std::vector<size_t> cg::world::optimize_vertex_cache(
+  uint32_t* indices,
+  size_t index_count,
+  size_t vertex_count,
+  size_t cache_size
+)
+{
+  PROFILE_ZONE("Optimize vertex cache");
+
+  size_t triangle_count = index_count / 3;
+
+  // Triangles around every vertex and the number of them that are not
+  // emitted yet
+  std::vector<size_t> adjacency_offsets;
+  std::vector<uint32_t> adjacency;
+  build_adjacency(indices, triangle_count, vertex_count, adjacency_offsets, adjacency);
+  std::vector<uint32_t> live_triangles(vertex_count);
+  for (size_t v = 0; v < vertex_count; v++)
+    live_triangles[v] = static_cast<uint32_t>(adjacency_offsets[v + 1] - adjacency_offsets[v]);
+
+  std::vector<size_t> cache_time(vertex_count, 0);
+  std::vector<bool> emitted(triangle_count, false);
+  std::vector<uint32_t> dead_ends;
+  std::vector<uint32_t> candidates;
+  std::vector<uint32_t> reordered;
+  reordered.reserve(triangle_count * 3);
+  std::vector<size_t> clusters;
+  size_t time = cache_size + 1;
+  size_t cursor = 0;
+
+  // Recently used vertices with triangles left, then the next such vertex
+  // in index order; -1 once every triangle is emitted
+  auto skip_dead_end = [&]() -> int64_t {
+    while (!dead_ends.empty())
+    {
+      uint32_t vertex = dead_ends.back();
+      dead_ends.pop_back();
+      if (live_triangles[vertex] > 0)
+        return vertex;
+    }
+    for (; cursor < vertex_count; cursor++)
+    {
+      if (live_triangles[cursor] > 0)
+        return static_cast<int64_t>(cursor);
+    }
+    return -1;
+  };
+
+  int64_t fanning = skip_dead_end();
+  if (fanning >= 0)
+    clusters.push_back(0);
+  while (fanning >= 0)
+  {
+    candidates.clear();
+    for (size_t a = adjacency_offsets[fanning]; a < adjacency_offsets[fanning + 1]; a++)
+    {
+      uint32_t triangle = adjacency[a];
+      if (emitted[triangle])
+        continue;
+      emitted[triangle] = true;
+
+      for (size_t k = 0; k < 3; k++)
+      {
+        uint32_t vertex = indices[3 * triangle + k];
+        reordered.push_back(vertex);
+        dead_ends.push_back(vertex);
+        candidates.push_back(vertex);
+        live_triangles[vertex]--;
+        if (time - cache_time[vertex] > cache_size)
+          cache_time[vertex] = time++;
+      }
+    }
+
+    // The candidate that is in the cache the longest and stays there
+    // while its remaining triangles are emitted
+    int64_t next = -1;
+    int64_t best_priority = -1;
+    for (uint32_t vertex : candidates)
+    {
+      if (live_triangles[vertex] == 0)
+        continue;
+      int64_t priority = 0;
+      if (time - cache_time[vertex] + 2 * live_triangles[vertex] <= cache_size)
+        priority = static_cast<int64_t>(time - cache_time[vertex]);
+      if (priority > best_priority)
+      {
+        best_priority = priority;
+        next = vertex;
+      }
+    }
+    if (next < 0)
+    {
+      next = skip_dead_end();
+      if (next >= 0)
+        clusters.push_back(reordered.size());
+    }
+    fanning = next;
+  }
+
+  std::copy(reordered.begin(), reordered.end(), indices);
+  return clusters;
+}
+
+void cg::world::optimize_overdraw(
+  uint32_t* indices,
+  size_t index_count,
+  const std::vector<size_t>& clusters,
+  const vertex* vertices,
+  size_t cache_size,
+  float cluster_threshold
+)
+{
+  PROFILE_ZONE("Optimize overdraw");
+
+  size_t triangle_count = index_count / 3;
+  if (clusters.empty() || triangle_count == 0)
+    return;
+
+  // Clusters are split once their misses per triangle fall to
+  // cluster_threshold times those of the whole order: the cache is warm
+  // by then, and smaller clusters can be sorted more finely
+  uint32_t max_index = *std::max_element(indices, indices + triangle_count * 3);
+  std::vector<size_t> loaded_at(static_cast<size_t>(max_index) + 1, 0);
+  size_t misses = 0;
+  auto load = [&](uint32_t vertex) {
+    size_t& loaded = loaded_at[vertex];
+    if (loaded == 0 || misses - loaded >= cache_size)
+    {
+      loaded = ++misses;
+      return size_t{ 1 };
+    }
+    return size_t{ 0 };
+  };
+  for (size_t i = 0; i < triangle_count * 3; i++)
+    load(indices[i]);
+  float split_acmr =
+    cluster_threshold * static_cast<float>(misses) / static_cast<float>(triangle_count);
+
+  std::vector<size_t> split_clusters;
+  std::fill(loaded_at.begin(), loaded_at.end(), 0);
+  misses = 0;
+  for (size_t c = 0; c < clusters.size(); c++)
+  {
+    size_t end = c + 1 < clusters.size() ? clusters[c + 1] : triangle_count * 3;
+    size_t cluster_start = clusters[c];
+    size_t cluster_misses = 0;
+    // A cluster may be drawn after any other, so it starts with a cold cache
+    misses += cache_size;
+    split_clusters.push_back(cluster_start);
+    for (size_t i = cluster_start; i + 2 < end; i += 3)
+    {
+      cluster_misses += load(indices[i]) + load(indices[i + 1]) + load(indices[i + 2]);
+      size_t cluster_triangles = (i + 3 - cluster_start) / 3;
+      if (i + 3 < end &&
+          static_cast<float>(cluster_misses) <= split_acmr * static_cast<float>(cluster_triangles))
+      {
+        cluster_start = i + 3;
+        cluster_misses = 0;
+        misses += cache_size;
+        split_clusters.push_back(cluster_start);
+      }
+    }
+  }
+
+  float3 mesh_centroid(0.f);
+  for (size_t i = 0; i < triangle_count * 3; i++)
+    mesh_centroid += position(vertices[indices[i]]);
+  mesh_centroid /= static_cast<float>(triangle_count * 3);
+
+  // Area weighted centroid and normal of every cluster
+  std::vector<float> facing(split_clusters.size());
+  for (size_t c = 0; c < split_clusters.size(); c++)
+  {
+    size_t end = c + 1 < split_clusters.size() ? split_clusters[c + 1] : triangle_count * 3;
+    float3 centroid(0.f);
+    float3 normal(0.f);
+    float area = 0.f;
+    for (size_t i = split_clusters[c]; i + 2 < end; i += 3)
+    {
+      float3 a = position(vertices[indices[i + 0]]);
+      float3 b = position(vertices[indices[i + 1]]);
+      float3 c_position = position(vertices[indices[i + 2]]);
+      float3 triangle_normal = cross(b - a, c_position - a);
+      float triangle_area = length(triangle_normal);
+      centroid += (a + b + c_position) / 3.f * triangle_area;
+      normal += triangle_normal;
+      area += triangle_area;
+    }
+    if (area > 0.f)
+      centroid /= area;
+    float normal_length = length(normal);
+    facing[c] = normal_length > 0.f ? dot(centroid - mesh_centroid, normal / normal_length) : 0.f;
+  }
+
+  std::vector<size_t> order(split_clusters.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(
+    order.begin(), order.end(), [&](size_t a, size_t b) { return facing[a] > facing[b]; });
+
+  std::vector<uint32_t> reordered;
+  reordered.reserve(triangle_count * 3);
+  for (size_t c : order)
+  {
+    size_t end = c + 1 < split_clusters.size() ? split_clusters[c + 1] : triangle_count * 3;
+    reordered.insert(reordered.end(), indices + split_clusters[c], indices + end);
+  }
+  std::copy(reordered.begin(), reordered.end(), indices);
+}
+
+std::vector<uint32_t> cg::world::optimize_vertex_fetch(
+  uint32_t* indices,
+  size_t index_count,
+  size_t vertex_count
+)
+{
+  PROFILE_ZONE("Optimize vertex fetch");
+
+  std::vector<uint32_t> remap(vertex_count, UINT32_MAX);
+  uint32_t next_vertex = 0;
+  for (size_t i = 0; i < index_count; i++)
+  {
+    uint32_t& new_id = remap[indices[i]];
+    if (new_id == UINT32_MAX)
+      new_id = next_vertex++;
+    indices[i] = new_id;
+  }
+  for (auto& new_id : remap)
+  {
+    if (new_id == UINT32_MAX)
+      new_id = next_vertex++;
+  }
+  return remap;
+}
+
+std::vector<cg::world::meshlet> cg::world::build_meshlets(
+  uint32_t* indices,
+  size_t index_count,
+  const vertex* vertices,
+  size_t vertex_count,
+  size_t max_vertices,
+  size_t max_triangles
+)
+{
+  PROFILE_ZONE("Build meshlets");
+
+  size_t triangle_count = index_count / 3;
+  std::vector<size_t> adjacency_offsets;
+  std::vector<uint32_t> adjacency;
+  build_adjacency(indices, triangle_count, vertex_count, adjacency_offsets, adjacency);
+
+  std::vector<bool> assigned(triangle_count, false);
+  // Meshlet a vertex was last added to, so that a meshlet counts its
+  // vertices without clearing anything
+  std::vector<size_t> vertex_meshlet(vertex_count, SIZE_MAX);
+  std::vector<uint32_t> candidates;
+  std::vector<uint32_t> reordered;
+  reordered.reserve(triangle_count * 3);
+  std::vector<meshlet> meshlets;
+  size_t cursor = 0;
+
+  while (reordered.size() < triangle_count * 3)
+  {
+    while (assigned[cursor])
+      cursor++;
+
+    size_t id = meshlets.size();
+    meshlet current = {};
+    current.index_offset = reordered.size();
+    size_t meshlet_vertices = 0;
+    candidates.clear();
+
+    // Grows from the first free triangle over the triangles around its
+    // vertices, taking the one that adds the fewest vertices each time
+    for (int64_t next = static_cast<int64_t>(cursor); next >= 0;)
+    {
+      uint32_t triangle = static_cast<uint32_t>(next);
+      assigned[triangle] = true;
+      for (size_t k = 0; k < 3; k++)
+      {
+        uint32_t vertex = indices[3 * triangle + k];
+        reordered.push_back(vertex);
+        if (vertex_meshlet[vertex] == id)
+          continue;
+        vertex_meshlet[vertex] = id;
+        meshlet_vertices++;
+        candidates.insert(
+          candidates.end(), adjacency.begin() + adjacency_offsets[vertex],
+          adjacency.begin() + adjacency_offsets[vertex + 1]);
+      }
+      if (reordered.size() - current.index_offset >= max_triangles * 3)
+        break;
+
+      next = -1;
+      size_t fewest_new_vertices = 4;
+      size_t kept = 0;
+      for (uint32_t candidate : candidates)
+      {
+        if (assigned[candidate])
+          continue;
+        candidates[kept++] = candidate;
+
+        size_t new_vertices = 0;
+        for (size_t k = 0; k < 3; k++)
+          new_vertices += vertex_meshlet[indices[3 * candidate + k]] != id;
+        if (meshlet_vertices + new_vertices <= max_vertices && new_vertices < fewest_new_vertices)
+        {
+          fewest_new_vertices = new_vertices;
+          next = candidate;
+        }
+      }
+      candidates.resize(kept);
+    }
+
+    current.index_count = reordered.size() - current.index_offset;
+    meshlets.push_back(current);
+  }
+
+  std::copy(reordered.begin(), reordered.end(), indices);
+  for (auto& meshlet : meshlets)
+    compute_meshlet_bounds(meshlet, indices, vertices);
+  return meshlets;
+}
+
+size_t cg::world::simplify_mesh(
+  uint32_t* indices,
+  size_t index_count,
+  const vertex* vertices,
+  size_t vertex_count,
+  size_t target_index_count,
+  float target_error,
+  float* result_error
+)
+{
+  PROFILE_ZONE("Simplify mesh");
+
+  size_t triangle_count = index_count / 3;
+  std::vector<size_t> adjacency_offsets;
+  std::vector<uint32_t> adjacency;
+  build_adjacency(indices, triangle_count, vertex_count, adjacency_offsets, adjacency);
+
+  // An edge without the same edge the other way round in a neighbouring
+  // triangle is a border; its vertices never collapse
+  auto has_edge = [&](size_t triangle, uint32_t from, uint32_t to) {
+    const uint32_t* corners = indices + 3 * triangle;
+    for (size_t k = 0; k < 3; k++)
+    {
+      if (corners[k] == from && corners[(k + 1) % 3] == to)
+        return true;
+    }
+    return false;
+  };
+  std::vector<bool> locked(vertex_count, false);
+  std::vector<quadric> quadrics(vertex_count, quadric{});
+  for (size_t t = 0; t < triangle_count; t++)
+  {
+    const uint32_t* corners = indices + 3 * t;
+    for (size_t k = 0; k < 3; k++)
+    {
+      uint32_t a = corners[k];
+      uint32_t b = corners[(k + 1) % 3];
+      bool opposite = false;
+      for (size_t j = adjacency_offsets[b]; j < adjacency_offsets[b + 1] && !opposite; j++)
+        opposite = adjacency[j] != t && has_edge(adjacency[j], b, a);
+      if (!opposite)
+        locked[a] = locked[b] = true;
+    }
+
+    quadric plane = make_plane_quadric(
+      position(vertices[corners[0]]), position(vertices[corners[1]]),
+      position(vertices[corners[2]]));
+    for (size_t k = 0; k < 3; k++)
+      quadrics[corners[k]] += plane;
+  }
+
+  struct collapse
+  {
+    float cost;
+    uint32_t from;
+    uint32_t to;
+  };
+  std::vector<collapse> collapses;
+  std::vector<uint32_t> remap(vertex_count);
+  std::vector<bool> collapsed(vertex_count);
+  double error_limit = static_cast<double>(target_error) * target_error;
+  double max_error = 0.0;
+
+  // Every pass collapses the cheapest edges whose vertices no other
+  // collapse of the pass touched, then drops the triangles that vanished
+  while (triangle_count * 3 > target_index_count)
+  {
+    collapses.clear();
+    for (size_t i = 0; i < triangle_count * 3; i++)
+    {
+      // Both triangles of an edge list it, so one of them adds it
+      uint32_t a = indices[i];
+      uint32_t b = indices[i - i % 3 + (i + 1) % 3];
+      if (a > b)
+        continue;
+      quadric combined = quadrics[a];
+      combined += quadrics[b];
+      if (!locked[a])
+        collapses.push_back({ static_cast<float>(combined.error(position(vertices[b]))), a, b });
+      if (!locked[b])
+        collapses.push_back({ static_cast<float>(combined.error(position(vertices[a]))), b, a });
+    }
+    std::sort(collapses.begin(), collapses.end(), [](const collapse& a, const collapse& b) {
+      return a.cost < b.cost;
+    });
+
+    std::iota(remap.begin(), remap.end(), 0);
+    std::fill(collapsed.begin(), collapsed.end(), false);
+    size_t left = triangle_count;
+    size_t performed = 0;
+    for (const auto& [cost, from, to] : collapses)
+    {
+      if (left * 3 <= target_index_count || cost > error_limit)
+        break;
+      if (collapsed[from] || collapsed[to])
+        continue;
+
+      // Triangles around the vertex with the collapses of the pass so far;
+      // those that keep their area must not turn over, nor turn edge-on to
+      // the normals of their corners, as small turns add up over passes;
+      // models may wind their triangles either way around the normals
+      size_t vanishing = 0;
+      bool flips = false;
+      for (size_t j = adjacency_offsets[from]; j < adjacency_offsets[from + 1] && !flips; j++)
+      {
+        const uint32_t* corners = indices + 3 * adjacency[j];
+        uint32_t current[3] = { remap[corners[0]], remap[corners[1]], remap[corners[2]] };
+        if (current[0] == current[1] || current[1] == current[2] || current[0] == current[2])
+          continue;
+        if (current[0] == to || current[1] == to || current[2] == to)
+        {
+          vanishing++;
+          continue;
+        }
+
+        float3 before[3];
+        float3 after[3];
+        float3 surface_normal(0.f);
+        for (size_t k = 0; k < 3; k++)
+        {
+          uint32_t corner = current[k] == from ? to : current[k];
+          before[k] = position(vertices[current[k]]);
+          after[k] = position(vertices[corner]);
+          surface_normal += float3{ vertices[corner].nx, vertices[corner].ny, vertices[corner].nz };
+        }
+        float3 normal_before = cross(before[1] - before[0], before[2] - before[0]);
+        float3 normal_after = cross(after[1] - after[0], after[2] - after[0]);
+        flips = (dot(normal_before, normal_after) <= 0.f && length(normal_before) > 0.f) ||
+                std::abs(dot(normal_after, surface_normal)) <
+                  0.25f * length(normal_after) * length(surface_normal);
+      }
+      if (flips)
+        continue;
+
+      remap[from] = to;
+      quadrics[to] += quadrics[from];
+      collapsed[from] = collapsed[to] = true;
+      left -= std::min(vanishing, left);
+      max_error = std::max(max_error, static_cast<double>(cost));
+      performed++;
+    }
+    if (performed == 0)
+      break;
+
+    size_t kept = 0;
+    for (size_t t = 0; t < triangle_count; t++)
+    {
+      uint32_t a = remap[indices[3 * t + 0]];
+      uint32_t b = remap[indices[3 * t + 1]];
+      uint32_t c = remap[indices[3 * t + 2]];
+      if (a == b || b == c || a == c)
+        continue;
+      indices[kept++] = a;
+      indices[kept++] = b;
+      indices[kept++] = c;
+    }
+    triangle_count = kept / 3;
+    build_adjacency(indices, triangle_count, vertex_count, adjacency_offsets, adjacency);
+  }
+
+  if (result_error)
+    *result_error = static_cast<float>(std::sqrt(max_error));
+  return triangle_count * 3;
+}
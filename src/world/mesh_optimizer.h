@@ -0,0 +1,113 @@
+#pragma once
+
+#include "resource.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+
+namespace cg::world
+{
+// Vertices a post-transform cache holds in the orders below
+constexpr size_t vertex_cache_size = 16;
+// Limits of a meshlet, as in the mesh shader pipelines
+constexpr size_t meshlet_max_vertices = 64;
+constexpr size_t meshlet_max_triangles = 124;
+
+// A run of whole triangles of an index buffer with a bounding sphere and
+// a cone around the normals of the triangles; cone_cutoff is the sine of
+// its half angle, or 1 when the normals spread over a hemisphere
+struct meshlet
+{
+  size_t index_offset;
+  size_t index_count;
+  size_t shape;
+
+  float3 center;
+  float radius;
+  float3 cone_axis;
+  float cone_cutoff;
+};
+
+// Average cache misses per triangle of a FIFO vertex cache, and pixels
+// shaded per visible pixel with a depth test, averaged over views along
+// the six axes
+struct mesh_statistics
+{
+  float acmr;
+  float overdraw;
+};
+
+mesh_statistics analyze_mesh(
+  const uint32_t* indices,
+  size_t index_count,
+  const vertex* vertices,
+  size_t cache_size = vertex_cache_size
+);
+
+// Tipsify, from Sander et al. "Fast triangle reordering for vertex
+// locality and reduced overdraw": triangles are emitted in fans around
+// vertices that are still in the cache. Indices must be below
+// vertex_count. Returns the first index of every cluster, a run that
+// starts where the fans had to jump to a vertex out of the cache
+std::vector<size_t> optimize_vertex_cache(
+  uint32_t* indices,
+  size_t index_count,
+  size_t vertex_count,
+  size_t cache_size = vertex_cache_size
+);
+
+// Splits the clusters of optimize_vertex_cache where their cache misses
+// per triangle fall to cluster_threshold times those of the whole order,
+// then sorts them so that those facing away from the centre of the mesh
+// come first; they tend to hide the rest from most views. The triangles
+// within a cluster keep their order
+void optimize_overdraw(
+  uint32_t* indices,
+  size_t index_count,
+  const std::vector<size_t>& clusters,
+  const vertex* vertices,
+  size_t cache_size = vertex_cache_size,
+  float cluster_threshold = 1.05f
+);
+
+// Renumbers vertices in the order the indices first use them; vertices
+// that no index uses go last. Returns the new id of every old vertex
+std::vector<uint32_t> optimize_vertex_fetch(
+  uint32_t* indices,
+  size_t index_count,
+  size_t vertex_count
+);
+
+// Groups neighbouring triangles into meshlets of at most max_vertices
+// vertices and max_triangles triangles and reorders the indices, which
+// must be below vertex_count, so that every meshlet is a run of them
+std::vector<meshlet> build_meshlets(
+  uint32_t* indices,
+  size_t index_count,
+  const vertex* vertices,
+  size_t vertex_count,
+  size_t max_vertices = meshlet_max_vertices,
+  size_t max_triangles = meshlet_max_triangles
+);
+
+// Collapses edges onto one of their vertices, cheapest first by the
+// quadric error metrics of Garland and Heckbert "Surface simplification
+// using quadric error metrics", until target_index_count indices are left
+// or every collapse would move the surface more than target_error. No
+// vertex moves or is added, so the indices keep using the same vertices;
+// those on edges with a single triangle stay, so borders, seams and
+// neighbouring shapes keep meeting. Indices must be below vertex_count.
+// Returns the new index count; result_error gets how far the surface
+// moved, as the root of the mean squared distance to the original planes
+size_t simplify_mesh(
+  uint32_t* indices,
+  size_t index_count,
+  const vertex* vertices,
+  size_t vertex_count,
+  size_t target_index_count,
+  float target_error,
+  float* result_error = nullptr
+);
+} // namespace cg::world
@@ -3,38 +3,574 @@
 #include "model.h"
 
 #include "utils/error_handler.h"
+#include "utils/mapped_file.h"
+#include "world/obj_parser.h"
+#include "utils/profiler.h"
 
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+#include <fstream>
 #include <linalg.h>
 #include <stdio.h>
+#include <unordered_map>
 
 
 using namespace linalg::aliases;
 using namespace cg::world;
 
+namespace
+{
+// Welded vertices are equal bit for bit, so the hash reads the raw floats
+struct vertex_hash
+{
+  size_t operator()(const cg::vertex& vertex) const
+  {
+    uint32_t words[sizeof(cg::vertex) / sizeof(uint32_t)];
+    std::memcpy(words, &vertex, sizeof(cg::vertex));
+    uint64_t hash = 14695981039346656037ull;
+    for (uint32_t word : words)
+      hash = (hash ^ word) * 1099511628211ull;
+    return static_cast<size_t>(hash);
+  }
+};
+
+struct vertex_equal
+{
+  bool operator()(const cg::vertex& a, const cg::vertex& b) const
+  {
+    return std::memcmp(&a, &b, sizeof(cg::vertex)) == 0;
+  }
+};
+
+// Unique vertices of welded face corners and the indices of the corners
+struct welded_mesh
+{
+  std::vector<cg::vertex> vertices;
+  std::vector<uint16_t> material_ids;
+  std::vector<uint32_t> indices;
+  std::unordered_map<cg::vertex, uint32_t, vertex_hash, vertex_equal> vertex_ids;
+};
+
+// Appends the face corners of a shape; corners with the same position,
+// normal and material share one vertex. expanded_corners, when given, gets
+// every corner at the position of its index
+void weld_shape(
+  welded_mesh& mesh,
+  const tinyobj::attrib_t& attrib,
+  const tinyobj::shape_t& shape,
+  const std::vector<tinyobj::material_t>& materials,
+  uint16_t default_material_id,
+  cg::vertex* expanded_corners)
+{
+  // Loop over faces in a shape
+  size_t index_offset = 0;
+
+  for (size_t f = 0; f < shape.mesh.num_face_vertices.size(); f++)
+  {
+    int fv = shape.mesh.num_face_vertices[f];
+    // Faces before the first usemtl have no material
+    int material_id = shape.mesh.material_ids[f];
+    bool has_material = material_id >= 0 && material_id < static_cast<int>(materials.size());
+
+    // Computed normal of a face (if none is specified)
+    float3 normal;
+    // Compute normal for the face if there are no normals specified
+    // for the vertices.
+    if (shape.mesh.indices[index_offset].normal_index < 0)
+    {
+      auto a_id = shape.mesh.indices[index_offset + 0];
+      auto b_id = shape.mesh.indices[index_offset + 1];
+      auto c_id = shape.mesh.indices[index_offset + 2];
+
+      float3 a{ attrib.vertices[3 * a_id.vertex_index + 0],
+                attrib.vertices[3 * a_id.vertex_index + 1],
+                attrib.vertices[3 * a_id.vertex_index + 2] };
+      float3 b{ attrib.vertices[3 * b_id.vertex_index + 0],
+                attrib.vertices[3 * b_id.vertex_index + 1],
+                attrib.vertices[3 * b_id.vertex_index + 2] };
+      float3 c{ attrib.vertices[3 * c_id.vertex_index + 0],
+                attrib.vertices[3 * c_id.vertex_index + 1],
+                attrib.vertices[3 * c_id.vertex_index + 2] };
+
+      normal = normalize(cross(b - a, c - a));
+    }
+
+    // Loop over vertices in the face.
+    for (size_t v = 0; v < fv; v++)
+    {
+      // access to vertex
+      tinyobj::index_t idx = shape.mesh.indices[index_offset + v];
+      tinyobj::real_t vx = attrib.vertices[3 * idx.vertex_index + 0];
+      tinyobj::real_t vy = attrib.vertices[3 * idx.vertex_index + 1];
+      tinyobj::real_t vz = attrib.vertices[3 * idx.vertex_index + 2];
+
+      tinyobj::real_t nx;
+      tinyobj::real_t ny;
+      tinyobj::real_t nz;
+      if (idx.normal_index > -1)
+      {
+        // If normal is supplied in the file, read it
+        nx = attrib.normals[3 * idx.normal_index + 0];
+        ny = attrib.normals[3 * idx.normal_index + 1];
+        nz = attrib.normals[3 * idx.normal_index + 2];
+      }
+      else
+      {
+        // If not, use predicted values
+        nx = normal[0];
+        ny = normal[1];
+        nz = normal[2];
+      }
+
+      // Read UVs
+      // tinyobj::real_t tx = attrib.texcoords[2 * idx.texcoord_index + 0];
+      // tinyobj::real_t ty = attrib.texcoords[2 * idx.texcoord_index + 1];
+
+      cg::vertex vertex = {};
+
+      vertex.x = vx;
+      vertex.y = vy;
+      vertex.z = vz;
+
+      vertex.nx = nx;
+      vertex.ny = ny;
+      vertex.nz = nz;
+
+      // Read material
+      if (has_material)
+      {
+        auto material = materials[material_id];
+        vertex.ambient_r = material.ambient[0];
+        vertex.ambient_g = material.ambient[1];
+        vertex.ambient_b = material.ambient[2];
+
+        vertex.diffuse_r = material.diffuse[0];
+        vertex.diffuse_g = material.diffuse[1];
+        vertex.diffuse_b = material.diffuse[2];
+
+        vertex.emissive_r = material.emission[0];
+        vertex.emissive_g = material.emission[1];
+        vertex.emissive_b = material.emission[2];
+      }
+      else
+      {
+        // Do nothing
+      }
+
+      auto [id, inserted] = mesh.vertex_ids.try_emplace(
+        vertex, static_cast<uint32_t>(mesh.vertices.size()));
+      if (inserted)
+      {
+        mesh.vertices.push_back(vertex);
+        mesh.material_ids.push_back(
+          has_material ? static_cast<uint16_t>(material_id) : default_material_id);
+      }
+      if (expanded_corners)
+        expanded_corners[mesh.indices.size()] = vertex;
+      mesh.indices.push_back(id->second);
+
+      // Optional: vertex colors
+      // tinyobj::real_t red = attrib.colors[3*idx.vertex_index+0];
+      // tinyobj::real_t green = attrib.colors[3*idx.vertex_index+1];
+      // tinyobj::real_t blue = attrib.colors[3*idx.vertex_index+2];
+    }
+    index_offset += fv;
+
+    // per-face material
+    shape.mesh.material_ids[f];
+  }
+}
+
+// OBJ materials and a last entry without colour for faces without one
+std::vector<cg::material> make_material_table(const std::vector<tinyobj::material_t>& materials)
+{
+  std::vector<cg::material> material_table;
+  for (const auto& obj_material : materials)
+  {
+    material_table.push_back({
+      float3{ obj_material.ambient[0], obj_material.ambient[1], obj_material.ambient[2] },
+      float3{ obj_material.diffuse[0], obj_material.diffuse[1], obj_material.diffuse[2] },
+      float3{ obj_material.emission[0], obj_material.emission[1], obj_material.emission[2] },
+    });
+  }
+  material_table.push_back({ float3(0.f), float3(0.f), float3(0.f) });
+  if (material_table.size() > UINT16_MAX)
+    THROW_ERROR("Too many materials for 16-bit material ids");
+  return material_table;
+}
+
+template<typename T>
+std::shared_ptr<cg::resource<T>> make_buffer(const std::vector<T>& items)
+{
+  auto buffer = std::make_shared<cg::resource<T>>(items.size());
+  std::copy(items.begin(), items.end(), buffer->begin());
+  return buffer;
+}
+
+constexpr uint32_t mesh_version = 1;
+constexpr uint64_t mesh_section_alignment = 64;
+
+// Followed by the material table, the unique vertices, their material ids,
+// the indices and shapes + 1 index offsets. Sections start at multiples of
+// 64 bytes; the file has the byte order of the machine that wrote it
+struct mesh_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t vertex_size;
+
+  uint64_t material_count;
+  uint64_t vertex_count;
+  uint64_t index_count;
+  uint64_t shape_count;
+
+  float bounds_min[3];
+  float bounds_extent[3];
+
+  uint64_t material_offset;
+  uint64_t vertex_offset;
+  uint64_t material_id_offset;
+  uint64_t index_offset;
+  uint64_t shape_offset;
+
+  // Triangles per shape of a mesh streamed from an OBJ file, zero otherwise
+  uint64_t batch_triangles;
+  uint8_t reserved[8];
+};
+static_assert(sizeof(mesh_header) % mesh_section_alignment == 0);
+
+uint64_t align_section(uint64_t offset)
+{
+  return (offset + mesh_section_alignment - 1) / mesh_section_alignment * mesh_section_alignment;
+}
+
+// A header with the counts and the section offsets; bounds are left empty
+mesh_header make_mesh_header(
+  uint64_t material_count,
+  uint64_t vertex_count,
+  uint64_t index_count,
+  uint64_t shape_count)
+{
+  mesh_header header = {};
+  std::memcpy(header.magic, "CGMESH", 7);
+  header.version = mesh_version;
+  header.vertex_size = sizeof(cg::vertex);
+  header.material_count = material_count;
+  header.vertex_count = vertex_count;
+  header.index_count = index_count;
+  header.shape_count = shape_count;
+
+  header.material_offset = align_section(sizeof(header));
+  header.vertex_offset =
+    align_section(header.material_offset + header.material_count * sizeof(cg::material));
+  header.material_id_offset =
+    align_section(header.vertex_offset + header.vertex_count * sizeof(cg::vertex));
+  header.index_offset =
+    align_section(header.material_id_offset + header.vertex_count * sizeof(uint16_t));
+  header.shape_offset =
+    align_section(header.index_offset + header.index_count * sizeof(uint32_t));
+  return header;
+}
+
+// Writes sections in file order with zeros up to the start of each one
+struct section_writer
+{
+  void write(uint64_t offset, const void* data, uint64_t size)
+  {
+    static const char padding[mesh_section_alignment] = {};
+    stream.write(padding, static_cast<std::streamsize>(offset - written));
+    stream.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+    written = offset + size;
+  }
+
+  std::ofstream& stream;
+  uint64_t written = 0;
+};
+
+std::filesystem::path temporary_file(const std::filesystem::path& path, const char* suffix)
+{
+  std::filesystem::path temporary_path = path;
+  temporary_path += suffix;
+  return temporary_path;
+}
+
+// A triangle takes about a kilobyte while it is parsed and welded
+size_t stream_batch_triangles(size_t memory_budget)
+{
+  return std::max<size_t>(memory_budget / 1024, 1);
+}
+
+// A streamed mesh is reused while it is newer than the OBJ file and its
+// material libraries and was split into batches of the same size
+bool is_streamed_mesh_current(
+  const std::filesystem::path& obj_path,
+  const std::filesystem::path& mesh_path,
+  size_t batch_triangles)
+{
+  std::error_code error;
+  auto mesh_time = std::filesystem::last_write_time(mesh_path, error);
+  if (error)
+    return false;
+  auto obj_time = std::filesystem::last_write_time(obj_path, error);
+  if (error || mesh_time < obj_time)
+    return false;
+  for (const auto& library : cg::world::obj_material_libraries(obj_path))
+  {
+    auto library_time = std::filesystem::last_write_time(library, error);
+    if (!error && mesh_time < library_time)
+      return false;
+  }
+
+  mesh_header header = {};
+  std::ifstream stream(mesh_path, std::ios::binary);
+  stream.read(reinterpret_cast<char*>(&header), sizeof(header));
+  return stream && std::memcmp(header.magic, "CGMESH", 7) == 0 &&
+         header.version == mesh_version && header.batch_triangles == batch_triangles;
+}
+
+// Converts an OBJ file to a binary mesh without holding the model in
+// memory: batches of batch_triangles are welded on their own and go
+// straight to the mesh file, or to scratch files for the sections that
+// come after the vertices. Every batch becomes a shape, so a renderer can
+// draw it and release its pages before the next one
+void stream_obj_to_mesh(
+  const std::filesystem::path& obj_path,
+  const std::filesystem::path& mesh_path,
+  size_t batch_triangles)
+{
+  PROFILE_ZONE("Stream OBJ to mesh");
+
+  cg::world::obj_stream obj;
+  if (!obj.open(obj_path))
+    THROW_ERROR("Can't read the model " + obj_path.string());
+
+  std::vector<cg::material> material_table = make_material_table(obj.get_materials());
+  uint16_t default_material_id = static_cast<uint16_t>(material_table.size() - 1);
+  mesh_header header = make_mesh_header(material_table.size(), 0, 0, 0);
+
+  std::filesystem::path temporary_path = temporary_file(mesh_path, ".tmp");
+  std::filesystem::path material_id_path = temporary_file(mesh_path, ".material_ids.tmp");
+  std::filesystem::path index_path = temporary_file(mesh_path, ".indices.tmp");
+  auto remove_scratch_files = [&]() {
+    std::error_code error;
+    std::filesystem::remove(material_id_path, error);
+    std::filesystem::remove(index_path, error);
+  };
+
+  // A failed conversion leaves no temporary files behind; the streams are
+  // closed by the time they are removed
+  try
+  {
+    std::vector<uint64_t> shape_offsets{ 0 };
+    {
+      std::ofstream stream(temporary_path, std::ios::binary | std::ios::trunc);
+      std::ofstream material_id_stream(material_id_path, std::ios::binary | std::ios::trunc);
+      std::ofstream index_stream(index_path, std::ios::binary | std::ios::trunc);
+      if (!stream || !material_id_stream || !index_stream)
+        THROW_ERROR("Can't write the mesh " + mesh_path.string());
+
+      section_writer writer{ stream };
+      writer.write(0, &header, sizeof(header));
+      writer.write(
+        header.material_offset, material_table.data(),
+        material_table.size() * sizeof(cg::material));
+      writer.write(header.vertex_offset, nullptr, 0);
+
+      float3 bounds_max(-FLT_MAX);
+      float3 bounds_min(FLT_MAX);
+      uint64_t vertex_count = 0;
+
+      tinyobj::attrib_t attrib;
+      tinyobj::shape_t shape;
+      while (obj.next_batch(batch_triangles, attrib, shape))
+      {
+        welded_mesh mesh;
+        weld_shape(mesh, attrib, shape, obj.get_materials(), default_material_id, nullptr);
+        if (vertex_count + mesh.vertices.size() > UINT32_MAX)
+          THROW_ERROR("Too many vertices for 32-bit indices in " + obj_path.string());
+
+        for (auto& index : mesh.indices)
+          index += static_cast<uint32_t>(vertex_count);
+        for (const auto& vertex : mesh.vertices)
+        {
+          bounds_min = min(bounds_min, float3{ vertex.x, vertex.y, vertex.z });
+          bounds_max = max(bounds_max, float3{ vertex.x, vertex.y, vertex.z });
+        }
+        writer.write(
+          writer.written, mesh.vertices.data(), mesh.vertices.size() * sizeof(cg::vertex));
+        material_id_stream.write(
+          reinterpret_cast<const char*>(mesh.material_ids.data()),
+          static_cast<std::streamsize>(mesh.material_ids.size() * sizeof(uint16_t)));
+        index_stream.write(
+          reinterpret_cast<const char*>(mesh.indices.data()),
+          static_cast<std::streamsize>(mesh.indices.size() * sizeof(uint32_t)));
+
+        vertex_count += mesh.vertices.size();
+        shape_offsets.push_back(shape_offsets.back() + mesh.indices.size());
+        obj.release_pages();
+      }
+
+      if (!material_id_stream || !index_stream)
+        THROW_ERROR("Can't write the mesh " + mesh_path.string());
+      material_id_stream.close();
+      index_stream.close();
+
+      // Offsets of the sections after the vertices follow from the counts
+      mesh_header final_header = make_mesh_header(
+        material_table.size(), vertex_count, shape_offsets.back(), shape_offsets.size() - 1);
+      final_header.batch_triangles = batch_triangles;
+      for (int i = 0; i < 3; i++)
+      {
+        final_header.bounds_min[i] = vertex_count ? bounds_min[i] : 0.f;
+        final_header.bounds_extent[i] = vertex_count ? bounds_max[i] - bounds_min[i] : 0.f;
+      }
+
+      // The scratch files are copied in blocks, so they are never read whole
+      auto copy_section = [&](uint64_t offset, const std::filesystem::path& path) {
+        std::ifstream input(path, std::ios::binary);
+        std::vector<char> block(1 << 20);
+        writer.write(offset, nullptr, 0);
+        while (input.read(block.data(), static_cast<std::streamsize>(block.size())) ||
+               input.gcount() > 0)
+          writer.write(writer.written, block.data(), static_cast<uint64_t>(input.gcount()));
+      };
+      copy_section(final_header.material_id_offset, material_id_path);
+      copy_section(final_header.index_offset, index_path);
+      writer.write(
+        final_header.shape_offset, shape_offsets.data(), shape_offsets.size() * sizeof(uint64_t));
+
+      stream.seekp(0);
+      stream.write(reinterpret_cast<const char*>(&final_header), sizeof(final_header));
+      if (!stream)
+        THROW_ERROR("Can't write the mesh " + mesh_path.string());
+    }
+    remove_scratch_files();
+
+    std::error_code error;
+    std::filesystem::rename(temporary_path, mesh_path, error);
+    if (error)
+      THROW_ERROR("Can't write the mesh " + mesh_path.string());
+  }
+  catch (...)
+  {
+    remove_scratch_files();
+    std::error_code error;
+    std::filesystem::remove(temporary_path, error);
+    throw;
+  }
+}
+} // namespace
+
+float2 cg::world::encode_octahedral(const float3& normal)
+{
+  float sum = std::abs(normal.x) + std::abs(normal.y) + std::abs(normal.z);
+  // Degenerate faces have no normal
+  if (!(sum > 0.f))
+    return float2{ 0.f, 0.f };
+
+  float2 encoded{ normal.x / sum, normal.y / sum };
+  if (normal.z < 0.f)
+  {
+    encoded = float2{
+      (1.f - std::abs(encoded.y)) * (encoded.x >= 0.f ? 1.f : -1.f),
+      (1.f - std::abs(encoded.x)) * (encoded.y >= 0.f ? 1.f : -1.f),
+    };
+  }
+  return encoded;
+}
+
+float3 cg::world::decode_octahedral(const float2& encoded)
+{
+  float3 normal{ encoded.x, encoded.y, 1.f - std::abs(encoded.x) - std::abs(encoded.y) };
+  float fold = std::max(-normal.z, 0.f);
+  normal.x += normal.x >= 0.f ? -fold : fold;
+  normal.y += normal.y >= 0.f ? -fold : fold;
+  return normalize(normal);
+}
+
 cg::world::model::model() {}
 
 cg::world::model::~model() {}
 
-void cg::world::model::load_obj(const std::filesystem::path& model_path)
+void cg::world::model::load(const std::filesystem::path& model_path)
+{
+  if (model_path.extension() == mesh_extension)
+    load_mesh(model_path);
+  else if (memory_budget > 0)
+    load_obj_streaming(model_path);
+  else
+    load_obj(model_path);
+}
+
+void cg::world::model::set_memory_budget(size_t bytes)
 {
-  tinyobj::ObjReaderConfig reader_config;
-  reader_config.mtl_search_path =
-    model_path.parent_path().string(); // Path to material files
-  reader_config.triangulate = true;
-  tinyobj::ObjReader reader;
-  reader.ParseFromFile(model_path.string(), reader_config);
+  memory_budget = bytes;
+}
 
-  auto& attrib = reader.GetAttrib();
-  auto& shapes = reader.GetShapes();
-  auto& materials = reader.GetMaterials();
+std::future<void> cg::world::model::load_async(
+  const std::filesystem::path& model_path,
+  bool in_stream_shapes
+)
+{
+  {
+    std::lock_guard lock(loading_mutex);
+    loading_async = true;
+    stream_shapes = in_stream_shapes;
+    loaded_shapes = 0;
+    // A failed load leaves no shapes behind
+    shape_index_offsets.assign(1, 0);
+  }
 
-  std::vector<size_t> per_shapes_ids(shapes.size());
-  for (size_t s = 0; s < shapes.size(); s++)
-    per_shapes_ids[s] = shapes[s].mesh.indices.size();
+  return std::async(std::launch::async, [this, model_path]() {
+    auto finish = [this]() {
+      {
+        std::lock_guard lock(loading_mutex);
+        loading_async = false;
+        stream_shapes = false;
+      }
+      shape_loaded.notify_all();
+    };
+
+    try
+    {
+      load(model_path);
+    }
+    catch (...)
+    {
+      finish();
+      throw;
+    }
+    finish();
+  });
+}
 
-  // Counters used to populate our buffers
-  size_t vertex_buffer_id = 0;
-  size_t per_shape_id = 0;
+std::optional<cg::resource_view<cg::vertex>>
+  cg::world::model::wait_for_shape(size_t shape) const
+{
+  std::unique_lock lock(loading_mutex);
+  shape_loaded.wait(
+    lock, [&]() { return (stream_shapes && loaded_shapes > shape) || !loading_async; });
+
+  if (shape + 1 >= shape_index_offsets.size())
+    return std::nullopt;
+  // Shapes that weren't streamed are expanded once the load is done
+  auto buffer = loading_async ? vertex_buffer : get_vertex_buffer();
+  return resource_view<vertex>(
+    buffer, shape_index_offsets[shape],
+    shape_index_offsets[shape + 1] - shape_index_offsets[shape]);
+}
+
+void cg::world::model::load_obj(const std::filesystem::path& model_path)
+{
+  PROFILE_ZONE("Load OBJ");
+
+  tinyobj::attrib_t attrib;
+  std::vector<tinyobj::shape_t> shapes;
+  std::vector<tinyobj::material_t> materials;
+  if (!parse_obj(model_path, attrib, shapes, materials))
+    THROW_ERROR("Can't read the model " + model_path.string());
 
   size_t vert_count = 0;
   for (size_t s = 0; s < shapes.size(); s++)
@@ -46,144 +582,526 @@ void cg::world::model::load_obj(const std::filesystem::path& model_path)
     }
   }
 
-  // The final data structures for our loaded model
-  vertex_buffer = std::make_shared<cg::resource<cg::vertex>>(vert_count);
-  per_shape_buffer.resize(shapes.size());
-
-  // Initialize per shape buffers
-  for (size_t s = 0; s < shapes.size(); s++)
+  // The expanded buffers of an older load are dropped. An async load
+  // expands the corners right away, so shapes can be used as they end
+  welded_mesh mesh;
+  mesh.indices.reserve(vert_count);
+  mesh.vertex_ids.reserve(vert_count);
   {
-    per_shape_buffer[s] =
-      std::make_shared<cg::resource<cg::vertex>>(per_shapes_ids[s]);
+    std::lock_guard lock(loading_mutex);
+    shape_index_offsets.assign(1, 0);
+    vertex_buffer =
+      stream_shapes ? std::make_shared<cg::resource<cg::vertex>>(vert_count) : nullptr;
   }
+  cg::vertex* streamed_corners = vertex_buffer ? vertex_buffer->begin() : nullptr;
+  compact_vertex_buffer = nullptr;
+  expanded_compact_buffer = nullptr;
+  mesh_file = nullptr;
+  meshlets.clear();
+  lods.clear();
+  lod_index_buffer = nullptr;
+
+  material_table = make_material_table(materials);
+  uint16_t default_material_id = static_cast<uint16_t>(material_table.size() - 1);
 
   // Loop over shapes
   for (size_t s = 0; s < shapes.size(); s++)
   {
-    // Reset per-shape ID
-    per_shape_id = 0;
-    // Loop over faces in a shape
-    size_t index_offset = 0;
-
-    for (size_t f = 0; f < shapes[s].mesh.num_face_vertices.size(); f++)
+    weld_shape(mesh, attrib, shapes[s], materials, default_material_id, streamed_corners);
     {
-      int fv = shapes[s].mesh.num_face_vertices[f];
+      std::lock_guard lock(loading_mutex);
+      shape_index_offsets.push_back(mesh.indices.size());
+      loaded_shapes = shape_index_offsets.size() - 1;
+    }
+    shape_loaded.notify_all();
+  }
 
-      // Computed normal of a face (if none is specified)
-      float3 normal;
-      // Compute normal for the face if there are no normals specified
-      // for the vertices.
-      if (shapes[s].mesh.indices[index_offset].normal_index < 0)
-      {
-        auto a_id = shapes[s].mesh.indices[index_offset + 0];
-        auto b_id = shapes[s].mesh.indices[index_offset + 1];
-        auto c_id = shapes[s].mesh.indices[index_offset + 2];
-
-        float3 a{ attrib.vertices[3 * a_id.vertex_index + 0],
-                  attrib.vertices[3 * a_id.vertex_index + 1],
-                  attrib.vertices[3 * a_id.vertex_index + 2] };
-        float3 b{ attrib.vertices[3 * b_id.vertex_index + 0],
-                  attrib.vertices[3 * b_id.vertex_index + 1],
-                  attrib.vertices[3 * b_id.vertex_index + 2] };
-        float3 c{ attrib.vertices[3 * c_id.vertex_index + 0],
-                  attrib.vertices[3 * c_id.vertex_index + 1],
-                  attrib.vertices[3 * c_id.vertex_index + 2] };
-
-        normal = normalize(cross(b - a, c - a));
-      }
+  indexed_vertex_buffer = make_buffer(mesh.vertices);
+  index_buffer = make_buffer(mesh.indices);
+  vertex_material_ids = make_buffer(mesh.material_ids);
 
-      // Loop over vertices in the face.
-      for (size_t v = 0; v < fv; v++)
-      {
-        // access to vertex
-        tinyobj::index_t idx = shapes[s].mesh.indices[index_offset + v];
-        tinyobj::real_t vx = attrib.vertices[3 * idx.vertex_index + 0];
-        tinyobj::real_t vy = attrib.vertices[3 * idx.vertex_index + 1];
-        tinyobj::real_t vz = attrib.vertices[3 * idx.vertex_index + 2];
-
-        tinyobj::real_t nx;
-        tinyobj::real_t ny;
-        tinyobj::real_t nz;
-        if (idx.normal_index > -1)
-        {
-          // If normal is supplied in the file, read it
-          nx = attrib.normals[3 * idx.normal_index + 0];
-          ny = attrib.normals[3 * idx.normal_index + 1];
-          nz = attrib.normals[3 * idx.normal_index + 2];
-        }
-        else
-        {
-          // If not, use predicted values
-          nx = normal[0];
-          ny = normal[1];
-          nz = normal[2];
-        }
+  float3 bounds_max(-FLT_MAX);
+  bounds_min = float3(FLT_MAX);
+  for (const auto& vertex : mesh.vertices)
+  {
+    bounds_min = min(bounds_min, float3{ vertex.x, vertex.y, vertex.z });
+    bounds_max = max(bounds_max, float3{ vertex.x, vertex.y, vertex.z });
+  }
+  bounds_extent = mesh.vertices.empty() ? float3(0.f) : bounds_max - bounds_min;
+}
 
-        // Read UVs
-        // tinyobj::real_t tx = attrib.texcoords[2 * idx.texcoord_index + 0];
-        // tinyobj::real_t ty = attrib.texcoords[2 * idx.texcoord_index + 1];
+void cg::world::model::save_mesh(const std::filesystem::path& mesh_path) const
+{
+  PROFILE_ZONE("Save mesh");
 
-        cg::vertex vertex = {};
+  if (!indexed_vertex_buffer || !index_buffer)
+    THROW_ERROR("There is no model to save");
 
-        vertex.x = vx;
-        vertex.y = vy;
-        vertex.z = vz;
+  mesh_header header = make_mesh_header(
+    material_table.size(), indexed_vertex_buffer->get_number_of_elements(),
+    index_buffer->get_number_of_elements(), shape_index_offsets.size() - 1);
+  for (int i = 0; i < 3; i++)
+  {
+    header.bounds_min[i] = bounds_min[i];
+    header.bounds_extent[i] = bounds_extent[i];
+  }
 
-        vertex.nx = nx;
-        vertex.ny = ny;
-        vertex.nz = nz;
+  std::vector<uint64_t> shape_offsets(shape_index_offsets.begin(), shape_index_offsets.end());
 
-        // Read material
-        if (materials.size() > 0)
-        {
-          auto material = materials[shapes[s].mesh.material_ids[f]];
-          vertex.ambient_r = material.ambient[0];
-          vertex.ambient_g = material.ambient[1];
-          vertex.ambient_b = material.ambient[2];
-
-          vertex.diffuse_r = material.diffuse[0];
-          vertex.diffuse_g = material.diffuse[1];
-          vertex.diffuse_b = material.diffuse[2];
-
-          vertex.emissive_r = material.emission[0];
-          vertex.emissive_g = material.emission[1];
-          vertex.emissive_b = material.emission[2];
-        }
-        else
-        {
-          // Do nothing
-        }
+  // Written next to the target first, like the checkpoints, so a converter
+  // that fails midway leaves the previous mesh intact
+  std::filesystem::path temporary_path = temporary_file(mesh_path, ".tmp");
+  {
+    std::ofstream stream(temporary_path, std::ios::binary | std::ios::trunc);
+    if (!stream)
+      THROW_ERROR("Can't write the mesh " + mesh_path.string());
 
-        // printf("adding 1\n");
-        vertex_buffer->item(vertex_buffer_id++) = vertex;
-        // printf("adding 2\n");
-        per_shape_buffer[s]->item(per_shape_id++) = vertex;
-        // printf("adding 3\n");
+    section_writer writer{ stream };
+    writer.write(0, &header, sizeof(header));
+    writer.write(
+      header.material_offset, material_table.data(),
+      header.material_count * sizeof(cg::material));
+    writer.write(
+      header.vertex_offset, indexed_vertex_buffer->get_data(),
+      header.vertex_count * sizeof(cg::vertex));
+    writer.write(
+      header.material_id_offset, vertex_material_ids->get_data(),
+      header.vertex_count * sizeof(uint16_t));
+    writer.write(
+      header.index_offset, index_buffer->get_data(), header.index_count * sizeof(uint32_t));
+    writer.write(
+      header.shape_offset, shape_offsets.data(), shape_offsets.size() * sizeof(uint64_t));
 
-        // Optional: vertex colors
-        // tinyobj::real_t red = attrib.colors[3*idx.vertex_index+0];
-        // tinyobj::real_t green = attrib.colors[3*idx.vertex_index+1];
-        // tinyobj::real_t blue = attrib.colors[3*idx.vertex_index+2];
-      }
-      index_offset += fv;
+    if (!stream)
+      THROW_ERROR("Can't write the mesh " + mesh_path.string());
+  }
+
+  std::error_code error;
+  std::filesystem::rename(temporary_path, mesh_path, error);
+  if (error)
+    THROW_ERROR("Can't write the mesh " + mesh_path.string());
+}
+
+void cg::world::model::load_mesh(const std::filesystem::path& mesh_path)
+{
+  PROFILE_ZONE("Load mesh");
+
+  auto file = std::make_shared<cg::utils::mapped_file>();
+  if (!file->open(mesh_path, true))
+    THROW_ERROR("Can't read the model " + mesh_path.string());
+
+  mesh_header header;
+  if (file->get_size() < sizeof(header))
+    THROW_ERROR("Not a mesh file: " + mesh_path.string());
+  std::memcpy(&header, file->get_data(), sizeof(header));
+  if (std::memcmp(header.magic, "CGMESH", 7) != 0)
+    THROW_ERROR("Not a mesh file: " + mesh_path.string());
+  if (header.version != mesh_version || header.vertex_size != sizeof(cg::vertex))
+    THROW_ERROR("Unsupported version of the mesh file " + mesh_path.string());
+
+  auto section = [&](uint64_t offset, uint64_t count, uint64_t item_size) {
+    if (offset % mesh_section_alignment != 0 || offset > file->get_size() ||
+        count > (file->get_size() - offset) / item_size)
+      THROW_ERROR("Mesh file is truncated: " + mesh_path.string());
+    return file->get_writable_data() + offset;
+  };
+
+  // The material table and shapes are small and copied
+  auto* materials = reinterpret_cast<const cg::material*>(
+    section(header.material_offset, header.material_count, sizeof(cg::material)));
+  material_table.assign(materials, materials + header.material_count);
+
+  auto* shape_offsets = reinterpret_cast<const uint64_t*>(
+    section(header.shape_offset, header.shape_count + 1, sizeof(uint64_t)));
+  std::vector<size_t> offsets(shape_offsets, shape_offsets + header.shape_count + 1);
+  if (offsets.front() != 0 || offsets.back() != header.index_count ||
+      !std::is_sorted(offsets.begin(), offsets.end()) ||
+      std::any_of(offsets.begin(), offsets.end(), [](size_t offset) { return offset % 3 != 0; }))
+    THROW_ERROR("Mesh file has wrong shape offsets: " + mesh_path.string());
+
+  // The mesh passes read vertices through the indices unchecked, so the
+  // indices are checked once here
+  auto* indices = reinterpret_cast<uint32_t*>(
+    section(header.index_offset, header.index_count, sizeof(uint32_t)));
+  if (std::any_of(indices, indices + header.index_count, [&](uint32_t index) {
+        return index >= header.vertex_count;
+      }))
+    THROW_ERROR("Mesh file has wrong indices: " + mesh_path.string());
+  {
+    std::lock_guard lock(loading_mutex);
+    shape_index_offsets = std::move(offsets);
+  }
+
+  // Vertices, their material ids and indices stay in the mapping, which
+  // the buffers keep open
+  vertex_material_ids = std::make_shared<cg::resource<uint16_t>>(
+    file,
+    reinterpret_cast<uint16_t*>(
+      section(header.material_id_offset, header.vertex_count, sizeof(uint16_t))),
+    header.vertex_count);
+  indexed_vertex_buffer = std::make_shared<cg::resource<cg::vertex>>(
+    file,
+    reinterpret_cast<cg::vertex*>(
+      section(header.vertex_offset, header.vertex_count, sizeof(cg::vertex))),
+    header.vertex_count);
+  index_buffer = std::make_shared<cg::resource<uint32_t>>(file, indices, header.index_count);
+
+  bounds_min = float3{ header.bounds_min[0], header.bounds_min[1], header.bounds_min[2] };
+  bounds_extent =
+    float3{ header.bounds_extent[0], header.bounds_extent[1], header.bounds_extent[2] };
+
+  mesh_file = file;
+  meshlets.clear();
+  lods.clear();
+  lod_index_buffer = nullptr;
+  vertex_buffer = nullptr;
+  compact_vertex_buffer = nullptr;
+  expanded_compact_buffer = nullptr;
+}
+
+void cg::world::model::load_obj_streaming(const std::filesystem::path& model_path)
+{
+  PROFILE_ZONE("Load OBJ streaming");
+
+  // The converted mesh is kept next to the model and reused while it is
+  // up to date
+  std::filesystem::path mesh_path = model_path;
+  mesh_path.replace_extension(std::string(".stream") + mesh_extension);
+
+  if (!std::filesystem::exists(model_path))
+    THROW_ERROR("Can't read the model " + model_path.string());
+  size_t batch_triangles = stream_batch_triangles(memory_budget);
+  if (!is_streamed_mesh_current(model_path, mesh_path, batch_triangles))
+    stream_obj_to_mesh(model_path, mesh_path, batch_triangles);
+
+  load_mesh(mesh_path);
+}
+
+void cg::world::model::release_shape(size_t shape) const
+{
+  if (!mesh_file || shape + 1 >= shape_index_offsets.size())
+    return;
+
+  size_t first = shape_index_offsets[shape];
+  size_t count = shape_index_offsets[shape + 1] - first;
+  if (count == 0)
+    return;
+
+  // Shapes of a streamed mesh have their own vertices, so the vertex range
+  // of a shape spans from its smallest to its largest index
+  const uint32_t* indices = index_buffer->begin() + first;
+  auto [min_index, max_index] = std::minmax_element(indices, indices + count);
+  auto file_offset = [&](const void* data) {
+    return static_cast<size_t>(static_cast<const uint8_t*>(data) - mesh_file->get_data());
+  };
+
+  mesh_file->release(file_offset(indices), count * sizeof(uint32_t));
+  mesh_file->release(
+    file_offset(indexed_vertex_buffer->begin() + *min_index),
+    (*max_index - *min_index + 1) * sizeof(cg::vertex));
+}
+
+void cg::world::model::optimize_mesh()
+{
+  PROFILE_ZONE("Optimize mesh");
+
+  if (!indexed_vertex_buffer || !index_buffer)
+    THROW_ERROR("There is no model to optimize");
+
+  std::vector<uint32_t> indices(index_buffer->begin(), index_buffer->end());
+  for (size_t s = 0; s + 1 < shape_index_offsets.size(); s++)
+  {
+    uint32_t* shape_indices = indices.data() + shape_index_offsets[s];
+    size_t count = shape_index_offsets[s + 1] - shape_index_offsets[s];
+    if (count == 0)
+      continue;
+
+    // Shapes are optimized in the range of vertices they use
+    auto [min_index, max_index] = std::minmax_element(shape_indices, shape_indices + count);
+    uint32_t first_vertex = *min_index;
+    size_t vertex_count = *max_index - first_vertex + 1;
+    for (size_t i = 0; i < count; i++)
+      shape_indices[i] -= first_vertex;
+    auto clusters = optimize_vertex_cache(shape_indices, count, vertex_count);
+    optimize_overdraw(
+      shape_indices, count, clusters, indexed_vertex_buffer->begin() + first_vertex);
+    for (size_t i = 0; i < count; i++)
+      shape_indices[i] += first_vertex;
+  }
+
+  auto remap = optimize_vertex_fetch(
+    indices.data(), indices.size(), indexed_vertex_buffer->get_number_of_elements());
+  std::vector<cg::vertex> vertices(remap.size());
+  std::vector<uint16_t> material_ids(remap.size());
+  for (size_t v = 0; v < remap.size(); v++)
+  {
+    vertices[remap[v]] = indexed_vertex_buffer->item(v);
+    material_ids[remap[v]] = vertex_material_ids->item(v);
+  }
+
+  // New buffers rather than writes to a mapped mesh, whose released pages
+  // would lose them
+  indexed_vertex_buffer = make_buffer(vertices);
+  index_buffer = make_buffer(indices);
+  vertex_material_ids = make_buffer(material_ids);
+  mesh_file = nullptr;
+  meshlets.clear();
+  lods.clear();
+  lod_index_buffer = nullptr;
+  vertex_buffer = nullptr;
+  compact_vertex_buffer = nullptr;
+  expanded_compact_buffer = nullptr;
+}
+
+void cg::world::model::build_meshlets(size_t max_vertices, size_t max_triangles)
+{
+  if (!indexed_vertex_buffer || !index_buffer)
+    THROW_ERROR("There is no model to build meshlets for");
 
-      // per-face material
-      shapes[s].mesh.material_ids[f];
+  std::vector<uint32_t> indices(index_buffer->begin(), index_buffer->end());
+  meshlets.clear();
+  for (size_t s = 0; s + 1 < shape_index_offsets.size(); s++)
+  {
+    uint32_t* shape_indices = indices.data() + shape_index_offsets[s];
+    size_t count = shape_index_offsets[s + 1] - shape_index_offsets[s];
+    if (count == 0)
+      continue;
+
+    auto [min_index, max_index] = std::minmax_element(shape_indices, shape_indices + count);
+    uint32_t first_vertex = *min_index;
+    size_t vertex_count = *max_index - first_vertex + 1;
+    for (size_t i = 0; i < count; i++)
+      shape_indices[i] -= first_vertex;
+    auto shape_meshlets = cg::world::build_meshlets(
+      shape_indices, count, indexed_vertex_buffer->begin() + first_vertex, vertex_count,
+      max_vertices, max_triangles);
+    for (size_t i = 0; i < count; i++)
+      shape_indices[i] += first_vertex;
+
+    for (auto& meshlet : shape_meshlets)
+    {
+      meshlet.index_offset += shape_index_offsets[s];
+      meshlet.shape = s;
+      meshlets.push_back(meshlet);
+    }
+  }
+
+  index_buffer = make_buffer(indices);
+  mesh_file = nullptr;
+  vertex_buffer = nullptr;
+  expanded_compact_buffer = nullptr;
+}
+
+const std::vector<cg::world::meshlet>& cg::world::model::get_meshlets() const
+{
+  return meshlets;
+}
+
+void cg::world::model::build_lods(size_t max_levels)
+{
+  PROFILE_ZONE("Build levels of detail");
+
+  if (!indexed_vertex_buffer || !index_buffer)
+    THROW_ERROR("There is no model to build levels of detail for");
+
+  std::vector<uint32_t> lod_indices;
+  lods.assign(shape_index_offsets.empty() ? 0 : shape_index_offsets.size() - 1, lod_chain{});
+  for (size_t s = 0; s < lods.size(); s++)
+  {
+    std::vector<uint32_t> level(
+      index_buffer->begin() + shape_index_offsets[s],
+      index_buffer->begin() + shape_index_offsets[s + 1]);
+    if (level.empty())
+      continue;
+
+    // Shapes are simplified in the range of vertices they use
+    auto [min_index, max_index] = std::minmax_element(level.begin(), level.end());
+    uint32_t first_vertex = *min_index;
+    size_t vertex_count = *max_index - first_vertex + 1;
+    const cg::vertex* vertices = indexed_vertex_buffer->begin() + first_vertex;
+
+    float3 bounds_min(FLT_MAX);
+    float3 bounds_max(-FLT_MAX);
+    for (auto& index : level)
+    {
+      index -= first_vertex;
+      float3 position{ vertices[index].x, vertices[index].y, vertices[index].z };
+      bounds_min = min(bounds_min, position);
+      bounds_max = max(bounds_max, position);
+    }
+    auto& chain = lods[s];
+    chain.center = (bounds_min + bounds_max) / 2.f;
+    chain.radius = 0.f;
+    for (uint32_t index : level)
+    {
+      float3 position{ vertices[index].x, vertices[index].y, vertices[index].z };
+      chain.radius = std::max(chain.radius, length(position - chain.center));
+    }
+
+    // Every level is simplified from the one before, so its errors add up
+    float error = 0.f;
+    for (size_t l = 0; l < max_levels; l++)
+    {
+      size_t previous_count = level.size();
+      float level_error = 0.f;
+      size_t count = simplify_mesh(
+        level.data(), level.size(), vertices, vertex_count, previous_count / 2, FLT_MAX,
+        &level_error);
+      // Levels that keep most triangles aren't worth their indices
+      if (count == 0 || count > previous_count * 3 / 4)
+        break;
+
+      level.resize(count);
+      error += level_error;
+      chain.levels.push_back({ lod_indices.size(), count, error });
+      for (uint32_t index : level)
+        lod_indices.push_back(index + first_vertex);
     }
   }
+
+  lod_index_buffer = make_buffer(lod_indices);
+}
+
+const std::vector<cg::world::lod_chain>& cg::world::model::get_lods() const
+{
+  return lods;
+}
+
+std::shared_ptr<cg::resource<uint32_t>> cg::world::model::get_lod_index_buffer() const
+{
+  return lod_index_buffer;
 }
 
 std::shared_ptr<cg::resource<cg::vertex>> cg::world::model::get_vertex_buffer() const
 {
+  if (!vertex_buffer && index_buffer)
+  {
+    vertex_buffer =
+      std::make_shared<cg::resource<cg::vertex>>(index_buffer->get_number_of_elements());
+    for (size_t i = 0; i < index_buffer->get_number_of_elements(); i++)
+      vertex_buffer->item(i) = indexed_vertex_buffer->item(index_buffer->item(i));
+  }
   return vertex_buffer;
 }
 
-std::vector<std::shared_ptr<cg::resource<cg::vertex>>>
-  cg::world::model::get_per_shape_buffer() const
+std::vector<cg::resource_view<cg::vertex>> cg::world::model::get_per_shape_buffer() const
+{
+  // Corners are expanded in index order, so shapes have the same ranges
+  auto expanded_buffer = get_vertex_buffer();
+  std::vector<resource_view<vertex>> per_shape_buffer;
+  for (size_t s = 0; s + 1 < shape_index_offsets.size(); s++)
+  {
+    per_shape_buffer.emplace_back(
+      expanded_buffer, shape_index_offsets[s],
+      shape_index_offsets[s + 1] - shape_index_offsets[s]);
+  }
+  return per_shape_buffer;
+}
+
+std::shared_ptr<cg::resource<cg::vertex>> cg::world::model::get_indexed_vertex_buffer() const
+{
+  return indexed_vertex_buffer;
+}
+
+std::shared_ptr<cg::resource<uint32_t>> cg::world::model::get_index_buffer() const
+{
+  return index_buffer;
+}
+
+std::vector<cg::resource_view<uint32_t>> cg::world::model::get_per_shape_index_buffer() const
+{
+  std::vector<resource_view<uint32_t>> per_shape_index_buffer;
+  for (size_t s = 0; s + 1 < shape_index_offsets.size(); s++)
+  {
+    per_shape_index_buffer.emplace_back(
+      index_buffer, shape_index_offsets[s],
+      shape_index_offsets[s + 1] - shape_index_offsets[s]);
+  }
+  return per_shape_index_buffer;
+}
+
+
+const std::vector<cg::material>& cg::world::model::get_materials() const
+{
+  return material_table;
+}
+
+std::shared_ptr<cg::resource<cg::compact_vertex>>
+  cg::world::model::get_compact_vertex_buffer() const
+{
+  if (!compact_vertex_buffer && indexed_vertex_buffer)
+  {
+    auto quantize_position = [](float value, float origin, float extent) {
+      if (extent <= 0.f)
+        return uint16_t{ 0 };
+      float steps = std::round((value - origin) / extent * 65535.f);
+      return static_cast<uint16_t>(std::clamp(steps, 0.f, 65535.f));
+    };
+    auto quantize_normal = [](float value) {
+      return static_cast<int16_t>(std::round(std::clamp(value, -1.f, 1.f) * 32767.f));
+    };
+
+    compact_vertex_buffer = std::make_shared<cg::resource<cg::compact_vertex>>(
+      indexed_vertex_buffer->get_number_of_elements());
+    for (size_t i = 0; i < indexed_vertex_buffer->get_number_of_elements(); i++)
+    {
+      const auto& vertex = indexed_vertex_buffer->item(i);
+      float2 normal = encode_octahedral(float3{ vertex.nx, vertex.ny, vertex.nz });
+
+      auto& compact = compact_vertex_buffer->item(i);
+      compact.x = quantize_position(vertex.x, bounds_min.x, bounds_extent.x);
+      compact.y = quantize_position(vertex.y, bounds_min.y, bounds_extent.y);
+      compact.z = quantize_position(vertex.z, bounds_min.z, bounds_extent.z);
+      compact.nx = quantize_normal(normal.x);
+      compact.ny = quantize_normal(normal.y);
+      compact.material_id = vertex_material_ids->item(i);
+      if (compact.material_id >= material_table.size())
+        THROW_ERROR("Vertex has a wrong material id");
+    }
+  }
+  return compact_vertex_buffer;
+}
+
+std::vector<cg::resource_view<cg::compact_vertex>>
+  cg::world::model::get_per_shape_compact_buffer() const
 {
+  auto indexed_buffer = get_compact_vertex_buffer();
+  if (!expanded_compact_buffer && index_buffer)
+  {
+    expanded_compact_buffer = std::make_shared<cg::resource<cg::compact_vertex>>(
+      index_buffer->get_number_of_elements());
+    for (size_t i = 0; i < index_buffer->get_number_of_elements(); i++)
+      expanded_compact_buffer->item(i) = indexed_buffer->item(index_buffer->item(i));
+  }
+
+  std::vector<resource_view<compact_vertex>> per_shape_buffer;
+  for (size_t s = 0; s + 1 < shape_index_offsets.size(); s++)
+  {
+    per_shape_buffer.emplace_back(
+      expanded_compact_buffer, shape_index_offsets[s],
+      shape_index_offsets[s + 1] - shape_index_offsets[s]);
+  }
   return per_shape_buffer;
 }
 
+cg::vertex cg::world::model::decode_vertex(const compact_vertex& compact) const
+{
+  float3 steps{
+    static_cast<float>(compact.x), static_cast<float>(compact.y), static_cast<float>(compact.z)
+  };
+  float3 position = bounds_min + steps / 65535.f * bounds_extent;
+  float3 normal = decode_octahedral(
+    float2{ static_cast<float>(compact.nx), static_cast<float>(compact.ny) } / 32767.f);
+  const material& material = material_table[compact.material_id];
+
+  return cg::vertex{
+    position.x, position.y, position.z,
+    normal.x, normal.y, normal.z,
+    material.ambient.x, material.ambient.y, material.ambient.z,
+    material.diffuse.x, material.diffuse.y, material.diffuse.z,
+    material.emissive.x, material.emissive.y, material.emissive.z,
+  };
+}
 
 const float4x4 cg::world::model::get_world_matrix() const
 {
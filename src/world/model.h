@@ -1,25 +1,123 @@
 #pragma once
 
 #include "resource.h"
+#include "world/mesh_optimizer.h"
 
+#include <condition_variable>
+#include <cstdint>
 #include <filesystem>
+#include <future>
 #include <linalg.h>
+#include <mutex>
+#include <optional>
 #include <tiny_obj_loader.h>
 
 
 using namespace linalg::aliases;
 
+namespace cg::utils
+{
+class mapped_file;
+} // namespace cg::utils
+
 namespace cg::world
 {
+// Unit normal folded onto the octahedron and unfolded onto [-1, 1]^2
+float2 encode_octahedral(const float3& normal);
+float3 decode_octahedral(const float2& encoded);
+
+// Extension of the binary meshes written by model::save_mesh
+constexpr char mesh_extension[] = ".cgmesh";
+
+// A coarser copy of the triangles of a shape in the level of detail index
+// buffer; error is how far its surface may lie from that of the shape
+struct lod_level
+{
+  size_t index_offset;
+  size_t index_count;
+  float error;
+};
+
+// Levels of detail of a shape, finest first, and a sphere around the shape
+struct lod_chain
+{
+  float3 center;
+  float radius;
+  std::vector<lod_level> levels;
+};
+
 class model
 {
 public:
   model();
   virtual ~model();
 
+  // A binary mesh by its extension, an OBJ file otherwise; streamed when
+  // there is a memory budget
+  void load(const std::filesystem::path& model_path);
   void load_obj(const std::filesystem::path& model_path);
+  // Bytes of the model that load keeps in memory at a time; 0 for no limit
+  void set_memory_budget(size_t bytes);
+  // Converts the OBJ file batch by batch to a binary mesh next to it, with
+  // one shape per batch, and maps that; the mesh is reused while it is
+  // newer than the OBJ file
+  void load_obj_streaming(const std::filesystem::path& model_path);
+  // Loads on a worker thread; the future rethrows loading errors and other
+  // calls wait for it. With stream_shapes, OBJ shapes are expanded as they
+  // are welded, so wait_for_shape hands them out while the rest still loads
+  std::future<void> load_async(
+    const std::filesystem::path& model_path, bool stream_shapes = true);
+  // Corners of a shape once it is loaded, with shape views like
+  // get_per_shape_buffer; nullopt when the model has fewer shapes
+  std::optional<resource_view<vertex>> wait_for_shape(size_t shape) const;
+  // The indexed buffers, materials and shapes in 64-byte aligned sections.
+  // Loading maps the file and uses the vertex and index sections in place;
+  // the mapping is copy-on-write, so writes to the buffers stay in memory
+  void save_mesh(const std::filesystem::path& mesh_path) const;
+  void load_mesh(const std::filesystem::path& mesh_path);
+  // One vertex per face corner; expanded from the indexed buffers on the
+  // first call, so models that are only drawn indexed never store them.
+  // Shapes are views into the same buffer
   std::shared_ptr<resource<vertex>> get_vertex_buffer() const;
-  std::vector<std::shared_ptr<resource<vertex>>> get_per_shape_buffer() const;
+  std::vector<resource_view<vertex>> get_per_shape_buffer() const;
+
+  // Unique vertices of all shapes and three indices per triangle
+  std::shared_ptr<resource<vertex>> get_indexed_vertex_buffer() const;
+  std::shared_ptr<resource<uint32_t>> get_index_buffer() const;
+  std::vector<resource_view<uint32_t>> get_per_shape_index_buffer() const;
+
+  // Colours of the OBJ materials; the last entry has no colour and is used
+  // when the OBJ has no materials
+  const std::vector<material>& get_materials() const;
+  // The indexed vertex buffer as compact vertices, built on the first call;
+  // per-shape views are expanded like get_per_shape_buffer
+  std::shared_ptr<resource<compact_vertex>> get_compact_vertex_buffer() const;
+  std::vector<resource_view<compact_vertex>> get_per_shape_compact_buffer() const;
+  vertex decode_vertex(const compact_vertex& compact) const;
+
+  // Drops the mapped pages of the indices and vertices of a shape after it
+  // is drawn; they are read again from the mesh file when used. Does
+  // nothing for models that aren't mapped
+  void release_shape(size_t shape) const;
+  // Reorders the triangles of every shape for the vertex cache and for
+  // overdraw, then the vertices in the order the triangles use them. The
+  // buffers of a mapped mesh are copied first, so releasing shapes stops
+  void optimize_mesh();
+  // Splits every shape into meshlets of neighbouring triangles and
+  // reorders the triangles of the shape so that each meshlet is a run of
+  // the index buffer; like optimize_mesh, releasing shapes stops
+  void build_meshlets(
+    size_t max_vertices = meshlet_max_vertices, size_t max_triangles = meshlet_max_triangles);
+  // Meshlets of all shapes in shape order; empty until they are built
+  const std::vector<meshlet>& get_meshlets() const;
+  // Simplifies every shape into up to max_levels levels of detail with
+  // about half the triangles of the level before each. The levels index the
+  // vertices of the shapes, so they are drawn with the same vertex buffer;
+  // optimize_mesh renumbers the vertices and drops them
+  void build_lods(size_t max_levels = 6);
+  // Level chains of all shapes; empty until they are built
+  const std::vector<lod_chain>& get_lods() const;
+  std::shared_ptr<resource<uint32_t>> get_lod_index_buffer() const;
 
   const float4x4 get_world_matrix() const;
 
@@ -28,7 +126,31 @@ protected:
   std::vector<tinyobj::shape_t> shapes;
   std::vector<tinyobj::material_t> materials;
 
-  std::shared_ptr<resource<vertex>> vertex_buffer;
-  std::vector<std::shared_ptr<resource<vertex>>> per_shape_buffer;
+  std::shared_ptr<resource<vertex>> indexed_vertex_buffer;
+  std::shared_ptr<resource<uint32_t>> index_buffer;
+  std::vector<size_t> shape_index_offsets;
+  std::vector<meshlet> meshlets;
+  std::vector<lod_chain> lods;
+  std::shared_ptr<resource<uint32_t>> lod_index_buffer;
+
+  std::vector<material> material_table;
+  std::shared_ptr<resource<uint16_t>> vertex_material_ids;
+  float3 bounds_min;
+  float3 bounds_extent;
+
+  mutable std::shared_ptr<resource<vertex>> vertex_buffer;
+
+  // The binary mesh the buffers live in, if they were mapped
+  std::shared_ptr<utils::mapped_file> mesh_file;
+  size_t memory_budget = 0;
+
+  // Guards the shape offsets and the loaded shape count of load_async
+  mutable std::mutex loading_mutex;
+  mutable std::condition_variable shape_loaded;
+  bool loading_async = false;
+  bool stream_shapes = false;
+  size_t loaded_shapes = 0;
+  mutable std::shared_ptr<resource<compact_vertex>> compact_vertex_buffer;
+  mutable std::shared_ptr<resource<compact_vertex>> expanded_compact_buffer;
 };
 } // namespace cg::world
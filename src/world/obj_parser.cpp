@@ -0,0 +1,636 @@
+#include "obj_parser.h"
+
+#include "utils/profiler.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <omp.h>
+#include <string>
+#include <string_view>
+
+
+namespace
+{
+// Indices of a corner that count back from the end of the chunk's own
+// arrays; they need the sizes of the previous chunks added
+constexpr uint8_t relative_vertex = 1;
+constexpr uint8_t relative_texcoord = 2;
+constexpr uint8_t relative_normal = 4;
+
+// Shape start or material change before the given triangle of a chunk
+struct obj_event
+{
+  size_t triangle;
+  std::string name;
+};
+
+struct obj_chunk
+{
+  std::vector<tinyobj::real_t> vertices;
+  std::vector<tinyobj::real_t> normals;
+  std::vector<tinyobj::real_t> texcoords;
+  std::vector<tinyobj::index_t> indices;
+  std::vector<std::pair<size_t, uint8_t>> relative_corners;
+
+  std::vector<obj_event> shape_starts;
+  std::vector<obj_event> material_changes;
+  std::vector<std::string> material_libraries;
+};
+
+bool is_blank(char c)
+{
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+const char* skip_blanks(const char* p, const char* end)
+{
+  while (p < end && is_blank(*p))
+    p++;
+  return p;
+}
+
+std::string_view next_token(const char*& p, const char* end)
+{
+  p = skip_blanks(p, end);
+  const char* begin = p;
+  while (p < end && !is_blank(*p))
+    p++;
+  return std::string_view(begin, p - begin);
+}
+
+std::string_view rest_of_line(const char* p, const char* end)
+{
+  p = skip_blanks(p, end);
+  while (end > p && is_blank(end[-1]))
+    end--;
+  return std::string_view(p, end - p);
+}
+
+// from_chars rounds like strtof without its locale and allocation costs;
+// a token it can't read is skipped and gives 0
+tinyobj::real_t parse_real(const char*& p, const char* end)
+{
+  p = skip_blanks(p, end);
+  if (p < end && *p == '+')
+    p++;
+  tinyobj::real_t value = 0;
+  p = std::from_chars(p, end, value).ptr;
+  while (p < end && !is_blank(*p))
+    p++;
+  return value;
+}
+
+// A v, v/t, v//n or v/t/n corner; false when the vertex index is missing
+bool parse_corner(
+  const char*& p,
+  const char* end,
+  const int counts[3],
+  tinyobj::index_t& corner,
+  uint8_t& relative)
+{
+  int values[3] = { 0, 0, 0 };
+  for (int k = 0; k < 3 && p < end && !is_blank(*p); k++)
+  {
+    if (*p != '/')
+    {
+      if (*p == '+')
+        p++;
+      p = std::from_chars(p, end, values[k]).ptr;
+    }
+    if (p < end && *p == '/')
+      p++;
+    else
+      break;
+  }
+  while (p < end && !is_blank(*p))
+    p++;
+
+  relative = 0;
+  auto resolve = [&](int value, int count, uint8_t bit) {
+    if (value < 0)
+      relative |= bit;
+    return value > 0 ? value - 1 : value < 0 ? count + value : -1;
+  };
+  corner.vertex_index = resolve(values[0], counts[0], relative_vertex);
+  corner.texcoord_index = resolve(values[1], counts[1], relative_texcoord);
+  corner.normal_index = resolve(values[2], counts[2], relative_normal);
+  return values[0] != 0;
+}
+
+void parse_chunk(const char* p, const char* end, obj_chunk& chunk)
+{
+  std::vector<tinyobj::index_t> face;
+  std::vector<uint8_t> face_relative;
+
+  while (p < end)
+  {
+    const char* line_end = static_cast<const char*>(std::memchr(p, '\n', end - p));
+    if (!line_end)
+      line_end = end;
+
+    const char* q = p;
+    std::string_view keyword = next_token(q, line_end);
+    if (keyword == "v")
+    {
+      for (int i = 0; i < 3; i++)
+        chunk.vertices.push_back(parse_real(q, line_end));
+    }
+    else if (keyword == "vn")
+    {
+      for (int i = 0; i < 3; i++)
+        chunk.normals.push_back(parse_real(q, line_end));
+    }
+    else if (keyword == "vt")
+    {
+      for (int i = 0; i < 2; i++)
+        chunk.texcoords.push_back(parse_real(q, line_end));
+    }
+    else if (keyword == "f")
+    {
+      int counts[3] = {
+        static_cast<int>(chunk.vertices.size() / 3),
+        static_cast<int>(chunk.texcoords.size() / 2),
+        static_cast<int>(chunk.normals.size() / 3),
+      };
+
+      face.clear();
+      face_relative.clear();
+      bool valid = true;
+      for (q = skip_blanks(q, line_end); q < line_end; q = skip_blanks(q, line_end))
+      {
+        tinyobj::index_t corner;
+        uint8_t relative;
+        valid &= parse_corner(q, line_end, counts, corner, relative);
+        face.push_back(corner);
+        face_relative.push_back(relative);
+      }
+
+      // Fan triangulation, like the triangulating tinyobj reader
+      for (size_t i = 1; valid && i + 1 < face.size(); i++)
+      {
+        for (size_t k : { size_t{ 0 }, i, i + 1 })
+        {
+          if (face_relative[k])
+            chunk.relative_corners.emplace_back(chunk.indices.size(), face_relative[k]);
+          chunk.indices.push_back(face[k]);
+        }
+      }
+    }
+    else if (keyword == "o" || keyword == "g")
+    {
+      chunk.shape_starts.push_back(
+        { chunk.indices.size() / 3, std::string(rest_of_line(q, line_end)) });
+    }
+    else if (keyword == "usemtl")
+    {
+      chunk.material_changes.push_back(
+        { chunk.indices.size() / 3, std::string(rest_of_line(q, line_end)) });
+    }
+    else if (keyword == "mtllib")
+    {
+      for (auto name = next_token(q, line_end); !name.empty(); name = next_token(q, line_end))
+        chunk.material_libraries.emplace_back(name);
+    }
+
+    p = line_end + 1;
+  }
+}
+
+// Libraries are read once, from the folder of the model
+void load_material_library(
+  const std::filesystem::path& model_path,
+  const std::string& library,
+  std::vector<std::string>& loaded_libraries,
+  std::map<std::string, int>& material_map,
+  std::vector<tinyobj::material_t>& materials)
+{
+  if (std::find(loaded_libraries.begin(), loaded_libraries.end(), library) !=
+      loaded_libraries.end())
+    return;
+  loaded_libraries.push_back(library);
+
+  std::ifstream stream(model_path.parent_path() / library);
+  if (!stream)
+    return;
+  std::string warning;
+  std::string error;
+  tinyobj::LoadMtl(&material_map, &materials, &stream, &warning, &error);
+}
+
+std::filesystem::path scratch_file(const std::filesystem::path& model_path, const char* name)
+{
+  std::filesystem::path path = model_path;
+  path += ".";
+  path += name;
+  path += ".tmp";
+  return path;
+}
+} // namespace
+
+bool cg::world::parse_obj(
+  const std::filesystem::path& path,
+  tinyobj::attrib_t& attrib,
+  std::vector<tinyobj::shape_t>& shapes,
+  std::vector<tinyobj::material_t>& materials
+)
+{
+  PROFILE_ZONE("Parse OBJ");
+
+  cg::utils::mapped_file file;
+  if (!file.open(path))
+    return false;
+
+  attrib = tinyobj::attrib_t();
+  shapes.clear();
+  materials.clear();
+
+  // Chunks of a megabyte or more, several per thread so that the dense and
+  // sparse parts of the file even out
+  const char* data = reinterpret_cast<const char*>(file.get_data());
+  const char* data_end = data + file.get_size();
+  size_t chunk_count = std::clamp<size_t>(
+    file.get_size() >> 20, 1, 8 * static_cast<size_t>(omp_get_max_threads()));
+
+  std::vector<const char*> chunk_bounds(chunk_count + 1, data_end);
+  chunk_bounds[0] = data;
+  for (size_t i = 1; i < chunk_count; i++)
+  {
+    const char* split = std::max(data + file.get_size() / chunk_count * i, chunk_bounds[i - 1]);
+    const char* line_end = static_cast<const char*>(std::memchr(split, '\n', data_end - split));
+    chunk_bounds[i] = line_end ? line_end + 1 : data_end;
+  }
+
+  std::vector<obj_chunk> chunks(chunk_count);
+  #pragma omp parallel for schedule(dynamic)
+  for (int i = 0; i < static_cast<int>(chunk_count); i++)
+    parse_chunk(chunk_bounds[i], chunk_bounds[i + 1], chunks[i]);
+
+  struct chunk_offsets
+  {
+    size_t vertices;
+    size_t normals;
+    size_t texcoords;
+    size_t indices;
+  };
+  std::vector<chunk_offsets> offsets(chunk_count + 1, { 0, 0, 0, 0 });
+  for (size_t i = 0; i < chunk_count; i++)
+  {
+    offsets[i + 1] = {
+      offsets[i].vertices + chunks[i].vertices.size(),
+      offsets[i].normals + chunks[i].normals.size(),
+      offsets[i].texcoords + chunks[i].texcoords.size(),
+      offsets[i].indices + chunks[i].indices.size(),
+    };
+  }
+
+  attrib.vertices.resize(offsets.back().vertices);
+  attrib.normals.resize(offsets.back().normals);
+  attrib.texcoords.resize(offsets.back().texcoords);
+  std::vector<tinyobj::index_t> indices(offsets.back().indices);
+
+  #pragma omp parallel for schedule(dynamic)
+  for (int i = 0; i < static_cast<int>(chunk_count); i++)
+  {
+    const obj_chunk& chunk = chunks[i];
+    std::copy(chunk.vertices.begin(), chunk.vertices.end(), attrib.vertices.begin() + offsets[i].vertices);
+    std::copy(chunk.normals.begin(), chunk.normals.end(), attrib.normals.begin() + offsets[i].normals);
+    std::copy(chunk.texcoords.begin(), chunk.texcoords.end(), attrib.texcoords.begin() + offsets[i].texcoords);
+    std::copy(chunk.indices.begin(), chunk.indices.end(), indices.begin() + offsets[i].indices);
+
+    for (auto [corner, relative] : chunk.relative_corners)
+    {
+      auto& index = indices[offsets[i].indices + corner];
+      if (relative & relative_vertex)
+        index.vertex_index += static_cast<int>(offsets[i].vertices / 3);
+      if (relative & relative_texcoord)
+        index.texcoord_index += static_cast<int>(offsets[i].texcoords / 2);
+      if (relative & relative_normal)
+        index.normal_index += static_cast<int>(offsets[i].normals / 3);
+    }
+  }
+
+  std::map<std::string, int> material_map;
+  std::vector<std::string> material_libraries;
+  for (const auto& chunk : chunks)
+  {
+    for (const auto& library : chunk.material_libraries)
+      load_material_library(path, library, material_libraries, material_map, materials);
+  }
+
+  // Materials and shapes carry over chunk bounds, so their events are
+  // replayed in file order
+  size_t triangle_count = indices.size() / 3;
+  std::vector<int> material_ids(triangle_count);
+  std::vector<obj_event> shape_starts;
+  int material_id = -1;
+  size_t material_begin = 0;
+  for (size_t i = 0; i < chunk_count; i++)
+  {
+    size_t first_triangle = offsets[i].indices / 3;
+    for (const auto& change : chunks[i].material_changes)
+    {
+      size_t triangle = first_triangle + change.triangle;
+      std::fill(material_ids.begin() + material_begin, material_ids.begin() + triangle, material_id);
+      material_begin = triangle;
+
+      auto found = material_map.find(change.name);
+      material_id = found != material_map.end() ? found->second : -1;
+    }
+    for (const auto& start : chunks[i].shape_starts)
+      shape_starts.push_back({ first_triangle + start.triangle, start.name });
+  }
+  std::fill(material_ids.begin() + material_begin, material_ids.end(), material_id);
+
+  // Faces whose indices fall outside the attributes, such as a relative index
+  // before the first vertex, are dropped like in the streaming reader
+  const int vertex_count = static_cast<int>(attrib.vertices.size() / 3);
+  const int normal_count = static_cast<int>(attrib.normals.size() / 3);
+  const int texcoord_count = static_cast<int>(attrib.texcoords.size() / 2);
+  auto valid_corner = [&](const tinyobj::index_t& index) {
+    return index.vertex_index >= 0 && index.vertex_index < vertex_count &&
+           index.normal_index >= -1 && index.normal_index < normal_count &&
+           index.texcoord_index >= -1 && index.texcoord_index < texcoord_count;
+  };
+  std::vector<size_t> kept_before(triangle_count + 1);
+  size_t kept = 0;
+  for (size_t t = 0; t < triangle_count; t++)
+  {
+    kept_before[t] = kept;
+    if (!valid_corner(indices[3 * t]) || !valid_corner(indices[3 * t + 1]) ||
+        !valid_corner(indices[3 * t + 2]))
+      continue;
+    std::copy(indices.begin() + 3 * t, indices.begin() + 3 * t + 3, indices.begin() + 3 * kept);
+    material_ids[kept++] = material_ids[t];
+  }
+  kept_before[triangle_count] = kept;
+  indices.resize(3 * kept);
+  material_ids.resize(kept);
+  for (auto& start : shape_starts)
+    start.triangle = kept_before[start.triangle];
+  triangle_count = kept;
+
+  // A shape without faces only names the next one
+  std::string shape_name;
+  size_t shape_begin = 0;
+  auto add_shape = [&](size_t shape_end) {
+    if (shape_end == shape_begin)
+      return;
+    tinyobj::shape_t shape;
+    shape.name = shape_name;
+    shape.mesh.indices.assign(indices.begin() + 3 * shape_begin, indices.begin() + 3 * shape_end);
+    shape.mesh.num_face_vertices.assign(shape_end - shape_begin, 3);
+    shape.mesh.material_ids.assign(
+      material_ids.begin() + shape_begin, material_ids.begin() + shape_end);
+    shapes.push_back(std::move(shape));
+    shape_begin = shape_end;
+  };
+  for (const auto& start : shape_starts)
+  {
+    add_shape(start.triangle);
+    shape_name = start.name;
+  }
+  add_shape(triangle_count);
+
+  return true;
+}
+
+std::vector<std::filesystem::path> cg::world::obj_material_libraries(
+  const std::filesystem::path& path)
+{
+  std::vector<std::filesystem::path> libraries;
+  utils::mapped_file file;
+  if (!file.open(path))
+    return libraries;
+
+  // Only the mtllib lines are read, so the rest of the file is skipped by
+  // searching for the keyword
+  std::string_view text(reinterpret_cast<const char*>(file.get_data()), file.get_size());
+  for (size_t found = text.find("mtllib"); found != std::string_view::npos;
+       found = text.find("mtllib", found + 1))
+  {
+    if (found > 0 && text[found - 1] != '\n')
+      continue;
+    const char* q = text.data() + found;
+    const char* line_end = static_cast<const char*>(
+      std::memchr(q, '\n', text.size() - found));
+    if (!line_end)
+      line_end = text.data() + text.size();
+    if (next_token(q, line_end) != "mtllib")
+      continue;
+    for (auto name = next_token(q, line_end); !name.empty(); name = next_token(q, line_end))
+      libraries.push_back(path.parent_path() / std::string(name));
+  }
+  return libraries;
+}
+
+cg::world::obj_stream::~obj_stream()
+{
+  close();
+}
+
+bool cg::world::obj_stream::open(const std::filesystem::path& path)
+{
+  PROFILE_ZONE("Read OBJ attributes");
+
+  close();
+  if (!file.open(path))
+    return false;
+  scratch_path = path;
+
+  // The attributes go out through small buffers, so memory doesn't grow
+  // with the file
+  {
+    std::ofstream position_stream(
+      scratch_file(path, "positions"), std::ios::binary | std::ios::trunc);
+    std::ofstream normal_stream(scratch_file(path, "normals"), std::ios::binary | std::ios::trunc);
+    std::vector<tinyobj::real_t> position_buffer;
+    std::vector<tinyobj::real_t> normal_buffer;
+    auto flush = [](std::ofstream& stream, std::vector<tinyobj::real_t>& buffer) {
+      stream.write(
+        reinterpret_cast<const char*>(buffer.data()),
+        static_cast<std::streamsize>(buffer.size() * sizeof(tinyobj::real_t)));
+      buffer.clear();
+    };
+    constexpr size_t buffer_size = 1 << 16;
+
+    std::vector<std::string> material_libraries;
+    const char* data = reinterpret_cast<const char*>(file.get_data());
+    const char* end = data + file.get_size();
+    for (const char* p = data; p < end;)
+    {
+      const char* line_end = static_cast<const char*>(std::memchr(p, '\n', end - p));
+      if (!line_end)
+        line_end = end;
+
+      const char* q = p;
+      std::string_view keyword = next_token(q, line_end);
+      if (keyword == "v")
+      {
+        for (int i = 0; i < 3; i++)
+          position_buffer.push_back(parse_real(q, line_end));
+        if (position_buffer.size() >= buffer_size)
+          flush(position_stream, position_buffer);
+      }
+      else if (keyword == "vn")
+      {
+        for (int i = 0; i < 3; i++)
+          normal_buffer.push_back(parse_real(q, line_end));
+        if (normal_buffer.size() >= buffer_size)
+          flush(normal_stream, normal_buffer);
+      }
+      else if (keyword == "mtllib")
+      {
+        for (auto name = next_token(q, line_end); !name.empty(); name = next_token(q, line_end))
+          load_material_library(path, std::string(name), material_libraries, material_map, materials);
+      }
+
+      p = line_end + 1;
+    }
+    flush(position_stream, position_buffer);
+    flush(normal_stream, normal_buffer);
+    file.release(0, file.get_size());
+
+    if (!position_stream || !normal_stream)
+    {
+      close();
+      return false;
+    }
+  }
+
+  if (!positions.open(scratch_file(path, "positions")) ||
+      !normals.open(scratch_file(path, "normals")))
+  {
+    close();
+    return false;
+  }
+  return true;
+}
+
+void cg::world::obj_stream::close()
+{
+  file.close();
+  positions.close();
+  normals.close();
+
+  if (!scratch_path.empty())
+  {
+    std::error_code error;
+    std::filesystem::remove(scratch_file(scratch_path, "positions"), error);
+    std::filesystem::remove(scratch_file(scratch_path, "normals"), error);
+    scratch_path.clear();
+  }
+
+  materials.clear();
+  material_map.clear();
+  read_offset = 0;
+  read_vertices = 0;
+  read_normals = 0;
+  material_id = -1;
+  shape_name.clear();
+}
+
+const std::vector<tinyobj::material_t>& cg::world::obj_stream::get_materials() const
+{
+  return materials;
+}
+
+bool cg::world::obj_stream::next_batch(
+  size_t max_triangles,
+  tinyobj::attrib_t& attrib,
+  tinyobj::shape_t& shape
+)
+{
+  attrib = tinyobj::attrib_t();
+  shape = tinyobj::shape_t();
+
+  const char* data = reinterpret_cast<const char*>(file.get_data());
+  const char* end = data + file.get_size();
+  auto* position_data = reinterpret_cast<const tinyobj::real_t*>(positions.get_data());
+  auto* normal_data = reinterpret_cast<const tinyobj::real_t*>(normals.get_data());
+  int position_count = static_cast<int>(positions.get_size() / (3 * sizeof(tinyobj::real_t)));
+  int normal_count = static_cast<int>(normals.get_size() / (3 * sizeof(tinyobj::real_t)));
+
+  std::vector<tinyobj::index_t> face;
+  while (read_offset < file.get_size() && shape.mesh.material_ids.size() < max_triangles)
+  {
+    const char* p = data + read_offset;
+    const char* line_end = static_cast<const char*>(std::memchr(p, '\n', end - p));
+    if (!line_end)
+      line_end = end;
+
+    const char* q = p;
+    std::string_view keyword = next_token(q, line_end);
+    if (keyword == "v")
+    {
+      read_vertices++;
+    }
+    else if (keyword == "vn")
+    {
+      read_normals++;
+    }
+    else if (keyword == "f")
+    {
+      // Corners count back from the attributes read up to this line
+      int counts[3] = { read_vertices, 0, read_normals };
+      face.clear();
+      bool valid = true;
+      for (q = skip_blanks(q, line_end); q < line_end; q = skip_blanks(q, line_end))
+      {
+        tinyobj::index_t corner;
+        uint8_t relative;
+        valid &= parse_corner(q, line_end, counts, corner, relative);
+        valid &= corner.vertex_index >= 0 && corner.vertex_index < position_count;
+        face.push_back(corner);
+      }
+
+      for (size_t i = 1; valid && i + 1 < face.size(); i++)
+      {
+        for (size_t k : { size_t{ 0 }, i, i + 1 })
+        {
+          tinyobj::index_t corner = { static_cast<int>(attrib.vertices.size() / 3), -1, -1 };
+          attrib.vertices.insert(
+            attrib.vertices.end(), position_data + 3 * face[k].vertex_index,
+            position_data + 3 * face[k].vertex_index + 3);
+          if (face[k].normal_index >= 0 && face[k].normal_index < normal_count)
+          {
+            corner.normal_index = static_cast<int>(attrib.normals.size() / 3);
+            attrib.normals.insert(
+              attrib.normals.end(), normal_data + 3 * face[k].normal_index,
+              normal_data + 3 * face[k].normal_index + 3);
+          }
+          shape.mesh.indices.push_back(corner);
+        }
+        shape.mesh.num_face_vertices.push_back(3);
+        shape.mesh.material_ids.push_back(material_id);
+      }
+    }
+    else if (keyword == "o" || keyword == "g")
+    {
+      // The next shape starts a new batch, which reads this line again
+      if (!shape.mesh.indices.empty())
+        break;
+      shape_name = std::string(rest_of_line(q, line_end));
+    }
+    else if (keyword == "usemtl")
+    {
+      auto found = material_map.find(std::string(rest_of_line(q, line_end)));
+      material_id = found != material_map.end() ? found->second : -1;
+    }
+
+    read_offset = std::min<size_t>(line_end - data + 1, file.get_size());
+  }
+
+  shape.name = shape_name;
+  return !shape.mesh.indices.empty();
+}
+
+void cg::world::obj_stream::release_pages() const
+{
+  file.release(0, read_offset);
+  positions.release(0, positions.get_size());
+  normals.release(0, normals.get_size());
+}
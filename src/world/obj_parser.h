@@ -0,0 +1,67 @@
+#pragma once
+
+#include "utils/mapped_file.h"
+
+#include <filesystem>
+#include <map>
+#include <string>
+#include <tiny_obj_loader.h>
+#include <vector>
+
+
+namespace cg::world
+{
+// Parses a memory-mapped OBJ file in chunks split at line ends, one chunk
+// per task, and merges the chunks with global index offsets. Polygons are
+// triangulated as fans, o and g lines start shapes, and the mtllib files
+// are read from the folder of the model. False when the file can't be read
+bool parse_obj(
+  const std::filesystem::path& path,
+  tinyobj::attrib_t& attrib,
+  std::vector<tinyobj::shape_t>& shapes,
+  std::vector<tinyobj::material_t>& materials
+);
+
+// Paths of the material libraries named by the mtllib lines of an OBJ file,
+// in the folder of the model. Empty when the file can't be read
+std::vector<std::filesystem::path> obj_material_libraries(const std::filesystem::path& path);
+
+// Reads an OBJ file that doesn't fit into memory in batches of triangles.
+// Opening moves the positions and normals to scratch files next to the
+// model, so that a batch can fetch its corners from anywhere in the file
+class obj_stream
+{
+public:
+  obj_stream() = default;
+  ~obj_stream();
+
+  obj_stream(const obj_stream&) = delete;
+  obj_stream& operator=(const obj_stream&) = delete;
+
+  // False when the file can't be read or the scratch files can't be written
+  bool open(const std::filesystem::path& path);
+  void close();
+
+  const std::vector<tinyobj::material_t>& get_materials() const;
+  // Up to about max_triangles of one shape, in file order; attrib has the
+  // positions and normals of their corners only. False at the end of file
+  bool next_batch(size_t max_triangles, tinyobj::attrib_t& attrib, tinyobj::shape_t& shape);
+  // Drops the pages of the file and the scratch files read so far
+  void release_pages() const;
+
+protected:
+  utils::mapped_file file;
+  utils::mapped_file positions;
+  utils::mapped_file normals;
+  std::filesystem::path scratch_path;
+
+  std::vector<tinyobj::material_t> materials;
+  std::map<std::string, int> material_map;
+
+  size_t read_offset = 0;
+  int read_vertices = 0;
+  int read_normals = 0;
+  int material_id = -1;
+  std::string shape_name;
+};
+} // namespace cg::world
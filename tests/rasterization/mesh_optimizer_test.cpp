@@ -0,0 +1,340 @@
+#define CATCH_CONFIG_MAIN
+
+#include "resource.h"
+#include "world/mesh_optimizer.h"
+#include "world/model.h"
+
+#include <algorithm>
+#include <array>
+#include <catch.hpp>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+#include <random>
+
+
+// A sphere of rings and segments with its triangles facing outwards
+static void make_sphere(
+  float radius, std::vector<cg::vertex>& vertices, std::vector<uint32_t>& indices)
+{
+  const size_t segments = 32;
+  const size_t rings = 16;
+  uint32_t first = static_cast<uint32_t>(vertices.size());
+  for (size_t ring = 0; ring <= rings; ring++)
+  {
+    for (size_t segment = 0; segment <= segments; segment++)
+    {
+      float theta = 3.14159265f * ring / rings;
+      float phi = 2.f * 3.14159265f * segment / segments;
+      cg::vertex vertex = {};
+      vertex.nx = std::sin(theta) * std::cos(phi);
+      vertex.ny = std::cos(theta);
+      vertex.nz = std::sin(theta) * std::sin(phi);
+      vertex.x = radius * vertex.nx;
+      vertex.y = radius * vertex.ny;
+      vertex.z = radius * vertex.nz;
+      vertices.push_back(vertex);
+    }
+  }
+  for (size_t ring = 0; ring < rings; ring++)
+  {
+    for (size_t segment = 0; segment < segments; segment++)
+    {
+      uint32_t a = first + static_cast<uint32_t>(ring * (segments + 1) + segment);
+      uint32_t c = a + static_cast<uint32_t>(segments + 1);
+      indices.insert(indices.end(), { a, a + 1, c });
+      indices.insert(indices.end(), { a + 1, c + 1, c });
+    }
+  }
+}
+
+static std::vector<std::array<uint32_t, 3>> sorted_triangles(const std::vector<uint32_t>& indices)
+{
+  std::vector<std::array<uint32_t, 3>> triangles;
+  for (size_t i = 0; i + 2 < indices.size(); i += 3)
+    triangles.push_back({ indices[i], indices[i + 1], indices[i + 2] });
+  std::sort(triangles.begin(), triangles.end());
+  return triangles;
+}
+
+SCENARIO("Mesh optimizer lowers cache misses and keeps every triangle")
+{
+  GIVEN("A sphere inside a larger one in random triangle order")
+  {
+    std::vector<cg::vertex> vertices;
+    std::vector<uint32_t> indices;
+    make_sphere(0.5f, vertices, indices);
+    make_sphere(1.f, vertices, indices);
+
+    std::vector<size_t> order(indices.size() / 3);
+    for (size_t t = 0; t < order.size(); t++)
+      order[t] = t;
+    std::shuffle(order.begin(), order.end(), std::mt19937(42));
+    std::vector<uint32_t> shuffled;
+    for (size_t t : order)
+      shuffled.insert(shuffled.end(), indices.begin() + 3 * t, indices.begin() + 3 * t + 3);
+
+    WHEN("Reorder the triangles for the cache and overdraw and the vertices for fetch")
+    {
+      auto before = cg::world::analyze_mesh(shuffled.data(), shuffled.size(), vertices.data());
+
+      std::vector<uint32_t> optimized = shuffled;
+      auto clusters = cg::world::optimize_vertex_cache(
+        optimized.data(), optimized.size(), vertices.size());
+      auto cache_order = optimized;
+      auto cache_statistics =
+        cg::world::analyze_mesh(cache_order.data(), cache_order.size(), vertices.data());
+      cg::world::optimize_overdraw(optimized.data(), optimized.size(), clusters, vertices.data());
+      auto overdraw_order = optimized;
+      auto remap = cg::world::optimize_vertex_fetch(
+        optimized.data(), optimized.size(), vertices.size());
+
+      std::vector<cg::vertex> fetched_vertices(vertices.size());
+      for (size_t v = 0; v < vertices.size(); v++)
+        fetched_vertices[remap[v]] = vertices[v];
+      auto after =
+        cg::world::analyze_mesh(optimized.data(), optimized.size(), fetched_vertices.data());
+
+      std::vector<uint32_t> remapped_shuffled = shuffled;
+      for (auto& index : remapped_shuffled)
+        index = remap[index];
+      std::vector<uint32_t> sorted_remap = remap;
+      std::sort(sorted_remap.begin(), sorted_remap.end());
+
+      uint32_t first_unused = 0;
+      bool fetch_in_order = true;
+      for (uint32_t index : optimized)
+      {
+        fetch_in_order &= index <= first_unused;
+        first_unused = std::max(first_unused, index + 1);
+      }
+
+      THEN("Make sure misses and overdraw drop and the triangles are the same")
+      {
+        REQUIRE(before.acmr > 1.5f);
+        REQUIRE(cache_statistics.acmr < 0.7f);
+        REQUIRE(after.acmr < 0.8f);
+        // The outer sphere hides the inner one once it is drawn first
+        REQUIRE(after.overdraw >= 1.f);
+        REQUIRE(after.overdraw < cache_statistics.overdraw - 0.1f);
+        REQUIRE_FALSE(clusters.empty());
+        REQUIRE(sorted_triangles(cache_order) == sorted_triangles(shuffled));
+        REQUIRE(sorted_triangles(overdraw_order) == sorted_triangles(shuffled));
+        REQUIRE(sorted_triangles(optimized) == sorted_triangles(remapped_shuffled));
+        REQUIRE(std::adjacent_find(sorted_remap.begin(), sorted_remap.end()) == sorted_remap.end());
+        REQUIRE(fetch_in_order);
+      }
+    }
+  }
+}
+
+SCENARIO("Optimized model draws the same corners in every shape")
+{
+  GIVEN("The Cornell box")
+  {
+    std::filesystem::path obj_file("models/CornellBox-Original.obj");
+    cg::world::model model;
+    model.load_obj(absolute(obj_file));
+
+    auto shape_corners = [](cg::world::model& model) {
+      std::vector<std::vector<std::array<float, 9>>> shapes;
+      for (auto& shape : model.get_per_shape_buffer())
+      {
+        std::vector<std::array<float, 9>> triangles;
+        for (size_t i = 0; i + 2 < shape.get_number_of_elements(); i += 3)
+        {
+          std::array<float, 9> triangle;
+          for (size_t k = 0; k < 3; k++)
+          {
+            triangle[3 * k + 0] = shape.item(i + k).x;
+            triangle[3 * k + 1] = shape.item(i + k).y;
+            triangle[3 * k + 2] = shape.item(i + k).z;
+          }
+          triangles.push_back(triangle);
+        }
+        std::sort(triangles.begin(), triangles.end());
+        shapes.push_back(triangles);
+      }
+      return shapes;
+    };
+
+    WHEN("Optimize the mesh")
+    {
+      auto loaded_corners = shape_corners(model);
+      size_t vertex_count = model.get_indexed_vertex_buffer()->get_number_of_elements();
+      model.optimize_mesh();
+      auto optimized_corners = shape_corners(model);
+
+      THEN("Make sure every shape keeps its triangles and the vertices are kept")
+      {
+        REQUIRE(optimized_corners == loaded_corners);
+        REQUIRE(model.get_indexed_vertex_buffer()->get_number_of_elements() == vertex_count);
+        REQUIRE(model.get_compact_vertex_buffer()->get_number_of_elements() == vertex_count);
+      }
+    }
+  }
+}
+
+SCENARIO("Meshlets stay within their limits and bound their triangles")
+{
+  GIVEN("A sphere inside a larger one")
+  {
+    std::vector<cg::vertex> vertices;
+    std::vector<uint32_t> indices;
+    make_sphere(0.5f, vertices, indices);
+    make_sphere(1.f, vertices, indices);
+
+    WHEN("Build meshlets")
+    {
+      std::vector<uint32_t> meshlet_indices = indices;
+      auto meshlets = cg::world::build_meshlets(
+        meshlet_indices.data(), meshlet_indices.size(), vertices.data(), vertices.size());
+
+      size_t next_offset = 0;
+      bool contiguous = true;
+      bool within_limits = true;
+      bool inside_spheres = true;
+      bool inside_cones = true;
+      size_t cullable_cones = 0;
+      for (const auto& meshlet : meshlets)
+      {
+        contiguous &= meshlet.index_offset == next_offset && meshlet.index_count % 3 == 0;
+        next_offset = meshlet.index_offset + meshlet.index_count;
+
+        std::vector<uint32_t> unique(
+          meshlet_indices.begin() + meshlet.index_offset,
+          meshlet_indices.begin() + meshlet.index_offset + meshlet.index_count);
+        std::sort(unique.begin(), unique.end());
+        unique.erase(std::unique(unique.begin(), unique.end()), unique.end());
+        within_limits &= unique.size() <= cg::world::meshlet_max_vertices &&
+                         meshlet.index_count / 3 <= cg::world::meshlet_max_triangles;
+
+        for (uint32_t index : unique)
+        {
+          const auto& vertex = vertices[index];
+          float3 position(vertex.x, vertex.y, vertex.z);
+          inside_spheres &= length(position - meshlet.center) <= meshlet.radius * 1.001f;
+        }
+
+        if (meshlet.cone_cutoff >= 1.f)
+          continue;
+        cullable_cones++;
+        // Every triangle faces within the cone around the axis
+        float cone_cosine = std::sqrt(1.f - meshlet.cone_cutoff * meshlet.cone_cutoff);
+        for (size_t i = meshlet.index_offset; i < next_offset; i += 3)
+        {
+          float3 corners[3];
+          for (size_t k = 0; k < 3; k++)
+          {
+            const auto& vertex = vertices[meshlet_indices[i + k]];
+            corners[k] = float3(vertex.x, vertex.y, vertex.z);
+          }
+          float3 normal = cross(corners[1] - corners[0], corners[2] - corners[0]);
+          if (length(normal) > 0.f)
+            inside_cones &= dot(normalize(normal), meshlet.cone_axis) >= cone_cosine - 1e-3f;
+        }
+      }
+
+      THEN("Make sure the meshlets cover every triangle within their bounds")
+      {
+        REQUIRE(meshlets.size() >= indices.size() / 3 / cg::world::meshlet_max_triangles);
+        REQUIRE(contiguous);
+        REQUIRE(next_offset == indices.size());
+        REQUIRE(within_limits);
+        REQUIRE(sorted_triangles(meshlet_indices) == sorted_triangles(indices));
+        REQUIRE(inside_spheres);
+        REQUIRE(cullable_cones > 0);
+        REQUIRE(inside_cones);
+      }
+    }
+  }
+}
+
+SCENARIO("Simplified meshes keep their borders and stay close to the surface")
+{
+  GIVEN("A sphere and a flat grid")
+  {
+    std::vector<cg::vertex> sphere_vertices;
+    std::vector<uint32_t> sphere_indices;
+    make_sphere(1.f, sphere_vertices, sphere_indices);
+
+    const size_t grid_size = 16;
+    std::vector<cg::vertex> grid_vertices;
+    std::vector<uint32_t> grid_indices;
+    for (size_t y = 0; y <= grid_size; y++)
+    {
+      for (size_t x = 0; x <= grid_size; x++)
+      {
+        cg::vertex vertex = {};
+        vertex.x = static_cast<float>(x) / grid_size;
+        vertex.y = static_cast<float>(y) / grid_size;
+        vertex.nz = 1.f;
+        grid_vertices.push_back(vertex);
+      }
+    }
+    for (size_t y = 0; y < grid_size; y++)
+    {
+      for (size_t x = 0; x < grid_size; x++)
+      {
+        uint32_t a = static_cast<uint32_t>(y * (grid_size + 1) + x);
+        uint32_t c = a + static_cast<uint32_t>(grid_size + 1);
+        grid_indices.insert(grid_indices.end(), { a, a + 1, c });
+        grid_indices.insert(grid_indices.end(), { a + 1, c + 1, c });
+      }
+    }
+
+    WHEN("Simplify the sphere to half and the grid to a quarter of their triangles")
+    {
+      std::vector<uint32_t> simplified_sphere = sphere_indices;
+      float sphere_error = 0.f;
+      simplified_sphere.resize(cg::world::simplify_mesh(
+        simplified_sphere.data(), simplified_sphere.size(), sphere_vertices.data(),
+        sphere_vertices.size(), sphere_indices.size() / 2, FLT_MAX, &sphere_error));
+      std::vector<uint32_t> simplified_grid = grid_indices;
+      float grid_error = 1.f;
+      simplified_grid.resize(cg::world::simplify_mesh(
+        simplified_grid.data(), simplified_grid.size(), grid_vertices.data(),
+        grid_vertices.size(), grid_indices.size() / 4, FLT_MAX, &grid_error));
+
+      auto corner = [](const std::vector<cg::vertex>& vertices, uint32_t index) {
+        return float3(vertices[index].x, vertices[index].y, vertices[index].z);
+      };
+      bool sphere_faces_out = true;
+      for (size_t i = 0; i + 2 < simplified_sphere.size(); i += 3)
+      {
+        float3 a = corner(sphere_vertices, simplified_sphere[i]);
+        float3 b = corner(sphere_vertices, simplified_sphere[i + 1]);
+        float3 c = corner(sphere_vertices, simplified_sphere[i + 2]);
+        // The corners of the south pole differ by rounding, so its slivers
+        // face anywhere
+        float3 normal = cross(b - a, c - a);
+        if (length(normal) > 1e-6f)
+          sphere_faces_out &= dot(normal, a + b + c) > 0.f;
+      }
+      float grid_area = 0.f;
+      bool grid_faces_up = true;
+      for (size_t i = 0; i + 2 < simplified_grid.size(); i += 3)
+      {
+        float3 a = corner(grid_vertices, simplified_grid[i]);
+        float3 b = corner(grid_vertices, simplified_grid[i + 1]);
+        float3 c = corner(grid_vertices, simplified_grid[i + 2]);
+        float3 normal = cross(b - a, c - a);
+        grid_area += length(normal) / 2.f;
+        grid_faces_up &= normal.z > 0.f;
+      }
+
+      THEN("Make sure the triangles drop, face the same way and cover the same surface")
+      {
+        REQUIRE(simplified_sphere.size() <= sphere_indices.size() / 2);
+        REQUIRE(sphere_error > 0.f);
+        REQUIRE(sphere_error < 0.05f);
+        REQUIRE(sphere_faces_out);
+        REQUIRE(simplified_grid.size() <= grid_indices.size() / 4);
+        REQUIRE(grid_error < 1e-4f);
+        REQUIRE(grid_faces_up);
+        // Holes or folds would change the area, as the border stays
+        REQUIRE(grid_area == Approx(1.f).epsilon(1e-4));
+      }
+    }
+  }
+}
@@ -2,8 +2,12 @@
 
 #include "resource.h"
 #include "world/model.h"
+#include "world/obj_parser.h"
 
 #include <catch.hpp>
+#include <chrono>
+#include <cstring>
+#include <fstream>
 
 
 SCENARIO("Loader produces correct vertex buffer resource")
@@ -39,3 +43,437 @@ SCENARIO("Loader produces correct vertex buffer resource")
     }
   }
 }
+
+SCENARIO("Loader welds shared vertices into an indexed vertex buffer")
+{
+  GIVEN("The Cornell box")
+  {
+    std::filesystem::path obj_file("models/CornellBox-Original.obj");
+
+    WHEN("Loader load the file")
+    {
+      cg::world::model model;
+      model.load_obj(absolute(obj_file));
+
+      auto vertex_buffer = model.get_vertex_buffer();
+      auto indexed_vertex_buffer = model.get_indexed_vertex_buffer();
+      auto index_buffer = model.get_index_buffer();
+      auto per_shape_buffer = model.get_per_shape_buffer();
+      auto per_shape_index_buffer = model.get_per_shape_index_buffer();
+
+      size_t shape_mismatches = 0;
+      size_t shape_indices = 0;
+      for (size_t s = 0; s < per_shape_buffer.size(); s++)
+      {
+        for (size_t i = 0; i < per_shape_buffer[s].get_number_of_elements(); i++)
+        {
+          cg::vertex expected = per_shape_buffer[s].item(i);
+          cg::vertex indexed =
+            indexed_vertex_buffer->item(per_shape_index_buffer[s].item(i));
+          shape_mismatches += std::memcmp(&expected, &indexed, sizeof(cg::vertex)) != 0;
+        }
+        shape_indices += per_shape_index_buffer[s].get_number_of_elements();
+      }
+
+      size_t mismatches = 0;
+      for (size_t i = 0; i < index_buffer->get_number_of_elements(); i++)
+      {
+        cg::vertex expected = vertex_buffer->item(i);
+        cg::vertex indexed = indexed_vertex_buffer->item(index_buffer->item(i));
+        mismatches += std::memcmp(&expected, &indexed, sizeof(cg::vertex)) != 0;
+      }
+
+      THEN("The indexed buffers expand to the vertex buffer with fewer vertices")
+      {
+        REQUIRE(index_buffer->get_number_of_elements() == vertex_buffer->get_number_of_elements());
+        REQUIRE(mismatches == 0);
+        REQUIRE(indexed_vertex_buffer->get_number_of_elements() <
+                vertex_buffer->get_number_of_elements());
+        REQUIRE(per_shape_buffer.size() == per_shape_index_buffer.size());
+        REQUIRE(per_shape_buffer[0].get_resource() == vertex_buffer);
+        REQUIRE(shape_mismatches == 0);
+        REQUIRE(shape_indices == index_buffer->get_number_of_elements());
+      }
+    }
+  }
+}
+
+SCENARIO("Compact vertices decode close to the loaded vertices")
+{
+  GIVEN("The Cornell box")
+  {
+    std::filesystem::path obj_file("models/CornellBox-Original.obj");
+
+    WHEN("Loader load the file and the vertices are compacted")
+    {
+      cg::world::model model;
+      model.load_obj(absolute(obj_file));
+
+      auto indexed_vertex_buffer = model.get_indexed_vertex_buffer();
+      auto compact_vertex_buffer = model.get_compact_vertex_buffer();
+
+      float position_error = 0.f;
+      float normal_error = 0.f;
+      size_t material_mismatches = 0;
+      for (size_t i = 0; i < indexed_vertex_buffer->get_number_of_elements(); i++)
+      {
+        const cg::vertex& vertex = indexed_vertex_buffer->item(i);
+        cg::vertex decoded = model.decode_vertex(compact_vertex_buffer->item(i));
+
+        position_error = std::max(position_error, length(
+          float3{ vertex.x, vertex.y, vertex.z } - float3{ decoded.x, decoded.y, decoded.z }));
+        normal_error = std::max(normal_error, length(
+          float3{ vertex.nx, vertex.ny, vertex.nz } - float3{ decoded.nx, decoded.ny, decoded.nz }));
+        material_mismatches += vertex.ambient_r != decoded.ambient_r ||
+                               vertex.diffuse_g != decoded.diffuse_g ||
+                               vertex.emissive_b != decoded.emissive_b;
+      }
+
+      THEN("Positions and normals are within the quantization step and materials exact")
+      {
+        REQUIRE(sizeof(cg::compact_vertex) == 12);
+        REQUIRE(compact_vertex_buffer->get_number_of_elements() ==
+                indexed_vertex_buffer->get_number_of_elements());
+        REQUIRE(position_error < 1e-4f);
+        REQUIRE(normal_error < 1e-3f);
+        REQUIRE(material_mismatches == 0);
+      }
+    }
+  }
+}
+
+SCENARIO("Parallel OBJ parser merges its chunks with global indices")
+{
+  GIVEN("An OBJ file of several megabytes with relative indices, materials and shapes")
+  {
+    auto directory = std::filesystem::temp_directory_path();
+    auto obj_path = directory / "obj_parser_test.obj";
+    auto mtl_path = directory / "obj_parser_test.mtl";
+
+    std::ofstream(mtl_path) << "newmtl red\nKd 1 0 0\nnewmtl green\nKd 0 1 0\n";
+
+    // Triangle t has the vertices 3t, 3t + 1 and 3t + 2, which store their
+    // own index as x; materials alternate every 1000 triangles
+    const size_t triangles = 100000;
+    {
+      std::ofstream obj(obj_path);
+      obj << "mtllib obj_parser_test.mtl\no first\n";
+      // Faces past the attributes are dropped
+      obj << "f -3 -2 -1\n";
+      for (size_t t = 0; t < triangles; t++)
+      {
+        if (t == triangles / 2)
+          obj << "g second\n";
+        if (t % 1000 == 0)
+          obj << "usemtl " << ((t / 1000) % 2 ? "green" : "red") << "\n";
+        for (size_t v = 3 * t; v < 3 * t + 3; v++)
+          obj << "v " << v << " 0.5 -0.25e1\n";
+        if (t == triangles / 4)
+          obj << "f 1 2 999999999\nf 1//1 2//1 3//1\nf 1/5 2/5 3/5\n";
+        if (t % 2)
+          obj << "f -3 -2 -1\n";
+        else
+          obj << "f " << 3 * t + 1 << " " << 3 * t + 2 << " " << 3 * t + 3 << "\n";
+      }
+      obj << "f 1 2 3 4\n";
+    }
+
+    WHEN("Parse the file")
+    {
+      tinyobj::attrib_t attrib;
+      std::vector<tinyobj::shape_t> shapes;
+      std::vector<tinyobj::material_t> materials;
+      bool parsed = cg::world::parse_obj(obj_path, attrib, shapes, materials);
+      std::filesystem::remove(obj_path);
+      std::filesystem::remove(mtl_path);
+
+      size_t mismatches = 0;
+      size_t t = 0;
+      for (const auto& shape : shapes)
+      {
+        for (size_t f = 0; f < shape.mesh.material_ids.size() && t < triangles; f++, t++)
+        {
+          for (size_t k = 0; k < 3; k++)
+          {
+            int index = shape.mesh.indices[3 * f + k].vertex_index;
+            mismatches += index != static_cast<int>(3 * t + k) ||
+                          attrib.vertices[3 * index] != static_cast<float>(3 * t + k);
+          }
+          mismatches += shape.mesh.material_ids[f] != static_cast<int>((t / 1000) % 2);
+        }
+      }
+
+      THEN("Make sure that every valid triangle has its vertices, material and shape")
+      {
+        REQUIRE(parsed);
+        REQUIRE(materials.size() == 2);
+        REQUIRE(attrib.vertices.size() == 9 * triangles);
+        REQUIRE(attrib.vertices[2] == -2.5f);
+        REQUIRE(shapes.size() == 2);
+        REQUIRE(shapes[0].name == "first");
+        REQUIRE(shapes[1].name == "second");
+        REQUIRE(shapes[0].mesh.material_ids.size() == triangles / 2);
+        // The closing quad is a fan of two triangles
+        REQUIRE(shapes[1].mesh.material_ids.size() == triangles / 2 + 2);
+        REQUIRE(shapes[1].mesh.indices.back().vertex_index == 3);
+        REQUIRE(mismatches == 0);
+      }
+    }
+  }
+}
+
+SCENARIO("Binary mesh loads the buffers of the OBJ model in place")
+{
+  GIVEN("The Cornell box saved as a binary mesh")
+  {
+    std::filesystem::path obj_file("models/CornellBox-Original.obj");
+    auto mesh_path = std::filesystem::temp_directory_path() / "model_loader_test.cgmesh";
+
+    cg::world::model obj_model;
+    obj_model.load_obj(absolute(obj_file));
+    obj_model.save_mesh(mesh_path);
+
+    WHEN("Load the binary mesh and write to its vertex buffer")
+    {
+      cg::world::model mesh_model;
+      mesh_model.load(mesh_path);
+
+      auto obj_vertices = obj_model.get_indexed_vertex_buffer();
+      auto mesh_vertices = mesh_model.get_indexed_vertex_buffer();
+      auto obj_indices = obj_model.get_index_buffer();
+      auto mesh_indices = mesh_model.get_index_buffer();
+
+      bool same_vertices =
+        mesh_vertices->get_number_of_elements() == obj_vertices->get_number_of_elements() &&
+        std::memcmp(mesh_vertices->get_data(), obj_vertices->get_data(),
+                    obj_vertices->get_size_in_bytes()) == 0;
+      bool same_indices =
+        mesh_indices->get_number_of_elements() == obj_indices->get_number_of_elements() &&
+        std::memcmp(mesh_indices->get_data(), obj_indices->get_data(),
+                    obj_indices->get_size_in_bytes()) == 0;
+
+      size_t shape_mismatches = 0;
+      auto obj_shapes = obj_model.get_per_shape_index_buffer();
+      auto mesh_shapes = mesh_model.get_per_shape_index_buffer();
+      for (size_t s = 0; s < std::min(obj_shapes.size(), mesh_shapes.size()); s++)
+      {
+        shape_mismatches += obj_shapes[s].get_offset() != mesh_shapes[s].get_offset() ||
+                            obj_shapes[s].get_number_of_elements() !=
+                              mesh_shapes[s].get_number_of_elements();
+      }
+
+      size_t compact_mismatches = 0;
+      auto obj_compact = obj_model.get_compact_vertex_buffer();
+      auto mesh_compact = mesh_model.get_compact_vertex_buffer();
+      for (size_t i = 0; i < obj_compact->get_number_of_elements(); i++)
+      {
+        compact_mismatches += std::memcmp(
+          &obj_compact->item(i), &mesh_compact->item(i), sizeof(cg::compact_vertex)) != 0;
+      }
+
+      // The mapping is copy-on-write, so the file keeps its vertex
+      mesh_vertices->item(0).x += 1.f;
+      cg::world::model reloaded_model;
+      reloaded_model.load_mesh(mesh_path);
+      float reloaded_x = reloaded_model.get_indexed_vertex_buffer()->item(0).x;
+
+      // Copies of a mapped buffer don't share its memory
+      cg::resource<uint32_t> index_copy = *mesh_indices;
+      index_copy.item(0) += 1;
+
+      THEN("Make sure the buffers, shapes and materials match the OBJ model")
+      {
+        REQUIRE(same_vertices);
+        REQUIRE(same_indices);
+        REQUIRE(mesh_shapes.size() == obj_shapes.size());
+        REQUIRE(shape_mismatches == 0);
+        REQUIRE(mesh_model.get_materials().size() == obj_model.get_materials().size());
+        REQUIRE(compact_mismatches == 0);
+        REQUIRE(reloaded_x == obj_vertices->item(0).x);
+        REQUIRE(mesh_vertices->item(0).x == obj_vertices->item(0).x + 1.f);
+        REQUIRE(mesh_indices->item(0) == obj_indices->item(0));
+        REQUIRE(index_copy.item(0) == obj_indices->item(0) + 1);
+      }
+    }
+
+    WHEN("An index of the binary mesh points past its vertices")
+    {
+      std::string bytes;
+      {
+        std::ifstream stream(mesh_path, std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+      }
+      auto obj_indices = obj_model.get_index_buffer();
+      size_t index_offset = bytes.find(std::string(
+        reinterpret_cast<const char*>(obj_indices->get_data()), obj_indices->get_size_in_bytes()));
+      uint32_t past_the_vertices =
+        static_cast<uint32_t>(obj_model.get_indexed_vertex_buffer()->get_number_of_elements());
+      if (index_offset != std::string::npos)
+        std::memcpy(&bytes[index_offset], &past_the_vertices, sizeof(past_the_vertices));
+      std::ofstream(mesh_path, std::ios::binary | std::ios::trunc) << bytes;
+
+      THEN("Make sure that the mesh is rejected on load")
+      {
+        REQUIRE(index_offset != std::string::npos);
+        cg::world::model mesh_model;
+        REQUIRE_THROWS(mesh_model.load_mesh(mesh_path));
+      }
+    }
+
+    std::filesystem::remove(mesh_path);
+  }
+}
+
+SCENARIO("Asynchronous loader hands out the shapes of the model")
+{
+  GIVEN("The Cornell box")
+  {
+    std::filesystem::path obj_file("models/CornellBox-Original.obj");
+
+    WHEN("Load it asynchronously and take the shapes as they are loaded")
+    {
+      cg::world::model model;
+      auto loading = model.load_async(absolute(obj_file));
+
+      std::vector<cg::resource_view<cg::vertex>> streamed_shapes;
+      for (size_t shape = 0; auto shape_buffer = model.wait_for_shape(shape); shape++)
+        streamed_shapes.push_back(*shape_buffer);
+      loading.get();
+
+      cg::world::model sync_model;
+      sync_model.load_obj(absolute(obj_file));
+      auto per_shape_buffer = sync_model.get_per_shape_buffer();
+
+      size_t mismatches = 0;
+      for (size_t s = 0; s < std::min(streamed_shapes.size(), per_shape_buffer.size()); s++)
+      {
+        mismatches +=
+          streamed_shapes[s].get_number_of_elements() != per_shape_buffer[s].get_number_of_elements();
+        for (size_t i = 0; i < streamed_shapes[s].get_number_of_elements(); i++)
+        {
+          mismatches += std::memcmp(
+            &streamed_shapes[s].item(i), &per_shape_buffer[s].item(i), sizeof(cg::vertex)) != 0;
+        }
+      }
+
+      size_t loaded_shapes = model.get_per_shape_buffer().size();
+      auto missing_loading = model.load_async("missing_model.obj");
+      bool missing_has_shapes = model.wait_for_shape(0).has_value();
+
+      THEN("Make sure the shapes match the synchronous load and errors reach the future")
+      {
+        REQUIRE(streamed_shapes.size() == per_shape_buffer.size());
+        REQUIRE(mismatches == 0);
+        REQUIRE(loaded_shapes == per_shape_buffer.size());
+        REQUIRE_FALSE(missing_has_shapes);
+        REQUIRE_THROWS(missing_loading.get());
+      }
+    }
+  }
+}
+
+SCENARIO("Streaming loader converts the OBJ model within its memory budget")
+{
+  GIVEN("The Cornell box in a folder of its own")
+  {
+    auto directory = std::filesystem::temp_directory_path() / "model_loader_test_stream";
+    std::filesystem::create_directories(directory);
+    for (const char* name : { "CornellBox-Original.obj", "CornellBox-Original.mtl" })
+    {
+      std::filesystem::copy_file(
+        std::filesystem::path("models") / name, directory / name,
+        std::filesystem::copy_options::overwrite_existing);
+    }
+    auto obj_path = directory / "CornellBox-Original.obj";
+
+    WHEN("Load it with a budget of a few triangles and release the shapes")
+    {
+      cg::world::model model;
+      model.set_memory_budget(4096);
+      model.load(obj_path);
+
+      cg::world::model obj_model;
+      obj_model.load_obj(obj_path);
+
+      auto vertex_buffer = model.get_vertex_buffer();
+      auto obj_vertex_buffer = obj_model.get_vertex_buffer();
+      bool same_corners =
+        vertex_buffer->get_number_of_elements() == obj_vertex_buffer->get_number_of_elements() &&
+        std::memcmp(vertex_buffer->get_data(), obj_vertex_buffer->get_data(),
+                    obj_vertex_buffer->get_size_in_bytes()) == 0;
+
+      // Released pages are read again from the mesh file
+      auto indices = model.get_index_buffer();
+      std::vector<uint32_t> drawn_indices(indices->begin(), indices->end());
+      size_t shapes = model.get_per_shape_index_buffer().size();
+      for (size_t s = 0; s < shapes; s++)
+        model.release_shape(s);
+      bool same_after_release = std::equal(drawn_indices.begin(), drawn_indices.end(),
+                                           indices->begin(), indices->end());
+
+      bool has_scratch_files = false;
+      for (const auto& entry : std::filesystem::directory_iterator(directory))
+        has_scratch_files |= entry.path().extension() == ".tmp";
+      bool has_mesh = std::filesystem::exists(directory / "CornellBox-Original.stream.cgmesh");
+
+      THEN("Make sure the triangles match the OBJ model in several chunks")
+      {
+        REQUIRE(same_corners);
+        REQUIRE(shapes > obj_model.get_per_shape_index_buffer().size());
+        REQUIRE(model.get_materials().size() == obj_model.get_materials().size());
+        REQUIRE(same_after_release);
+        REQUIRE_FALSE(has_scratch_files);
+        REQUIRE(has_mesh);
+      }
+    }
+
+    WHEN("Load it again with another budget and after an edit of its materials")
+    {
+      auto mesh_path = directory / "CornellBox-Original.stream.cgmesh";
+      cg::world::model model;
+      model.set_memory_budget(4096);
+      model.load(obj_path);
+      size_t shapes = model.get_per_shape_index_buffer().size();
+      auto mesh_time = std::filesystem::last_write_time(mesh_path);
+
+      cg::world::model same_budget_model;
+      same_budget_model.set_memory_budget(4096);
+      same_budget_model.load(obj_path);
+      bool reused = std::filesystem::last_write_time(mesh_path) == mesh_time;
+
+      cg::world::model other_budget_model;
+      other_budget_model.set_memory_budget(8192);
+      other_budget_model.load(obj_path);
+      size_t other_budget_shapes = other_budget_model.get_per_shape_index_buffer().size();
+
+      // Every material turns blue in a library newer than the mesh
+      auto mtl_path = directory / "CornellBox-Original.mtl";
+      std::string library;
+      {
+        std::ifstream stream(mtl_path);
+        for (std::string line; std::getline(stream, line);)
+          library += (line.find("Kd ") != std::string::npos ? "Kd 0 0 1" : line) + "\n";
+      }
+      std::ofstream(mtl_path) << library;
+      std::filesystem::last_write_time(
+        mtl_path, std::filesystem::last_write_time(mesh_path) + std::chrono::hours(1));
+      cg::world::model edited_model;
+      edited_model.set_memory_budget(8192);
+      edited_model.load(obj_path);
+      // The last material is the default one of faces without a material
+      const auto& materials = edited_model.get_materials();
+      bool all_blue = materials.size() > 1;
+      for (size_t m = 0; m + 1 < materials.size(); m++)
+        all_blue &= materials[m].diffuse.x == 0.f && materials[m].diffuse.z == 1.f;
+
+      THEN("Make sure the mesh is converted again unless nothing changed")
+      {
+        REQUIRE(reused);
+        REQUIRE(other_budget_shapes < shapes);
+        REQUIRE(all_blue);
+      }
+    }
+
+    std::filesystem::remove_all(directory);
+  }
+}
@@ -51,3 +51,71 @@ SCENARIO("Rasterizer produces correct image")
     }
   }
 }
+
+SCENARIO("Indexed draw produces the same image as draw")
+{
+  GIVEN("A quad as two triangles with and without an index buffer")
+  {
+    auto indexed_vertex_buffer = std::make_shared<cg::resource<cg::vertex>>(4);
+    indexed_vertex_buffer->item(0) = { -0.8f, -0.6f, 0.f };
+    indexed_vertex_buffer->item(1) = { -0.6f, 0.8f, 0.f };
+    indexed_vertex_buffer->item(2) = { 0.7f, 0.5f, 0.f };
+    indexed_vertex_buffer->item(3) = { 0.6f, -0.7f, 0.f };
+
+    auto index_buffer = std::make_shared<cg::resource<uint32_t>>(6);
+    uint32_t indices[] = { 0, 2, 1, 0, 3, 2 };
+    std::copy(std::begin(indices), std::end(indices), index_buffer->begin());
+
+    auto vertex_buffer = std::make_shared<cg::resource<cg::vertex>>(6);
+    for (size_t i = 0; i < 6; i++)
+      vertex_buffer->item(i) = indexed_vertex_buffer->item(indices[i]);
+
+    auto render_target = std::make_shared<cg::resource<cg::unsigned_color>>(16, 16);
+    auto indexed_render_target = std::make_shared<cg::resource<cg::unsigned_color>>(16, 16);
+
+    cg::renderer::rasterizer<cg::vertex, cg::unsigned_color> rasterizer;
+    rasterizer.set_viewport(16, 16);
+
+    size_t shaded_vertices = 0;
+    rasterizer.vertex_shader = [&](float4 vertex, cg::vertex vertex_data)
+    {
+      shaded_vertices++;
+      return std::make_pair(vertex, vertex_data);
+    };
+
+    rasterizer.pixel_shader = [](cg::vertex vertex_data, float depth)
+    {
+      return cg::color{ 1.f, 1.f, 1.f };
+    };
+
+    WHEN("Draw both")
+    {
+      rasterizer.set_vertex_buffer(vertex_buffer);
+      rasterizer.set_render_target(render_target);
+      rasterizer.clear_render_target({ 0, 0, 0 });
+      rasterizer.draw(6, 0);
+
+      shaded_vertices = 0;
+      rasterizer.set_vertex_buffer(indexed_vertex_buffer);
+      rasterizer.set_index_buffer(index_buffer);
+      rasterizer.set_render_target(indexed_render_target);
+      rasterizer.clear_render_target({ 0, 0, 0 });
+      rasterizer.draw_indexed(6, 0);
+
+      size_t covered = 0;
+      size_t mismatches = 0;
+      for (size_t i = 0; i < render_target->get_number_of_elements(); i++)
+      {
+        covered += render_target->item(i).r == 255;
+        mismatches += render_target->item(i).r != indexed_render_target->item(i).r;
+      }
+
+      THEN("Make sure that the images are the same and shared vertices are shaded once")
+      {
+        REQUIRE(covered > 0);
+        REQUIRE(mismatches == 0);
+        REQUIRE(shaded_vertices == 4);
+      }
+    }
+  }
+}
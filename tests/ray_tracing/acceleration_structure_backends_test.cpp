@@ -0,0 +1,105 @@
+#define CATCH_CONFIG_MAIN
+#define CATCH_CONFIG_ENABLE_BENCHMARKING
+
+#include "renderer/raytracer/raytracer.h"
+#include "resource.h"
+#include "world/model.h"
+
+#include <catch.hpp>
+#include <chrono>
+#include <random>
+
+
+using scene_raytracer = cg::renderer::raytracer<cg::vertex, cg::unsigned_color>;
+
+static size_t trace_rays(const scene_raytracer& raytracer, std::vector<float>& hit_t)
+{
+  std::mt19937 generator(7);
+  std::uniform_real_distribution<float> distribution(-1.f, 1.f);
+
+  size_t hits = 0;
+  hit_t.clear();
+  for (int i = 0; i < 4096; i++)
+  {
+    float3 position{ 0.5f * distribution(generator),
+                     1.f + 0.5f * distribution(generator),
+                     0.5f * distribution(generator) };
+    float3 direction{ distribution(generator),
+                      distribution(generator),
+                      distribution(generator) };
+    cg::renderer::ray ray(position, direction);
+
+    cg::renderer::payload payload;
+    bool hit = raytracer.closest_hit(ray, payload) != nullptr;
+    hits += hit;
+    hit_t.push_back(hit ? payload.t : -1.f);
+  }
+  return hits;
+}
+
+SCENARIO("Grid and kd-tree find the same hits as the BVH")
+{
+  GIVEN("Cornell box with every kind of acceleration structure")
+  {
+    cg::world::model model;
+    model.load_obj("models/CornellBox-Original.obj");
+
+    scene_raytracer raytracers[3];
+    const char* names[3] = { "BVH", "Uniform grid", "kd-tree" };
+    cg::renderer::acceleration_structure_type types[3] = {
+      cg::renderer::acceleration_structure_type::bvh,
+      cg::renderer::acceleration_structure_type::grid,
+      cg::renderer::acceleration_structure_type::kd_tree
+    };
+
+    for (int i = 0; i < 3; i++)
+    {
+      raytracers[i].acceleration_type = types[i];
+      raytracers[i].set_per_shape_vertex_buffer(model.get_per_shape_buffer());
+
+      auto start = std::chrono::high_resolution_clock::now();
+      raytracers[i].build_acceleration_structure();
+      auto stop = std::chrono::high_resolution_clock::now();
+      std::cout << names[i] << " build: "
+                << std::chrono::duration<float, std::milli>(stop - start).count()
+                << " ms\n";
+    }
+
+    WHEN("Trace the same rays through all of them")
+    {
+      std::vector<float> hit_t[3];
+      size_t hits[3];
+      for (int i = 0; i < 3; i++)
+        hits[i] = trace_rays(raytracers[i], hit_t[i]);
+
+      BENCHMARK("BVH traversal")
+      {
+        std::vector<float> t;
+        return trace_rays(raytracers[0], t);
+      };
+
+      BENCHMARK("Uniform grid traversal")
+      {
+        std::vector<float> t;
+        return trace_rays(raytracers[1], t);
+      };
+
+      BENCHMARK("kd-tree traversal")
+      {
+        std::vector<float> t;
+        return trace_rays(raytracers[2], t);
+      };
+
+      THEN("Make sure that the hits are the same")
+      {
+        REQUIRE(hits[0] > 0);
+        for (int i = 1; i < 3; i++)
+        {
+          REQUIRE(hits[i] == hits[0]);
+          for (size_t ray = 0; ray < hit_t[0].size(); ray++)
+            REQUIRE(hit_t[i][ray] == Approx(hit_t[0][ray]).margin(1e-4f));
+        }
+      }
+    }
+  }
+}
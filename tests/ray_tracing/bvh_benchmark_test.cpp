@@ -0,0 +1,306 @@
+#define CATCH_CONFIG_MAIN
+#define CATCH_CONFIG_ENABLE_BENCHMARKING
+
+#include "renderer/raytracer/raytracer.h"
+#include "resource.h"
+
+#include <catch.hpp>
+#include <chrono>
+#include <random>
+#include <tuple>
+
+
+using bvh_raytracer = cg::renderer::raytracer<cg::vertex, cg::unsigned_color>;
+
+// Tessellated unit sphere with 2 * segments^2 triangles
+static std::shared_ptr<cg::resource<cg::vertex>> make_sphere(size_t segments)
+{
+  const float pi = 3.14159265358979f;
+  auto vertex_buffer =
+    std::make_shared<cg::resource<cg::vertex>>(6 * segments * segments);
+
+  auto point = [&](size_t i, size_t j) {
+    float theta = pi * i / segments;
+    float phi = 2.f * pi * j / segments;
+    cg::vertex vertex = {};
+    vertex.nx = std::sin(theta) * std::cos(phi);
+    vertex.ny = std::cos(theta);
+    vertex.nz = std::sin(theta) * std::sin(phi);
+    vertex.x = vertex.nx;
+    vertex.y = vertex.ny;
+    vertex.z = vertex.nz;
+    return vertex;
+  };
+
+  size_t index = 0;
+  for (size_t i = 0; i < segments; i++)
+    for (size_t j = 0; j < segments; j++)
+    {
+      vertex_buffer->item(index++) = point(i, j);
+      vertex_buffer->item(index++) = point(i + 1, j);
+      vertex_buffer->item(index++) = point(i, j + 1);
+      vertex_buffer->item(index++) = point(i, j + 1);
+      vertex_buffer->item(index++) = point(i + 1, j);
+      vertex_buffer->item(index++) = point(i + 1, j + 1);
+    }
+
+  return vertex_buffer;
+}
+
+// Finely tessellated sphere crossed by long thin triangles in random
+// directions, like the trims and the diagonal beams of architectural models
+static std::shared_ptr<cg::resource<cg::vertex>> make_slivers(size_t count)
+{
+  auto sphere = make_sphere(64);
+  size_t sphere_size = sphere->get_number_of_elements();
+  auto vertex_buffer =
+    std::make_shared<cg::resource<cg::vertex>>(sphere_size + 3 * count);
+  for (size_t i = 0; i < sphere_size; i++)
+    vertex_buffer->item(i) = sphere->item(i);
+
+  std::mt19937 generator(42);
+  std::uniform_real_distribution<float> distribution(-1.f, 1.f);
+  auto random_point = [&]() {
+    return float3{
+      distribution(generator), distribution(generator), distribution(generator)
+    };
+  };
+
+  for (size_t i = 0; i < count; i++)
+  {
+    float3 direction = normalize(random_point());
+    float3 start = 1.5f * random_point() - 1.5f * direction;
+    float3 end = start + 3.f * direction;
+    float3 width = normalize(cross(direction, random_point())) * 0.01f;
+
+    float3 points[3] = { start, end, end + width };
+    for (size_t j = 0; j < 3; j++)
+    {
+      cg::vertex vertex = {};
+      vertex.x = points[j].x;
+      vertex.y = points[j].y;
+      vertex.z = points[j].z;
+      vertex.nz = 1.f;
+      vertex_buffer->item(sphere_size + 3 * i + j) = vertex;
+    }
+  }
+
+  return vertex_buffer;
+}
+
+// Expected cost of a random ray through the hierarchy, relative to one
+// triangle test
+static float sah_cost(const cg::renderer::aabb<cg::vertex>& shape)
+{
+  auto half_area = [](const float3& aabb_min, const float3& aabb_max) {
+    float3 extent = aabb_max - aabb_min;
+    return extent.x * extent.y + extent.y * extent.z + extent.z * extent.x;
+  };
+
+  const auto& nodes = shape.get_nodes();
+  float root_area = half_area(nodes[0].aabb_min, nodes[0].aabb_max);
+  float cost = 0.f;
+  for (auto& node : nodes)
+  {
+    float area = half_area(node.aabb_min, node.aabb_max) / root_area;
+    cost += node.is_leaf() ? area * node.count : area;
+  }
+  return cost;
+}
+
+static const cg::renderer::aabb<cg::vertex>& get_bvh(const bvh_raytracer& raytracer)
+{
+  return dynamic_cast<const cg::renderer::aabb<cg::vertex>&>(
+    *raytracer.acceleration_structures[0]);
+}
+
+static size_t trace_grid(const bvh_raytracer& raytracer, float& sum_t)
+{
+  size_t hits = 0;
+  sum_t = 0.f;
+  for (int x = 0; x < 64; x++)
+    for (int y = 0; y < 64; y++)
+    {
+      cg::renderer::ray ray(
+        float3{ 0.f, 0.f, 3.f },
+        float3{ x / 64.f - 0.5f, y / 64.f - 0.5f, -1.f });
+
+      cg::renderer::payload payload;
+      if (raytracer.closest_hit(ray, payload))
+      {
+        hits++;
+        sum_t += payload.t;
+      }
+    }
+  return hits;
+}
+
+SCENARIO("Compressed BVH nodes save memory at a small traversal cost")
+{
+  GIVEN("Binary and compressed BVH of a finely tessellated sphere")
+  {
+    std::vector<std::shared_ptr<cg::resource<cg::vertex>>> vertex_buffer{
+      make_sphere(256)
+    };
+
+    bvh_raytracer binary_raytracer;
+    binary_raytracer.set_per_shape_vertex_buffer(vertex_buffer);
+    binary_raytracer.build_acceleration_structure();
+
+    bvh_raytracer compressed_raytracer;
+    compressed_raytracer.compress_bvh = true;
+    compressed_raytracer.set_per_shape_vertex_buffer(vertex_buffer);
+    compressed_raytracer.build_acceleration_structure();
+
+    const auto& binary_shape = get_bvh(binary_raytracer);
+    const auto& compressed_shape = get_bvh(compressed_raytracer);
+
+    size_t binary_size =
+      binary_shape.get_nodes().size() * sizeof(cg::renderer::bvh_node);
+    size_t compressed_size = compressed_shape.get_compressed_nodes().size() *
+                             sizeof(cg::renderer::compressed_bvh_node);
+
+    std::cout << "Binary BVH: " << binary_shape.get_nodes().size()
+              << " nodes, " << binary_size << " bytes\n";
+    std::cout << "Compressed BVH: "
+              << compressed_shape.get_compressed_nodes().size() << " nodes, "
+              << compressed_size << " bytes\n";
+
+    WHEN("Trace the same rays through both hierarchies")
+    {
+      float binary_sum_t, compressed_sum_t;
+      size_t binary_hits = trace_grid(binary_raytracer, binary_sum_t);
+      size_t compressed_hits = trace_grid(compressed_raytracer, compressed_sum_t);
+
+      BENCHMARK("Binary BVH traversal")
+      {
+        float sum_t;
+        return trace_grid(binary_raytracer, sum_t);
+      };
+
+      BENCHMARK("Compressed BVH traversal")
+      {
+        float sum_t;
+        return trace_grid(compressed_raytracer, sum_t);
+      };
+
+      THEN("Make sure that the hits match and the nodes take less memory")
+      {
+        REQUIRE(alignof(cg::renderer::compressed_bvh_node) == 64);
+        REQUIRE(compressed_shape.get_nodes().empty());
+        REQUIRE(binary_hits > 0);
+        REQUIRE(compressed_hits == binary_hits);
+        REQUIRE(compressed_sum_t == Approx(binary_sum_t));
+        REQUIRE(binary_size >= 2.5f * compressed_size);
+      }
+    }
+  }
+}
+
+SCENARIO("Spatial splits lower the traversal cost of long thin triangles")
+{
+  GIVEN("Object and spatial split BVH of overlapping slivers")
+  {
+    std::vector<std::shared_ptr<cg::resource<cg::vertex>>> vertex_buffer{
+      make_slivers(64)
+    };
+
+    bvh_raytracer object_raytracer;
+    object_raytracer.set_per_shape_vertex_buffer(vertex_buffer);
+    auto object_start = std::chrono::high_resolution_clock::now();
+    object_raytracer.build_acceleration_structure();
+    auto object_stop = std::chrono::high_resolution_clock::now();
+
+    bvh_raytracer spatial_raytracer;
+    spatial_raytracer.set_per_shape_vertex_buffer(vertex_buffer);
+    auto spatial_start = std::chrono::high_resolution_clock::now();
+    spatial_raytracer.build_acceleration_structure(
+      cg::renderer::bvh_split_mode::spatial);
+    auto spatial_stop = std::chrono::high_resolution_clock::now();
+
+    const auto& object_shape = get_bvh(object_raytracer);
+    const auto& spatial_shape = get_bvh(spatial_raytracer);
+
+    auto memory = [](const cg::renderer::aabb<cg::vertex>& shape) {
+      return shape.get_nodes().size() * sizeof(cg::renderer::bvh_node) +
+             shape.get_triangles().size() * sizeof(cg::renderer::triangle<cg::vertex>);
+    };
+
+    for (auto [name, shape, start, stop] : {
+           std::make_tuple("Object splits", &object_shape, object_start, object_stop),
+           std::make_tuple("Spatial splits", &spatial_shape, spatial_start, spatial_stop) })
+    {
+      std::cout << name << ": SAH cost " << sah_cost(*shape) << ", build "
+                << std::chrono::duration<float, std::milli>(stop - start).count()
+                << " ms, " << memory(*shape) << " bytes, "
+                << shape->get_triangles().size() << " triangle references\n";
+    }
+
+    WHEN("Trace the same rays through both hierarchies")
+    {
+      float object_sum_t, spatial_sum_t;
+      size_t object_hits = trace_grid(object_raytracer, object_sum_t);
+      size_t spatial_hits = trace_grid(spatial_raytracer, spatial_sum_t);
+
+      BENCHMARK("Object split BVH traversal")
+      {
+        float sum_t;
+        return trace_grid(object_raytracer, sum_t);
+      };
+
+      BENCHMARK("Spatial split BVH traversal")
+      {
+        float sum_t;
+        return trace_grid(spatial_raytracer, sum_t);
+      };
+
+      THEN("Make sure that the hits match and the cost is lower within the budget")
+      {
+        REQUIRE(object_hits > 0);
+        REQUIRE(spatial_hits == object_hits);
+        REQUIRE(spatial_sum_t == Approx(object_sum_t));
+        REQUIRE(sah_cost(spatial_shape) < sah_cost(object_shape));
+        size_t number_of_triangles = vertex_buffer[0]->get_number_of_elements() / 3;
+        REQUIRE(spatial_shape.get_triangles().size() <=
+                number_of_triangles * (1.f + spatial_raytracer.spatial_split_budget));
+      }
+    }
+  }
+}
+
+SCENARIO("Leaves too large for compressed nodes keep the BVH binary")
+{
+  GIVEN("A sphere in a single leaf, as the build leaves it at the depth cap")
+  {
+    auto vertex_buffer = make_sphere(16);
+    std::vector<cg::renderer::triangle<cg::vertex>> triangles;
+    for (size_t i = 0; i < vertex_buffer->get_number_of_elements(); i += 3)
+      triangles.emplace_back(
+        vertex_buffer->item(i), vertex_buffer->item(i + 1), vertex_buffer->item(i + 2));
+
+    cg::renderer::bvh_node root = {
+      float3(-1.f), 0, float3(1.f), static_cast<uint32_t>(triangles.size())
+    };
+    cg::renderer::aabb<cg::vertex> shape;
+    shape.assign(triangles, { root });
+
+    WHEN("Compress the hierarchy")
+    {
+      shape.compress_bvh();
+
+      cg::renderer::ray ray(float3{ 0.f, 0.f, 3.f }, float3{ 0.f, 0.f, -1.f });
+      cg::renderer::payload payload = {};
+      payload.t = FLT_MAX;
+      bool hit = shape.intersect(ray, payload, 0.f, false) != nullptr;
+
+      THEN("Make sure that the binary leaf is kept and still hit")
+      {
+        REQUIRE(triangles.size() > shape.max_bvh_leaf_size);
+        REQUIRE(shape.get_compressed_nodes().empty());
+        REQUIRE(shape.get_nodes().size() == 1);
+        REQUIRE(hit);
+        REQUIRE(payload.t == Approx(2.f).epsilon(0.01));
+      }
+    }
+  }
+}
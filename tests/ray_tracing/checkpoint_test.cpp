@@ -0,0 +1,93 @@
+#define CATCH_CONFIG_MAIN
+
+#include "renderer/raytracer/checkpoint.h"
+#include "renderer/raytracer/raytracer.h"
+#include "resource.h"
+
+#include <catch.hpp>
+#include <filesystem>
+
+
+SCENARIO("Progressive passes resumed from a checkpoint match ray generation")
+{
+  GIVEN("Raytracer with random shading")
+  {
+    cg::renderer::raytracer<cg::vertex, cg::unsigned_color> raytracer;
+    raytracer.set_viewport(12, 8);
+    raytracer.SSAA_factor = 3;
+
+    // Depends on the sampler, so a wrongly seeded pass changes the image
+    raytracer.miss_shader = [](const cg::renderer::ray& ray) {
+      cg::renderer::payload payload = {};
+      cg::renderer::sampler& sampler = cg::renderer::thread_sampler();
+      payload.color = { sampler.next(), sampler.next(), 0.5f + 0.5f * ray.direction.y };
+      return payload;
+    };
+
+    float3 position{ 0.f, 0.f, 0.f };
+    float3 direction{ 0.f, 0.f, 1.f };
+    float3 right{ 1.f, 0.f, 0.f };
+    float3 up{ 0.f, 1.f, 0.f };
+
+    auto reference = std::make_shared<cg::resource<cg::unsigned_color>>(12, 8);
+    auto hdr_reference = std::make_shared<cg::resource<float3>>(12, 8);
+    raytracer.set_render_target(reference);
+    raytracer.set_aux_buffers(hdr_reference, nullptr, nullptr, nullptr);
+    raytracer.ray_generation(position, direction, right, up);
+
+    auto checkpoint_path =
+      std::filesystem::temp_directory_path() / "checkpoint_test.checkpoint";
+    uint64_t key = cg::renderer::checkpoint_key(1, { 12.f, 8.f, 3.f });
+
+    WHEN("Render four passes, save them and resume in a fresh buffer")
+    {
+      auto accumulation = std::make_shared<cg::resource<float3>>(12, 8);
+      raytracer.set_accumulation_buffer(accumulation);
+      for (size_t pass = 0; pass < 4; pass++)
+        raytracer.accumulation_pass(position, direction, right, up, pass);
+      bool saved = cg::renderer::save_checkpoint(checkpoint_path, key, *accumulation, 4);
+
+      auto resumed = std::make_shared<cg::resource<float3>>(12, 8);
+      uint32_t passes = 0;
+      bool loaded = cg::renderer::load_checkpoint(checkpoint_path, key, *resumed, passes);
+
+      uint32_t other_passes = 0;
+      cg::resource<float3> other_size(8, 8);
+      bool other_key_loaded = cg::renderer::load_checkpoint(
+        checkpoint_path, cg::renderer::checkpoint_key(1, { 12.f, 8.f, 2.f }),
+        *resumed, other_passes);
+      bool other_size_loaded =
+        cg::renderer::load_checkpoint(checkpoint_path, key, other_size, other_passes);
+      std::filesystem::remove(checkpoint_path);
+
+      raytracer.set_accumulation_buffer(resumed);
+      for (size_t pass = passes; pass < 9; pass++)
+        raytracer.accumulation_pass(position, direction, right, up, pass);
+
+      auto result = std::make_shared<cg::resource<cg::unsigned_color>>(12, 8);
+      auto hdr_result = std::make_shared<cg::resource<float3>>(12, 8);
+      raytracer.set_render_target(result);
+      raytracer.set_aux_buffers(hdr_result, nullptr, nullptr, nullptr);
+      raytracer.resolve_accumulation(position, direction, right, up, 9);
+
+      size_t mismatches = 0;
+      for (size_t i = 0; i < result->get_number_of_elements(); i++)
+      {
+        mismatches += result->item(i).r != reference->item(i).r ||
+                      result->item(i).g != reference->item(i).g ||
+                      result->item(i).b != reference->item(i).b ||
+                      hdr_result->item(i) != hdr_reference->item(i);
+      }
+
+      THEN("Make sure that the resumed image is the same")
+      {
+        REQUIRE(saved);
+        REQUIRE(loaded);
+        REQUIRE(passes == 4);
+        REQUIRE_FALSE(other_key_loaded);
+        REQUIRE_FALSE(other_size_loaded);
+        REQUIRE(mismatches == 0);
+      }
+    }
+  }
+}
@@ -0,0 +1,117 @@
+#define CATCH_CONFIG_MAIN
+
+#include "renderer/raytracer/denoiser.h"
+#include "renderer/raytracer/path_integrator.h"
+#include "renderer/raytracer/raytracer.h"
+#include "resource.h"
+#include "world/camera.h"
+#include "world/model.h"
+
+#include <catch.hpp>
+
+
+using path_raytracer = cg::renderer::raytracer<cg::vertex, cg::unsigned_color>;
+
+static std::shared_ptr<cg::resource<float3>> render_cornell_box(
+  int ssaa_factor,
+  std::shared_ptr<cg::resource<float3>> albedo = nullptr,
+  std::shared_ptr<cg::resource<float3>> normal = nullptr,
+  std::shared_ptr<cg::resource<float>> depth = nullptr)
+{
+  const size_t width = 64;
+  const size_t height = 48;
+
+  cg::world::model model;
+  model.load_obj(absolute(std::filesystem::path("models/CornellBox-Original.obj")));
+
+  cg::world::camera camera;
+  camera.set_width(static_cast<float>(width));
+  camera.set_height(static_cast<float>(height));
+  camera.set_position(float3{ 0.f, 1.f, 2.2f });
+
+  auto render_target =
+    std::make_shared<cg::resource<cg::unsigned_color>>(width, height);
+  auto hdr_target = std::make_shared<cg::resource<float3>>(width, height);
+
+  auto raytracer = std::make_shared<path_raytracer>();
+  raytracer->set_viewport(width, height);
+  raytracer->set_render_target(render_target);
+  raytracer->set_aux_buffers(hdr_target, albedo, normal, depth);
+  raytracer->set_per_shape_vertex_buffer(model.get_per_shape_buffer());
+  raytracer->build_acceleration_structure();
+  raytracer->SSAA_factor = ssaa_factor;
+
+  cg::renderer::path_integrator<cg::vertex, cg::unsigned_color> integrator(
+    raytracer);
+  integrator.collect_area_lights();
+  integrator.max_indirect_radiance = 1.f;
+
+  raytracer->miss_shader = [](const cg::renderer::ray& ray)
+  {
+    cg::renderer::payload payload = {};
+    payload.color = { 0.f, 0.f, 0.f };
+    return payload;
+  };
+  raytracer->closest_hit_shader =
+    [&](
+    const cg::renderer::ray& ray, cg::renderer::payload& payload,
+    const cg::renderer::triangle<cg::vertex>& triangle)
+    {
+      payload.color = cg::color::from_float3(
+        integrator.shade(ray, payload, triangle));
+      return payload;
+    };
+
+  raytracer->ray_generation(
+    camera.get_position(), camera.get_direction(),
+    camera.get_right(), camera.get_up());
+
+  return hdr_target;
+}
+
+static float rmse(cg::resource<float3>& image, cg::resource<float3>& reference)
+{
+  double error = 0.0;
+  for (size_t i = 0; i < image.get_number_of_elements(); i++)
+  {
+    float3 difference =
+      clamp(image.item(i), float3(0.f), float3(1.f)) -
+      clamp(reference.item(i), float3(0.f), float3(1.f));
+    error += dot(difference, difference) / 3.f;
+  }
+  return static_cast<float>(
+    std::sqrt(error / image.get_number_of_elements()));
+}
+
+SCENARIO("Denoiser brings a low sample render closer to the reference")
+{
+  GIVEN("Cornell box rendered at 256 spp and at 4 spp with aux buffers")
+  {
+    auto reference = render_cornell_box(16);
+
+    auto albedo = std::make_shared<cg::resource<float3>>(64, 48);
+    auto normal = std::make_shared<cg::resource<float3>>(64, 48);
+    auto depth = std::make_shared<cg::resource<float>>(64, 48);
+    auto noisy = render_cornell_box(2, albedo, normal, depth);
+
+    WHEN("Denoise the 4 spp render")
+    {
+      auto denoised = std::make_shared<cg::resource<float3>>(64, 48);
+      for (size_t i = 0; i < noisy->get_number_of_elements(); i++)
+        denoised->item(i) = noisy->item(i);
+
+      cg::renderer::denoiser denoiser;
+      denoiser.set_buffers(denoised, albedo, normal, depth);
+      denoiser.denoise();
+
+      THEN("Make sure that the error to the reference is lower")
+      {
+        float noisy_error = rmse(*noisy, *reference);
+        float denoised_error = rmse(*denoised, *reference);
+
+        INFO("RMSE 4 spp: " << noisy_error << ", denoised: " << denoised_error);
+        REQUIRE(denoised_error < noisy_error);
+      }
+    }
+  }
+}
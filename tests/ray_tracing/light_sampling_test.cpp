@@ -0,0 +1,50 @@
+#define CATCH_CONFIG_MAIN
+
+#include "renderer/raytracer/light_sampler.h"
+
+#include <catch.hpp>
+
+
+SCENARIO("Alias table picks lights proportionally to their power")
+{
+  GIVEN("Alias table built over lights of different power")
+  {
+    std::vector<float> power{ 1.f, 0.f, 3.f, 4.f };
+
+    cg::renderer::alias_table table;
+    table.build(power);
+
+    WHEN("Sample the table with uniformly distributed numbers")
+    {
+      std::vector<size_t> histogram(power.size(), 0);
+      bool pmf_is_consistent = true;
+      const size_t sample_count = 80000;
+
+      for (size_t i = 0; i < sample_count; i++)
+      {
+        float pmf;
+        float u = (static_cast<float>(i) + 0.5f) / sample_count;
+        size_t index = table.sample(u, pmf);
+
+        pmf_is_consistent &= pmf == table.get_pmf(index);
+        histogram[index]++;
+      }
+
+      THEN("Make sure that the frequencies match the PMF")
+      {
+        REQUIRE(pmf_is_consistent);
+        REQUIRE(table.get_pmf(0) == Approx(0.125f));
+        REQUIRE(table.get_pmf(1) == 0.f);
+        REQUIRE(table.get_pmf(2) == Approx(0.375f));
+        REQUIRE(table.get_pmf(3) == Approx(0.5f));
+
+        REQUIRE(histogram[1] == 0);
+        for (size_t i = 0; i < power.size(); i++)
+        {
+          float frequency = static_cast<float>(histogram[i]) / sample_count;
+          REQUIRE(frequency == Approx(table.get_pmf(i)).margin(0.01f));
+        }
+      }
+    }
+  }
+}
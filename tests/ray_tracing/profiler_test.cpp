@@ -0,0 +1,80 @@
+#define CATCH_CONFIG_MAIN
+
+#include "renderer/raytracer/raytracer.h"
+#include "resource.h"
+#include "utils/profiler.h"
+
+#include <atomic>
+#include <catch.hpp>
+#include <filesystem>
+#include <fstream>
+#include <omp.h>
+#include <sstream>
+
+
+static size_t count_occurrences(const std::string& text, const std::string& pattern)
+{
+  size_t count = 0;
+  for (size_t position = text.find(pattern); position != std::string::npos;
+       position = text.find(pattern, position + pattern.size()))
+    count++;
+  return count;
+}
+
+SCENARIO("Profiler records zones of every thread into a Chrome trace")
+{
+  GIVEN("Raytracer with a miss shader and an enabled profiler")
+  {
+    cg::renderer::raytracer<cg::vertex, cg::unsigned_color> raytracer;
+    auto render_target = std::make_shared<cg::resource<cg::unsigned_color>>(8, 8);
+    raytracer.set_render_target(render_target);
+    raytracer.set_viewport(8, 8);
+    // Every miss adds the size of the team tracing its column
+    std::atomic<size_t> misses = 0;
+    std::atomic<size_t> team_sizes = 0;
+    raytracer.miss_shader = [&](const cg::renderer::ray& ray) {
+      misses++;
+      team_sizes += static_cast<size_t>(omp_get_num_threads());
+      cg::renderer::payload payload = {};
+      payload.t = -1.f;
+      return payload;
+    };
+
+    cg::utils::enable_profiler();
+
+    WHEN("Generate rays and save the trace")
+    {
+      {
+        PROFILE_ZONE("Test frame");
+        raytracer.ray_generation(
+          float3{ 0.f, 0.f, 0.f }, float3{ 0.f, 0.f, 1.f },
+          float3{ 1.f, 0.f, 0.f }, float3{ 0.f, 1.f, 0.f });
+      }
+
+      auto trace_path = std::filesystem::temp_directory_path() / "profiler_test_trace.json";
+      cg::utils::save_chrome_trace(trace_path);
+
+      std::ifstream file(trace_path);
+      std::stringstream trace;
+      trace << file.rdbuf();
+      std::string text = trace.str();
+      file.close();
+      std::filesystem::remove(trace_path);
+
+      THEN("Make sure that every zone and thread is in the trace")
+      {
+        REQUIRE(text.rfind("{\"displayTimeUnit\"", 0) == 0);
+        REQUIRE(text.find("]}") != std::string::npos);
+        REQUIRE(count_occurrences(text, "\"Test frame\"") == 1);
+        REQUIRE(count_occurrences(text, "\"Ray generation\"") == 1);
+        REQUIRE(count_occurrences(text, "Main thread") == 1);
+        // Every thread of the team opens one zone per column, and every
+        // column has the same number of misses
+        size_t misses_per_column = misses / 8;
+        REQUIRE(misses_per_column > 0);
+        REQUIRE(count_occurrences(text, "\"Ray generation column\"") ==
+                team_sizes / misses_per_column);
+      }
+    }
+  }
+}
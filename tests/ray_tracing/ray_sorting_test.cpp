@@ -0,0 +1,178 @@
+#define CATCH_CONFIG_MAIN
+
+#include "renderer/raytracer/path_integrator.h"
+#include "renderer/raytracer/raytracer.h"
+#include "resource.h"
+
+#include <catch.hpp>
+#include <chrono>
+#include <random>
+
+
+using batch_raytracer = cg::renderer::raytracer<cg::vertex, cg::unsigned_color>;
+
+// Tessellated sphere of the given radius with 2 * segments^2 triangles and
+// inward facing normals
+static std::shared_ptr<cg::resource<cg::vertex>> make_room(size_t segments, float radius)
+{
+  const float pi = 3.14159265358979f;
+  auto vertex_buffer =
+    std::make_shared<cg::resource<cg::vertex>>(6 * segments * segments);
+
+  auto point = [&](size_t i, size_t j) {
+    float theta = pi * i / segments;
+    float phi = 2.f * pi * j / segments;
+    cg::vertex vertex = {};
+    vertex.nx = -std::sin(theta) * std::cos(phi);
+    vertex.ny = -std::cos(theta);
+    vertex.nz = -std::sin(theta) * std::sin(phi);
+    vertex.x = -radius * vertex.nx;
+    vertex.y = -radius * vertex.ny;
+    vertex.z = -radius * vertex.nz;
+    vertex.diffuse_r = 0.8f;
+    vertex.diffuse_g = 0.7f;
+    vertex.diffuse_b = 0.6f;
+    return vertex;
+  };
+
+  size_t index = 0;
+  for (size_t i = 0; i < segments; i++)
+    for (size_t j = 0; j < segments; j++)
+    {
+      vertex_buffer->item(index++) = point(i, j);
+      vertex_buffer->item(index++) = point(i + 1, j);
+      vertex_buffer->item(index++) = point(i, j + 1);
+      vertex_buffer->item(index++) = point(i, j + 1);
+      vertex_buffer->item(index++) = point(i + 1, j);
+      vertex_buffer->item(index++) = point(i + 1, j + 1);
+    }
+
+  return vertex_buffer;
+}
+
+SCENARIO("Sorted ray batches find the same hits as unsorted ones")
+{
+  GIVEN("Diffuse bounce rays inside a finely tessellated room")
+  {
+    auto raytracer = std::make_shared<batch_raytracer>();
+    raytracer->set_per_shape_vertex_buffer({ make_room(256, 2.f) });
+    raytracer->build_acceleration_structure();
+
+    // Rays start on the walls and leave them in random directions, like
+    // the bounce rays of a path tracer
+    std::mt19937 generator(3);
+    std::uniform_real_distribution<float> distribution(-1.f, 1.f);
+    std::vector<cg::renderer::ray> rays;
+    while (rays.size() < 1 << 16)
+    {
+      float3 point{ distribution(generator), distribution(generator), distribution(generator) };
+      float3 direction{ distribution(generator), distribution(generator), distribution(generator) };
+      if (length(point) < 0.01f || length(direction) < 0.01f)
+        continue;
+      float3 origin = 1.99f * normalize(point);
+      if (dot(direction, origin) > 0.f)
+        direction = -direction;
+      rays.emplace_back(origin, normalize(direction));
+    }
+
+    WHEN("Trace the batch unsorted and sorted")
+    {
+      auto measure = [&](bool sort_rays, std::vector<cg::renderer::batch_hit<cg::vertex>>& hits) {
+        raytracer->sort_rays = sort_rays;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int repeat = 0; repeat < 4; repeat++)
+          raytracer->closest_hits(rays, hits);
+        auto stop = std::chrono::high_resolution_clock::now();
+        return 4.f * rays.size() / std::chrono::duration<float>(stop - start).count();
+      };
+
+      std::vector<cg::renderer::batch_hit<cg::vertex>> unsorted_hits, sorted_hits;
+      float unsorted_rate = measure(false, unsorted_hits);
+      float sorted_rate = measure(true, sorted_hits);
+
+      std::cout << "Unsorted: " << unsorted_rate / 1e6f << " M rays/s\n";
+      std::cout << "Sorted: " << sorted_rate / 1e6f << " M rays/s\n";
+
+      size_t hits = 0;
+      size_t mismatches = 0;
+      for (size_t i = 0; i < rays.size(); i++)
+      {
+        hits += unsorted_hits[i].hit_triangle != nullptr;
+        mismatches += unsorted_hits[i].hit_triangle != sorted_hits[i].hit_triangle ||
+                      unsorted_hits[i].hit.t != sorted_hits[i].hit.t;
+      }
+
+      THEN("Make sure that every ray gets its own hit back")
+      {
+        REQUIRE(hits == rays.size());
+        REQUIRE(mismatches == 0);
+      }
+    }
+  }
+}
+
+SCENARIO("Batch ray generation renders the same image as ray generation")
+{
+  GIVEN("Path integrator in a lit room")
+  {
+    auto raytracer = std::make_shared<batch_raytracer>();
+    raytracer->set_per_shape_vertex_buffer({ make_room(32, 2.f) });
+    raytracer->build_acceleration_structure();
+    raytracer->SSAA_factor = 2;
+
+    auto integrator =
+      std::make_shared<cg::renderer::path_integrator<cg::vertex, cg::unsigned_color>>(raytracer);
+    integrator->set_lights({ { float3{ 0.f, 1.5f, 0.f }, float3{ 1.f, 1.f, 1.f } } });
+
+    raytracer->miss_shader = [](const cg::renderer::ray& ray) {
+      cg::renderer::payload payload = {};
+      payload.color = { 0.f, 0.f, 0.f };
+      return payload;
+    };
+    raytracer->closest_hit_shader = [&](const cg::renderer::ray& ray,
+                                        cg::renderer::payload& payload,
+                                        const cg::renderer::triangle<cg::vertex>& triangle) {
+      payload.color = cg::color::from_float3(integrator->shade(ray, payload, triangle));
+      return payload;
+    };
+    raytracer->batch_tile_size = 5;
+    raytracer->batch_shader = [&](cg::renderer::sample_batch& batch) {
+      integrator->shade_batch(batch);
+    };
+
+    auto reference = std::make_shared<cg::resource<cg::unsigned_color>>(24, 16);
+    auto sorted = std::make_shared<cg::resource<cg::unsigned_color>>(24, 16);
+    raytracer->set_viewport(24, 16);
+
+    WHEN("Render depth first and in sorted batches")
+    {
+      float3 position{ 0.f, 0.f, 1.f };
+      float3 direction{ 0.f, 0.f, -1.f };
+      float3 right{ 1.f, 0.f, 0.f };
+      float3 up{ 0.f, 1.f, 0.f };
+
+      raytracer->set_render_target(reference);
+      raytracer->ray_generation(position, direction, right, up);
+
+      raytracer->sort_rays = true;
+      raytracer->set_render_target(sorted);
+      raytracer->batch_ray_generation(position, direction, right, up);
+
+      size_t lit = 0;
+      size_t mismatches = 0;
+      for (size_t i = 0; i < reference->get_number_of_elements(); i++)
+      {
+        lit += reference->item(i).r > 0;
+        mismatches += reference->item(i).r != sorted->item(i).r ||
+                      reference->item(i).g != sorted->item(i).g ||
+                      reference->item(i).b != sorted->item(i).b;
+      }
+
+      THEN("Make sure that the images are the same")
+      {
+        REQUIRE(lit > 0);
+        REQUIRE(mismatches == 0);
+      }
+    }
+  }
+}
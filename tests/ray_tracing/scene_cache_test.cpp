@@ -0,0 +1,138 @@
+#define CATCH_CONFIG_MAIN
+
+#include "renderer/raytracer/raytracer.h"
+#include "renderer/raytracer/scene_cache.h"
+#include "resource.h"
+#include "world/model.h"
+
+#include <catch.hpp>
+#include <fstream>
+
+
+using scene_raytracer = cg::renderer::raytracer<cg::vertex, cg::unsigned_color>;
+
+SCENARIO("BVH and scene cache keep the hits of a linear traversal")
+{
+  GIVEN("Cornell box with a BVH per shape and a scene cache of it")
+  {
+    std::filesystem::path model_path =
+      absolute(std::filesystem::path("models/CornellBox-Original.obj"));
+    std::filesystem::path cache_path =
+      std::filesystem::temp_directory_path() / "scene_cache_test.scene_cache";
+
+    cg::world::model model;
+    model.load_obj(model_path);
+
+    scene_raytracer raytracer;
+    raytracer.set_per_shape_vertex_buffer(model.get_per_shape_buffer());
+    raytracer.bvh_max_leaf_size = 2;
+    raytracer.build_acceleration_structure();
+
+    uint64_t key =
+      cg::renderer::scene_cache_key(model_path, raytracer.get_build_settings());
+    REQUIRE(cg::renderer::save_scene_cache(
+      cache_path, key, raytracer.acceleration_structures));
+
+    WHEN("Load the cache and trace the same rays through all the structures")
+    {
+      scene_raytracer cached_raytracer;
+      bool loaded = cg::renderer::load_scene_cache(
+        cache_path, key, cached_raytracer.acceleration_structures);
+      bool stale_key_rejected = !cg::renderer::load_scene_cache(
+        cache_path, key + 1, cached_raytracer.acceleration_structures);
+
+      // Same triangles without a hierarchy are traced linearly
+      scene_raytracer linear_raytracer;
+      for (auto& shape : raytracer.acceleration_structures)
+      {
+        auto linear_shape = std::make_shared<cg::renderer::aabb<cg::vertex>>();
+        linear_shape->assign(shape->get_triangles(), {});
+        linear_raytracer.acceleration_structures.push_back(linear_shape);
+      }
+
+      size_t mismatches = 0;
+      size_t hits = 0;
+      for (int x = 0; x < 32; x++)
+        for (int y = 0; y < 32; y++)
+        {
+          cg::renderer::ray ray(
+            float3{ 0.f, 1.f, 2.2f },
+            float3{ x / 16.f - 1.f, y / 16.f - 1.f, -1.f });
+
+          cg::renderer::payload linear_payload, bvh_payload, cached_payload;
+          auto linear_hit = linear_raytracer.closest_hit(ray, linear_payload);
+          auto bvh_hit = raytracer.closest_hit(ray, bvh_payload);
+          auto cached_hit = cached_raytracer.closest_hit(ray, cached_payload);
+
+          // Rays through a shared edge may report either triangle
+          hits += linear_hit != nullptr;
+          if ((linear_hit == nullptr) != (bvh_hit == nullptr) ||
+              (linear_hit == nullptr) != (cached_hit == nullptr) ||
+              std::abs(linear_payload.t - bvh_payload.t) > 1e-4f ||
+              std::abs(linear_payload.t - cached_payload.t) > 1e-4f)
+            mismatches++;
+        }
+
+      std::filesystem::remove(cache_path);
+
+      THEN("Make sure that the hits are the same")
+      {
+        REQUIRE(loaded);
+        REQUIRE(stale_key_rejected);
+        REQUIRE(cached_raytracer.acceleration_structures.size() ==
+                raytracer.acceleration_structures.size());
+        auto bvh = std::dynamic_pointer_cast<cg::renderer::aabb<cg::vertex>>(
+          raytracer.acceleration_structures[0]);
+        REQUIRE(bvh);
+        REQUIRE(!bvh->get_nodes().empty());
+        REQUIRE(hits > 0);
+        REQUIRE(mismatches == 0);
+      }
+    }
+
+    WHEN("Corrupt the triangle count or the root node of the first shape")
+    {
+      std::string bytes;
+      {
+        std::ifstream stream(cache_path, std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+      }
+      auto load_corrupted = [&](size_t offset, const void* value, size_t size) {
+        std::string corrupted = bytes;
+        std::memcpy(&corrupted[offset], value, size);
+        std::ofstream(cache_path, std::ios::binary | std::ios::trunc) << corrupted;
+        scene_raytracer cached_raytracer;
+        return cg::renderer::load_scene_cache(
+          cache_path, key, cached_raytracer.acceleration_structures);
+      };
+
+      // A count whose size in bytes wraps around
+      size_t shape_offset = sizeof(cg::renderer::scene_cache_header);
+      uint64_t wrapping_count =
+        UINT64_MAX / sizeof(cg::renderer::triangle<cg::vertex>) + 2;
+      bool wrapping_count_loaded =
+        load_corrupted(shape_offset, &wrapping_count, sizeof(wrapping_count));
+
+      // A root leaf with more triangles than the shape has
+      cg::renderer::scene_cache_shape shape_header;
+      std::memcpy(&shape_header, &bytes[shape_offset], sizeof(shape_header));
+      size_t root_offset = shape_offset + sizeof(shape_header) +
+                           shape_header.number_of_triangles *
+                             sizeof(cg::renderer::triangle<cg::vertex>);
+      cg::renderer::bvh_node root;
+      std::memcpy(&root, &bytes[root_offset], sizeof(root));
+      root.left_first = 0;
+      root.count = static_cast<uint32_t>(shape_header.number_of_triangles + 1);
+      bool overlong_leaf_loaded = load_corrupted(root_offset, &root, sizeof(root));
+
+      std::filesystem::remove(cache_path);
+
+      THEN("Make sure that both caches are rejected")
+      {
+        REQUIRE(shape_header.number_of_nodes > 0);
+        REQUIRE_FALSE(wrapping_count_loaded);
+        REQUIRE_FALSE(overlong_leaf_loaded);
+      }
+    }
+  }
+}
@@ -0,0 +1,112 @@
+#define CATCH_CONFIG_MAIN
+
+#include "renderer/raytracer/raytracer.h"
+#include "resource.h"
+
+#include <atomic>
+#include <catch.hpp>
+#include <chrono>
+#include <thread>
+
+
+SCENARIO("Stopped accumulation passes leave the accumulation untouched")
+{
+  GIVEN("Raytracer with a slow miss shader")
+  {
+    cg::renderer::raytracer<cg::vertex, cg::unsigned_color> raytracer;
+    raytracer.set_viewport(64, 64);
+
+    std::atomic<size_t> shaded = 0;
+    raytracer.miss_shader = [&](const cg::renderer::ray& ray) {
+      shaded++;
+      std::this_thread::sleep_for(std::chrono::microseconds(200));
+      cg::renderer::payload payload = {};
+      payload.color = { 1.f, 0.5f, 0.25f };
+      return payload;
+    };
+
+    float3 position{ 0.f, 0.f, 0.f };
+    float3 direction{ 0.f, 0.f, 1.f };
+    float3 right{ 1.f, 0.f, 0.f };
+    float3 up{ 0.f, 1.f, 0.f };
+
+    auto accumulation = std::make_shared<cg::resource<float3>>(64, 64);
+    raytracer.set_accumulation_buffer(accumulation);
+
+    auto accumulated = [&]() {
+      size_t count = 0;
+      for (size_t i = 0; i < accumulation->get_number_of_elements(); i++)
+        count += accumulation->item(i).x != 0.f;
+      return count;
+    };
+
+    WHEN("Render a pass after its deadline and one without a deadline")
+    {
+      raytracer.set_deadline(std::chrono::steady_clock::now() - std::chrono::seconds(1));
+      bool late_pass = raytracer.accumulation_pass(position, direction, right, up, 0);
+      size_t late_shaded = shaded;
+      size_t late_accumulated = accumulated();
+
+      raytracer.set_deadline(std::nullopt);
+      bool pass = raytracer.accumulation_pass(position, direction, right, up, 0);
+
+      THEN("Make sure that only the second pass is accumulated")
+      {
+        REQUIRE_FALSE(late_pass);
+        REQUIRE(late_shaded == 0);
+        REQUIRE(late_accumulated == 0);
+        REQUIRE(pass);
+        REQUIRE(accumulated() == 64 * 64);
+      }
+    }
+
+    WHEN("Cancel a pass from another thread")
+    {
+      std::thread canceller([&]() {
+        while (shaded < 16)
+          std::this_thread::yield();
+        raytracer.cancel();
+      });
+      bool pass = raytracer.accumulation_pass(position, direction, right, up, 0);
+      canceller.join();
+
+      THEN("Make sure that the pass stops before shading every pixel")
+      {
+        REQUIRE_FALSE(pass);
+        REQUIRE(shaded < 64 * 64);
+        REQUIRE(accumulated() == 0);
+      }
+    }
+
+    WHEN("Cancel a pass, clear the cancel and render the pass again")
+    {
+      raytracer.cancel();
+      bool cancelled_pass = raytracer.accumulation_pass(position, direction, right, up, 0);
+      raytracer.clear_cancel();
+      bool pass = raytracer.accumulation_pass(position, direction, right, up, 0);
+
+      THEN("Make sure that only the pass after the clear is accumulated")
+      {
+        REQUIRE_FALSE(cancelled_pass);
+        REQUIRE(pass);
+        REQUIRE(accumulated() == 64 * 64);
+      }
+    }
+
+    WHEN("Set the stop flag of the raytracer, as a signal handler would")
+    {
+      std::atomic<bool> stop_flag = true;
+      raytracer.set_stop_flag(&stop_flag);
+      bool stopped_pass = raytracer.accumulation_pass(position, direction, right, up, 0);
+      stop_flag = false;
+      bool pass = raytracer.accumulation_pass(position, direction, right, up, 0);
+
+      THEN("Make sure that the pass stops while the flag is set")
+      {
+        REQUIRE_FALSE(stopped_pass);
+        REQUIRE(pass);
+        REQUIRE(accumulated() == 64 * 64);
+      }
+    }
+  }
+}
@@ -0,0 +1,124 @@
+#define CATCH_CONFIG_MAIN
+
+#include "renderer/raytracer/raytracer.h"
+#include "renderer/raytracer/traversal_stats.h"
+#include "resource.h"
+
+#include <catch.hpp>
+#include <filesystem>
+#include <fstream>
+
+
+static_assert(
+  cg::renderer::traversal_stats_enabled, "The test needs RAY_TRAVERSAL_STATS defined");
+
+// Width and height from the IHDR chunk, which follows the 8-byte signature
+static std::pair<uint32_t, uint32_t> png_size(const std::filesystem::path& path)
+{
+  std::ifstream stream(path, std::ios::binary);
+  unsigned char header[24] = {};
+  stream.read(reinterpret_cast<char*>(header), sizeof(header));
+  auto big_endian = [&](size_t offset) {
+    return static_cast<uint32_t>(header[offset]) << 24 |
+           static_cast<uint32_t>(header[offset + 1]) << 16 |
+           static_cast<uint32_t>(header[offset + 2]) << 8 | header[offset + 3];
+  };
+  return { big_endian(16), big_endian(20) };
+}
+
+SCENARIO("Traversal counters count the rays, nodes and triangles of every pixel")
+{
+  GIVEN("A quad of two triangles in the middle of the view")
+  {
+    const size_t width = 32;
+    const size_t height = 24;
+    cg::renderer::raytracer<cg::vertex, cg::unsigned_color> raytracer;
+    raytracer.set_viewport(width, height);
+    raytracer.SSAA_factor = 1;
+    auto render_target = std::make_shared<cg::resource<cg::unsigned_color>>(width, height);
+    raytracer.set_render_target(render_target);
+    auto stats = std::make_shared<cg::resource<cg::renderer::traversal_counters>>(width, height);
+    raytracer.set_stats_buffer(stats);
+
+    auto quad = std::make_shared<cg::resource<cg::vertex>>(6);
+    const float corners[6][2] = {
+      { -0.9f, -0.9f }, { 0.9f, -0.9f }, { 0.9f, 0.9f },
+      { -0.9f, -0.9f }, { 0.9f, 0.9f }, { -0.9f, 0.9f },
+    };
+    for (size_t i = 0; i < 6; i++)
+    {
+      cg::vertex vertex = {};
+      vertex.x = corners[i][0];
+      vertex.y = corners[i][1];
+      vertex.z = -2.f;
+      vertex.nz = 1.f;
+      quad->item(i) = vertex;
+    }
+    raytracer.set_per_shape_vertex_buffer({ quad });
+    raytracer.build_acceleration_structure();
+
+    raytracer.miss_shader = [](const cg::renderer::ray& ray) {
+      cg::renderer::payload payload = {};
+      payload.color = { 0.f, 0.f, 0.f };
+      return payload;
+    };
+    raytracer.closest_hit_shader = [](
+      const cg::renderer::ray& ray, cg::renderer::payload& payload,
+      const cg::renderer::triangle<cg::vertex>& triangle) {
+      payload.color = { 1.f, 1.f, 1.f };
+      return payload;
+    };
+
+    WHEN("Trace one ray per pixel and report the counters")
+    {
+      raytracer.ray_generation(
+        float3{ 0.f, 0.f, 0.f }, float3{ 0.f, 0.f, -1.f }, float3{ 1.f, 0.f, 0.f },
+        float3{ 0.f, 1.f, 0.f });
+
+      size_t hits = 0;
+      bool one_ray_each = true;
+      bool hits_counted = true;
+      bool misses_skip_the_tree = true;
+      for (size_t i = 0; i < width * height; i++)
+      {
+        const auto& counters = stats->item(i);
+        one_ray_each &= counters.rays == 1;
+        if (render_target->item(i).r > 0)
+        {
+          hits++;
+          hits_counted &= counters.nodes >= 1 && counters.triangles >= 1 && counters.triangles <= 2;
+        }
+        else
+        {
+          // The rays miss the bounds of the quad before reaching its tree
+          misses_skip_the_tree &= counters.nodes == 0 && counters.triangles == 0;
+        }
+      }
+
+      auto result_path = std::filesystem::temp_directory_path() / "traversal_stats_test.png";
+      cg::renderer::report_traversal_stats(*stats, result_path);
+      std::vector<std::filesystem::path> heatmaps;
+      for (const char* counter : { "rays", "nodes", "triangles" })
+      {
+        heatmaps.push_back(
+          std::filesystem::temp_directory_path() /
+          (std::string("traversal_stats_test_") + counter + ".png"));
+      }
+
+      THEN("Make sure hits test the triangles, misses test nothing and the heatmaps match the view")
+      {
+        REQUIRE(hits > 0);
+        REQUIRE(hits < width * height);
+        REQUIRE(one_ray_each);
+        REQUIRE(hits_counted);
+        REQUIRE(misses_skip_the_tree);
+        for (const auto& heatmap : heatmaps)
+        {
+          REQUIRE(std::filesystem::exists(heatmap));
+          REQUIRE(png_size(heatmap) == std::pair<uint32_t, uint32_t>(width, height));
+          std::filesystem::remove(heatmap);
+        }
+      }
+    }
+  }
+}
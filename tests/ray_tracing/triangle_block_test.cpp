@@ -0,0 +1,195 @@
+#define CATCH_CONFIG_MAIN
+
+#include "renderer/raytracer/raytracer.h"
+#include "renderer/raytracer/triangle_block.h"
+#include "resource.h"
+
+#include <catch.hpp>
+#include <chrono>
+#include <random>
+
+
+using scene_triangle = cg::renderer::triangle<cg::vertex>;
+
+static scene_triangle make_triangle(const float3& a, const float3& b, const float3& c)
+{
+  cg::vertex vertices[3] = {};
+  const float3* positions[3] = { &a, &b, &c };
+  for (int i = 0; i < 3; i++)
+  {
+    vertices[i].x = positions[i]->x;
+    vertices[i].y = positions[i]->y;
+    vertices[i].z = positions[i]->z;
+  }
+  return scene_triangle(vertices[0], vertices[1], vertices[2]);
+}
+
+SCENARIO("Triangle block kernel matches the scalar test and is faster")
+{
+  GIVEN("Blocks of random triangles and random rays")
+  {
+    std::mt19937 generator(11);
+    std::uniform_real_distribution<float> distribution(-1.f, 1.f);
+    auto random_point = [&]() {
+      return float3{ distribution(generator), distribution(generator), distribution(generator) };
+    };
+
+    std::vector<scene_triangle> triangles;
+    std::vector<cg::renderer::triangle_block> blocks(512);
+    for (auto& block : blocks)
+    {
+      for (uint32_t lane = 0; lane < cg::renderer::triangle_block::width; lane++)
+      {
+        float3 center = random_point();
+        triangles.push_back(make_triangle(
+          center + 0.2f * random_point(),
+          center + 0.2f * random_point(),
+          center + 0.2f * random_point()));
+        block.set(lane, triangles.back().a, triangles.back().b, triangles.back().c);
+      }
+    }
+
+    std::vector<cg::renderer::ray> rays;
+    for (int i = 0; i < 256; i++)
+      rays.emplace_back(2.f * random_point(), random_point());
+
+    WHEN("Intersect every ray with every block")
+    {
+      size_t hits = 0;
+      size_t mismatches = 0;
+      for (auto& ray : rays)
+      {
+        cg::renderer::block_ray block_ray(ray);
+        for (size_t b = 0; b < blocks.size(); b++)
+        {
+          // Reference: nearest hit of the scalar test over the same lanes
+          int lane = -1;
+          float t = 100.f;
+          cg::renderer::payload nearest;
+          for (uint32_t i = 0; i < cg::renderer::triangle_block::width; i++)
+          {
+            auto payload = cg::renderer::intersect_triangle(
+              triangles[b * cg::renderer::triangle_block::width + i], ray);
+            if (payload.t > 0.f && payload.t < t)
+            {
+              lane = i;
+              t = payload.t;
+              nearest = payload;
+            }
+          }
+
+          cg::renderer::block_hit scalar_hit, simd_hit;
+          bool scalar_found = cg::renderer::intersect_block_scalar(
+            blocks[b], block_ray, 0.f, 100.f, false, scalar_hit);
+          bool simd_found = cg::renderer::intersect_block(
+            blocks[b], block_ray, 0.f, 100.f, false, simd_hit);
+
+          hits += lane >= 0;
+          if (scalar_found != (lane >= 0) || simd_found != (lane >= 0))
+          {
+            mismatches++;
+            continue;
+          }
+          if (lane >= 0 &&
+              (scalar_hit.lane != static_cast<uint32_t>(lane) || scalar_hit.t != t ||
+               simd_hit.lane != scalar_hit.lane || simd_hit.t != scalar_hit.t ||
+               simd_hit.u != nearest.bary.y || simd_hit.v != nearest.bary.z))
+            mismatches++;
+        }
+      }
+
+      // Throughput of the scalar test against the block kernel
+      auto measure = [&](auto&& test) {
+        size_t found = 0;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int repeat = 0; repeat < 8; repeat++)
+          for (auto& ray : rays)
+            found += test(ray);
+        auto stop = std::chrono::high_resolution_clock::now();
+        float seconds = std::chrono::duration<float>(stop - start).count();
+        return std::make_pair(8.f * rays.size() * triangles.size() / seconds, found);
+      };
+
+      auto [scalar_rate, scalar_found] = measure([&](const cg::renderer::ray& ray) {
+        size_t found = 0;
+        for (auto& triangle : triangles)
+          found += cg::renderer::intersect_triangle(triangle, ray).t > 0.f;
+        return found;
+      });
+      auto [block_rate, block_found] = measure([&](const cg::renderer::ray& ray) {
+        size_t found = 0;
+        cg::renderer::block_ray block_ray(ray);
+        cg::renderer::block_hit hit;
+        for (auto& block : blocks)
+          found += cg::renderer::intersect_block(block, block_ray, 0.f, 100.f, false, hit);
+        return found;
+      });
+
+      std::cout << "Scalar: " << scalar_rate / 1e6f << " M triangle tests/s\n";
+      std::cout << (cg::renderer::has_avx2() ? "AVX2" : "Scalar fallback")
+                << " blocks: " << block_rate / 1e6f << " M triangle tests/s\n";
+
+      THEN("Make sure that the nearest hits are the same")
+      {
+        REQUIRE(hits > 0);
+        REQUIRE(mismatches == 0);
+        REQUIRE(block_found > 0);
+        REQUIRE(scalar_found >= block_found);
+      }
+    }
+  }
+}
+
+SCENARIO("Watertight test does not leak through shared edges")
+{
+  GIVEN("Fan of triangles around a shared vertex")
+  {
+    std::mt19937 generator(5);
+    std::uniform_real_distribution<float> distribution(-1.f, 1.f);
+
+    const float pi = 3.14159265358979f;
+    float3 center{ 0.1f, 0.2f, 0.3f };
+    float3 ring[8];
+    for (int i = 0; i < 8; i++)
+    {
+      float angle = 2.f * pi * i / 8.f;
+      ring[i] = center + float3{ std::cos(angle), 0.3f * std::sin(angle), std::sin(angle) };
+    }
+
+    cg::renderer::triangle_block block;
+    for (uint32_t i = 0; i < 8; i++)
+      block.set(i, center, ring[i], ring[(i + 1) % 8]);
+
+    WHEN("Aim rays exactly at the shared vertex and edges")
+    {
+      size_t rays = 0;
+      size_t watertight_misses = 0;
+      size_t scalar_mismatches = 0;
+      for (int i = 0; i < 4096; i++)
+      {
+        float3 origin = center + 3.f * float3{
+          distribution(generator), distribution(generator), distribution(generator) };
+        float3 target = i % 2 == 0 ? center : center + 0.5f * (ring[i % 8] - center);
+        cg::renderer::ray ray(origin, target - origin);
+        cg::renderer::block_ray block_ray(ray);
+
+        cg::renderer::block_hit hit, scalar_hit;
+        bool found = cg::renderer::intersect_block(block, block_ray, 0.f, 100.f, true, hit);
+        bool scalar_found =
+          cg::renderer::intersect_block_scalar(block, block_ray, 0.f, 100.f, true, scalar_hit);
+
+        rays++;
+        watertight_misses += !found;
+        scalar_mismatches += found != scalar_found ||
+                             (found && (hit.lane != scalar_hit.lane || hit.t != scalar_hit.t));
+      }
+
+      THEN("Make sure that every ray hits the fan")
+      {
+        REQUIRE(rays > 0);
+        REQUIRE(watertight_misses == 0);
+        REQUIRE(scalar_mismatches == 0);
+      }
+    }
+  }
+}